@@ -0,0 +1,701 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file bench_micro.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Microbenchmarks of the hot paths of request handling. Every case is warmed up
+// and calibrated to run about BENCH_TARGET_NS per repetition; the median and the
+// best repetition are reported, in nanoseconds and TSC cycles per operation.
+//
+// Usage: bench_micro [-j] [-r repetitions] [name filter]
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+
+#define HTTPSERVER_IMPL
+#include "../src/httpserver.h"
+
+#include "../src/hashmap.h"
+#include "../src/vfs.h"
+#include "../src/mime.h"
+#include "../src/luaapp.h"
+#include "../src/utils.h"
+#include "../src/router.h"
+#include "../src/json.h"
+#include "../src/form.h"
+#include "../src/shdict.h"
+#include "../src/pool.h"
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#define BENCH_WARMUP_NS 100000000ULL
+#define BENCH_TARGET_NS 20000000ULL
+#define BENCH_REPETITIONS 9
+#define BENCH_MAX_REPETITIONS 101
+#define BENCH_VFS_ENTRIES 256
+
+typedef void (*bench_fn_t)(uint64_t iterations);
+
+struct bench_case {
+	const char* name;
+	bench_fn_t fn;
+};
+
+struct bench_result {
+	const char* name;
+	uint64_t iterations;
+	double ns_median;
+	double ns_min;
+	double cycles_median;
+};
+
+static const char* g_browser_head =
+	"GET /static/app/dashboard.js?v=20241017&theme=dark&lang=en HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"129\", \"Not=A?Brand\";v=\"8\", \"Google Chrome\";v=\"129\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/129.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Referer: https://www.example.com/dashboard/overview?range=7d&group=service\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-US,en;q=0.9,pl;q=0.8\r\n"
+	"If-None-Match: \"5f3c2a1b-19a4\"\r\n"
+	"If-Modified-Since: Thu, 17 Oct 2024 08:12:44 GMT\r\n"
+	"\r\n";
+
+static const char* g_mime_types =
+	"txt\t\ttext/plain\n"
+	"lua\t\ttext/plain\n"
+	"html\ttext/html\n"
+	"htm\t\ttext/html\n"
+	"css\t\ttext/css\n"
+	"png\t\timage/png\n"
+	"jpg\t\timage/jpg\n"
+	"svg\t\timage/svg+xml\n"
+	"js\t\tapplication/javascript\n"
+	"json\tapplication/json\n";
+
+static const char* g_query = "v=20241017&theme=dark&lang=en&page=20&sort=desc&filter=active";
+
+static const char* g_json =
+	"{\"id\":1042,\"name\":\"Dashboard\",\"active\":true,\"ratio\":0.75,\"owner\":{\"id\":7,\"login\":\"admin\","
+	"\"email\":\"admin@example.com\"},\"tags\":[\"ops\",\"metrics\",\"prod\"],\"widgets\":["
+	"{\"id\":1,\"type\":\"graph\",\"title\":\"Requests per second\",\"span\":6,\"targets\":[\"rate(emb_http_responses_total[1m])\"]},"
+	"{\"id\":2,\"type\":\"graph\",\"title\":\"Latency \\\"p99\\\"\",\"span\":6,\"targets\":[\"histogram_quantile(0.99, emb_http_latency)\"]},"
+	"{\"id\":3,\"type\":\"table\",\"title\":\"Top paths\",\"span\":12,\"targets\":[]}],"
+	"\"created\":\"2024-10-17T12:00:00Z\",\"description\":null}";
+static int32_t g_json_ref;
+static const char* g_form_boundary = "----WebKitFormBoundary7MA4YWxkTrZu0gW";
+static char g_form[8192];
+static int32_t g_form_len;
+static struct shdict* g_shared;
+static struct pool* g_pool;
+static uint64_t g_pool_done;
+static const char* g_vfs_paths[] = {
+	"/index.html", "/static/app/dashboard.js", "/static/css/main.css", "/img/logo.png",
+	"/static/lib/file17.js", "/static/lib/file101.js", "/static/lib/file230.js", "/missing.html",
+};
+static const char* g_routes[] = {
+	"/", "/login", "/logout", "/api/status", "/api/users", "/api/users/:id", "/api/users/:id/posts",
+	"/api/users/:id/posts/:post", "/api/posts", "/api/posts/:post", "/api/posts/:post/comments",
+	"/api/search", "/admin", "/admin/settings", "/assets/*path"
+};
+static const char* g_route_paths[] = {
+	"/api/users/42/posts/7", "/api/status", "/assets/js/app.min.js", "/api/posts/1337/comments"
+};
+static const char* g_mime_exts[] = { "js", "html", "css", "png", "json", "svg", "txt", "xyz" };
+
+static struct http_server_s g_server;
+static struct http_request_s g_request;
+static struct hsh_buffer_s g_head_buffer;
+static struct http_response_s* g_response;
+static struct hashmap* g_vfs_mem;
+static struct hashmap* g_vfs_fs;
+static struct hashmap* g_mime;
+static struct lua_app* g_lua;
+static char g_fs_dir[64];
+static volatile uint64_t g_sink;
+
+// ************************************************************************************
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ************************************************************************************
+uint64_t ticks() {
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	return now_ns();
+#endif
+}
+
+// ************************************************************************************
+int32_t parse_head(struct hsh_buffer_s* buffer, struct hs_token_array_s* tokens) {
+	struct hsh_parser_s parser;
+
+	hsh_parser_init(&parser);
+	buffer->index = 0;
+	buffer->sequence_id++;
+	if (tokens) tokens->size = 0;
+
+	while(1) {
+		struct hsh_token_s token = hsh_parser_exec(&parser, buffer, HTTP_MAX_REQUEST_BUF_SIZE);
+		if (token.type == HSH_TOK_NONE) return -1;
+		if (tokens) _hs_token_array_push(tokens, token, &g_server.memused);
+		if (token.type == HSH_TOK_HEADERS_DONE) return 0;
+	}
+}
+
+// ************************************************************************************
+void free_response(struct http_response_s* response) {
+	http_header_t* h = response->headers;
+	while(h) {
+		http_header_t* next = h->next;
+		free(h);
+		h = next;
+	}
+	free(response);
+}
+
+// ************************************************************************************
+void bench_parser_exec(uint64_t iterations) {
+	for(uint64_t i=0;i<iterations;++i) {
+		g_sink += parse_head(&g_head_buffer, NULL);
+	}
+}
+
+// ************************************************************************************
+void bench_request_header_hit(uint64_t iterations) {
+	for(uint64_t i=0;i<iterations;++i) {
+		g_sink += hs_request_header(&g_request, "Accept-Encoding").len;
+	}
+}
+
+// ************************************************************************************
+void bench_request_header_miss(uint64_t iterations) {
+	for(uint64_t i=0;i<iterations;++i) {
+		g_sink += hs_request_header(&g_request, "X-Forwarded-For").len;
+	}
+}
+
+// ************************************************************************************
+void bench_serialize_headers(uint64_t iterations) {
+	for(uint64_t i=0;i<iterations;++i) {
+		grwbuf_t ctx;
+		_grwbuf_init(&ctx, _http_headers_size(&g_request, g_response), &g_server.memused);
+		_http_serialize_headers(&g_request, g_response, &ctx);
+		g_sink += ctx.size;
+		free(ctx.buf);
+		g_server.memused -= ctx.capacity;
+	}
+}
+
+// ************************************************************************************
+void bench_hashmap_get_vfs(uint64_t iterations) {
+	struct vfs_entry q;
+	for(uint64_t i=0;i<iterations;++i) {
+		q.vfs_path = (char*)g_vfs_paths[i & 7];
+		g_sink += hashmap_get(g_vfs_mem, &q) != NULL;
+	}
+}
+
+// ************************************************************************************
+void bench_hashmap_get_mime(uint64_t iterations) {
+	struct mime_entry q;
+	for(uint64_t i=0;i<iterations;++i) {
+		q.extension = (char*)g_mime_exts[i & 7];
+		g_sink += hashmap_get(g_mime, &q) != NULL;
+	}
+}
+
+// ************************************************************************************
+void bench_vfs_get_mem(uint64_t iterations) {
+	struct vfs_buffer buf;
+	for(uint64_t i=0;i<iterations;++i) {
+		vfs_get(g_vfs_mem, "/static/app/dashboard.js", &buf);
+		g_sink += buf.len;
+		vfs_buffer_free(&buf);
+	}
+}
+
+// ************************************************************************************
+void bench_vfs_get_fs(uint64_t iterations) {
+	struct vfs_buffer buf;
+	for(uint64_t i=0;i<iterations;++i) {
+		vfs_get(g_vfs_fs, "/dashboard.js", &buf);
+		g_sink += buf.len;
+		vfs_buffer_free(&buf);
+	}
+}
+
+// ************************************************************************************
+void bench_extract_extension(uint64_t iterations) {
+	char ext[32];
+	for(uint64_t i=0;i<iterations;++i) {
+		extract_extension(g_vfs_paths[i & 7], ext, sizeof(ext));
+		g_sink += ext[0];
+	}
+}
+
+// ************************************************************************************
+void bench_parse_query(uint64_t iterations) {
+	int32_t len = strlen(g_query);
+	for(uint64_t i=0;i<iterations;++i) {
+		lua_newtable(g_lua->state);
+		luaapp_parse_query(g_lua, g_query, len);
+		lua_settop(g_lua->state, 0);
+	}
+}
+
+// ************************************************************************************
+// luaapp_parse_query before the single pass decoder, kept for comparison
+void legacy_parse_query(struct lua_app* app, const char* query, int32_t len) {
+	char* query_copy = strndup(query, len);
+	char* p = NULL;
+
+	while((p = strsep(&query_copy, "&\n"))) {
+		char *name = strtok(p, "=");
+		char* value = NULL;
+
+		if (name && (value = strtok(NULL, "="))) {
+			lua_pushstring(app->state, name);
+			lua_pushstring(app->state, value);
+			lua_settable(app->state, -3);
+		}
+	}
+
+	free(query_copy);
+}
+
+// ************************************************************************************
+void bench_parse_query_legacy(uint64_t iterations) {
+	int32_t len = strlen(g_query);
+	for(uint64_t i=0;i<iterations;++i) {
+		lua_newtable(g_lua->state);
+		legacy_parse_query(g_lua, g_query, len);
+		lua_settop(g_lua->state, 0);
+	}
+}
+
+// ************************************************************************************
+void bench_query_values(uint64_t iterations) {
+	int32_t len = strlen(g_query);
+	for(uint64_t i=0;i<iterations;++i) {
+		g_sink += luaapp_query_values(g_lua->state, g_query, len, "page", 4);
+		lua_settop(g_lua->state, 0);
+	}
+}
+
+// ************************************************************************************
+void bench_push_request(uint64_t iterations) {
+	for(uint64_t i=0;i<iterations;++i) {
+		luaapp_push_request(g_lua, &g_request);
+		lua_settop(g_lua->state, 0);
+	}
+}
+
+// ************************************************************************************
+void bench_pop_response(uint64_t iterations) {
+	for(uint64_t i=0;i<iterations;++i) {
+		luaapp_push_response(g_lua);
+
+		lua_pushstring(g_lua->state, "content");
+		lua_pushstring(g_lua->state, "<html><body>Hello, World!</body></html>");
+		lua_settable(g_lua->state, -3);
+
+		lua_pushstring(g_lua->state, "headers");
+		lua_gettable(g_lua->state, -2);
+		lua_pushstring(g_lua->state, "Cache-Control");
+		lua_pushstring(g_lua->state, "no-cache");
+		lua_settable(g_lua->state, -3);
+		lua_pop(g_lua->state, 1);
+
+		struct http_response_s* response = luaapp_pop_response(g_lua);
+		g_sink += response->content_length;
+		free_response(response);
+		lua_settop(g_lua->state, 0);
+	}
+}
+
+// ************************************************************************************
+void bench_router_match(uint64_t iterations) {
+	struct router_match match;
+	int32_t lens[4];
+	for(int32_t i=0;i<4;++i) lens[i] = strlen(g_route_paths[i]);
+
+	for(uint64_t i=0;i<iterations;++i) {
+		g_sink += router_match(g_lua->router, "GET", 3, g_route_paths[i & 3], lens[i & 3], &match);
+	}
+}
+
+// ************************************************************************************
+void bench_json_decode(uint64_t iterations) {
+	int32_t len = strlen(g_json);
+	for(uint64_t i=0;i<iterations;++i) {
+		json_decode(g_lua->state, g_json, len, NULL);
+		lua_settop(g_lua->state, 0);
+	}
+}
+
+// ************************************************************************************
+void bench_json_encode(uint64_t iterations) {
+	lua_rawgeti(g_lua->state, LUA_REGISTRYINDEX, g_json_ref);
+	for(uint64_t i=0;i<iterations;++i) {
+		g_lua->json.len = 0;
+		json_encode(g_lua->state, -1, &g_lua->json, NULL);
+		g_sink += g_lua->json.len;
+	}
+	lua_settop(g_lua->state, 0);
+}
+
+// ************************************************************************************
+// Parses a browser style upload: four fields and a 4 KB file.
+void bench_form_feed(uint64_t iterations) {
+	for(uint64_t i=0;i<iterations;++i) {
+		struct form* form = form_init(g_form_boundary, 1);
+		form_feed(form, g_form, g_form_len);
+		g_sink += form_finish(form);
+		form_free(form);
+	}
+}
+
+// ************************************************************************************
+void bench_form_push(uint64_t iterations) {
+	struct form* form = form_init(g_form_boundary, 1);
+	form_feed(form, g_form, g_form_len);
+	for(uint64_t i=0;i<iterations;++i) {
+		form_push(g_lua->state, form);
+		lua_settop(g_lua->state, 0);
+	}
+	form_free(form);
+}
+
+// ************************************************************************************
+void bench_shdict_get(uint64_t iterations) {
+	struct shdict_value value;
+	for(uint64_t i=0;i<iterations;++i) {
+		g_sink += shdict_get(g_shared, g_vfs_paths[i & 3], strlen(g_vfs_paths[i & 3]), &value);
+	}
+}
+
+// ************************************************************************************
+void bench_shdict_incr(uint64_t iterations) {
+	struct shdict_value delta = { SHDICT_INTEGER, 1 };
+	struct shdict_value init = { SHDICT_INTEGER, 0 };
+	struct shdict_value result;
+	for(uint64_t i=0;i<iterations;++i) {
+		shdict_incr(g_shared, "requests", 8, &delta, &init, 0, &result);
+		g_sink += result.integer;
+	}
+}
+
+// ************************************************************************************
+void bench_pool_done(struct pool_task* task, void* data) {
+	g_pool_done++;
+	pool_task_free(task);
+}
+
+// ************************************************************************************
+// Offload overhead: submit, wake a worker, wait on the eventfd and complete.
+void bench_pool_roundtrip(uint64_t iterations) {
+	struct pollfd pfd = { pool_fd(g_pool), POLLIN, 0 };
+	for(uint64_t i=0;i<iterations;++i) {
+		uint64_t done = g_pool_done;
+		pool_submit(g_pool, pool_task_init(POOL_SHA256, "abc", 3));
+		while (g_pool_done == done) {
+			poll(&pfd, 1, -1);
+			pool_drain(g_pool);
+		}
+	}
+}
+
+// ************************************************************************************
+void setup_form() {
+	const char* fields[] = { "title", "Quarterly report", "tags", "ops", "tags", "metrics", "visibility", "internal" };
+	int32_t len = 0;
+
+	for(int32_t i=0;i<8;i+=2) {
+		len += sprintf(g_form + len, "--%s\r\nContent-Disposition: form-data; name=\"%s\"\r\n\r\n%s\r\n",
+			g_form_boundary, fields[i], fields[i + 1]);
+	}
+	len += sprintf(g_form + len, "--%s\r\nContent-Disposition: form-data; name=\"file\"; filename=\"report.csv\"\r\n"
+		"Content-Type: text/csv\r\n\r\n", g_form_boundary);
+	for(int32_t i=0;i<4096;++i) {
+		g_form[len++] = i % 64 == 63 ? '\n' : 'a' + i % 26;
+	}
+	len += sprintf(g_form + len, "\r\n--%s--\r\n", g_form_boundary);
+	g_form_len = len;
+}
+
+// ************************************************************************************
+void setup_request() {
+	g_server.date_len = hs_generate_date_time(g_server.date);
+
+	int32_t len = strlen(g_browser_head);
+	g_head_buffer.buf = strdup(g_browser_head);
+	g_head_buffer.length = len;
+	g_head_buffer.capacity = len;
+
+	g_request.server = &g_server;
+	g_request.flags = HTTP_KEEP_ALIVE;
+	g_request.buffer = g_head_buffer;
+	_hs_token_array_init(&g_request.tokens, 32);
+	parse_head(&g_request.buffer, &g_request.tokens);
+	hs_request_index_headers(&g_request);
+
+	g_response = http_response_init();
+	http_response_status(g_response, 200);
+	http_response_header(g_response, "Content-Type", "application/javascript");
+	http_response_header(g_response, "Cache-Control", "public, max-age=3600");
+	http_response_header(g_response, "ETag", "\"5f3c2a1b-19a4\"");
+	http_response_header(g_response, "X-Request-Id", "3f2a9c1e-7b4d-4e8a-9f00-1c2d3e4f5a6b");
+	http_response_body(g_response, "", 0);
+}
+
+// ************************************************************************************
+// Builds the same image of packed files vfs_init_mem reads from the executable.
+void setup_vfs_mem() {
+	char path[64];
+	char* data = calloc(1, 4096);
+	char* image = malloc(BENCH_VFS_ENTRIES * (4096 + 128) + 4);
+	void* curr = image;
+
+	mem_write_u32(&curr, BENCH_VFS_ENTRIES);
+	for(int32_t i=0;i<BENCH_VFS_ENTRIES;++i) {
+		if (i < 4) {
+			strcpy(path, g_vfs_paths[i]);
+		} else {
+			sprintf(path, "/static/lib/file%d.js", i);
+		}
+		mem_write_u32(&curr, strlen(path));
+		mem_write_buf(&curr, path, strlen(path));
+		mem_write_u8(&curr, 0);
+		mem_write_u32(&curr, 4096);
+		mem_write_buf(&curr, data, 4096);
+		mem_write_u8(&curr, 0);
+	}
+
+	vfs_init_mem(&g_vfs_mem, image);
+	free(data);
+}
+
+// ************************************************************************************
+int32_t setup_vfs_fs() {
+	char path[128];
+	char data[4096] = { 0 };
+
+	strcpy(g_fs_dir, "/tmp/bench_micro_XXXXXX");
+	if (!mkdtemp(g_fs_dir)) return -1;
+
+	sprintf(path, "%s/dashboard.js", g_fs_dir);
+	int32_t fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) return -1;
+	write_full(fd, data, sizeof(data));
+	close(fd);
+
+	return vfs_init_fs(&g_vfs_fs, g_fs_dir);
+}
+
+// ************************************************************************************
+void cleanup_vfs_fs() {
+	char path[128];
+	sprintf(path, "%s/dashboard.js", g_fs_dir);
+	unlink(path);
+	rmdir(g_fs_dir);
+}
+
+// ************************************************************************************
+int compare_double(const void* a, const void* b) {
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// ************************************************************************************
+void bench_run(struct bench_case* c, int32_t repetitions, struct bench_result* res) {
+	uint64_t iterations = 1;
+	uint64_t elapsed = 0;
+	uint64_t warmup_start = now_ns();
+
+	// warm-up, doubling the iterations until a run is long enough to time
+	while(1) {
+		uint64_t start = now_ns();
+		c->fn(iterations);
+		elapsed = now_ns() - start;
+
+		if (elapsed >= BENCH_TARGET_NS / 10 && now_ns() - warmup_start >= BENCH_WARMUP_NS) break;
+		if (elapsed < BENCH_TARGET_NS / 10) iterations *= 2;
+	}
+	iterations = iterations * BENCH_TARGET_NS / (elapsed ? elapsed : 1);
+	if (iterations == 0) iterations = 1;
+
+	double ns[BENCH_MAX_REPETITIONS];
+	double cycles[BENCH_MAX_REPETITIONS];
+	for(int32_t r=0;r<repetitions;++r) {
+		uint64_t start = now_ns();
+		uint64_t start_ticks = ticks();
+		c->fn(iterations);
+		cycles[r] = (double)(ticks() - start_ticks) / iterations;
+		ns[r] = (double)(now_ns() - start) / iterations;
+	}
+
+	qsort(ns, repetitions, sizeof(double), compare_double);
+	qsort(cycles, repetitions, sizeof(double), compare_double);
+
+	res->name = c->name;
+	res->iterations = iterations;
+	res->ns_median = ns[repetitions / 2];
+	res->ns_min = ns[0];
+	res->cycles_median = cycles[repetitions / 2];
+}
+
+// ************************************************************************************
+int main(int argc, char** argv) {
+	struct bench_case cases[] = {
+		{ "hsh_parser_exec/browser", bench_parser_exec },
+		{ "hs_request_header/hit", bench_request_header_hit },
+		{ "hs_request_header/miss", bench_request_header_miss },
+		{ "_http_serialize_headers", bench_serialize_headers },
+		{ "hashmap_get/vfs_entry_hash", bench_hashmap_get_vfs },
+		{ "hashmap_get/mime_entry_hash", bench_hashmap_get_mime },
+		{ "vfs_get/mem", bench_vfs_get_mem },
+		{ "vfs_get/fs", bench_vfs_get_fs },
+		{ "extract_extension", bench_extract_extension },
+		{ "luaapp_parse_query/legacy", bench_parse_query_legacy },
+		{ "luaapp_parse_query", bench_parse_query },
+		{ "luaapp_query_values", bench_query_values },
+		{ "luaapp_push_request", bench_push_request },
+		{ "luaapp_pop_response", bench_pop_response },
+		{ "router_match", bench_router_match },
+		{ "json_decode", bench_json_decode },
+		{ "json_encode", bench_json_encode },
+		{ "form_feed/multipart", bench_form_feed },
+		{ "form_push", bench_form_push },
+		{ "shdict_get", bench_shdict_get },
+		{ "shdict_incr", bench_shdict_incr },
+		{ "pool_roundtrip/sha256", bench_pool_roundtrip },
+	};
+	int32_t count = sizeof(cases) / sizeof(cases[0]);
+	struct bench_result results[sizeof(cases) / sizeof(cases[0])];
+	int32_t json = 0;
+	int32_t repetitions = BENCH_REPETITIONS;
+	const char* filter = NULL;
+	int32_t opt = 0;
+
+	while ((opt = getopt(argc, argv, "jr:")) != -1) {
+		switch(opt) {
+			case 'j':
+				json = 1;
+				break;
+			case 'r':
+				repetitions = atoi(optarg);
+				break;
+			default:
+				printf("Usage: %s [-j] [-r repetitions] [name filter]\n", argv[0]);
+				return 1;
+		}
+	}
+	if (optind < argc) filter = argv[optind];
+	if (repetitions < 1) repetitions = 1;
+	if (repetitions > BENCH_MAX_REPETITIONS) repetitions = BENCH_MAX_REPETITIONS;
+
+	// setup
+	if (1) {
+		setup_request();
+		setup_vfs_mem();
+		if (setup_vfs_fs() < 0) {
+			fprintf(stderr, "Cannot create the fs vfs in /tmp\n");
+			return 1;
+		}
+
+		struct vfs_buffer buf = { (char*)g_mime_types, strlen(g_mime_types), 0 };
+		mime_load(&g_mime, &buf);
+
+		g_lua = luaapp_init(g_vfs_mem);
+		if (!g_lua) return 1;
+		luaL_dostring(g_lua->state, "HTTPRequest = { } HTTPResponse = { }");
+		json_decode(g_lua->state, g_json, strlen(g_json), NULL);
+		g_json_ref = luaL_ref(g_lua->state, LUA_REGISTRYINDEX);
+		setup_form();
+
+		g_shared = shdict_init(SHDICT_DEFAULT_SIZE);
+		for(int32_t i=0;i<4;++i) {
+			struct shdict_value value = { SHDICT_STRING, 0, 0, g_json, 256 };
+			shdict_set(g_shared, g_vfs_paths[i], strlen(g_vfs_paths[i]), &value, 0);
+		}
+		g_pool = pool_init(1, bench_pool_done, NULL);
+
+		for(int32_t i=0;i<sizeof(g_routes) / sizeof(g_routes[0]);++i) {
+			router_add(g_lua->router, "GET", g_routes[i], i);
+		}
+	}
+
+	int32_t done = 0;
+	for(int32_t i=0;i<count;++i) {
+		if (filter && !strstr(cases[i].name, filter)) continue;
+
+		bench_run(&cases[i], repetitions, &results[done]);
+		struct bench_result* r = &results[done++];
+
+		if (!json) {
+			printf("%-30s %10.1f ns/op  (min %8.1f)  %10.1f cycles/op  %10llu iterations\n",
+				r->name, r->ns_median, r->ns_min, r->cycles_median, (unsigned long long)r->iterations);
+		}
+	}
+
+	if (json) {
+		printf("[\n");
+		for(int32_t i=0;i<done;++i) {
+			struct bench_result* r = &results[i];
+			printf("  {\"name\":\"%s\",\"iterations\":%llu,\"repetitions\":%d,\"ns_per_op\":%.2f,\"ns_per_op_min\":%.2f,\"cycles_per_op\":%.2f}%s\n",
+				r->name, (unsigned long long)r->iterations, repetitions, r->ns_median, r->ns_min, r->cycles_median, i + 1 < done ? "," : "");
+		}
+		printf("]\n");
+	}
+
+	cleanup_vfs_fs();
+	return 0;
+}
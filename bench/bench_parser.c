@@ -0,0 +1,163 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file bench_parser.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <time.h>
+
+#define HTTPSERVER_IMPL
+#include "../src/httpserver.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+#define ITERATIONS 200000
+
+static const char* g_browser_head =
+	"GET /static/app/dashboard.js?v=20241017 HTTP/1.1\r\n"
+	"Host: www.example.com\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"129\", \"Not=A?Brand\";v=\"8\", \"Google Chrome\";v=\"129\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/129.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,image/apng,*/*;q=0.8\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: script\r\n"
+	"Referer: https://www.example.com/dashboard/overview?range=7d&group=service\r\n"
+	"Accept-Encoding: gzip, deflate, br, zstd\r\n"
+	"Accept-Language: en-US,en;q=0.9,pl;q=0.8\r\n"
+	"If-None-Match: \"5f3c2a1b-19a4\"\r\n"
+	"If-Modified-Since: Thu, 17 Oct 2024 08:12:44 GMT\r\n";
+
+struct bench_case {
+	const char* name;
+	int32_t cookie_len;
+	char* data;
+	int32_t len;
+};
+
+// ************************************************************************************
+void build_case(struct bench_case* c) {
+	int32_t head_len = strlen(g_browser_head);
+	c->data = malloc(head_len + c->cookie_len + 64);
+	memcpy(c->data, g_browser_head, head_len);
+	c->len = head_len;
+
+	if (c->cookie_len > 0) {
+		c->len += sprintf(c->data + c->len, "Cookie: ");
+		for(int32_t i=0;i<c->cookie_len;++i) {
+			c->data[c->len++] = (i % 37 == 36) ? ';' : 'a' + (i * 7) % 26;
+		}
+		c->len += sprintf(c->data + c->len, "\r\n");
+	}
+	c->len += sprintf(c->data + c->len, "\r\n");
+}
+
+// ************************************************************************************
+uint64_t ticks() {
+#ifdef HAVE_RDTSC
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+// ************************************************************************************
+int32_t parse_head(struct bench_case* c, struct hsh_buffer_s* buffer) {
+	struct hsh_parser_s parser;
+	int32_t tokens = 0;
+
+	hsh_parser_init(&parser);
+	buffer->index = 0;
+	buffer->sequence_id++;
+
+	while(1) {
+		struct hsh_token_s token = hsh_parser_exec(&parser, buffer, HTTP_MAX_REQUEST_BUF_SIZE);
+		if (token.type == HSH_TOK_NONE) return -1;
+		tokens++;
+		if (token.type == HSH_TOK_HEADERS_DONE) return tokens;
+	}
+}
+
+// ************************************************************************************
+int main() {
+	struct bench_case cases[] = {
+		{ "browser", 0 },
+		{ "browser+1k cookie", 1024 },
+		{ "browser+3k cookie", 3072 },
+	};
+	const char* level_names[] = { "ragel", "scalar", "sse4.2", "avx2" };
+
+#ifdef HAVE_RDTSC
+	printf("%-20s %-8s %10s %12s\n", "case", "scanner", "bytes", "bytes/cycle");
+#else
+	printf("%-20s %-8s %10s %12s\n", "case", "scanner", "bytes", "bytes/ns");
+#endif
+
+	for(uint32_t i=0;i<sizeof(cases) / sizeof(cases[0]);++i) {
+		struct bench_case* c = &cases[i];
+		build_case(c);
+
+		struct hsh_buffer_s buffer = { 0 };
+		buffer.buf = c->data;
+		buffer.length = c->len;
+		buffer.capacity = c->len;
+
+		int32_t expected_tokens = -1;
+		for(int32_t level=HSH_SIMD_OFF;level<=HSH_SIMD_AVX2;++level) {
+			if (hsh_parser_set_simd(level) != level) continue;
+
+			int32_t tokens = parse_head(c, &buffer);
+			if (tokens < 0 || (expected_tokens >= 0 && tokens != expected_tokens)) {
+				printf("%s: %s produced %d tokens\n", c->name, level_names[level], tokens);
+				return 1;
+			}
+			expected_tokens = tokens;
+
+			uint64_t start = ticks();
+			for(int32_t n=0;n<ITERATIONS;++n) {
+				parse_head(c, &buffer);
+			}
+			uint64_t elapsed = ticks() - start;
+
+			printf("%-20s %-8s %10d %12.3f\n", c->name, level_names[level], c->len, (double)c->len * ITERATIONS / elapsed);
+		}
+
+		free(c->data);
+	}
+
+	return 0;
+}
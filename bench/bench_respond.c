@@ -0,0 +1,128 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file bench_respond.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <time.h>
+
+#define HTTPSERVER_IMPL
+#include "../src/httpserver.h"
+
+#define ITERATIONS 2000000
+
+static const char* g_body = "<html><body>Hello, World!</body></html>";
+
+// ************************************************************************************
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ************************************************************************************
+void release_write(struct http_request_s* request) {
+	_hs_buffer_free(&request->buffer, &request->server->memused);
+}
+
+// ************************************************************************************
+void fill_response(struct http_response_s* response) {
+	http_response_status(response, 200);
+	http_response_header(response, "Content-Type", "text/html");
+	http_response_header(response, "Cache-Control", "no-cache");
+	http_response_header(response, "X-Request-Id", "3f2a9c1e-7b4d-4e8a-9f00-1c2d3e4f5a6b");
+	http_response_body(response, g_body, strlen(g_body));
+}
+
+// ************************************************************************************
+// Reference: the previous vsnprintf based serialization, kept for comparison.
+int legacy_serialize(struct http_server_s* server, struct http_response_s* response, char* out, int size) {
+	int pos = 0;
+
+	pos += snprintf(out + pos, size - pos, "HTTP/1.1 %d %s\r\nDate: %s\r\n", response->status, hs_status_text[response->status], "Sun, 19 Oct 2026 12:00:00 GMT");
+	pos += snprintf(out + pos, size - pos, "Content-Length: %d\r\n", response->content_length);
+	pos += snprintf(out + pos, size - pos, "%s: %s\r\n", "Connection", "keep-alive");
+	for(http_header_t* h = response->headers; h; h = h->next) {
+		pos += snprintf(out + pos, size - pos, "%s: %s\r\n", h->key, h->value);
+	}
+	pos += snprintf(out + pos, size - pos, "\r\n");
+	memcpy(out + pos, response->body, response->content_length);
+
+	return pos + response->content_length;
+}
+
+// ************************************************************************************
+int main() {
+	struct http_server_s server = { 0 };
+	server.date_len = hs_generate_date_time(server.date);
+
+	struct http_request_s request = { 0 };
+	request.server = &server;
+	request.flags = HTTP_KEEP_ALIVE;
+
+	uint64_t total_bytes = 0;
+	uint64_t start = 0;
+	uint64_t elapsed = 0;
+
+	// legacy
+	if (1) {
+		char out[1024];
+		start = now_ns();
+		for(int32_t i=0;i<ITERATIONS;++i) {
+			struct http_response_s* response = http_response_init();
+			fill_response(response);
+			total_bytes += legacy_serialize(&server, response, out, sizeof(out));
+
+			http_header_t* h = response->headers;
+			while(h) {
+				http_header_t* next = h->next;
+				free(h);
+				h = next;
+			}
+			free(response);
+		}
+		elapsed = now_ns() - start;
+		printf("vsnprintf serializer: %8.1f ns/response\n", (double)elapsed / ITERATIONS);
+	}
+
+	// current
+	if (1) {
+		start = now_ns();
+		for(int32_t i=0;i<ITERATIONS;++i) {
+			struct http_response_s* response = http_response_init();
+			fill_response(response);
+			hs_request_respond(&request, response, release_write);
+		}
+		elapsed = now_ns() - start;
+		printf("direct serializer:    %8.1f ns/response\n", (double)elapsed / ITERATIONS);
+	}
+
+	return total_bytes == 0;
+}
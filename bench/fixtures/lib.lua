@@ -0,0 +1,7 @@
+
+-- TODO: fill with usefull methods
+
+HTTPRequest = { }
+HTTPResponse = { }
+
+
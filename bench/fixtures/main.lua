@@ -0,0 +1,26 @@
+
+-- Handlers used by bench/run_e2e.sh
+
+function __httpHandle(request, response)
+	if request.path == "/lua/headers" then
+		local count = 0
+		for k,v in pairs(request.headers) do
+			count = count + 1
+		end
+		for i=1,20 do
+			response.headers["X-Bench-" .. i] = tostring(i)
+		end
+		response.headers["Content-Type"] = "text/plain"
+		response.content = "headers=" .. count
+	elseif request.path == "/lua/slowcache" then
+		-- a refresh that keeps the event loop busy, see stale_check
+		local start = os.clock()
+		while os.clock() - start < 0.3 do end
+		response.cacheTTL = 1
+		response.cacheStale = 60
+		response.content = "refreshed"
+	else
+		response.content = "Hello, World!"
+	end
+	response.code = 200
+end
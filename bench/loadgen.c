@@ -0,0 +1,588 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file loadgen.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+// Closed loop HTTP/1.1 load generator: every connection keeps up to -P requests
+// in flight and sends the next one as soon as a response arrives. Latency is
+// measured from queueing a request to the last byte of its response.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define LG_MAX_PATHS 64
+#define LG_MAX_HEADERS 128
+#define LG_MAX_PIPELINE 256
+#define LG_IN_SIZE 65536
+#define LG_MAX_EVENTS 256
+
+enum lg_state {
+	LG_CONNECTING,
+	LG_HEAD,
+	LG_BODY,
+	LG_BODY_EOF,
+};
+
+struct lg_options {
+	const char* host;
+	int32_t port;
+	const char* unix_path;
+	int32_t connections;
+	int32_t duration;
+	int32_t warmup;
+	int32_t pipeline;
+	int32_t keepalive;
+	int32_t json;
+	const char* name;
+	const char* paths[LG_MAX_PATHS];
+	int32_t weights[LG_MAX_PATHS];
+	int32_t path_count;
+	const char* headers[LG_MAX_HEADERS];
+	int32_t header_count;
+};
+
+struct lg_request {
+	char* data;
+	int32_t len;
+};
+
+struct lg_conn {
+	int32_t fd;
+	int32_t state;
+	int32_t want_write;
+
+	char* out;
+	int32_t out_len;
+	int32_t out_pos;
+	int32_t out_cap;
+
+	char in[LG_IN_SIZE];
+	int32_t in_len;
+	int64_t body_left;
+	int32_t close_after;
+
+	// send times of the requests in flight, oldest first
+	uint64_t sent_at[LG_MAX_PIPELINE];
+	int32_t sent_head;
+	int32_t inflight;
+	uint32_t next;
+};
+
+struct lg_stats {
+	uint64_t* samples;
+	uint64_t sample_count;
+	uint64_t sample_cap;
+	uint64_t completed;
+	uint64_t bytes;
+	uint64_t non2xx;
+	uint64_t errors;
+	uint64_t connects;
+};
+
+static struct lg_options g_opts;
+static struct lg_request* g_requests;
+static int32_t g_request_count;
+static struct sockaddr_storage g_addr;
+static socklen_t g_addr_len;
+static int32_t g_epoll;
+static struct lg_stats g_stats;
+static int32_t g_recording;
+
+// ************************************************************************************
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// ************************************************************************************
+void print_usage(char* app_name) {
+	printf("Usage:\n");
+	printf("  %s -p port [options] [path[:weight] ...]\n", app_name);
+	printf("  %s -u socket [options] [path[:weight] ...]\n", app_name);
+	printf("\n");
+	printf("Options:\n");
+	printf("  -h host      server address (default 127.0.0.1)\n");
+	printf("  -u path      connect to a unix socket instead of host and port\n");
+	printf("  -c count     connections (default 64)\n");
+	printf("  -d seconds   measured duration (default 10)\n");
+	printf("  -w seconds   warm-up before measuring (default 1)\n");
+	printf("  -P depth     requests in flight per connection (default 1)\n");
+	printf("  -k           new connection for every request (no keep-alive)\n");
+	printf("  -H header    extra request header, e.g. \"Accept: */*\", repeatable\n");
+	printf("  -n name      scenario name printed with the results\n");
+	printf("  -j           print results as a JSON object\n");
+	printf("\n");
+	printf("Paths are requested in proportion to their weights (default /).\n");
+}
+
+// ************************************************************************************
+// Builds the request of every path, each path weight times, in the order they are sent.
+void build_requests() {
+	char head[8192];
+	int32_t head_len = 0;
+
+	for(int32_t i=0;i<g_opts.header_count;++i) {
+		head_len += snprintf(head + head_len, sizeof(head) - head_len, "%s\r\n", g_opts.headers[i]);
+	}
+	if (!g_opts.keepalive) {
+		head_len += snprintf(head + head_len, sizeof(head) - head_len, "Connection: close\r\n");
+	}
+
+	char host[300];
+	if (g_opts.unix_path) {
+		snprintf(host, sizeof(host), "localhost");
+	} else {
+		snprintf(host, sizeof(host), "%s:%d", g_opts.host, g_opts.port);
+	}
+
+	int32_t total = 0;
+	for(int32_t i=0;i<g_opts.path_count;++i) total += g_opts.weights[i];
+
+	g_requests = (struct lg_request*)calloc(total, sizeof(struct lg_request));
+	g_request_count = 0;
+
+	for(int32_t i=0;i<g_opts.path_count;++i) {
+		char* data = (char*)malloc(strlen(g_opts.paths[i]) + strlen(host) + head_len + 64);
+		int32_t len = sprintf(data, "GET %s HTTP/1.1\r\nHost: %s\r\n%.*s\r\n", g_opts.paths[i], host, head_len, head);
+
+		for(int32_t w=0;w<g_opts.weights[i];++w) {
+			g_requests[g_request_count].data = data;
+			g_requests[g_request_count].len = len;
+			g_request_count++;
+		}
+	}
+}
+
+// ************************************************************************************
+void record_sample(uint64_t ns) {
+	if (!g_recording) return;
+
+	if (g_stats.sample_count == g_stats.sample_cap) {
+		g_stats.sample_cap = g_stats.sample_cap ? g_stats.sample_cap * 2 : 65536;
+		g_stats.samples = (uint64_t*)realloc(g_stats.samples, g_stats.sample_cap * sizeof(uint64_t));
+	}
+	g_stats.samples[g_stats.sample_count++] = ns;
+}
+
+// ************************************************************************************
+void conn_update_events(struct lg_conn* conn) {
+	int32_t want = conn->state == LG_CONNECTING || conn->out_pos < conn->out_len;
+	if (want == conn->want_write) return;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | (want ? EPOLLOUT : 0);
+	ev.data.ptr = conn;
+	epoll_ctl(g_epoll, EPOLL_CTL_MOD, conn->fd, &ev);
+	conn->want_write = want;
+}
+
+// ************************************************************************************
+void conn_queue_request(struct lg_conn* conn) {
+	struct lg_request* req = &g_requests[conn->next++ % g_request_count];
+
+	if (conn->out_pos == conn->out_len) {
+		conn->out_pos = 0;
+		conn->out_len = 0;
+	}
+	if (conn->out_len + req->len > conn->out_cap) {
+		conn->out_cap = (conn->out_len + req->len) * 2;
+		conn->out = (char*)realloc(conn->out, conn->out_cap);
+	}
+	memcpy(conn->out + conn->out_len, req->data, req->len);
+	conn->out_len += req->len;
+
+	conn->sent_at[(conn->sent_head + conn->inflight) % LG_MAX_PIPELINE] = now_ns();
+	conn->inflight++;
+}
+
+// ************************************************************************************
+void conn_flush(struct lg_conn* conn) {
+	while (conn->out_pos < conn->out_len) {
+		ssize_t n = send(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos, MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			break;
+		}
+		conn->out_pos += n;
+	}
+	conn_update_events(conn);
+}
+
+// ************************************************************************************
+void conn_open(struct lg_conn* conn) {
+	conn->fd = socket(g_addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	conn->state = LG_CONNECTING;
+	conn->in_len = 0;
+	conn->out_len = 0;
+	conn->out_pos = 0;
+	conn->inflight = 0;
+	conn->sent_head = 0;
+	conn->close_after = 0;
+
+	if (g_addr.ss_family == AF_INET) {
+		int32_t flag = 1;
+		setsockopt(conn->fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	}
+
+	if (connect(conn->fd, (struct sockaddr*)&g_addr, g_addr_len) < 0 && errno != EINPROGRESS) {
+		perror("connect");
+		exit(1);
+	}
+	g_stats.connects++;
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = conn;
+	epoll_ctl(g_epoll, EPOLL_CTL_ADD, conn->fd, &ev);
+	conn->want_write = 1;
+
+	// the requests wait in the output buffer, their latency includes the connect
+	int32_t depth = g_opts.keepalive ? g_opts.pipeline : 1;
+	for(int32_t i=0;i<depth;++i) {
+		conn_queue_request(conn);
+	}
+}
+
+// ************************************************************************************
+void conn_reopen(struct lg_conn* conn) {
+	epoll_ctl(g_epoll, EPOLL_CTL_DEL, conn->fd, NULL);
+	close(conn->fd);
+	conn_open(conn);
+}
+
+// ************************************************************************************
+void conn_error(struct lg_conn* conn) {
+	if (g_recording) g_stats.errors++;
+	conn_reopen(conn);
+}
+
+// ************************************************************************************
+// Finds a header value in the response head, case insensitive.
+const char* find_header(const char* head, int32_t len, const char* name) {
+	int32_t name_len = strlen(name);
+
+	for(int32_t i=0;i + name_len + 1 < len;++i) {
+		if (head[i] != '\n') continue;
+		if (strncasecmp(head + i + 1, name, name_len) == 0 && head[i + 1 + name_len] == ':') {
+			const char* value = head + i + 2 + name_len;
+			while (*value == ' ') value++;
+			return value;
+		}
+	}
+	return NULL;
+}
+
+// ************************************************************************************
+void conn_response_done(struct lg_conn* conn) {
+	uint64_t latency = now_ns() - conn->sent_at[conn->sent_head];
+	conn->sent_head = (conn->sent_head + 1) % LG_MAX_PIPELINE;
+	conn->inflight--;
+
+	record_sample(latency);
+	if (g_recording) g_stats.completed++;
+
+	if (conn->close_after || !g_opts.keepalive) {
+		conn_reopen(conn);
+		return;
+	}
+
+	conn->state = LG_HEAD;
+	conn_queue_request(conn);
+	conn_flush(conn);
+}
+
+// ************************************************************************************
+// Consumes as many responses from the input buffer as possible.
+// Returns -1 on a protocol error, 1 if the connection was reopened.
+int32_t conn_process_input(struct lg_conn* conn) {
+	int32_t pos = 0;
+
+	while (pos < conn->in_len) {
+		if (conn->state == LG_HEAD) {
+			char* end = memmem(conn->in + pos, conn->in_len - pos, "\r\n\r\n", 4);
+			if (!end) break;
+
+			int32_t head_len = end + 4 - (conn->in + pos);
+			const char* head = conn->in + pos;
+			if (head_len < 12 || strncmp(head, "HTTP/1.", 7) != 0) return -1;
+
+			int32_t status = atoi(head + 9);
+			if (g_recording && (status < 200 || status >= 400)) g_stats.non2xx++;
+
+			const char* connection = find_header(head, head_len, "Connection");
+			conn->close_after = connection && strncasecmp(connection, "close", 5) == 0;
+
+			const char* length = find_header(head, head_len, "Content-Length");
+			if (length) {
+				conn->body_left = atoll(length);
+				conn->state = LG_BODY;
+			} else {
+				// no length, the body ends with the connection
+				conn->close_after = 1;
+				conn->state = LG_BODY_EOF;
+			}
+
+			pos += head_len;
+		}
+
+		if (conn->state == LG_BODY) {
+			int64_t take = conn->in_len - pos;
+			if (take > conn->body_left) take = conn->body_left;
+			conn->body_left -= take;
+			pos += take;
+
+			if (conn->body_left == 0) {
+				conn_response_done(conn);
+				if (conn->state == LG_CONNECTING) return 1;
+			}
+		} else if (conn->state == LG_BODY_EOF) {
+			pos = conn->in_len;
+		}
+	}
+
+	memmove(conn->in, conn->in + pos, conn->in_len - pos);
+	conn->in_len -= pos;
+	return 0;
+}
+
+// ************************************************************************************
+void conn_on_readable(struct lg_conn* conn) {
+	while (1) {
+		ssize_t n = recv(conn->fd, conn->in + conn->in_len, LG_IN_SIZE - conn->in_len, 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN) return;
+			conn_error(conn);
+			return;
+		}
+		if (n == 0) {
+			if (conn->state == LG_BODY_EOF) {
+				conn_response_done(conn);
+			} else {
+				conn_error(conn);
+			}
+			return;
+		}
+
+		if (g_recording) g_stats.bytes += n;
+		conn->in_len += n;
+
+		int32_t rc = conn_process_input(conn);
+		if (rc < 0) {
+			conn_error(conn);
+			return;
+		}
+		if (rc > 0) return;
+
+		if (conn->in_len == LG_IN_SIZE) {
+			// a head larger than the input buffer
+			conn_error(conn);
+			return;
+		}
+	}
+}
+
+// ************************************************************************************
+void conn_on_event(struct lg_conn* conn, uint32_t events) {
+	if (conn->state == LG_CONNECTING) {
+		int32_t err = 0;
+		socklen_t len = sizeof(err);
+		getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0) {
+			conn_error(conn);
+			return;
+		}
+		conn->state = LG_HEAD;
+	}
+
+	if (events & EPOLLOUT) {
+		conn_flush(conn);
+	}
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		conn_on_readable(conn);
+	}
+}
+
+// ************************************************************************************
+int compare_u64(const void* a, const void* b) {
+	uint64_t x = *(const uint64_t*)a;
+	uint64_t y = *(const uint64_t*)b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// ************************************************************************************
+double percentile_ms(double p) {
+	if (g_stats.sample_count == 0) return 0;
+	uint64_t idx = (uint64_t)(p * (g_stats.sample_count - 1) + 0.5);
+	return g_stats.samples[idx] / 1e6;
+}
+
+// ************************************************************************************
+void print_results(double seconds) {
+	qsort(g_stats.samples, g_stats.sample_count, sizeof(uint64_t), compare_u64);
+
+	double rps = g_stats.completed / seconds;
+	double mbps = g_stats.bytes / seconds / (1024.0 * 1024.0);
+	const char* name = g_opts.name ? g_opts.name : g_opts.paths[0];
+
+	if (g_opts.json) {
+		printf("{\"name\":\"%s\",\"requests\":%llu,\"rps\":%.1f,\"mbps\":%.2f,\"p50_ms\":%.3f,\"p99_ms\":%.3f,\"p999_ms\":%.3f,\"max_ms\":%.3f,\"non2xx\":%llu,\"errors\":%llu}\n",
+			name, (unsigned long long)g_stats.completed, rps, mbps, percentile_ms(0.5), percentile_ms(0.99), percentile_ms(0.999), percentile_ms(1.0),
+			(unsigned long long)g_stats.non2xx, (unsigned long long)g_stats.errors);
+	} else {
+		printf("%-24s %10.1f req/s %8.2f MB/s  p50 %7.3fms  p99 %7.3fms  p999 %7.3fms  non2xx %llu  errors %llu\n",
+			name, rps, mbps, percentile_ms(0.5), percentile_ms(0.99), percentile_ms(0.999),
+			(unsigned long long)g_stats.non2xx, (unsigned long long)g_stats.errors);
+	}
+}
+
+// ************************************************************************************
+int main(int argc, char** argv) {
+	int32_t opt = 0;
+
+	g_opts.host = "127.0.0.1";
+	g_opts.connections = 64;
+	g_opts.duration = 10;
+	g_opts.warmup = 1;
+	g_opts.pipeline = 1;
+	g_opts.keepalive = 1;
+
+	while ((opt = getopt(argc, argv, "h:p:u:c:d:w:P:kH:n:j")) != -1) {
+		switch(opt) {
+			case 'h': g_opts.host = optarg; break;
+			case 'p': g_opts.port = atoi(optarg); break;
+			case 'u': g_opts.unix_path = optarg; break;
+			case 'c': g_opts.connections = atoi(optarg); break;
+			case 'd': g_opts.duration = atoi(optarg); break;
+			case 'w': g_opts.warmup = atoi(optarg); break;
+			case 'P': g_opts.pipeline = atoi(optarg); break;
+			case 'k': g_opts.keepalive = 0; break;
+			case 'n': g_opts.name = optarg; break;
+			case 'j': g_opts.json = 1; break;
+			case 'H':
+				if (g_opts.header_count < LG_MAX_HEADERS) g_opts.headers[g_opts.header_count++] = optarg;
+				break;
+			default:
+				print_usage(argv[0]);
+				return 1;
+		}
+	}
+
+	for(int32_t i=optind;i<argc && g_opts.path_count < LG_MAX_PATHS;++i) {
+		char* weight = strrchr(argv[i], ':');
+		g_opts.weights[g_opts.path_count] = 1;
+		if (weight) {
+			*weight = 0;
+			g_opts.weights[g_opts.path_count] = atoi(weight + 1) > 0 ? atoi(weight + 1) : 1;
+		}
+		g_opts.paths[g_opts.path_count++] = argv[i];
+	}
+	if (g_opts.path_count == 0) {
+		g_opts.paths[0] = "/";
+		g_opts.weights[0] = 1;
+		g_opts.path_count = 1;
+	}
+
+	if ((g_opts.port <= 0 && !g_opts.unix_path) || g_opts.connections <= 0 || g_opts.duration <= 0 ||
+		g_opts.pipeline <= 0 || g_opts.pipeline > LG_MAX_PIPELINE) {
+		print_usage(argv[0]);
+		return 1;
+	}
+
+	// resolve
+	if (g_opts.unix_path) {
+		struct sockaddr_un* addr = (struct sockaddr_un*)&g_addr;
+		if (strlen(g_opts.unix_path) >= sizeof(addr->sun_path)) {
+			fprintf(stderr, "Socket path too long: %s\n", g_opts.unix_path);
+			return 1;
+		}
+		addr->sun_family = AF_UNIX;
+		strcpy(addr->sun_path, g_opts.unix_path);
+		g_addr_len = sizeof(struct sockaddr_un);
+	} else {
+		struct addrinfo hints = { 0 };
+		struct addrinfo* res = NULL;
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(g_opts.host, NULL, &hints, &res) != 0 || !res) {
+			fprintf(stderr, "Cannot resolve %s\n", g_opts.host);
+			return 1;
+		}
+		struct sockaddr_in* addr = (struct sockaddr_in*)&g_addr;
+		*addr = *(struct sockaddr_in*)res->ai_addr;
+		addr->sin_port = htons(g_opts.port);
+		g_addr_len = sizeof(struct sockaddr_in);
+		freeaddrinfo(res);
+	}
+
+	build_requests();
+	g_epoll = epoll_create1(EPOLL_CLOEXEC);
+
+	struct lg_conn* conns = (struct lg_conn*)calloc(g_opts.connections, sizeof(struct lg_conn));
+	for(int32_t i=0;i<g_opts.connections;++i) {
+		// spread the request mix across connections
+		conns[i].next = i;
+		conn_open(&conns[i]);
+	}
+
+	uint64_t start = now_ns();
+	uint64_t measure_start = start + (uint64_t)g_opts.warmup * 1000000000ULL;
+	uint64_t end = measure_start + (uint64_t)g_opts.duration * 1000000000ULL;
+	g_recording = g_opts.warmup <= 0;
+
+	struct epoll_event events[LG_MAX_EVENTS];
+	while (1) {
+		uint64_t now = now_ns();
+		if (now >= end) break;
+		if (!g_recording && now >= measure_start) g_recording = 1;
+
+		int32_t n = epoll_wait(g_epoll, events, LG_MAX_EVENTS, 100);
+		for(int32_t i=0;i<n;++i) {
+			conn_on_event((struct lg_conn*)events[i].data.ptr, events[i].events);
+		}
+	}
+
+	print_results((end - measure_start) / 1e9);
+	return g_stats.completed == 0;
+}
@@ -0,0 +1,105 @@
+#!/bin/sh
+# End-to-end benchmark: runs loadgen against emb-http-lua serving bench/fixtures,
+# first from the data directory (-d), then as a self-packed executable and
+# last from the data directory over a unix socket (-u), to compare with the
+# loopback TCP numbers of the first run.
+#
+# Usage: run_e2e.sh [emb-http-lua] [loadgen]
+#
+# Environment:
+#   PORT         port to listen on (default 18080)
+#   CONNECTIONS  loadgen connections (default 64)
+#   DURATION     seconds measured per scenario (default 10)
+#   RESULTS      file to append JSON results to, for comparing against a baseline
+
+SERVER=$(realpath "${1:-./emb-http-lua}")
+LOADGEN=$(realpath "${2:-./loadgen}")
+FIXTURES=$(dirname "$(realpath "$0")")/fixtures
+PORT=${PORT:-18080}
+CONNECTIONS=${CONNECTIONS:-64}
+DURATION=${DURATION:-10}
+
+WORK=$(mktemp -d)
+PID=
+TARGET="-p $PORT"
+
+cleanup() {
+	[ -n "$PID" ] && kill "$PID" 2>/dev/null
+	rm -rf "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+cp -r "$FIXTURES" "$WORK/data"
+head -c 1048576 /dev/urandom > "$WORK/data/big.bin"
+
+
+wait_for_server() {
+	for i in $(seq 50); do
+		if "$LOADGEN" $TARGET -c 1 -d 1 -w 0 /tiny.txt > /dev/null 2>&1; then
+			return 0
+		fi
+		sleep 0.1
+	done
+	echo "server did not start" >&2
+	exit 1
+}
+
+run() {
+	name=$1
+	shift
+	if [ -n "$RESULTS" ]; then
+		"$LOADGEN" $TARGET -c "$CONNECTIONS" -d "$DURATION" -n "$name" -j "$@" | tee -a "$RESULTS"
+	else
+		"$LOADGEN" $TARGET -c "$CONNECTIONS" -d "$DURATION" -n "$name" "$@"
+	fi
+}
+
+scenarios() {
+	mode=$1
+	run "$mode/static-tiny" /tiny.txt
+	run "$mode/static-1mb" /big.bin
+	run "$mode/lua-trivial" /lua
+	set --
+	for i in 01 02 03 04 05 06 07 08 09 10 11 12 13 14 15 16 17 18 19 20; do
+		set -- "$@" -H "X-Bench-Header-$i: value-$i-aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+	done
+	run "$mode/lua-headers" "$@" /lua/headers
+	run "$mode/static-tiny-P16" -P 16 /tiny.txt
+	run "$mode/static-tiny-close" -k /tiny.txt
+}
+
+# The request refreshing a stale cache entry gets the stale copy before its
+# 0.3s handler runs, so it should take about as long as a cache hit.
+stale_check() {
+	command -v curl > /dev/null || return 0
+	curl -s -o /dev/null "http://127.0.0.1:$PORT/lua/slowcache"
+	sleep 1.5
+	curl -s -o /dev/null -w "$1/stale-while-revalidate %{time_total}s\n" "http://127.0.0.1:$PORT/lua/slowcache"
+}
+
+# data directory mode
+"$SERVER" -d "$WORK/data" -p "$PORT" > "$WORK/server.log" 2>&1 &
+PID=$!
+wait_for_server
+scenarios dir
+stale_check dir
+kill "$PID"
+wait "$PID" 2>/dev/null
+PID=
+
+# self-packed mode
+"$SERVER" -d "$WORK/data" -o "$WORK/packed" > /dev/null || exit 1
+"$WORK/packed" -p "$PORT" > "$WORK/server.log" 2>&1 &
+PID=$!
+wait_for_server
+scenarios packed
+kill "$PID"
+wait "$PID" 2>/dev/null
+PID=
+
+# unix socket
+"$SERVER" -d "$WORK/data" -u "$WORK/emb.sock" > "$WORK/server.log" 2>&1 &
+PID=$!
+TARGET="-u $WORK/emb.sock"
+wait_for_server
+scenarios unix
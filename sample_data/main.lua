@@ -7,6 +7,8 @@ function __httpHandle(request, response)
 	print("path=" .. request.path)
 
 	for k,v in pairs(request.queryParams) do
+		-- a repeated parameter is an array of its values
+		if type(v) == "table" then v = table.concat(v, ", ") end
 		print("[param] " .. k .. ' = ' .. v)
 	end
 	for k,v in pairs(request.headers) do
@@ -0,0 +1,450 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file cache.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "cache.h"
+#include "hashmap.h"
+#include "httpserver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// The entry, its header pointers and all the strings live in one allocation.
+struct cache_entry {
+	struct cache_entry* prev;
+	struct cache_entry* next;
+
+	const char* key;
+	const char* path;
+	int64_t size;
+	int64_t stored;
+	int64_t expires;
+	int64_t stale_until;
+	int32_t refreshing;
+
+	int32_t status;
+	int32_t headers_count;
+	const char** headers;
+	const char* body;
+	int32_t body_len;
+	char age[16];
+};
+
+struct cache_slot {
+	const char* key;
+	struct cache_entry* entry;
+};
+
+struct cache_path {
+	char* path;
+	char* spec;
+	int32_t entries;
+};
+
+// ************************************************************************************
+int64_t cache_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ************************************************************************************
+uint64_t cache_slot_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct cache_slot* slot = item;
+    return hashmap_sip(slot->key, strlen(slot->key), seed0, seed1);
+}
+
+// ************************************************************************************
+int32_t cache_slot_compare(const void *a, const void *b, void *udata) {
+    const struct cache_slot* a_slot = a;
+    const struct cache_slot* b_slot = b;
+    return strcmp(a_slot->key, b_slot->key);
+}
+
+// ************************************************************************************
+uint64_t cache_path_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct cache_path* entry = item;
+    return hashmap_sip(entry->path, strlen(entry->path), seed0, seed1);
+}
+
+// ************************************************************************************
+int32_t cache_path_compare(const void *a, const void *b, void *udata) {
+    const struct cache_path* a_entry = a;
+    const struct cache_path* b_entry = b;
+    return strcmp(a_entry->path, b_entry->path);
+}
+
+// ************************************************************************************
+uint64_t cache_flight_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct cache_flight* flight = item;
+    return hashmap_sip(flight->key, strlen(flight->key), seed0, seed1);
+}
+
+// ************************************************************************************
+int32_t cache_flight_compare(const void *a, const void *b, void *udata) {
+    const struct cache_flight* a_flight = a;
+    const struct cache_flight* b_flight = b;
+    return strcmp(a_flight->key, b_flight->key);
+}
+
+// ************************************************************************************
+void cache_path_free(void *item) {
+    free(((struct cache_path*)item)->path);
+}
+
+// ************************************************************************************
+struct cache* cache_init(int64_t max_bytes) {
+	if (max_bytes <= 0) return NULL;
+
+	struct cache* res = (struct cache*)calloc(1, sizeof(struct cache));
+	res->max_bytes = max_bytes;
+	res->entries = hashmap_new(sizeof(struct cache_slot), 0, 0, 0, cache_slot_hash, cache_slot_compare, NULL, NULL);
+	res->specs = hashmap_new(sizeof(struct cache_path), 0, 0, 0, cache_path_hash, cache_path_compare, NULL, NULL);
+	res->flights = hashmap_new(sizeof(struct cache_flight), 0, 0, 0, cache_flight_hash, cache_flight_compare, NULL, NULL);
+	res->uncacheable = hashmap_new(sizeof(struct cache_path), 0, 0, 0, cache_path_hash, cache_path_compare, cache_path_free, NULL);
+	return res;
+}
+
+// ************************************************************************************
+int64_t cache_memory(struct cache* cache) {
+	if (!cache) return 0;
+	return cache->bytes;
+}
+
+// ************************************************************************************
+int32_t cache_append(char* key, int32_t* len, const char* s, int32_t n) {
+	if (*len + n >= CACHE_KEY_MAX) return -1;
+	memcpy(key + *len, s, n);
+	*len += n;
+	key[*len] = 0;
+	return 0;
+}
+
+// ************************************************************************************
+// Appends every name=value of the query string with the given name.
+int32_t cache_append_param(char* key, int32_t* len, const char* query, int32_t query_len, const char* name, int32_t name_len) {
+	const char* end = query + query_len;
+
+	for(const char* p = query; p < end; ) {
+		const char* amp = memchr(p, '&', end - p);
+		if (!amp) amp = end;
+
+		if (amp - p >= name_len && memcmp(p, name, name_len) == 0 && (p + name_len == amp || p[name_len] == '=')) {
+			if (cache_append(key, len, "&", 1) < 0) return -1;
+			if (cache_append(key, len, p, amp - p) < 0) return -1;
+		}
+		p = amp + 1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+// Builds the key of the request under the spec, returns -1 if it does not fit.
+int32_t cache_key(const char* path, const char* query, int32_t query_len, const char* spec, struct http_request_s* request, char* key) {
+	int32_t len = 0;
+	key[0] = 0;
+
+	if (cache_append(key, &len, path, strlen(path)) < 0) return -1;
+	if (cache_append(key, &len, "?", 1) < 0) return -1;
+
+	// no spec, the whole query
+	if (!spec || !spec[0]) {
+		if (query && cache_append(key, &len, query, query_len) < 0) return -1;
+		return len;
+	}
+
+	const char* p = spec;
+	int32_t headers = 0;
+	while (*p) {
+		int32_t n = strcspn(p, ",;");
+
+		if (n > 0 && !headers && query) {
+			if (cache_append_param(key, &len, query, query_len, p, n) < 0) return -1;
+		}
+		if (n > 0 && headers) {
+			char name[CACHE_SPEC_MAX];
+			memcpy(name, p, n);
+			name[n] = 0;
+
+			http_string_t value = http_request_header(request, name);
+			if (cache_append(key, &len, "\n", 1) < 0) return -1;
+			if (cache_append(key, &len, name, n) < 0) return -1;
+			if (cache_append(key, &len, ":", 1) < 0) return -1;
+			if (value.buf && cache_append(key, &len, value.buf, value.len) < 0) return -1;
+		}
+
+		if (p[n] == ';') headers = 1;
+		p += p[n] ? n + 1 : n;
+	}
+
+	return len;
+}
+
+// ************************************************************************************
+void cache_unlink(struct cache* cache, struct cache_entry* entry) {
+	if (entry->prev) entry->prev->next = entry->next;
+	else cache->head = entry->next;
+	if (entry->next) entry->next->prev = entry->prev;
+	else cache->tail = entry->prev;
+	entry->prev = NULL;
+	entry->next = NULL;
+}
+
+// ************************************************************************************
+void cache_link_head(struct cache* cache, struct cache_entry* entry) {
+	entry->prev = NULL;
+	entry->next = cache->head;
+	if (cache->head) cache->head->prev = entry;
+	cache->head = entry;
+	if (!cache->tail) cache->tail = entry;
+}
+
+// ************************************************************************************
+// Removes the entry, and the spec of its path once no entry uses it.
+void cache_remove(struct cache* cache, struct cache_entry* entry) {
+	struct cache_slot slot = { entry->key, NULL };
+	hashmap_delete(cache->entries, &slot);
+	cache_unlink(cache, entry);
+	cache->bytes -= entry->size;
+
+	struct cache_path lookup = { (char*)entry->path, NULL, 0 };
+	struct cache_path* p = (struct cache_path*)hashmap_get(cache->specs, &lookup);
+	if (p && --p->entries <= 0) {
+		char* path = p->path;
+		char* spec = p->spec;
+		cache->bytes -= sizeof(struct cache_path) + strlen(path) + strlen(spec) + 2;
+		hashmap_delete(cache->specs, &lookup);
+		free(path);
+		free(spec);
+	}
+
+	free(entry);
+}
+
+// ************************************************************************************
+// Fresh entries are served, stale ones too while the first request to see them
+// refreshes the entry (CACHE_REFRESH). Entries past the stale window are dropped.
+int32_t cache_lookup(struct cache* cache, const char* path, const char* query, int32_t query_len, struct http_request_s* request, char* key, char* spec, struct cache_entry** entry) {
+	*entry = NULL;
+	if (!cache || !path) return CACHE_MISS;
+
+	struct cache_path lookup = { (char*)path, NULL, 0 };
+	const struct cache_path* p = hashmap_get(cache->specs, &lookup);
+	if (!p) return CACHE_MISS;
+
+	strcpy(spec, p->spec);
+	if (cache_key(path, query, query_len, spec, request, key) < 0) return CACHE_MISS;
+
+	struct cache_slot slot = { key, NULL };
+	const struct cache_slot* found = hashmap_get(cache->entries, &slot);
+	if (!found) return CACHE_MISS;
+
+	struct cache_entry* e = found->entry;
+	int64_t now = cache_now();
+
+	if (now >= e->stale_until) {
+		cache_remove(cache, e);
+		return CACHE_MISS;
+	}
+
+	cache_unlink(cache, e);
+	cache_link_head(cache, e);
+	*entry = e;
+	snprintf(e->age, sizeof(e->age), "%lld", (long long)((now - e->stored) / 1000000000));
+
+	if (now < e->expires) return CACHE_FRESH;
+	if (e->refreshing) return CACHE_STALE;
+
+	e->refreshing = 1;
+	return CACHE_REFRESH;
+}
+
+// ************************************************************************************
+struct http_response_s* cache_response(struct cache_entry* entry) {
+	struct http_response_s* response = http_response_init();
+	http_response_status(response, entry->status);
+
+	// headers are kept in list order and the list is built by prepending
+	for(int32_t i=entry->headers_count - 1;i>=0;--i) {
+		http_response_header(response, entry->headers[i * 2], entry->headers[i * 2 + 1]);
+	}
+	http_response_header(response, "Age", entry->age);
+	http_response_body(response, entry->body, entry->body_len);
+	return response;
+}
+
+// ************************************************************************************
+void cache_store(struct cache* cache, const char* path, const char* key, struct cache_rule* rule, struct http_response_s* response) {
+	if (!cache || !rule || rule->ttl <= 0) return;
+
+	// replace whatever was under the key
+	struct cache_slot slot = { key, NULL };
+	const struct cache_slot* found = hashmap_get(cache->entries, &slot);
+	if (found) cache_remove(cache, found->entry);
+
+	int32_t headers_count = 0;
+	int64_t strings = strlen(key) + strlen(path) + 2;
+	for(http_header_t* h = response->headers; h; h = h->next) {
+		headers_count++;
+		strings += h->key_len + h->value_len + 2;
+	}
+
+	int64_t size = sizeof(struct cache_entry) + headers_count * 2 * sizeof(char*) + strings + response->content_length;
+	if (size > cache->max_bytes / 2) return;
+
+	struct cache_entry* e = (struct cache_entry*)calloc(1, size);
+	char* s = (char*)(e + 1) + headers_count * 2 * sizeof(char*);
+	int64_t now = cache_now();
+
+	e->size = size;
+	e->stored = now;
+	e->expires = now + (int64_t)(rule->ttl * 1e9);
+	e->stale_until = e->expires + (rule->stale > 0 ? (int64_t)(rule->stale * 1e9) : 0);
+	e->status = response->status;
+	e->headers_count = headers_count;
+	e->headers = (const char**)(e + 1);
+
+	e->key = strcpy(s, key);
+	s += strlen(key) + 1;
+	e->path = strcpy(s, path);
+	s += strlen(path) + 1;
+
+	int32_t i = 0;
+	for(http_header_t* h = response->headers; h; h = h->next, ++i) {
+		memcpy(s, h->key, h->key_len);
+		s[h->key_len] = 0;
+		e->headers[i * 2] = s;
+		s += h->key_len + 1;
+
+		memcpy(s, h->value, h->value_len);
+		s[h->value_len] = 0;
+		e->headers[i * 2 + 1] = s;
+		s += h->value_len + 1;
+	}
+
+	if (response->content_length > 0) {
+		memcpy(s, response->body, response->content_length);
+	}
+	e->body = s;
+	e->body_len = response->content_length;
+
+	struct cache_slot new_slot = { e->key, e };
+	hashmap_set(cache->entries, &new_slot);
+	cache_link_head(cache, e);
+	cache->bytes += size;
+
+	// the spec of the path, the last response decides it
+	struct cache_path lookup = { (char*)path, NULL, 0 };
+	struct cache_path* p = (struct cache_path*)hashmap_get(cache->specs, &lookup);
+	if (p) {
+		if (strcmp(p->spec, rule->spec) != 0) {
+			cache->bytes += (int64_t)strlen(rule->spec) - (int64_t)strlen(p->spec);
+			free(p->spec);
+			p->spec = strdup(rule->spec);
+		}
+		p->entries += 1;
+	} else {
+		struct cache_path entry = { strdup(path), strdup(rule->spec), 1 };
+		hashmap_set(cache->specs, &entry);
+		cache->bytes += sizeof(struct cache_path) + strlen(path) + strlen(rule->spec) + 2;
+	}
+
+	while (cache->bytes > cache->max_bytes && cache->tail && cache->tail != e) {
+		cache_remove(cache, cache->tail);
+	}
+
+	// the path turned out to be cacheable after all
+	const struct cache_path* known = hashmap_delete(cache->uncacheable, &lookup);
+	if (known) free(known->path);
+}
+
+// ************************************************************************************
+// Lets the next stale hit try again when a refresh did not store a response.
+void cache_refresh_done(struct cache* cache, const char* key) {
+	if (!cache) return;
+
+	struct cache_slot slot = { key, NULL };
+	const struct cache_slot* found = hashmap_get(cache->entries, &slot);
+	if (found) found->entry->refreshing = 0;
+}
+
+// ************************************************************************************
+// Drops every entry, responses of code that was reloaded.
+void cache_clear(struct cache* cache) {
+	if (!cache) return;
+	while (cache->head) cache_remove(cache, cache->head);
+	hashmap_clear(cache->uncacheable, false);
+}
+
+// ************************************************************************************
+// The pending miss of the key, NULL if there is none.
+struct cache_flight* cache_flight_get(struct cache* cache, const char* key) {
+	if (!cache) return NULL;
+
+	struct cache_flight lookup = { (char*)key, NULL };
+	return (struct cache_flight*)hashmap_get(cache->flights, &lookup);
+}
+
+// ************************************************************************************
+// Marks the miss of the key pending, until cache_flight_end. Returns 0 when
+// the path is known to give uncached responses, waiting would not help then.
+int32_t cache_flight_begin(struct cache* cache, const char* path, const char* key) {
+	if (!cache) return 0;
+
+	struct cache_path lookup = { (char*)path, NULL, 0 };
+	if (hashmap_get(cache->uncacheable, &lookup)) return 0;
+
+	struct cache_flight flight = { strdup(key), NULL };
+	hashmap_set(cache->flights, &flight);
+	return 1;
+}
+
+// ************************************************************************************
+// Ends the pending miss of the key and returns its waiters. A path given as
+// uncacheable gets no more pending misses until a response of it is stored.
+void* cache_flight_end(struct cache* cache, const char* key, const char* uncacheable) {
+	if (cache && uncacheable) {
+		struct cache_path known = { (char*)uncacheable, NULL, 0 };
+		if (!hashmap_get(cache->uncacheable, &known)) {
+			if (hashmap_count(cache->uncacheable) >= CACHE_UNCACHEABLE_MAX) hashmap_clear(cache->uncacheable, false);
+			known.path = strdup(uncacheable);
+			hashmap_set(cache->uncacheable, &known);
+		}
+	}
+
+	struct cache_flight* found = cache_flight_get(cache, key);
+	if (!found) return NULL;
+
+	struct cache_flight lookup = { found->key, NULL };
+	void* waiters = found->waiters;
+	hashmap_delete(cache->flights, &lookup);
+	free(lookup.key);
+	return waiters;
+}
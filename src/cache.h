@@ -0,0 +1,99 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file cache.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdint.h>
+
+#define CACHE_DEFAULT_SIZE ((int64_t)64 << 20)
+#define CACHE_SPEC_MAX 256
+#define CACHE_KEY_MAX 1024
+// paths remembered to give responses that are not cached, forgotten at once
+// when there are more
+#define CACHE_UNCACHEABLE_MAX 1024
+
+// results of cache_lookup
+#define CACHE_MISS 0
+#define CACHE_FRESH 1
+#define CACHE_STALE 2
+#define CACHE_REFRESH 3
+
+struct hashmap;
+struct cache_entry;
+struct http_request_s;
+struct http_response_s;
+
+// What a handler asked for through response.cacheTTL, response.cacheStale
+// and response.cacheKey. The spec lists the query parameters and headers that
+// vary the response as "param,param;header,header", empty for the whole query.
+struct cache_rule {
+	double ttl;
+	double stale;
+	char spec[CACHE_SPEC_MAX];
+};
+
+// A miss whose handler waits for a worker task. Other requests of the key
+// wait for its response (waiters, chained by the caller) instead of running
+// the handler again, unless the path is known to give uncached responses.
+struct cache_flight {
+	char* key;
+	void* waiters;
+};
+
+// Size bounded LRU of responses produced by Lua. Entries are keyed by the
+// path plus what the spec of the path selects from the request; the spec is
+// learned from the response that filled the entry.
+struct cache {
+	struct hashmap* entries;
+	struct hashmap* specs;
+	struct hashmap* flights;
+	struct hashmap* uncacheable;
+	struct cache_entry* head;
+	struct cache_entry* tail;
+	int64_t max_bytes;
+	int64_t bytes;
+};
+
+struct cache* cache_init(int64_t max_bytes);
+int64_t cache_memory(struct cache* cache);
+
+int32_t cache_key(const char* path, const char* query, int32_t query_len, const char* spec, struct http_request_s* request, char* key);
+
+int32_t cache_lookup(struct cache* cache, const char* path, const char* query, int32_t query_len, struct http_request_s* request, char* key, char* spec, struct cache_entry** entry);
+struct http_response_s* cache_response(struct cache_entry* entry);
+void cache_store(struct cache* cache, const char* path, const char* key, struct cache_rule* rule, struct http_response_s* response);
+void cache_refresh_done(struct cache* cache, const char* key);
+void cache_clear(struct cache* cache);
+
+struct cache_flight* cache_flight_get(struct cache* cache, const char* key);
+int32_t cache_flight_begin(struct cache* cache, const char* path, const char* key);
+void* cache_flight_end(struct cache* cache, const char* key, const char* uncacheable);
+
+#endif /* CACHE_H_ */
@@ -0,0 +1,473 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file form.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#define _GNU_SOURCE
+
+#include "form.h"
+#include "utils.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include <lua.h>
+
+#define FORM_PREAMBLE 0
+#define FORM_DELIMITER 1
+#define FORM_HEADERS 2
+#define FORM_BODY 3
+#define FORM_DONE 4
+#define FORM_ERROR 5
+#define FORM_TOO_LARGE 6
+
+static int64_t g_form_memory = 0;
+
+// ************************************************************************************
+void form_account(struct form* form, int64_t delta) {
+	form->memory += delta;
+	g_form_memory += delta;
+}
+
+// ************************************************************************************
+int64_t form_memory() {
+	return g_form_memory;
+}
+
+// ************************************************************************************
+// Compares the media type of a Content-Type value, parameters ignored.
+int32_t form_media_type_is(const char* content_type, int32_t len, const char* type) {
+	int32_t type_len = strlen(type);
+	if (len < type_len || strncasecmp(content_type, type, type_len) != 0) return 0;
+	return len == type_len || content_type[type_len] == ';' || content_type[type_len] == ' ';
+}
+
+// ************************************************************************************
+int32_t form_is_urlencoded(const char* content_type, int32_t len) {
+	return form_media_type_is(content_type, len, "application/x-www-form-urlencoded");
+}
+
+// ************************************************************************************
+// Finds the value of a ; separated parameter like name="value" or name=value,
+// returns its length or -1.
+int32_t form_param(const char* value, int32_t len, const char* param, char* out, int32_t out_max) {
+	int32_t param_len = strlen(param);
+	int32_t i = 0;
+
+	while (i < len) {
+		// to the start of the next parameter
+		while (i < len && value[i] != ';') {
+			if (value[i] == '"') {
+				i++;
+				while (i < len && value[i] != '"') i += value[i] == '\\' ? 2 : 1;
+			}
+			i++;
+		}
+		i++;
+		while (i < len && (value[i] == ' ' || value[i] == '\t')) i++;
+
+		if (len - i <= param_len || strncasecmp(value + i, param, param_len) != 0 || value[i + param_len] != '=') continue;
+		i += param_len + 1;
+
+		int32_t n = 0;
+		if (i < len && value[i] == '"') {
+			i++;
+			while (i < len && value[i] != '"') {
+				if (value[i] == '\\' && i + 1 < len) i++;
+				if (n < out_max - 1) out[n++] = value[i];
+				i++;
+			}
+		} else {
+			while (i < len && value[i] != ';' && value[i] != ' ' && value[i] != '\t') {
+				if (n < out_max - 1) out[n++] = value[i];
+				i++;
+			}
+		}
+		out[n] = 0;
+		return n;
+	}
+
+	return -1;
+}
+
+// ************************************************************************************
+// Extracts the boundary of a multipart/form-data Content-Type,
+// boundary needs FORM_BOUNDARY_MAX + 1 bytes. Returns its length or -1.
+int32_t form_boundary(const char* content_type, int32_t len, char* boundary) {
+	char value[FORM_BOUNDARY_MAX + 2];
+
+	if (!form_media_type_is(content_type, len, "multipart/form-data")) return -1;
+
+	int32_t n = form_param(content_type, len, "boundary", value, sizeof(value));
+	if (n <= 0 || n > FORM_BOUNDARY_MAX) return -1;
+
+	memcpy(boundary, value, n + 1);
+	return n;
+}
+
+// ************************************************************************************
+struct form* form_init(const char* boundary, int32_t zero_copy) {
+	struct form* res = (struct form*)calloc(1, sizeof(struct form));
+	res->delimiter_len = snprintf(res->delimiter, sizeof(res->delimiter), "\r\n--%s", boundary);
+	res->zero_copy = zero_copy;
+	res->state = FORM_PREAMBLE;
+	return res;
+}
+
+// ************************************************************************************
+int32_t form_part_begin(struct form* form, const char* headers, int32_t len) {
+	if (form->memory + (int64_t)sizeof(struct form_part) > FORM_MEMORY_MAX) {
+		form->state = FORM_TOO_LARGE;
+		return -1;
+	}
+
+	struct form_part* part = (struct form_part*)calloc(1, sizeof(struct form_part));
+	part->fd = -1;
+	form_account(form, sizeof(struct form_part));
+
+	for(const char* line = headers; line < headers + len; ) {
+		const char* eol = (const char*)memmem(line, headers + len - line, "\r\n", 2);
+		if (!eol) eol = headers + len;
+
+		const char* colon = (const char*)memchr(line, ':', eol - line);
+		if (colon) {
+			const char* value = colon + 1;
+			while (value < eol && (*value == ' ' || *value == '\t')) value++;
+
+			if (colon - line == 19 && strncasecmp(line, "Content-Disposition", 19) == 0) {
+				form_param(value, eol - value, "name", part->name, FORM_FIELD_MAX);
+				part->has_filename = form_param(value, eol - value, "filename", part->filename, FORM_FIELD_MAX) >= 0;
+			} else if (colon - line == 12 && strncasecmp(line, "Content-Type", 12) == 0) {
+				int32_t n = eol - value < FORM_FIELD_MAX ? eol - value : FORM_FIELD_MAX - 1;
+				memcpy(part->content_type, value, n);
+				part->content_type[n] = 0;
+			}
+		}
+
+		line = eol + 2;
+	}
+
+	if (form->last) form->last->next = part;
+	else form->parts = part;
+	form->last = part;
+	return 0;
+}
+
+// ************************************************************************************
+// Slices of stable input are kept as they are, the rest is copied; parts
+// growing over FORM_PART_MEMORY_MAX, or over what is left of FORM_MEMORY_MAX,
+// continue in a temporary file.
+int32_t form_part_data(struct form* form, const char* data, int32_t len, int32_t stable) {
+	struct form_part* part = form->last;
+	if (!part || len == 0) return 0;
+
+	if (part->fd >= 0) {
+		if (write_full(part->fd, data, len) != len) return -1;
+		part->size += len;
+		return 0;
+	}
+
+	if (!form->zero_copy && (part->size + len > FORM_PART_MEMORY_MAX || form->memory + len > FORM_MEMORY_MAX)) {
+		strcpy(part->path, FORM_TEMP_TEMPLATE);
+		part->fd = mkstemp(part->path);
+		if (part->fd < 0) {
+			part->path[0] = 0;
+			return -1;
+		}
+		if (part->size > 0 && write_full(part->fd, part->data, part->size) != part->size) return -1;
+		if (write_full(part->fd, data, len) != len) return -1;
+
+		free(part->owned);
+		form_account(form, -part->owned_cap);
+		part->owned = NULL;
+		part->owned_cap = 0;
+		part->data = NULL;
+		part->size += len;
+		return 0;
+	}
+
+	if (part->size == 0 && stable) {
+		part->data = data;
+		part->size = len;
+		return 0;
+	}
+
+	if (part->size + len > part->owned_cap) {
+		int64_t cap = part->owned_cap ? part->owned_cap : 1024;
+		while (cap < part->size + len) cap *= 2;
+		char* owned = (char*)realloc(part->owned, cap);
+
+		// a slice moves into the copy
+		if (part->data && part->data != part->owned) memcpy(owned, part->data, part->size);
+		form_account(form, cap - part->owned_cap);
+		part->owned = owned;
+		part->owned_cap = cap;
+	} else if (part->data && part->data != part->owned) {
+		memcpy(part->owned, part->data, part->size);
+	}
+
+	memcpy(part->owned + part->size, data, len);
+	part->data = part->owned;
+	part->size += len;
+	return 0;
+}
+
+// ************************************************************************************
+void form_part_end(struct form* form) {
+	struct form_part* part = form->last;
+	if (part && part->fd >= 0) {
+		close(part->fd);
+		part->fd = -1;
+	}
+}
+
+// ************************************************************************************
+// Length of the end of data that may be the start of the delimiter.
+int32_t form_partial_delimiter(struct form* form, const char* data, int32_t len) {
+	int32_t from = len > form->delimiter_len - 1 ? len - (form->delimiter_len - 1) : 0;
+
+	for(const char* p = data + from; (p = (const char*)memchr(p, '\r', data + len - p)); p++) {
+		if (memcmp(p, form->delimiter, data + len - p) == 0) return data + len - p;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+// Parses as much as it can, returns the number of bytes used or -1.
+int32_t form_parse(struct form* form, const char* buf, int32_t len, int32_t stable) {
+	int32_t pos = 0;
+
+	for(;;) {
+		switch (form->state) {
+			case FORM_PREAMBLE:
+			case FORM_BODY: {
+				// the first delimiter usually comes without the CRLF
+				if (!form->started) {
+					int32_t n = form->delimiter_len - 2;
+					if (len - pos < n) {
+						if (memcmp(buf + pos, form->delimiter + 2, len - pos) == 0) return pos;
+						form->started = 1;
+					} else {
+						form->started = 1;
+						if (memcmp(buf + pos, form->delimiter + 2, n) == 0) {
+							pos += n;
+							form->state = FORM_DELIMITER;
+							continue;
+						}
+					}
+				}
+
+				const char* d = (const char*)memmem(buf + pos, len - pos, form->delimiter, form->delimiter_len);
+				if (d) {
+					if (form->state == FORM_BODY) {
+						if (form_part_data(form, buf + pos, d - buf - pos, stable) < 0) return -1;
+						form_part_end(form);
+					}
+					pos = d - buf + form->delimiter_len;
+					form->state = FORM_DELIMITER;
+					continue;
+				}
+
+				int32_t keep = form_partial_delimiter(form, buf + pos, len - pos);
+				if (form->state == FORM_BODY && form_part_data(form, buf + pos, len - pos - keep, stable) < 0) return -1;
+				return len - keep;
+			}
+
+			case FORM_DELIMITER:
+				if (len - pos < 2) return pos;
+				if (buf[pos] == '-' && buf[pos + 1] == '-') {
+					form->state = FORM_DONE;
+					return len;
+				}
+				if (buf[pos] != '\r' || buf[pos + 1] != '\n') return -1;
+				pos += 2;
+				form->state = FORM_HEADERS;
+				continue;
+
+			case FORM_HEADERS: {
+				if (len - pos < 2) return pos;
+
+				// a part without headers
+				if (buf[pos] == '\r' && buf[pos + 1] == '\n') {
+					if (form_part_begin(form, buf + pos, 0) < 0) return -1;
+					pos += 2;
+					form->state = FORM_BODY;
+					continue;
+				}
+
+				const char* end = (const char*)memmem(buf + pos, len - pos, "\r\n\r\n", 4);
+				if (!end) return len - pos > FORM_HEADERS_MAX ? -1 : pos;
+				if (end - buf - pos > FORM_HEADERS_MAX) return -1;
+
+				if (form_part_begin(form, buf + pos, end - buf - pos) < 0) return -1;
+				pos = end - buf + 4;
+				form->state = FORM_BODY;
+				continue;
+			}
+
+			case FORM_DONE:
+				return len;
+
+			default:
+				return -1;
+		}
+	}
+}
+
+// ************************************************************************************
+void form_keep(struct form* form, const char* data, int32_t len) {
+	if (form->pending_len + len > form->pending_cap) {
+		int32_t cap = form->pending_cap ? form->pending_cap : 256;
+		while (cap < form->pending_len + len) cap *= 2;
+		form->pending = (char*)realloc(form->pending, cap);
+		form_account(form, cap - form->pending_cap);
+		form->pending_cap = cap;
+	}
+	memcpy(form->pending + form->pending_len, data, len);
+	form->pending_len += len;
+}
+
+// ************************************************************************************
+// Feeds the next piece of the body. Only what could not be parsed yet (the
+// start of a delimiter or of the part headers) is copied aside.
+int32_t form_feed(struct form* form, const char* data, int32_t len) {
+	int32_t used = 0;
+
+	if (!form || form->state == FORM_ERROR) return -1;
+	if (form->state == FORM_TOO_LARGE) return -2;
+
+	if (form->pending_len == 0) {
+		used = form_parse(form, data, len, form->zero_copy);
+		if (used >= 0) form_keep(form, data + used, len - used);
+	} else {
+		form_keep(form, data, len);
+		used = form_parse(form, form->pending, form->pending_len, 0);
+		if (used >= 0) {
+			memmove(form->pending, form->pending + used, form->pending_len - used);
+			form->pending_len -= used;
+		}
+	}
+
+	if (used < 0) {
+		if (form->state == FORM_TOO_LARGE) return -2;
+		form->state = FORM_ERROR;
+		return -1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+int32_t form_finish(struct form* form) {
+	if (!form) return -1;
+	if (form->state == FORM_TOO_LARGE) return -2;
+	return form->state == FORM_DONE ? 0 : -1;
+}
+
+// ************************************************************************************
+// Closes and removes the temporary files too.
+void form_free(struct form* form) {
+	if (!form) return;
+
+	struct form_part* part = form->parts;
+	while (part) {
+		struct form_part* next = part->next;
+		if (part->fd >= 0) close(part->fd);
+		if (part->path[0]) unlink(part->path);
+		free(part->owned);
+		free(part);
+		part = next;
+	}
+
+	free(form->pending);
+	g_form_memory -= form->memory;
+	free(form);
+}
+
+// ************************************************************************************
+// Sets key = value (the two values on the top of the stack, popped) in the
+// table at t. A key set again turns into an array of its values.
+void form_set_field(lua_State* L, int32_t t) {
+	lua_pushvalue(L, -2);
+	lua_rawget(L, t);
+
+	int32_t type = lua_type(L, -1);
+	if (type == LUA_TNIL) {
+		lua_pop(L, 1);
+		lua_rawset(L, t);
+	} else if (type == LUA_TTABLE && lua_rawlen(L, -1) > 0) {
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+		lua_pop(L, 2);
+	} else {
+		lua_createtable(L, 2, 0);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, 1);
+		lua_insert(L, -2);
+		lua_rawseti(L, -2, 2);
+		lua_rawset(L, t);
+	}
+}
+
+// ************************************************************************************
+// Pushes the table of fields. Plain fields are strings, files and parts kept
+// in temporary files are tables of filename, contentType, size and data or path.
+void form_push(lua_State* L, struct form* form) {
+	lua_newtable(L);
+	int32_t t = lua_gettop(L);
+
+	for(struct form_part* part = form->parts; part; part = part->next) {
+		lua_pushstring(L, part->name);
+
+		if (!part->has_filename && !part->path[0]) {
+			lua_pushlstring(L, part->data ? part->data : "", part->size);
+		} else {
+			lua_createtable(L, 0, 4);
+			if (part->has_filename) {
+				lua_pushstring(L, part->filename);
+				lua_setfield(L, -2, "filename");
+			}
+			if (part->content_type[0]) {
+				lua_pushstring(L, part->content_type);
+				lua_setfield(L, -2, "contentType");
+			}
+			lua_pushinteger(L, part->size);
+			lua_setfield(L, -2, "size");
+			if (part->path[0]) {
+				lua_pushstring(L, part->path);
+				lua_setfield(L, -2, "path");
+			} else {
+				lua_pushlstring(L, part->data ? part->data : "", part->size);
+				lua_setfield(L, -2, "data");
+			}
+		}
+
+		form_set_field(L, t);
+	}
+}
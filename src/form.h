@@ -0,0 +1,103 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file form.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef FORM_H_
+#define FORM_H_
+
+#include <stdint.h>
+
+// RFC 2046 limits boundaries to 70 characters
+#define FORM_BOUNDARY_MAX 70
+#define FORM_HEADERS_MAX 4096
+#define FORM_FIELD_MAX 256
+// larger parts go to a temporary file
+#define FORM_PART_MEMORY_MAX (64 * 1024)
+// bytes a streamed form holds in memory, the data of later parts goes to
+// temporary files; a form needing more for its parts alone is refused
+#define FORM_MEMORY_MAX (1024 * 1024)
+#define FORM_TEMP_TEMPLATE "/tmp/emb-upload-XXXXXX"
+
+struct lua_State;
+
+struct form_part {
+	char name[FORM_FIELD_MAX];
+	char filename[FORM_FIELD_MAX];
+	char content_type[FORM_FIELD_MAX];
+	int32_t has_filename;
+
+	// in memory: a slice of the body or the owned copy
+	const char* data;
+	char* owned;
+	int64_t owned_cap;
+	int64_t size;
+
+	// spilled to a file
+	char path[32];
+	int32_t fd;
+
+	struct form_part* next;
+};
+
+// Streaming multipart/form-data parser. The body can be fed in pieces of any
+// size; a piece is only copied when it ends with what may be the start of
+// a boundary or inside the part headers.
+struct form {
+	char delimiter[FORM_BOUNDARY_MAX + 4];
+	int32_t delimiter_len;
+	int32_t state;
+	int32_t started;
+	// slices of the fed data stay valid until form_free (the whole body at once)
+	int32_t zero_copy;
+
+	char* pending;
+	int32_t pending_len;
+	int32_t pending_cap;
+
+	struct form_part* parts;
+	struct form_part* last;
+
+	// held in memory, slices of the fed data not counted
+	int64_t memory;
+};
+
+int32_t form_is_urlencoded(const char* content_type, int32_t len);
+int32_t form_boundary(const char* content_type, int32_t len, char* boundary);
+
+struct form* form_init(const char* boundary, int32_t zero_copy);
+// -1 for a malformed body, -2 for one over FORM_MEMORY_MAX
+int32_t form_feed(struct form* form, const char* data, int32_t len);
+int32_t form_finish(struct form* form);
+void form_free(struct form* form);
+// bytes held by all the forms not freed yet
+int64_t form_memory();
+
+void form_push(struct lua_State* L, struct form* form);
+void form_set_field(struct lua_State* L, int32_t t);
+
+#endif /* FORM_H_ */
@@ -53,6 +53,12 @@
  *   #define HTTPSERVER_IMPL
  *   #include "httpserver.h"
  *
+ *   The event backend is selected by defining one of EPOLL (Linux), KQUEUE
+ *   (BSD, macOS) or IOURING (Linux 6.0 or newer) when compiling. The IOURING
+ *   backend accepts with a multishot accept, receives into a ring of kernel
+ *   provided buffers and sends with linked timeouts, submitting everything
+ *   queued during an event loop iteration with a single syscall.
+ *
  *   There are some #defines that can be configured. This must be done in the
  *   same file that you define HTTPSERVER_IMPL These defines have default values
  *   and will need to be #undef'd and redefined to configure them.
@@ -74,8 +80,10 @@
  *       connection alive a keep-alive request has completed.
  *
  *     HTTP_MAX_TOTAL_EST_MEM_USAGE - default 4294967296 (4GB) - This is the
- *       amount of read/write buffer space that is allowed to be allocated
- * across all requests before new requests will get 503 responses.
+ *       amount of memory (connection state, read/write buffers and memory
+ *       reported with http_server_set_external_memory) that is allowed to be
+ *       allocated across all requests before new requests will get 503
+ *       responses. Can be changed per server with http_server_set_max_memory.
  *
  *     HTTP_MAX_TOKEN_LENGTH - default 8192 (8KB) - This is the max size of any
  *       non body http tokens. i.e: header names, header values, url length,
@@ -86,11 +94,37 @@
  * the request + headers cannot fit in this size the request body will be
  *       streamed in.
  *
+ *     HTTP_LISTEN_BACKLOG - default 1024 - Initial length of the queue of
+ *       pending connections on the server socket. Can be changed per server
+ *       with http_server_set_listen_backlog.
+ *
+ *     HTTP_ACCEPT_BUDGET - default 64 - Initial maximum number of connections
+ *       accepted per wakeup of the event loop. Can be changed per server with
+ *       http_server_set_accept_budget.
+ *
+ *     HTTP_SHED_RETRY_AFTER - default 1 - Initial value of the Retry-After
+ *       header sent with 503 responses when the server is overloaded. Can be
+ *       changed per server with http_server_set_retry_after.
+ *
+ *     HTTP_REQUEST_LINE_MAX - default 256 - Bytes of the method and target
+ *       kept for the done handler, see http_request_line.
+ *
+ *     HTTP_URING_ENTRIES - default 1024 - Submission queue size of the
+ *       IOURING backend. The completion queue is four times larger.
+ *
+ *     HTTP_URING_BUF_COUNT - default 1024 - Number of receive buffers shared
+ *       by all connections of the IOURING backend. Must be a power of two.
+ *
+ *     HTTP_URING_BUF_SIZE - default 4096 - Size in bytes of each receive
+ *       buffer of the IOURING backend.
+ *
  *   For more details see the documentation of the interface and the example
  *   below.
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -102,6 +136,7 @@ struct http_string_s;
 struct http_server_s;
 struct http_request_s;
 struct http_response_s;
+struct http_server_stats_s;
 
 /**
  * Get the event loop descriptor that the server is running on.
@@ -129,6 +164,9 @@ struct http_response_s;
  *
  *   // Set ev.data.ptr to a foo pointer when registering the event.
  *
+ * For io_uring this is the ring descriptor. Operations can not be added to the
+ * ring from the outside, the event loop only dispatches its own completions.
+ *
  * @param server The server.
  *
  * @return The descriptor of the event loop.
@@ -200,6 +238,295 @@ int http_server_listen_poll(struct http_server_s *server);
  */
 int http_server_poll(struct http_server_s *server);
 
+/**
+ * Sets the length of the queue of pending connections passed to listen.
+ *
+ * Must be called before the server starts listening. The kernel may cap the
+ * value (see net.core.somaxconn on Linux).
+ *
+ * @param server The server.
+ * @param backlog The queue length.
+ */
+void http_server_set_listen_backlog(struct http_server_s *server, int backlog);
+
+/**
+ * Sets how many connections are accepted per wakeup of the event loop.
+ *
+ * Connections left in the queue are accepted on the next iteration of the
+ * event loop, after the already pending socket events were handled. This keeps
+ * established connections responsive during connection bursts. The IOURING
+ * backend accepts through a multishot accept and ignores the budget.
+ *
+ * @param server The server.
+ * @param budget Maximum connections accepted at once, 0 for no limit.
+ */
+void http_server_set_accept_budget(struct http_server_s *server, int budget);
+
+/**
+ * Enables TCP_DEFER_ACCEPT on the server socket.
+ *
+ * The event loop is then woken only once a connection has data to read, or
+ * after the given number of seconds. Must be called before the server starts
+ * listening. Has no effect on systems without TCP_DEFER_ACCEPT.
+ *
+ * @param server The server.
+ * @param seconds How long the kernel waits for data, 0 disables.
+ */
+void http_server_set_defer_accept(struct http_server_s *server, int seconds);
+
+/**
+ * Listens on a unix stream socket at path instead of the TCP port, e.g. for a
+ * reverse proxy on the same host. A socket file left behind by a server that
+ * is gone is replaced, listening fails while another server accepts on it.
+ * Must be called before the server starts listening.
+ *
+ * @param server The server.
+ * @param path The socket path.
+ * @param mode The permissions of the socket file, e.g. 0660.
+ */
+void http_server_set_unix_socket(struct http_server_s *server,
+                                 const char *path, int mode);
+
+/**
+ * Limits the number of open connections.
+ *
+ * Connections accepted above the limit are shed right away, before anything
+ * is read from them. See http_server_set_retry_after.
+ *
+ * @param server The server.
+ * @param max Maximum open connections, 0 for no limit.
+ */
+void http_server_set_max_connections(struct http_server_s *server, int max);
+
+/**
+ * Limits the number of requests in flight.
+ *
+ * A request is in flight from the moment the request handler is called until
+ * the complete response has been passed to http_respond or
+ * http_respond_chunk_end. Requests parsed above the limit are shed without
+ * calling the request handler.
+ *
+ * @param server The server.
+ * @param max Maximum requests in flight, 0 for no limit.
+ */
+void http_server_set_max_inflight(struct http_server_s *server, int max);
+
+/**
+ * Limits the total memory used by the server.
+ *
+ * Once the memory in use (see http_server_memory) is above the limit new
+ * connections and requests are shed until it drops again.
+ *
+ * @param server The server.
+ * @param bytes The limit in bytes, 0 for no limit.
+ */
+void http_server_set_max_memory(struct http_server_s *server, int64_t bytes);
+
+/**
+ * Reports memory used by the application on behalf of the server.
+ *
+ * The value replaces the previously reported one and counts towards the limit
+ * set with http_server_set_max_memory. Typically this is the heap of a
+ * scripting engine, updated after each request.
+ *
+ * @param server The server.
+ * @param bytes The memory currently used by the application.
+ */
+void http_server_set_external_memory(struct http_server_s *server,
+                                     int64_t bytes);
+
+/**
+ * Returns the memory used by the server, including the external memory.
+ *
+ * @param server The server.
+ *
+ * @return Estimated memory use in bytes.
+ */
+int64_t http_server_memory(struct http_server_s *server);
+
+/**
+ * Sets how shed connections and requests are answered.
+ *
+ * With a positive or zero value a "503 Service Unavailable" response carrying
+ * a Retry-After header with the given number of seconds is sent and the
+ * connection closed. With a negative value the connection is closed without a
+ * response, which is the cheapest option under heavy overload.
+ *
+ * @param server The server.
+ * @param seconds The Retry-After value, negative to close without a response.
+ */
+void http_server_set_retry_after(struct http_server_s *server, int seconds);
+
+/**
+ * Returns the connection counters of the server.
+ *
+ * @param server The server.
+ *
+ * @return Counters, updated while the server runs.
+ */
+struct http_server_stats_s const *
+http_server_stats(struct http_server_s *server);
+
+// Request phases timestamped while a done handler is set or the request is
+// traced, see http_request_phase_time.
+#define HTTP_PHASE_ACCEPT 0  // the connection was accepted, first request only
+#define HTTP_PHASE_START 1   // first bytes of the request were read
+#define HTTP_PHASE_HEADERS 2 // the request head was parsed
+#define HTTP_PHASE_HANDLER 3 // the request handler was called
+#define HTTP_PHASE_RESPOND 4 // the response was passed to http_respond
+#define HTTP_PHASE_WRITE 5   // the response was serialized, writing starts
+#define HTTP_PHASE_DONE 6    // the response was written
+#define HTTP_PHASE_COUNT 7
+
+/**
+ * Sets a callback invoked once the response of a request has been written.
+ *
+ * It is also invoked when writing the response failed. While a done handler
+ * is set the server takes a monotonic timestamp at each request phase, see
+ * http_request_phase_time. Without it no clock is read.
+ *
+ * @param server The server.
+ * @param handler The callback, NULL to disable.
+ */
+void http_server_set_done_handler(struct http_server_s *server,
+                                  void (*handler)(struct http_request_s *));
+
+/**
+ * Sets a callback invoked once per second from the server timer, on the event
+ * loop thread.
+ *
+ * @param server The server.
+ * @param handler The callback, NULL to disable.
+ */
+void http_server_set_tick_handler(struct http_server_s *server,
+                                  void (*handler)(struct http_server_s *));
+
+/**
+ * Sets a callback invoked when the connection of a request that still has
+ * userdata closes, e.g. the client went away while its body was streamed.
+ * It lets the userdata be released; the request is freed right after.
+ *
+ * @param server The server.
+ * @param handler The callback, NULL to disable.
+ */
+void http_server_set_abort_handler(struct http_server_s *server,
+                                   void (*handler)(struct http_request_s *));
+
+/**
+ * Calls handler on the event loop thread whenever fd is readable, e.g. an
+ * eventfd signalled by other threads. Works with every event backend. The
+ * handler should read the descriptor empty, it is reported again while it
+ * stays readable.
+ *
+ * @param server The server.
+ * @param fd The descriptor, watched for the lifetime of the server.
+ * @param handler The callback.
+ * @param data Passed to the callback.
+ */
+void http_server_watch(struct http_server_s *server, int fd,
+                       void (*handler)(void *), void *data);
+
+/**
+ * Serves on an already listening socket instead of binding the port, e.g. one
+ * inherited from the process being upgraded. Call before listening.
+ *
+ * @param server The server.
+ * @param fd The listening socket.
+ */
+void http_server_set_listen_fd(struct http_server_s *server, int fd);
+
+/**
+ * Returns the listening socket, -1 before the server listens or once it
+ * drains.
+ *
+ * @param server The server.
+ */
+int http_server_listen_fd(struct http_server_s *server);
+
+/**
+ * Stops accepting connections and lets the open ones finish: responses go
+ * out with Connection: close and keep-alive connections idle for a second
+ * are closed. Connections still open are counted in
+ * http_server_stats. The listening socket is closed; a process it was handed
+ * to keeps accepting on it.
+ *
+ * @param server The server.
+ */
+void http_server_drain(struct http_server_s *server);
+
+/**
+ * Traces every nth request: its phases are timestamped and the response gets
+ * a Server-Timing header with the time spent reading the head, waiting for
+ * the handler and in the handler.
+ *
+ * Sampling keeps the cost away from the other requests, which read no clock
+ * unless a done handler is set.
+ *
+ * @param server The server.
+ * @param every Trace one of every n requests, 1 for all, 0 to disable.
+ */
+void http_server_set_trace_sampling(struct http_server_s *server, int every);
+
+/**
+ * Returns 1 if the request was picked for tracing, see
+ * http_server_set_trace_sampling.
+ *
+ * @param request The request.
+ */
+int http_request_traced(struct http_request_s *request);
+
+/**
+ * Returns the status code of the response sent for the request.
+ *
+ * @param request The request.
+ *
+ * @return The status code, 0 if no response was sent yet.
+ */
+int http_request_status(struct http_request_s *request);
+
+/**
+ * Returns when the request went through a phase.
+ *
+ * Only recorded while a done handler is set on the server or the request is
+ * traced.
+ *
+ * @param request The request.
+ * @param phase One of the HTTP_PHASE_* constants.
+ *
+ * @return CLOCK_MONOTONIC time in nanoseconds, 0 if the phase was not reached.
+ */
+int64_t http_request_phase_time(struct http_request_s *request, int phase);
+
+/**
+ * Returns the method and target of the request, e.g. "GET /index.html".
+ *
+ * Unlike the other request accessors this stays valid in the done handler,
+ * after the response has replaced the request buffer. Only recorded while a
+ * done handler is set and truncated to HTTP_REQUEST_LINE_MAX bytes.
+ *
+ * @param request The request.
+ *
+ * @return The request line, empty if not recorded.
+ */
+struct http_string_s http_request_line(struct http_request_s *request);
+
+/**
+ * Returns the number of response bytes sent for the request, headers and
+ * chunk framing included.
+ *
+ * @param request The request.
+ */
+int64_t http_request_bytes_sent(struct http_request_s *request);
+
+/**
+ * Returns the server the request belongs to.
+ *
+ * @param request The request.
+ *
+ * @return The server.
+ */
+struct http_server_s *http_request_server(struct http_request_s *request);
+
 /**
  * Check if a request flag is set.
  *
@@ -388,6 +715,14 @@ void http_response_header(struct http_response_s *response, char const *key,
 void http_response_body(struct http_response_s *response, char const *body,
                         int length);
 
+/**
+ * Frees a response that is not going to be passed to http_respond, which
+ * frees the response itself.
+ *
+ * @param response The response to free.
+ */
+void http_response_free(struct http_response_s *response);
+
 /**
  * Starts writing the response to the client.
  *
@@ -401,16 +736,31 @@ void http_response_body(struct http_response_s *response, char const *body,
 void http_respond(struct http_request_s *request,
                   struct http_response_s *response);
 
+/**
+ * Sends a response given from the request handler without waiting for it to
+ * return.
+ *
+ * A response given while the request handler runs is written once the
+ * handler returns, together with the responses of pipelined requests. A
+ * handler that keeps working after responding calls this to send it first, as
+ * much of it as the socket takes right away. Does nothing outside of the
+ * handler.
+ *
+ * @param request The request responded to.
+ */
+void http_respond_flush(struct http_request_s *request);
+
 /**
  * Writes a chunk to the client.
  *
- * The notify_done callback will be called when the write is complete. This call
- * consumes the response so a new response will need to be initialized for each
- * chunk. The response status of the request will be the response status that is
- * set when http_respond_chunk is called the first time. Any headers set for the
- * first call will be sent as the response headers. Transfer-Encoding header
- * will automatically be set to chunked. Headers set for subsequent calls will
- * be ignored.
+ * The notify_done callback will be called when the write is complete. Chunks
+ * given right away from it are queued and written together, up to 64 KB, and
+ * it is called again without waiting. This call consumes the response so a new
+ * response will need to be initialized for each chunk. The response status of
+ * the request will be the response status that is set when http_respond_chunk
+ * is called the first time. Any headers set for the first call will be sent as
+ * the response headers. Transfer-Encoding header will automatically be set to
+ * chunked. Headers set for subsequent calls will be ignored.
  *
  * @param request The request to respond to.
  * @param response The response to respond with.
@@ -511,14 +861,25 @@ int main() {
 
 #define HTTP_AUTOMATIC 0x8
 #define HTTP_CHUNKED_RESPONSE 0x20
+// Request was picked for tracing, see http_server_set_trace_sampling.
+#define HTTP_TRACED 0x10
+// Request handler was called and the response is not complete yet.
+#define HTTP_INFLIGHT 0x40
+// A response was written and the connection kept open for the next request.
+#define HTTP_REUSED 0x4
+// Found idle by the last sweep of a draining server, closed by the next one.
+#define HTTP_DRAIN_IDLE 0x2
 
 #define HTTP_KEEP_ALIVE 1
 #define HTTP_CLOSE 0
 
 #include <arpa/inet.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #ifdef KQUEUE
 #include <sys/event.h>
+#elif defined(IOURING)
+#include <linux/io_uring.h>
 #else
 #include <sys/epoll.h>
 #endif
@@ -527,14 +888,101 @@ int main() {
 typedef void (*epoll_cb_t)(struct epoll_event *);
 #endif
 
+// Limits of the output queue of a connection. Responses and chunks given
+// right away are queued until either is reached, then written.
+#define HTTP_OUT_QUEUE_MAX 65536
+#define HTTP_OUT_QUEUE_FRAGS 16
+
+// A serialized response, or chunk of one, owned by the output queue.
+struct hs_out_frag_s {
+  char *buf;
+  int32_t length;
+  int32_t capacity;
+};
+
+// Output of a connection not written yet, gathered by a single sendmsg.
+struct hs_out_queue_s {
+  struct hs_out_frag_s frags[HTTP_OUT_QUEUE_FRAGS];
+  int count;
+  // Bytes of the first fragment already written.
+  int offset;
+  // Unwritten bytes of all fragments.
+  int64_t length;
+  // More output follows right away, partial frames are held back with
+  // MSG_MORE until it is written.
+  char more;
+  // Waiting for the socket to take what a flush left, see
+  // hs_request_flush_output.
+  char flushing;
+};
+
+#ifdef IOURING
+typedef void (*uring_cb_t)(struct io_uring_cqe *);
+
+// Queues of an io_uring instance mapped from the kernel, plus the ring of
+// provided receive buffers.
+struct hs_uring_s {
+  int fd;
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned sq_entries;
+  // Tail including the entries queued but not submitted yet.
+  unsigned sqe_tail;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *buf_ring;
+  unsigned buf_tail;
+  char *bufs;
+};
+
+// io_uring state of a connection.
+struct hs_uring_conn_s {
+  // Submitted operations not completed yet, linked timeouts included.
+  int ops;
+  // Provided buffer with received data not yet moved to the request buffer,
+  // -1 if none.
+  int recv_bid;
+  int recv_off;
+  int recv_len;
+  int8_t recv_armed;
+  int8_t recv_eof;
+  int8_t send_armed;
+  int8_t send_failed;
+  int8_t closing;
+  struct __kernel_timespec recv_ts;
+  struct __kernel_timespec send_ts;
+  // Output queue fragments of the pending send.
+  struct msghdr send_msg;
+  struct iovec send_iov[HTTP_OUT_QUEUE_FRAGS];
+  // Next terminated connection waiting to be freed.
+  struct http_request_s *next_closed;
+};
+#endif
+
 typedef struct http_ev_cb_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent *ev);
+#elif defined(IOURING)
+  uring_cb_t handler;
 #else
   epoll_cb_t handler;
 #endif
 } ev_cb_t;
 
+// A descriptor watched for the application, see http_server_watch.
+struct hs_watch_s {
+  ev_cb_t ev;
+  int fd;
+  void (*handler)(void *);
+  void *data;
+  struct http_server_s *server;
+};
+
 struct hsh_buffer_s {
   char *buf;
   int32_t capacity;
@@ -580,9 +1028,53 @@ struct hs_token_array_s {
   int size;
 };
 
+// Well-known request headers with a dedicated slot in the header index.
+enum hs_known_header_e {
+  HS_HDR_HOST,
+  HS_HDR_CONNECTION,
+  HS_HDR_ACCEPT,
+  HS_HDR_ACCEPT_ENCODING,
+  HS_HDR_ACCEPT_LANGUAGE,
+  HS_HDR_CONTENT_LENGTH,
+  HS_HDR_CONTENT_TYPE,
+  HS_HDR_COOKIE,
+  HS_HDR_IF_NONE_MATCH,
+  HS_HDR_IF_MODIFIED_SINCE,
+  HS_HDR_RANGE,
+  HS_HDR_TRANSFER_ENCODING,
+  HS_HDR_USER_AGENT,
+  HS_HDR_AUTHORIZATION,
+  HS_HDR_REFERER,
+  HS_HDR_X_FORWARDED_FOR,
+  HS_HDR_KNOWN_COUNT
+};
+
+#define HS_HEADER_INDEX_SIZE 32
+#define HS_HEADER_INDEX_MAX_OTHER 24
+
+// Per request header lookup index, built once the headers are parsed. Entries
+// are the position + 1 of the header key in the token array, 0 when unused.
+struct hs_header_index_s {
+  // First occurrence of each well-known header.
+  int known[HS_HDR_KNOWN_COUNT];
+  // Open addressing table of the first occurrence of any other header.
+  int other[HS_HEADER_INDEX_SIZE];
+  int8_t built;
+  // Set when there were more other headers than the table holds.
+  int8_t overflow;
+};
+
 typedef struct http_request_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent *ev);
+#elif defined(IOURING)
+  // Completion handlers of receives, linked timeouts, sends and the polls
+  // waiting to flush output.
+  uring_cb_t handler;
+  uring_cb_t timer_handler;
+  uring_cb_t send_handler;
+  uring_cb_t flush_handler;
+  struct hs_uring_conn_s uring;
 #else
   epoll_cb_t handler;
   epoll_cb_t timer_handler;
@@ -591,33 +1083,111 @@ typedef struct http_request_s {
   void (*chunk_cb)(struct http_request_s *);
   void *data;
   struct hsh_buffer_s buffer;
+  // Received bytes of the pipelined requests following the current one.
+  struct hsh_buffer_s pipelined;
+  struct hs_out_queue_s out;
+  // End of the current request in buffer, 0 while its streamed body is still
+  // read or when the buffer no longer holds it.
+  int request_end;
+  // Set while the handler or chunk callback runs, its response is then
+  // queued and written once it returned.
+  char batching;
   struct hsh_parser_s parser;
   struct hs_token_array_s tokens;
+  struct hs_header_index_s header_index;
   int state;
   int socket;
   int timeout;
-  int64_t bytes_written;
+  // Status code of the response, 0 until responded.
+  int status;
+  // Length of line, the request line kept for the done handler.
+  int line_len;
+  char *line;
+  // Response bytes of the current request, all chunks included.
+  int64_t bytes_sent;
+  int64_t times[HTTP_PHASE_COUNT];
+  // Accept time of the connection, handed to its first request.
+  int64_t accepted_at;
+  // Neighbours in the list of open connections of the server.
+  struct http_request_s *open_prev;
+  struct http_request_s *open_next;
   struct http_server_s *server;
   char flags;
 } http_request_t;
 
+// Connection counters of the server.
+struct http_server_stats_s {
+  // Connections accepted since start.
+  int64_t accepted;
+  // Failed accept calls, not counting would-block.
+  int64_t accept_errors;
+  // Connections accepted during the last full second.
+  int accepted_last_second;
+  // Connections accepted so far in the current second.
+  int accepted_this_second;
+  // Currently open connections.
+  int connections;
+  // Requests passed to the request handler and not yet responded to.
+  int inflight;
+  // Connections and requests rejected because the server was overloaded.
+  int64_t shed;
+};
+
 typedef struct http_server_s {
 #ifdef KQUEUE
   void (*handler)(struct kevent *ev);
+#elif defined(IOURING)
+  uring_cb_t handler;
+  uring_cb_t timer_handler;
+  struct hs_uring_s ring;
+  struct __kernel_timespec timer_ts;
+  // Terminated connections waiting for their operations to complete.
+  http_request_t *closed;
 #else
   epoll_cb_t handler;
   epoll_cb_t timer_handler;
 #endif
   int64_t memused;
+  // Memory reported by the application, see http_server_set_external_memory.
+  int64_t extmemused;
+  int64_t max_memory;
+  int max_connections;
+  int max_inflight;
+  int retry_after;
+  // Retry-After header value rendered from retry_after.
+  char retry_after_str[12];
   int socket;
   int port;
   int loop;
   int timerfd;
+  int backlog;
+  int accept_budget;
+  int defer_accept;
+  // Spare descriptor released to shed connections when out of descriptors.
+  int reserve_fd;
+  // Inherited listening socket, -1 to bind the port.
+  int listen_fd;
+  // Unix socket listened on instead of the port when set.
+  const char *unix_path;
+  int unix_mode;
+  // Set by http_server_drain, nothing is accepted or kept alive anymore.
+  int draining;
+  // Open connections, walked when draining.
+  http_request_t *open;
+  struct http_server_stats_s stats;
   socklen_t len;
   void (*request_handler)(http_request_t *);
+  void (*done_handler)(http_request_t *);
+  void (*tick_handler)(struct http_server_s *);
+  void (*abort_handler)(http_request_t *);
+  // Trace one of every trace_sample requests, 0 for none.
+  int trace_sample;
+  unsigned int trace_counter;
   struct sockaddr_in addr;
   void *data;
-  char date[32];
+  // Complete "Date: ...\r\n" response header line, refreshed every second.
+  char date[48];
+  int date_len;
 } http_server_t;
 
 #endif
@@ -627,6 +1197,7 @@ typedef struct http_server_s {
 #define HS_BUFFER_UTIL_H
 
 #include <stdlib.h>
+#include <time.h>
 
 static inline void _hs_buffer_free(struct hsh_buffer_s *buffer,
                                    int64_t *memused) {
@@ -637,6 +1208,21 @@ static inline void _hs_buffer_free(struct hsh_buffer_s *buffer,
   }
 }
 
+static inline int64_t _hs_monotonic_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Timestamps a request phase, only when someone is interested in it.
+// CLOCK_MONOTONIC is read through the vDSO, the coarse clock would round the
+// sub-millisecond phases away.
+static inline void _hs_request_mark(http_request_t *request, int phase) {
+  if (request->server->done_handler ||
+      HTTP_FLAG_CHECK(request->flags, HTTP_TRACED))
+    request->times[phase] = _hs_monotonic_ns();
+}
+
 #endif
 
 #line 1 "request_util.h"
@@ -659,6 +1245,9 @@ typedef struct http_string_s http_string_t;
 http_string_t hs_get_token_string(http_request_t *request,
                                   enum hsh_token_e token_type);
 http_string_t hs_request_header(http_request_t *request, char const *key);
+http_string_t hs_request_known_header(http_request_t *request,
+                                      enum hs_known_header_e header);
+void hs_request_index_headers(http_request_t *request);
 void hs_request_detect_keep_alive_flag(http_request_t *request);
 int hs_request_iterate_headers(http_request_t *request, http_string_t *key,
                                http_string_t *val, int *iter);
@@ -679,10 +1268,23 @@ http_string_t hs_request_chunk(struct http_request_s *request);
 #define HSH_TOK_FLAG_BODY_FINAL 0x1
 #define HSH_TOK_FLAG_SMALL_BODY 0x2
 
+// Implementations of the bulk scanner used by the parser fast path.
+enum hsh_simd_e {
+  // Fast path disabled, every byte goes through the Ragel machine
+  HSH_SIMD_OFF,
+  HSH_SIMD_SCALAR,
+  HSH_SIMD_SSE42,
+  HSH_SIMD_AVX2
+};
+
 struct hsh_token_s hsh_parser_exec(struct hsh_parser_s *parser,
                                    struct hsh_buffer_s *buffer,
                                    int max_buf_capacity);
 void hsh_parser_init(struct hsh_parser_s *parser);
+int hsh_parser_exec_fast(struct hsh_parser_s *parser,
+                         struct hsh_buffer_s *buffer, int max_buf_capacity,
+                         struct hsh_token_s *token);
+int hsh_parser_set_simd(int level);
 
 #endif
 
@@ -741,6 +1343,10 @@ typedef struct http_header_s {
   char const *key;
   // The value of the header eg: application/json
   char const *value;
+  // Lengths of key and value, computed once so serialization can size the
+  // output buffer upfront.
+  int key_len;
+  int value_len;
   // Pointer to the next header in the linked list.
   struct http_header_s *next;
 } http_header_t;
@@ -763,6 +1369,7 @@ http_response_t *hs_response_init();
 void hs_response_set_header(http_response_t *response, char const *key,
                             char const *value);
 void hs_response_set_status(http_response_t *response, int status);
+void hs_response_free(http_response_t *response);
 void hs_response_set_body(http_response_t *response, char const *body,
                           int length);
 void hs_request_respond(struct http_request_s *request,
@@ -775,6 +1382,10 @@ void hs_request_respond_chunk_end(struct http_request_s *request,
                                   hs_req_fn_t http_write);
 void hs_request_respond_error(struct http_request_s *request, int code,
                               char const *message, hs_req_fn_t http_write);
+void hs_request_end_inflight(struct http_request_s *request);
+
+// Writes val in decimal to dst and returns the number of digits.
+int _hs_utoa(char *dst, unsigned int val);
 
 #endif
 
@@ -788,6 +1399,12 @@ struct kevent;
 
 typedef void (*hs_evt_cb_t)(struct kevent *ev);
 
+#elif defined(IOURING)
+
+struct io_uring_cqe;
+
+typedef void (*hs_evt_cb_t)(struct io_uring_cqe *cqe);
+
 #else
 
 struct epoll_event;
@@ -801,7 +1418,7 @@ struct http_server_s;
 
 void hs_server_listen_on_addr(struct http_server_s *serv, const char *ipaddr);
 int hs_server_run_event_loop(struct http_server_s *serv, const char *ipaddr);
-void hs_generate_date_time(char *datetime);
+int hs_generate_date_time(char *datetime);
 struct http_server_s *hs_server_init(int port,
                                      void (*handler)(struct http_request_s *),
                                      hs_evt_cb_t accept_cb,
@@ -834,6 +1451,18 @@ enum hs_write_rc_e {
 
 enum hs_write_rc_e hs_write_socket(struct http_request_s *request);
 
+// Appends a serialized response or chunk to the output queue of the request,
+// which takes over its buffer.
+void hs_request_queue_output(struct http_request_s *request, char *buf,
+                             int length, int capacity);
+int hs_out_queue_full(struct hs_out_queue_s *out);
+int hs_out_queue_iov(struct hs_out_queue_s *out, struct iovec *iov);
+void hs_out_queue_consume(struct hs_out_queue_s *out, int64_t bytes,
+                          int64_t *memused);
+void hs_out_queue_free(struct hs_out_queue_s *out, int64_t *memused);
+void hs_request_flush_output(struct http_request_s *request);
+void hs_request_flush_ready(struct http_request_s *request);
+
 #endif
 
 #line 1 "connection.h"
@@ -847,6 +1476,9 @@ struct http_server_s;
 #ifdef KQUEUE
 struct kevent;
 typedef void (*hs_io_cb_t)(struct kevent *ev);
+#elif defined(IOURING)
+struct io_uring_cqe;
+typedef void (*hs_io_cb_t)(struct io_uring_cqe *cqe);
 #else
 struct epoll_event;
 typedef void (*hs_io_cb_t)(struct epoll_event *ev);
@@ -883,6 +1515,16 @@ struct http_request_s *hs_server_accept_connection(struct http_server_s *server,
                                                    hs_io_cb_t io_cb,
                                                    hs_io_cb_t epoll_timer_cb);
 
+#ifdef IOURING
+/* Frees the terminated connections whose io_uring operations all completed.
+ *
+ * Called by the event loop after each batch of completions.
+ *
+ * @param server The http server struct.
+ */
+void hs_server_free_closed_connections(struct http_server_s *server);
+#endif
+
 #endif
 
 #line 1 "io_events.h"
@@ -892,11 +1534,21 @@ struct http_request_s *hs_server_accept_connection(struct http_server_s *server,
 #define HTTP_REQUEST_BUF_SIZE 1024
 #define HTTP_MAX_REQUEST_BUF_SIZE 8388608       // 8mb
 #define HTTP_MAX_TOTAL_EST_MEM_USAGE 4294967296 // 4gb
+#define HTTP_LISTEN_BACKLOG 1024
+#define HTTP_ACCEPT_BUDGET 64
+#define HTTP_SHED_RETRY_AFTER 1
+#define HTTP_REQUEST_LINE_MAX 256
+#define HTTP_URING_ENTRIES 1024
+#define HTTP_URING_BUF_COUNT 1024
+#define HTTP_URING_BUF_SIZE 4096
 
 struct http_request_s;
 
 void hs_request_begin_write(struct http_request_s *request);
 void hs_request_begin_read(struct http_request_s *request);
+void hs_request_begin_flush(struct http_request_s *request);
+void hs_request_shed(struct http_request_s *request);
+int hs_server_over_memory_limit(struct http_server_s *server);
 
 #ifdef KQUEUE
 
@@ -904,6 +1556,13 @@ struct kevent;
 
 void hs_on_kqueue_server_event(struct kevent *ev);
 
+#elif defined(IOURING)
+
+struct io_uring_cqe;
+
+void hs_on_uring_server_accept_event(struct io_uring_cqe *cqe);
+void hs_on_uring_server_timer_event(struct io_uring_cqe *cqe);
+
 #else
 
 struct epoll_event;
@@ -930,6 +1589,9 @@ int http_server_loop(http_server_t *server) { return server->loop; }
 http_server_t *http_server_init(int port, void (*handler)(http_request_t *)) {
 #ifdef KQUEUE
   return hs_server_init(port, handler, hs_on_kqueue_server_event, NULL);
+#elif defined(IOURING)
+  return hs_server_init(port, handler, hs_on_uring_server_accept_event,
+                        hs_on_uring_server_timer_event);
 #else
   return hs_server_init(port, handler, hs_on_epoll_server_connection_event,
                         hs_on_epoll_server_timer_event);
@@ -950,6 +1612,102 @@ void http_server_set_userdata(struct http_server_s *serv, void *data) {
   serv->data = data;
 }
 
+void http_server_set_listen_backlog(http_server_t *serv, int backlog) {
+  serv->backlog = backlog;
+}
+
+void http_server_set_accept_budget(http_server_t *serv, int budget) {
+  serv->accept_budget = budget;
+}
+
+void http_server_set_defer_accept(http_server_t *serv, int seconds) {
+  serv->defer_accept = seconds;
+}
+
+void http_server_set_unix_socket(http_server_t *serv, const char *path,
+                                 int mode) {
+  serv->unix_path = path;
+  serv->unix_mode = mode;
+}
+
+void http_server_set_max_connections(http_server_t *serv, int max) {
+  serv->max_connections = max;
+}
+
+void http_server_set_max_inflight(http_server_t *serv, int max) {
+  serv->max_inflight = max;
+}
+
+void http_server_set_max_memory(http_server_t *serv, int64_t bytes) {
+  serv->max_memory = bytes;
+}
+
+void http_server_set_external_memory(http_server_t *serv, int64_t bytes) {
+  serv->extmemused = bytes;
+}
+
+int64_t http_server_memory(http_server_t *serv) {
+  return serv->memused + serv->extmemused;
+}
+
+void http_server_set_retry_after(http_server_t *serv, int seconds) {
+  serv->retry_after = seconds;
+  if (seconds >= 0)
+    serv->retry_after_str[_hs_utoa(serv->retry_after_str, seconds)] = '\0';
+}
+
+struct http_server_stats_s const *http_server_stats(http_server_t *serv) {
+  return &serv->stats;
+}
+
+void http_server_set_done_handler(http_server_t *serv,
+                                  void (*handler)(http_request_t *)) {
+  serv->done_handler = handler;
+}
+
+void http_server_set_tick_handler(http_server_t *serv,
+                                  void (*handler)(http_server_t *)) {
+  serv->tick_handler = handler;
+}
+
+void http_server_set_abort_handler(http_server_t *serv,
+                                   void (*handler)(http_request_t *)) {
+  serv->abort_handler = handler;
+}
+
+void http_server_set_listen_fd(http_server_t *serv, int fd) {
+  serv->listen_fd = fd;
+}
+
+int http_server_listen_fd(http_server_t *serv) { return serv->socket; }
+
+void http_server_set_trace_sampling(http_server_t *serv, int every) {
+  serv->trace_sample = every > 0 ? every : 0;
+}
+
+int http_request_traced(http_request_t *request) {
+  return HTTP_FLAG_CHECK(request->flags, HTTP_TRACED) ? 1 : 0;
+}
+
+int http_request_status(http_request_t *request) { return request->status; }
+
+int64_t http_request_phase_time(http_request_t *request, int phase) {
+  return request->times[phase];
+}
+
+http_string_t http_request_line(http_request_t *request) {
+  http_string_t str = {request->line, request->line_len};
+  return str;
+}
+
+int64_t http_request_bytes_sent(http_request_t *request) {
+  return request->bytes_sent;
+}
+
+http_server_t *http_request_server(http_request_t *request) {
+  return request->server;
+}
+
 void *http_request_server_userdata(struct http_request_s *request) {
   return request->server->data;
 }
@@ -987,11 +1745,20 @@ void http_response_body(http_response_t *response, char const *body,
   hs_response_set_body(response, body, length);
 }
 
+void http_response_free(http_response_t *response) {
+  hs_response_free(response);
+}
+
 void http_respond(http_request_t *request, http_response_t *response) {
   hs_request_respond(request, response, hs_request_begin_write);
 }
 
-void http_respond_chunk(http_request_t *request, http_response_t *response,
+void http_respond_flush(http_request_t *request) {
+  if (request->batching && request->state == HTTP_SESSION_WRITE)
+    hs_request_flush_output(request);
+}
+
+void http_respond_chunk(http_request_t *request, http_response_t *response,
                         void (*cb)(http_request_t *)) {
   hs_request_respond_chunk(request, response, cb, hs_request_begin_write);
 }
@@ -1072,8 +1839,139 @@ http_string_t hs_get_token_string(http_request_t *request,
   return str;
 }
 
+// Lowercase names of the well-known headers by hs_known_header_e.
+static char const *hs_known_header_names[HS_HDR_KNOWN_COUNT] = {
+    [HS_HDR_HOST] = "host",
+    [HS_HDR_CONNECTION] = "connection",
+    [HS_HDR_ACCEPT] = "accept",
+    [HS_HDR_ACCEPT_ENCODING] = "accept-encoding",
+    [HS_HDR_ACCEPT_LANGUAGE] = "accept-language",
+    [HS_HDR_CONTENT_LENGTH] = "content-length",
+    [HS_HDR_CONTENT_TYPE] = "content-type",
+    [HS_HDR_COOKIE] = "cookie",
+    [HS_HDR_IF_NONE_MATCH] = "if-none-match",
+    [HS_HDR_IF_MODIFIED_SINCE] = "if-modified-since",
+    [HS_HDR_RANGE] = "range",
+    [HS_HDR_TRANSFER_ENCODING] = "transfer-encoding",
+    [HS_HDR_USER_AGENT] = "user-agent",
+    [HS_HDR_AUTHORIZATION] = "authorization",
+    [HS_HDR_REFERER] = "referer",
+    [HS_HDR_X_FORWARDED_FOR] = "x-forwarded-for",
+};
+
+// Perfect hash table of the well-known headers, see _hs_known_header_hash.
+// Holds the hs_known_header_e value + 1, 0 for unused slots.
+static const int8_t hs_known_header_slots[32] = {
+    [2] = HS_HDR_CONTENT_TYPE + 1,
+    [3] = HS_HDR_ACCEPT_LANGUAGE + 1,
+    [5] = HS_HDR_X_FORWARDED_FOR + 1,
+    [6] = HS_HDR_TRANSFER_ENCODING + 1,
+    [9] = HS_HDR_CONTENT_LENGTH + 1,
+    [10] = HS_HDR_RANGE + 1,
+    [11] = HS_HDR_USER_AGENT + 1,
+    [13] = HS_HDR_IF_MODIFIED_SINCE + 1,
+    [14] = HS_HDR_IF_NONE_MATCH + 1,
+    [15] = HS_HDR_CONNECTION + 1,
+    [16] = HS_HDR_AUTHORIZATION + 1,
+    [17] = HS_HDR_ACCEPT_ENCODING + 1,
+    [19] = HS_HDR_ACCEPT + 1,
+    [23] = HS_HDR_REFERER + 1,
+    [24] = HS_HDR_HOST + 1,
+    [28] = HS_HDR_COOKIE + 1,
+};
+
+static inline char _hs_lower(char c) {
+  return c >= 'A' && c <= 'Z' ? c + 32 : c;
+}
+
+// Collision free over hs_known_header_names, the caller still has to compare
+// the name as any other header may land in an occupied slot.
+static inline int _hs_known_header_hash(char const *key, int len) {
+  return (len + _hs_lower(key[0]) + 23 * _hs_lower(key[len - 1])) & 31;
+}
+
+int _hs_known_header_id(char const *key, int len) {
+  if (len == 0)
+    return -1;
+  int id = hs_known_header_slots[_hs_known_header_hash(key, len)] - 1;
+  if (id < 0 || (int)strlen(hs_known_header_names[id]) != len ||
+      !_hs_case_insensitive_cmp(key, hs_known_header_names[id], len))
+    return -1;
+  return id;
+}
+
+uint32_t _hs_header_hash(char const *key, int len) {
+  uint32_t hash = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    hash ^= (unsigned char)_hs_lower(key[i]);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+// Returns the value of the header whose key is at index entry - 1 of the
+// token array.
+http_string_t _hs_request_header_at(http_request_t *request, int entry) {
+  if (entry == 0)
+    return (http_string_t){};
+  struct hsh_token_s token = request->tokens.buf[entry];
+  return (http_string_t){.buf = &request->buffer.buf[token.index],
+                         .len = token.len};
+}
+
+// Finds the slot of the other table holding key or the empty slot where it
+// would be stored.
+int _hs_header_index_slot(http_request_t *request, char const *key, int len) {
+  struct hs_header_index_s *index = &request->header_index;
+  int slot = _hs_header_hash(key, len) & (HS_HEADER_INDEX_SIZE - 1);
+  while (index->other[slot]) {
+    struct hsh_token_s token = request->tokens.buf[index->other[slot] - 1];
+    if (token.len == len &&
+        _hs_case_insensitive_cmp(&request->buffer.buf[token.index], key, len))
+      break;
+    slot = (slot + 1) & (HS_HEADER_INDEX_SIZE - 1);
+  }
+  return slot;
+}
+
+// Builds the header lookup index. Called once HSH_TOK_HEADERS_DONE has been
+// reached so all header tokens are in place.
+void hs_request_index_headers(http_request_t *request) {
+  struct hs_header_index_s *index = &request->header_index;
+  memset(index, 0, sizeof(struct hs_header_index_s));
+  int others = 0;
+  for (int i = 0; i < request->tokens.size; i++) {
+    struct hsh_token_s token = request->tokens.buf[i];
+    if (token.type != HSH_TOK_HEADER_KEY)
+      continue;
+    char const *key = &request->buffer.buf[token.index];
+    int id = _hs_known_header_id(key, token.len);
+    if (id >= 0) {
+      if (!index->known[id])
+        index->known[id] = i + 1;
+    } else if (others == HS_HEADER_INDEX_MAX_OTHER) {
+      index->overflow = 1;
+    } else {
+      int slot = _hs_header_index_slot(request, key, token.len);
+      if (!index->other[slot]) {
+        index->other[slot] = i + 1;
+        others++;
+      }
+    }
+  }
+  index->built = 1;
+}
+
 http_string_t hs_request_header(http_request_t *request, char const *key) {
   int len = strlen(key);
+  if (request->header_index.built) {
+    int id = _hs_known_header_id(key, len);
+    if (id >= 0)
+      return _hs_request_header_at(request, request->header_index.known[id]);
+    int slot = _hs_header_index_slot(request, key, len);
+    if (request->header_index.other[slot] || !request->header_index.overflow)
+      return _hs_request_header_at(request, request->header_index.other[slot]);
+  }
   for (int i = 0; i < request->tokens.size; i++) {
     struct hsh_token_s token = request->tokens.buf[i];
     if (token.type == HSH_TOK_HEADER_KEY && token.len == len) {
@@ -1088,12 +1986,19 @@ http_string_t hs_request_header(http_request_t *request, char const *key) {
   return (http_string_t){};
 }
 
+http_string_t hs_request_known_header(http_request_t *request,
+                                      enum hs_known_header_e header) {
+  if (request->header_index.built)
+    return _hs_request_header_at(request, request->header_index.known[header]);
+  return hs_request_header(request, hs_known_header_names[header]);
+}
+
 void hs_request_detect_keep_alive_flag(http_request_t *request) {
   http_string_t str = hs_get_token_string(request, HSH_TOK_VERSION);
   if (str.buf == NULL)
     return;
   int version = str.buf[str.len - 1] == '1';
-  str = hs_request_header(request, "Connection");
+  str = hs_request_known_header(request, HS_HDR_CONNECTION);
   if ((str.len == 5 && _hs_case_insensitive_cmp(str.buf, "close", 5)) ||
       (str.len == 0 && version == HTTP_1_0)) {
     HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
@@ -1160,6 +2065,7 @@ http_string_t hs_request_chunk(struct http_request_s *request) {
 #define HSH_P_FLAG_CHUNKED 0x1
 #define HSH_P_FLAG_TOKEN_READY 0x2
 #define HSH_P_FLAG_DONE 0x4
+#define HSH_P_FLAG_FAST 0x8
 
 #define HSH_ENTER_TOKEN(tok_type, max_len) \
   parser->token.type = tok_type; \
@@ -1513,6 +2419,12 @@ struct hsh_token_s hsh_parser_exec(struct hsh_parser_s* parser, struct hsh_buffe
   if (HTTP_FLAG_CHECK(parser->flags, HSH_P_FLAG_DONE) || parser->sequence_id == buffer->sequence_id) {
     return none;
   }
+  if (parser->state == hsh_http_start || HTTP_FLAG_CHECK(parser->flags, HSH_P_FLAG_FAST)) {
+    struct hsh_token_s token;
+    if (hsh_parser_exec_fast(parser, buffer, max_buf_capacity, &token)) {
+      return token;
+    }
+  }
   int cs = parser->state;
   char* eof = NULL;
   char *p = buffer->buf + buffer->index;
@@ -1837,6 +2749,562 @@ _again:
   }
 }
 
+#line 1 "parser_fast.c"
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HSH_SIMD_X86
+#include <immintrin.h>
+#endif
+
+// Machine state reached after the empty line of a request without a body.
+// The other post-header states (74, 88, 89) are set explicitly by parser.rl.
+#define HSH_FAST_CS_NO_BODY 90
+
+// Token length limits of the fast path. They are kept below the limits of the
+// Ragel machine so anything near a limit is left to the machine to reject.
+#define HSH_FAST_MAX_METHOD 31
+#define HSH_FAST_MAX_TARGET 1000
+#define HSH_FAST_MAX_KEY 250
+#define HSH_FAST_MAX_VALUE 4000
+#define HSH_FAST_MAX_CONTENT_LENGTH_DIGITS 18
+
+// RFC 7230 tchar, the characters allowed in header names.
+static const char hsh_tchar[256] = {
+    ['!'] = 1, ['#'] = 1, ['$'] = 1, ['%'] = 1, ['&'] = 1, ['\''] = 1,
+    ['*'] = 1, ['+'] = 1, ['-'] = 1, ['.'] = 1, ['^'] = 1, ['_'] = 1,
+    ['`'] = 1, ['|'] = 1, ['~'] = 1, ['0'] = 1, ['1'] = 1, ['2'] = 1,
+    ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1,
+    ['9'] = 1, ['A'] = 1, ['B'] = 1, ['C'] = 1, ['D'] = 1, ['E'] = 1,
+    ['F'] = 1, ['G'] = 1, ['H'] = 1, ['I'] = 1, ['J'] = 1, ['K'] = 1,
+    ['L'] = 1, ['M'] = 1, ['N'] = 1, ['O'] = 1, ['P'] = 1, ['Q'] = 1,
+    ['R'] = 1, ['S'] = 1, ['T'] = 1, ['U'] = 1, ['V'] = 1, ['W'] = 1,
+    ['X'] = 1, ['Y'] = 1, ['Z'] = 1, ['a'] = 1, ['b'] = 1, ['c'] = 1,
+    ['d'] = 1, ['e'] = 1, ['f'] = 1, ['g'] = 1, ['h'] = 1, ['i'] = 1,
+    ['j'] = 1, ['k'] = 1, ['l'] = 1, ['m'] = 1, ['n'] = 1, ['o'] = 1,
+    ['p'] = 1, ['q'] = 1, ['r'] = 1, ['s'] = 1, ['t'] = 1, ['u'] = 1,
+    ['v'] = 1, ['w'] = 1, ['x'] = 1, ['y'] = 1, ['z'] = 1};
+
+static inline int _hsh_is_ctl(unsigned char c) {
+  return (c < 0x20 && c != '\t') || c >= 0x7f;
+}
+
+// Returns the first byte in [p, pe) that is a control character other than
+// tab, DEL or outside of ASCII. For a well formed header line that is the CR
+// terminating it.
+static char *_hsh_find_ctl_scalar(char *p, char *pe) {
+  while (p < pe && !_hsh_is_ctl(*p))
+    p++;
+  return p;
+}
+
+#ifdef HSH_SIMD_X86
+
+__attribute__((target("sse4.2"))) static char *_hsh_find_ctl_sse42(char *p,
+                                                                   char *pe) {
+  static const char ranges[16] = "\x00\x08\x0a\x1f\x7f\xff";
+  __m128i r = _mm_loadu_si128((const __m128i *)ranges);
+  while (pe - p >= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    int i = _mm_cmpestri(r, 6, v, 16,
+                         _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
+                             _SIDD_POSITIVE_POLARITY | _SIDD_LEAST_SIGNIFICANT);
+    if (i != 16)
+      return p + i;
+    p += 16;
+  }
+  return _hsh_find_ctl_scalar(p, pe);
+}
+
+__attribute__((target("avx2"))) static char *_hsh_find_ctl_avx2(char *p,
+                                                                char *pe) {
+  // Signed compare: bytes >= 0x80 are negative and land in the ctl range too.
+  __m256i space = _mm256_set1_epi8(0x20);
+  __m256i del = _mm256_set1_epi8(0x7f);
+  __m256i tab = _mm256_set1_epi8('\t');
+  while (pe - p >= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    __m256i ctl = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+                                  _mm256_cmpeq_epi8(v, del));
+    ctl = _mm256_andnot_si256(_mm256_cmpeq_epi8(v, tab), ctl);
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(ctl);
+    if (mask)
+      return p + __builtin_ctz(mask);
+    p += 32;
+  }
+  return _hsh_find_ctl_sse42(p, pe);
+}
+
+#endif
+
+static int hsh_simd_level = -1;
+static char *(*hsh_find_ctl)(char *, char *) = _hsh_find_ctl_scalar;
+
+// Selects the scanner implementation. Levels the cpu does not support are
+// lowered to the best supported one. Returns the level in effect.
+int hsh_parser_set_simd(int level) {
+#ifdef HSH_SIMD_X86
+  __builtin_cpu_init();
+  if (level >= HSH_SIMD_AVX2 && !__builtin_cpu_supports("avx2"))
+    level = HSH_SIMD_SSE42;
+  if (level >= HSH_SIMD_SSE42 && !__builtin_cpu_supports("sse4.2"))
+    level = HSH_SIMD_SCALAR;
+#else
+  if (level > HSH_SIMD_SCALAR)
+    level = HSH_SIMD_SCALAR;
+#endif
+  switch (level) {
+#ifdef HSH_SIMD_X86
+  case HSH_SIMD_AVX2:
+    hsh_find_ctl = _hsh_find_ctl_avx2;
+    break;
+  case HSH_SIMD_SSE42:
+    hsh_find_ctl = _hsh_find_ctl_sse42;
+    break;
+#endif
+  default:
+    hsh_find_ctl = _hsh_find_ctl_scalar;
+    break;
+  }
+  hsh_simd_level = level;
+  return level;
+}
+
+static inline int _hsh_is_crlf(char *p, char *pe) {
+  return p + 1 < pe && p[0] == '\r' && p[1] == '\n';
+}
+
+// Checks that [p, pe) starts with a complete request head in the canonical
+// form the fast path handles and records Content-Length and chunked encoding.
+// Returns 0 when the head is incomplete or uses any construct the Ragel
+// machine treats specially, in which case the machine parses it instead.
+static int _hsh_fast_validate(struct hsh_parser_s *parser, char *p,
+                              char *pe) {
+  int64_t content_length = 0;
+  int has_content_length = 0;
+  int chunked = 0;
+  int headers = 0;
+
+  // Request line: METHOD SP target SP HTTP/1.x CRLF
+  char *eol = hsh_find_ctl(p, pe);
+  if (!_hsh_is_crlf(eol, pe))
+    return 0;
+  char *q = p;
+  while (q < eol && ((*q >= 'A' && *q <= 'Z') || (*q >= 'a' && *q <= 'z')))
+    q++;
+  if (q == p || q - p > HSH_FAST_MAX_METHOD || *q != ' ')
+    return 0;
+  char *target = q + 1;
+  char *sp = (char *)memchr(target, ' ', eol - target);
+  if (!sp || sp == target || sp - target > HSH_FAST_MAX_TARGET)
+    return 0;
+  if (memchr(target, '\t', sp - target))
+    return 0;
+  if (eol - sp != 9 || memcmp(sp + 1, "HTTP/1.", 7) != 0 ||
+      (sp[8] != '0' && sp[8] != '1'))
+    return 0;
+  p = eol + 2;
+
+  // Header lines: key ":" 1*OWS value CRLF, terminated by an empty line
+  while (!_hsh_is_crlf(p, pe)) {
+    eol = hsh_find_ctl(p, pe);
+    if (!_hsh_is_crlf(eol, pe))
+      return 0;
+    q = p;
+    while (q < eol && hsh_tchar[(unsigned char)*q])
+      q++;
+    int key_len = q - p;
+    if (key_len == 0 || key_len > HSH_FAST_MAX_KEY || *q != ':')
+      return 0;
+    char *v = q + 1;
+    if (v == eol || (*v != ' ' && *v != '\t'))
+      return 0;
+    while (v < eol && (*v == ' ' || *v == '\t'))
+      v++;
+    int value_len = eol - v;
+    if (value_len == 0 || value_len > HSH_FAST_MAX_VALUE)
+      return 0;
+
+    if (key_len == 14 && _hs_case_insensitive_cmp(p, "content-length", 14)) {
+      if (has_content_length ||
+          value_len > HSH_FAST_MAX_CONTENT_LENGTH_DIGITS)
+        return 0;
+      for (char *d = v; d < eol; d++) {
+        if (*d < '0' || *d > '9')
+          return 0;
+        content_length = content_length * 10 + (*d - '0');
+      }
+      has_content_length = 1;
+    } else if (key_len == 17 &&
+               _hs_case_insensitive_cmp(p, "transfer-encoding", 17)) {
+      if (value_len != 7 || memcmp(v, "chunked", 7) != 0)
+        return 0;
+      chunked = 1;
+    }
+
+    headers++;
+    p = eol + 2;
+  }
+
+  // The machine never completes a head without headers, leave that to it.
+  if (headers == 0)
+    return 0;
+
+  parser->content_length = content_length;
+  if (chunked)
+    HTTP_FLAG_SET(parser->flags, HSH_P_FLAG_CHUNKED);
+  return 1;
+}
+
+// Same as action 11 of parser.rl, p points to the LF of the empty line.
+static void _hsh_fast_headers_done(struct hsh_parser_s *parser,
+                                   struct hsh_buffer_s *buffer, char *p,
+                                   int max_buf_capacity) {
+  // Limit counter as left by the machine after counting the final CRLF.
+  parser->limit_count = 2;
+  parser->limit_max = 256;
+  buffer->after_headers_index = p - buffer->buf + 1;
+  parser->content_remaining = parser->content_length;
+  parser->token = (struct hsh_token_s){};
+  parser->token.type = HSH_TOK_HEADERS_DONE;
+  if (HTTP_FLAG_CHECK(parser->flags, HSH_P_FLAG_CHUNKED)) {
+    HTTP_FLAG_SET(parser->token.flags, HSH_TOK_FLAG_STREAMED_BODY);
+    parser->state = 74;
+  } else if (parser->content_length == 0) {
+    HTTP_FLAG_SET(parser->token.flags, HSH_TOK_FLAG_NO_BODY);
+    parser->state = HSH_FAST_CS_NO_BODY;
+  } else if (parser->content_length >
+             max_buf_capacity - buffer->after_headers_index) {
+    HTTP_FLAG_SET(parser->token.flags, HSH_TOK_FLAG_STREAMED_BODY);
+    parser->state = 89;
+  } else {
+    if (parser->content_length + buffer->after_headers_index >
+        buffer->capacity) {
+      buffer->buf = (char *)realloc(buffer->buf, parser->content_length +
+                                                     buffer->after_headers_index);
+      buffer->capacity = parser->content_length + buffer->after_headers_index;
+    }
+    parser->state = 88;
+  }
+  buffer->index = buffer->after_headers_index;
+}
+
+// Bulk scanning alternative to the Ragel machine for the request head.
+//
+// Engages only at the start of a request whose complete head is already in
+// the buffer and passes _hsh_fast_validate. From then on each call yields the
+// next token exactly as the machine would, using the vectorized scanner to
+// find line ends. After HSH_TOK_HEADERS_DONE the machine state is set to the
+// matching body state and the machine continues with the body.
+//
+// Returns 0 when the machine should handle the call instead.
+int hsh_parser_exec_fast(struct hsh_parser_s *parser,
+                         struct hsh_buffer_s *buffer, int max_buf_capacity,
+                         struct hsh_token_s *token) {
+  if (hsh_simd_level < 0)
+    hsh_parser_set_simd(HSH_SIMD_AVX2);
+  if (hsh_simd_level == HSH_SIMD_OFF)
+    return 0;
+
+  char *p = buffer->buf + buffer->index;
+  char *pe = buffer->buf + buffer->length;
+
+  if (!HTTP_FLAG_CHECK(parser->flags, HSH_P_FLAG_FAST)) {
+    if (!_hsh_fast_validate(parser, p, pe))
+      return 0;
+    HTTP_FLAG_SET(parser->flags, HSH_P_FLAG_FAST);
+    parser->token.type = HSH_TOK_NONE;
+  }
+
+  char *end;
+  parser->token.flags = 0;
+  parser->token.index = p - buffer->buf;
+
+  switch (parser->token.type) {
+  case HSH_TOK_NONE:
+    end = (char *)memchr(p, ' ', pe - p);
+    parser->token.type = HSH_TOK_METHOD;
+    p = end + 1;
+    break;
+  case HSH_TOK_METHOD:
+    end = (char *)memchr(p, ' ', pe - p);
+    parser->token.type = HSH_TOK_TARGET;
+    p = end + 1;
+    break;
+  case HSH_TOK_TARGET:
+    end = p + 8;
+    parser->token.type = HSH_TOK_VERSION;
+    p = end + 2;
+    break;
+  case HSH_TOK_HEADER_KEY:
+    end = hsh_find_ctl(p, pe);
+    parser->token.type = HSH_TOK_HEADER_VALUE;
+    p = end + 2;
+    break;
+  default:
+    // After the version or a header value: next key or the empty line.
+    if (p[0] == '\r') {
+      HTTP_FLAG_CLEAR(parser->flags, HSH_P_FLAG_FAST);
+      _hsh_fast_headers_done(parser, buffer, p + 1, max_buf_capacity);
+      *token = parser->token;
+      return 1;
+    }
+    end = p;
+    while (*end != ':')
+      end++;
+    parser->token.type = HSH_TOK_HEADER_KEY;
+    p = end + 1;
+    while (*p == ' ' || *p == '\t')
+      p++;
+    break;
+  }
+
+  parser->token.len = end - (buffer->buf + parser->token.index);
+  buffer->index = p - buffer->buf;
+  *token = parser->token;
+  return 1;
+}
+
+#line 1 "uring.c"
+#ifdef IOURING
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// Buffer group of the provided receive buffers.
+#define HS_URING_BGID 0
+
+int _hs_uring_setup(unsigned entries, struct io_uring_params *p,
+                    unsigned flags) {
+  memset(p, 0, sizeof(*p));
+  p->flags = IORING_SETUP_CQSIZE | flags;
+  p->cq_entries = entries * 4;
+  return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+// Creates the ring and maps its queues. Returns -1 when io_uring is not
+// available.
+int _hs_uring_init(struct hs_uring_s *ring, unsigned entries) {
+  struct io_uring_params p;
+  int fd = -1;
+#ifdef IORING_SETUP_SINGLE_ISSUER
+  // Only the event loop thread submits, let the kernel skip the locking and
+  // run completion work when we enter the ring anyway.
+  fd = _hs_uring_setup(entries, &p,
+                       IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN |
+                           IORING_SETUP_SINGLE_ISSUER);
+#endif
+  if (fd < 0)
+    fd = _hs_uring_setup(entries, &p, 0);
+  if (fd < 0)
+    return -1;
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    close(fd);
+    return -1;
+  }
+
+  size_t sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  char *rings = (char *)mmap(NULL, sq_size > cq_size ? sq_size : cq_size,
+                             PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                             fd, IORING_OFF_SQ_RING);
+  void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+                    PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                    IORING_OFF_SQES);
+  if (rings == MAP_FAILED || sqes == MAP_FAILED) {
+    close(fd);
+    return -1;
+  }
+
+  ring->fd = fd;
+  ring->sq_head = (unsigned *)(rings + p.sq_off.head);
+  ring->sq_tail = (unsigned *)(rings + p.sq_off.tail);
+  ring->sq_array = (unsigned *)(rings + p.sq_off.array);
+  ring->sq_mask = *(unsigned *)(rings + p.sq_off.ring_mask);
+  ring->sq_entries = p.sq_entries;
+  ring->sqe_tail = *ring->sq_tail;
+  ring->sqes = (struct io_uring_sqe *)sqes;
+  ring->cq_head = (unsigned *)(rings + p.cq_off.head);
+  ring->cq_tail = (unsigned *)(rings + p.cq_off.tail);
+  ring->cq_mask = *(unsigned *)(rings + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+  return 0;
+}
+
+// Hands a receive buffer (back) to the kernel.
+void _hs_uring_recycle_buffer(struct hs_uring_s *ring, int bid) {
+  struct io_uring_buf *buf =
+      &ring->buf_ring->bufs[ring->buf_tail & (HTTP_URING_BUF_COUNT - 1)];
+  buf->addr = (uint64_t)(uintptr_t)(ring->bufs + (size_t)bid * HTTP_URING_BUF_SIZE);
+  buf->len = HTTP_URING_BUF_SIZE;
+  buf->bid = bid;
+  ring->buf_tail++;
+  __atomic_store_n(&ring->buf_ring->tail, (uint16_t)ring->buf_tail,
+                   __ATOMIC_RELEASE);
+}
+
+// Registers the receive buffers the kernel picks from when data arrives, so
+// idle connections do not hold a buffer. Returns -1 on kernels without
+// provided buffer rings.
+int _hs_uring_init_buffers(struct hs_uring_s *ring, int64_t *memused) {
+  void *buf_ring =
+      mmap(NULL, HTTP_URING_BUF_COUNT * sizeof(struct io_uring_buf),
+           PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  if (buf_ring == MAP_FAILED)
+    return -1;
+  ring->buf_ring = (struct io_uring_buf_ring *)buf_ring;
+  ring->buf_tail = 0;
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+  reg.ring_entries = HTTP_URING_BUF_COUNT;
+  reg.bgid = HS_URING_BGID;
+  if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_PBUF_RING,
+              &reg, 1) < 0)
+    return -1;
+
+  ring->bufs = (char *)malloc((size_t)HTTP_URING_BUF_COUNT * HTTP_URING_BUF_SIZE);
+  assert(ring->bufs != NULL);
+  *memused += (int64_t)HTTP_URING_BUF_COUNT * HTTP_URING_BUF_SIZE;
+  for (int bid = 0; bid < HTTP_URING_BUF_COUNT; bid++)
+    _hs_uring_recycle_buffer(ring, bid);
+  return 0;
+}
+
+// Submits the queued entries and waits for at least wait_nr completions.
+int _hs_uring_submit(struct hs_uring_s *ring, unsigned wait_nr) {
+  __atomic_store_n(ring->sq_tail, ring->sqe_tail, __ATOMIC_RELEASE);
+  unsigned pending =
+      ring->sqe_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  if (pending == 0 && wait_nr == 0)
+    return 0;
+  int rc;
+  do {
+    rc = (int)syscall(__NR_io_uring_enter, ring->fd, pending, wait_nr,
+                      wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+  } while (rc < 0 && errno == EINTR);
+  return rc;
+}
+
+// Returns a zeroed submission entry. When fewer than count entries are free
+// the queue is submitted first, so linked entries are never split between two
+// submissions.
+struct io_uring_sqe *_hs_uring_get_sqe(struct hs_uring_s *ring,
+                                       unsigned count) {
+  if (ring->sqe_tail + count -
+          __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) >
+      ring->sq_entries)
+    _hs_uring_submit(ring, 0);
+  unsigned idx = ring->sqe_tail++ & ring->sq_mask;
+  ring->sq_array[idx] = idx;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  return sqe;
+}
+
+void _hs_uring_prep_link_timeout(struct hs_uring_s *ring,
+                                 struct __kernel_timespec *ts, int seconds,
+                                 void *data) {
+  ts->tv_sec = seconds;
+  ts->tv_nsec = 0;
+  struct io_uring_sqe *sqe = _hs_uring_get_sqe(ring, 1);
+  sqe->opcode = IORING_OP_LINK_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)ts;
+  sqe->len = 1;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+}
+
+// Queues a receive into a provided buffer, cancelled when nothing arrives
+// within the given seconds.
+void _hs_uring_prep_recv(struct hs_uring_s *ring, int fd, void *data,
+                         struct __kernel_timespec *ts, int seconds,
+                         void *timeout_data) {
+  struct io_uring_sqe *sqe = _hs_uring_get_sqe(ring, 2);
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->len = HTTP_URING_BUF_SIZE;
+  sqe->flags = IOSQE_BUFFER_SELECT | IOSQE_IO_LINK;
+  sqe->buf_group = HS_URING_BGID;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+  _hs_uring_prep_link_timeout(ring, ts, seconds, timeout_data);
+}
+
+// Queues a send of the message, cancelled when it does not complete within
+// the given seconds.
+void _hs_uring_prep_sendmsg(struct hs_uring_s *ring, int fd,
+                            struct msghdr *msg, int flags, void *data,
+                            struct __kernel_timespec *ts, int seconds,
+                            void *timeout_data) {
+  struct io_uring_sqe *sqe = _hs_uring_get_sqe(ring, 2);
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = fd;
+  sqe->addr = (uint64_t)(uintptr_t)msg;
+  sqe->len = 1;
+  sqe->msg_flags = MSG_NOSIGNAL | flags;
+  sqe->flags = IOSQE_IO_LINK;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+  _hs_uring_prep_link_timeout(ring, ts, seconds, timeout_data);
+}
+
+// Queues an accept that keeps producing a completion per connection until it
+// fails.
+void _hs_uring_prep_multishot_accept(struct hs_uring_s *ring, int fd,
+                                     void *data) {
+  struct io_uring_sqe *sqe = _hs_uring_get_sqe(ring, 1);
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+}
+
+void _hs_uring_prep_timeout(struct hs_uring_s *ring,
+                            struct __kernel_timespec *ts, void *data) {
+  struct io_uring_sqe *sqe = _hs_uring_get_sqe(ring, 1);
+  sqe->opcode = IORING_OP_TIMEOUT;
+  sqe->addr = (uint64_t)(uintptr_t)ts;
+  sqe->len = 1;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+}
+
+// Cancels all operations submitted with the given user data. The cancel
+// itself completes with user data 0, which the event loop skips.
+void _hs_uring_prep_cancel(struct hs_uring_s *ring, void *data) {
+  struct io_uring_sqe *sqe = _hs_uring_get_sqe(ring, 1);
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->addr = (uint64_t)(uintptr_t)data;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_ALL;
+  sqe->flags = IOSQE_CQE_SKIP_SUCCESS;
+}
+
+// Dispatches up to max completions (0 for all available) to the handler of
+// their user data. Returns the number of completions handled.
+int _hs_uring_process_completions(struct hs_uring_s *ring, int max) {
+  int count = 0;
+  unsigned head = *ring->cq_head;
+  while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+    struct io_uring_cqe cqe = ring->cqes[head & ring->cq_mask];
+    head++;
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    if (cqe.user_data) {
+      ev_cb_t *ev_cb = (ev_cb_t *)(uintptr_t)cqe.user_data;
+      ev_cb->handler(&cqe);
+      count++;
+      if (count == max)
+        break;
+    }
+  }
+  return count;
+}
+
+#endif
+
 #line 1 "read_socket.c"
 #include <assert.h>
 #include <stdlib.h>
@@ -1844,8 +3312,9 @@ _again:
 #include <unistd.h>
 
 void _hs_token_array_push(struct hs_token_array_s *array,
-                          struct hsh_token_s a) {
+                          struct hsh_token_s a, int64_t *memused) {
   if (array->size == array->capacity) {
+    *memused += array->capacity * sizeof(struct hsh_token_s);
     array->capacity *= 2;
     array->buf = (struct hsh_token_s *)realloc(
         array->buf, array->capacity * sizeof(struct hsh_token_s));
@@ -1864,6 +3333,19 @@ void _hs_buffer_init(struct hsh_buffer_s *buffer, int initial_capacity,
   buffer->capacity = initial_capacity;
 }
 
+// Doubles the buffer capacity, up to max_request_buf_capacity.
+void _hs_buffer_grow(struct hsh_buffer_s *buffer, int64_t *server_memused,
+                     int64_t max_request_buf_capacity) {
+  *server_memused -= buffer->capacity;
+  buffer->capacity *= 2;
+  if (buffer->capacity > max_request_buf_capacity) {
+    buffer->capacity = max_request_buf_capacity;
+  }
+  *server_memused += buffer->capacity;
+  buffer->buf = (char *)realloc(buffer->buf, buffer->capacity);
+  assert(buffer->buf != NULL);
+}
+
 int _hs_read_into_buffer(struct hsh_buffer_s *buffer, int request_socket,
                          int64_t *server_memused,
                          int64_t max_request_buf_capacity) {
@@ -1876,14 +3358,7 @@ int _hs_read_into_buffer(struct hsh_buffer_s *buffer, int request_socket,
 
     if (buffer->length == buffer->capacity &&
         buffer->capacity != max_request_buf_capacity) {
-      *server_memused -= buffer->capacity;
-      buffer->capacity *= 2;
-      if (buffer->capacity > max_request_buf_capacity) {
-        buffer->capacity = max_request_buf_capacity;
-      }
-      *server_memused += buffer->capacity;
-      buffer->buf = (char *)realloc(buffer->buf, buffer->capacity);
-      assert(buffer->buf != NULL);
+      _hs_buffer_grow(buffer, server_memused, max_request_buf_capacity);
     }
   } while (bytes > 0 && buffer->capacity < max_request_buf_capacity);
 
@@ -1892,6 +3367,72 @@ int _hs_read_into_buffer(struct hsh_buffer_s *buffer, int request_socket,
   return bytes;
 }
 
+#ifdef IOURING
+
+// Moves the data of the last receive completion from its provided buffer into
+// the request buffer. Returns the bytes moved, 0 when the connection was
+// closed and -1 when nothing was received yet.
+int _hs_uring_read_into_buffer(http_request_t *request,
+                               int64_t max_request_buf_capacity) {
+  struct hsh_buffer_s *buffer = &request->buffer;
+  struct hs_uring_conn_s *conn = &request->uring;
+  struct hs_uring_s *ring = &request->server->ring;
+  if (conn->recv_eof)
+    return 0;
+  if (conn->recv_bid < 0)
+    return -1;
+
+  int bytes = 0;
+  while (conn->recv_len > 0) {
+    if (buffer->length == buffer->capacity) {
+      // The rest stays in the provided buffer until the body is streamed.
+      if (buffer->capacity == max_request_buf_capacity)
+        break;
+      _hs_buffer_grow(buffer, &request->server->memused,
+                      max_request_buf_capacity);
+    }
+    int len = buffer->capacity - buffer->length;
+    if (len > conn->recv_len)
+      len = conn->recv_len;
+    memcpy(buffer->buf + buffer->length,
+           ring->bufs + (size_t)conn->recv_bid * HTTP_URING_BUF_SIZE +
+               conn->recv_off,
+           len);
+    buffer->length += len;
+    conn->recv_off += len;
+    conn->recv_len -= len;
+    bytes += len;
+  }
+  if (conn->recv_len == 0) {
+    _hs_uring_recycle_buffer(ring, conn->recv_bid);
+    conn->recv_bid = -1;
+  }
+
+  buffer->sequence_id++;
+
+  return bytes > 0 ? bytes : -1;
+}
+
+#endif
+
+// Starts the buffer of a new request with the pipelined bytes received after
+// the previous one. Returns 1 when there were any.
+int _hs_request_take_pipelined(http_request_t *request,
+                               int64_t max_request_buf_capacity) {
+  struct hsh_buffer_s *pipelined = &request->pipelined;
+  if (!pipelined->buf)
+    return 0;
+  struct hsh_buffer_s *buffer = &request->buffer;
+  while (buffer->capacity < pipelined->length)
+    _hs_buffer_grow(buffer, &request->server->memused,
+                    max_request_buf_capacity);
+  memcpy(buffer->buf, pipelined->buf, pipelined->length);
+  buffer->length = pipelined->length;
+  buffer->sequence_id++;
+  _hs_buffer_free(pipelined, &request->server->memused);
+  return 1;
+}
+
 int _hs_buffer_requires_read(struct hsh_buffer_s *buffer) {
   return buffer->index >= buffer->length;
 }
@@ -1902,10 +3443,120 @@ void _hs_exec_callback(http_request_t *request,
   cb(request);
 }
 
+// Copies "METHOD target" out of the request buffer, which the response
+// replaces before the done handler runs.
+void _hs_request_keep_line(http_request_t *request) {
+  if (!request->line) {
+    request->line = (char *)malloc(HTTP_REQUEST_LINE_MAX);
+    assert(request->line != NULL);
+    request->server->memused += HTTP_REQUEST_LINE_MAX;
+  }
+  http_string_t method = hs_get_token_string(request, HSH_TOK_METHOD);
+  http_string_t target = hs_get_token_string(request, HSH_TOK_TARGET);
+  int len = method.len < HTTP_REQUEST_LINE_MAX ? method.len : 0;
+  memcpy(request->line, method.buf, len);
+  if (len < HTTP_REQUEST_LINE_MAX)
+    request->line[len++] = ' ';
+  int rest = HTTP_REQUEST_LINE_MAX - len;
+  int tlen = target.len < rest ? target.len : rest;
+  memcpy(request->line + len, target.buf, tlen);
+  request->line_len = len + tlen;
+}
+
+// Picks every trace_sample-th request for tracing when its first bytes
+// arrive.
+void _hs_request_begin_trace(http_request_t *request) {
+  http_server_t *server = request->server;
+  if (server->trace_sample > 0 &&
+      ++server->trace_counter % server->trace_sample == 0) {
+    HTTP_FLAG_SET(request->flags, HTTP_TRACED);
+  } else {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_TRACED);
+  }
+  _hs_request_mark(request, HTTP_PHASE_START);
+}
+
+// Called after the handler of a fully received request returned. While more
+// pipelined requests wait, a response given right away stays in the output
+// queue and 1 is returned to run the next one. Otherwise the queue is written
+// and the request may have been freed.
+int _hs_request_batch_response(http_request_t *request) {
+  if (request->state != HTTP_SESSION_WRITE) {
+    hs_request_flush_output(request);
+    return 0;
+  }
+  int more = request->pipelined.buf &&
+             HTTP_FLAG_CHECK(request->flags, HTTP_KEEP_ALIVE);
+  if (more && !HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE) &&
+      !hs_out_queue_full(&request->out)) {
+    if (request->server->done_handler && request->status) {
+      _hs_request_mark(request, HTTP_PHASE_DONE);
+      request->server->done_handler(request);
+    }
+    return 1;
+  }
+  request->out.more = more;
+  hs_request_begin_write(request);
+  return 0;
+}
+
+// Passes the request to the request handler, or sheds it when the server is
+// already at its in-flight or memory limit. Returns 1 when the next pipelined
+// request is to be run, see _hs_request_batch_response. The request may have
+// been freed otherwise.
+int _hs_exec_request_handler(http_request_t *request, int complete) {
+  http_server_t *server = request->server;
+  if ((server->max_inflight > 0 &&
+       server->stats.inflight >= server->max_inflight) ||
+      hs_server_over_memory_limit(server)) {
+    hs_request_shed(request);
+    return 0;
+  }
+  HTTP_FLAG_SET(request->flags, HTTP_INFLIGHT);
+  server->stats.inflight++;
+  if (server->done_handler)
+    _hs_request_keep_line(request);
+  _hs_request_mark(request, HTTP_PHASE_HANDLER);
+  request->batching = complete;
+  _hs_exec_callback(request, server->request_handler);
+  if (!complete)
+    return 0;
+  request->batching = 0;
+  return _hs_request_batch_response(request);
+}
+
+// Records where a streamed body ends. The last chunk of a chunked body is
+// followed by its trailer section, which ends with an empty line; when that is
+// not all received yet the connection is closed after the response instead.
+void _hs_request_streamed_end(http_request_t *request,
+                              struct hsh_token_s token) {
+  struct hsh_buffer_s *buffer = &request->buffer;
+  if (token.len > 0) {
+    request->request_end = token.index + token.len;
+    return;
+  }
+  request->request_end = 0;
+  for (int i = buffer->index; i + 1 < buffer->length; i++) {
+    if (buffer->buf[i] != '\r' || buffer->buf[i + 1] != '\n')
+      continue;
+    // An empty line: the first one or one after the CRLF of a trailer field.
+    if (i == buffer->index || (i - 2 >= buffer->index &&
+                               buffer->buf[i - 2] == '\r' &&
+                               buffer->buf[i - 1] == '\n')) {
+      request->request_end = i + 2;
+      return;
+    }
+  }
+  hs_request_set_keep_alive_flag(request, HTTP_CLOSE);
+}
+
+// Sets next to 1 when the handler responded and the next pipelined request
+// is to be parsed, to 2 when the parser waits for more data.
 enum hs_read_rc_e
 _hs_parse_buffer_and_exec_user_cb(http_request_t *request,
-                                  int max_request_buf_capacity) {
+                                  int max_request_buf_capacity, int *next) {
   enum hs_read_rc_e rc = HS_READ_RC_SUCCESS;
+  *next = 0;
 
   do {
     struct hsh_token_s token = hsh_parser_exec(
@@ -1913,19 +3564,28 @@ _hs_parse_buffer_and_exec_user_cb(http_request_t *request,
 
     switch (token.type) {
     case HSH_TOK_HEADERS_DONE:
-      _hs_token_array_push(&request->tokens, token);
+      _hs_token_array_push(&request->tokens, token, &request->server->memused);
+      hs_request_index_headers(request);
+      _hs_request_mark(request, HTTP_PHASE_HEADERS);
       if (HTTP_FLAG_CHECK(token.flags, HSH_TOK_FLAG_STREAMED_BODY) ||
           HTTP_FLAG_CHECK(token.flags, HSH_TOK_FLAG_NO_BODY)) {
         HTTP_FLAG_SET(request->flags, HTTP_FLG_STREAMED);
-        _hs_exec_callback(request, request->server->request_handler);
+        int complete = HTTP_FLAG_CHECK(token.flags, HSH_TOK_FLAG_NO_BODY);
+        if (complete)
+          request->request_end = request->buffer.after_headers_index;
+        *next = _hs_exec_request_handler(request, complete);
         return rc;
       }
       break;
     case HSH_TOK_BODY:
-      _hs_token_array_push(&request->tokens, token);
+      _hs_token_array_push(&request->tokens, token, &request->server->memused);
       if (HTTP_FLAG_CHECK(token.flags, HSH_TOK_FLAG_SMALL_BODY)) {
-        _hs_exec_callback(request, request->server->request_handler);
+        request->request_end = token.index + token.len;
+        *next = _hs_exec_request_handler(request, 1);
       } else {
+        // Bytes after the end of a streamed body belong to pipelined requests.
+        if (HTTP_FLAG_CHECK(token.flags, HSH_TOK_FLAG_BODY_FINAL))
+          _hs_request_streamed_end(request, token);
         if (HTTP_FLAG_CHECK(token.flags, HSH_TOK_FLAG_BODY_FINAL) &&
             token.len > 0) {
           _hs_exec_callback(request, request->chunk_cb);
@@ -1937,7 +3597,7 @@ _hs_parse_buffer_and_exec_user_cb(http_request_t *request,
           struct hsh_token_s token = {};
           memset(&token, 0, sizeof(struct hsh_token_s));
           token.type = HSH_TOK_BODY;
-          _hs_token_array_push(&request->tokens, token);
+          _hs_token_array_push(&request->tokens, token, &request->server->memused);
           _hs_exec_callback(request, request->chunk_cb);
         } else {
           _hs_exec_callback(request, request->chunk_cb);
@@ -1947,9 +3607,10 @@ _hs_parse_buffer_and_exec_user_cb(http_request_t *request,
     case HSH_TOK_ERR:
       return HS_READ_RC_PARSE_ERR;
     case HSH_TOK_NONE:
+      *next = 2;
       return rc;
     default:
-      _hs_token_array_push(&request->tokens, token);
+      _hs_token_array_push(&request->tokens, token, &request->server->memused);
       break;
     }
   } while (1);
@@ -1963,34 +3624,73 @@ _hs_parse_buffer_and_exec_user_cb(http_request_t *request,
 // fills the tokens array of the request struct. It will also invoke the
 // request_hander callback and the chunk_cb callback in the appropriate
 // scenarios.
+//
+// Pipelined requests received along with the current one are kept when its
+// response replaces the buffer and run back to back once it was given, their
+// responses batched into one write.
 enum hs_read_rc_e hs_read_request_and_exec_user_cb(http_request_t *request,
                                                    struct hs_read_opts_s opts) {
-  request->state = HTTP_SESSION_READ;
-  request->timeout = HTTP_REQUEST_TIMEOUT;
+  enum hs_read_rc_e rc;
+  int pipelined, next;
 
-  if (request->buffer.buf == NULL) {
-    _hs_buffer_init(&request->buffer, opts.initial_request_buf_capacity,
-                    &request->server->memused);
-    hsh_parser_init(&request->parser);
-  }
+  do {
+    request->state = HTTP_SESSION_READ;
+    request->timeout = HTTP_REQUEST_TIMEOUT;
+    pipelined = 0;
+
+    if (request->buffer.buf == NULL) {
+      _hs_buffer_init(&request->buffer, opts.initial_request_buf_capacity,
+                      &request->server->memused);
+      hsh_parser_init(&request->parser);
+      // A new request on a keep-alive connection, drop the previous tokens.
+      request->tokens.size = 0;
+      request->header_index.built = 0;
+      request->status = 0;
+      request->line_len = 0;
+      request->bytes_sent = 0;
+      memset(request->times, 0, sizeof(request->times));
+      request->times[HTTP_PHASE_ACCEPT] = request->accepted_at;
+      request->accepted_at = 0;
+      pipelined =
+          _hs_request_take_pipelined(request, opts.max_request_buf_capacity);
+      if (pipelined)
+        _hs_request_begin_trace(request);
+    }
 
-  if (_hs_buffer_requires_read(&request->buffer)) {
-    int bytes = _hs_read_into_buffer(&request->buffer, request->socket,
-                                     &request->server->memused,
-                                     opts.max_request_buf_capacity);
+    // The parser also waits for more data with unparsed bytes left, after it
+    // moved a streamed chunk to the front of a full buffer.
+    if (!pipelined &&
+        (_hs_buffer_requires_read(&request->buffer) ||
+         request->parser.sequence_id == request->buffer.sequence_id)) {
+#ifdef IOURING
+      int bytes =
+          _hs_uring_read_into_buffer(request, opts.max_request_buf_capacity);
+#else
+      int bytes = _hs_read_into_buffer(&request->buffer, request->socket,
+                                       &request->server->memused,
+                                       opts.max_request_buf_capacity);
+#endif
 
-    if (bytes == opts.eof_rc) {
-      return HS_READ_RC_SOCKET_ERR;
+      if (bytes == opts.eof_rc) {
+        return HS_READ_RC_SOCKET_ERR;
+      }
+      if (request->times[HTTP_PHASE_START] == 0 && request->buffer.length > 0)
+        _hs_request_begin_trace(request);
     }
-  }
 
-  return _hs_parse_buffer_and_exec_user_cb(request,
-                                           opts.max_request_buf_capacity);
+    rc = _hs_parse_buffer_and_exec_user_cb(
+        request, opts.max_request_buf_capacity, &next);
+    // The rest of an incomplete pipelined request may still be unread.
+  } while (rc == HS_READ_RC_SUCCESS && (next == 1 || (next == 2 && pipelined)));
+
+  // Responses queued ahead of a request not fully received go out now.
+  if (rc == HS_READ_RC_SUCCESS && next == 2)
+    hs_request_flush_output(request);
+  return rc;
 }
 
 #line 1 "respond.c"
 #include <assert.h>
-#include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -2059,9 +3759,66 @@ typedef struct {
   int capacity;
   int size;
   int64_t *memused;
-} grwprintf_t;
+} grwbuf_t;
+
+// Pre-rendered "HTTP/1.1 <code> <text>\r\n" lines, built on first use.
+typedef struct {
+  char line[48];
+  int len;
+} hs_status_line_t;
 
-void _grwprintf_init(grwprintf_t *ctx, int capacity, int64_t *memused) {
+static hs_status_line_t hs_status_lines[600];
+
+#define HS_CONN_KEEP_ALIVE "Connection: keep-alive\r\n"
+#define HS_CONN_CLOSE "Connection: close\r\n"
+#define HS_CONTENT_LENGTH "Content-Length: "
+// Room for the Content-Length line with the longest possible int value.
+#define HS_CONTENT_LENGTH_MAX (sizeof(HS_CONTENT_LENGTH) - 1 + 10 + 2)
+#define HS_CHUNK_SIZE_MAX (8 + 2)
+
+int _hs_utoa(char *dst, unsigned int val) {
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = '0' + val % 10;
+    val /= 10;
+  } while (val);
+  for (int i = 0; i < n; i++)
+    dst[i] = tmp[n - 1 - i];
+  return n;
+}
+
+int _hs_utox(char *dst, unsigned int val) {
+  static char const digits[] = "0123456789ABCDEF";
+  char tmp[8];
+  int n = 0;
+  do {
+    tmp[n++] = digits[val & 0xF];
+    val >>= 4;
+  } while (val);
+  for (int i = 0; i < n; i++)
+    dst[i] = tmp[n - 1 - i];
+  return n;
+}
+
+hs_status_line_t const *_hs_status_line(int status) {
+  hs_status_line_t *sl = &hs_status_lines[status];
+  if (sl->len == 0) {
+    char const *text = hs_status_text[status];
+    int text_len = strlen(text);
+    memcpy(sl->line, "HTTP/1.1 ", 9);
+    int len = 9 + _hs_utoa(sl->line + 9, status);
+    sl->line[len++] = ' ';
+    memcpy(sl->line + len, text, text_len);
+    len += text_len;
+    sl->line[len++] = '\r';
+    sl->line[len++] = '\n';
+    sl->len = len;
+  }
+  return sl;
+}
+
+void _grwbuf_init(grwbuf_t *ctx, int capacity, int64_t *memused) {
   ctx->memused = memused;
   ctx->size = 0;
   ctx->buf = (char *)malloc(capacity);
@@ -2070,7 +3827,7 @@ void _grwprintf_init(grwprintf_t *ctx, int capacity, int64_t *memused) {
   ctx->capacity = capacity;
 }
 
-void _grwmemcpy(grwprintf_t *ctx, char const *src, int size) {
+void _grwmemcpy(grwbuf_t *ctx, char const *src, int size) {
   if (ctx->size + size > ctx->capacity) {
     *ctx->memused -= ctx->capacity;
     ctx->capacity = ctx->size + size;
@@ -2082,71 +3839,115 @@ void _grwmemcpy(grwprintf_t *ctx, char const *src, int size) {
   ctx->size += size;
 }
 
-void _grwprintf(grwprintf_t *ctx, char const *fmt, ...) {
-  va_list args;
-  va_start(args, fmt);
+// Appends a header line. The caller must have sized the buffer already.
+static inline void _grwheader(grwbuf_t *ctx, http_header_t const *header) {
+  char *p = ctx->buf + ctx->size;
+  memcpy(p, header->key, header->key_len);
+  p += header->key_len;
+  *p++ = ':';
+  *p++ = ' ';
+  memcpy(p, header->value, header->value_len);
+  p += header->value_len;
+  *p++ = '\r';
+  *p++ = '\n';
+  ctx->size = p - ctx->buf;
+}
 
-  int bytes =
-      vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
-  if (bytes + ctx->size > ctx->capacity) {
-    *ctx->memused -= ctx->capacity;
-    while (bytes + ctx->size > ctx->capacity)
-      ctx->capacity *= 2;
-    *ctx->memused += ctx->capacity;
-    ctx->buf = (char *)realloc(ctx->buf, ctx->capacity);
-    assert(ctx->buf != NULL);
-    bytes +=
-        vsnprintf(ctx->buf + ctx->size, ctx->capacity - ctx->size, fmt, args);
+// Bytes needed to serialize the header list including the terminating CRLF.
+int _http_headers_list_size(http_response_t *response) {
+  int size = 2;
+  for (http_header_t *header = response->headers; header;
+       header = header->next) {
+    size += header->key_len + header->value_len + 4;
   }
-  ctx->size += bytes;
+  return size;
+}
 
-  va_end(args);
+// Upper bound of the bytes written by _http_serialize_headers.
+int _http_headers_size(http_request_t *request, http_response_t *response) {
+  return sizeof(((hs_status_line_t *)0)->line) + request->server->date_len +
+         sizeof(HS_CONN_KEEP_ALIVE) - 1 + HS_CONTENT_LENGTH_MAX +
+         _http_headers_list_size(response);
 }
 
-void _http_serialize_headers_list(http_response_t *response,
-                                  grwprintf_t *printctx) {
+void _http_serialize_headers_list(http_response_t *response, grwbuf_t *ctx) {
   http_header_t *header = response->headers;
   while (header) {
-    _grwprintf(printctx, "%s: %s\r\n", header->key, header->value);
+    _grwheader(ctx, header);
     header = header->next;
   }
-  _grwprintf(printctx, "\r\n");
+  _grwmemcpy(ctx, "\r\n", 2);
 }
 
 void _http_serialize_headers(http_request_t *request, http_response_t *response,
-                             grwprintf_t *printctx) {
+                             grwbuf_t *ctx) {
   if (HTTP_FLAG_CHECK(request->flags, HTTP_AUTOMATIC)) {
     hs_request_detect_keep_alive_flag(request);
   }
+  if (request->server->draining) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_KEEP_ALIVE);
+  }
+  hs_status_line_t const *sl = _hs_status_line(response->status);
+  _grwmemcpy(ctx, sl->line, sl->len);
+  _grwmemcpy(ctx, request->server->date, request->server->date_len);
   if (HTTP_FLAG_CHECK(request->flags, HTTP_KEEP_ALIVE)) {
-    hs_response_set_header(response, "Connection", "keep-alive");
+    _grwmemcpy(ctx, HS_CONN_KEEP_ALIVE, sizeof(HS_CONN_KEEP_ALIVE) - 1);
   } else {
-    hs_response_set_header(response, "Connection", "close");
+    _grwmemcpy(ctx, HS_CONN_CLOSE, sizeof(HS_CONN_CLOSE) - 1);
   }
-  _grwprintf(printctx, "HTTP/1.1 %d %s\r\nDate: %s\r\n", response->status,
-             hs_status_text[response->status], request->server->date);
   if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
-    _grwprintf(printctx, "Content-Length: %d\r\n", response->content_length);
+    char line[HS_CONTENT_LENGTH_MAX];
+    int len = sizeof(HS_CONTENT_LENGTH) - 1;
+    memcpy(line, HS_CONTENT_LENGTH, len);
+    len += _hs_utoa(line + len, response->content_length);
+    line[len++] = '\r';
+    line[len++] = '\n';
+    _grwmemcpy(ctx, line, len);
   }
-  _http_serialize_headers_list(response, printctx);
+  _http_serialize_headers_list(response, ctx);
+}
+
+// Moves the pipelined requests received after the current one out of the
+// request buffer before the response replaces it.
+void _hs_request_keep_pipelined(http_request_t *request) {
+  struct hsh_buffer_s *buffer = &request->buffer;
+  int end = request->request_end;
+  request->request_end = 0;
+  if (end == 0 || end >= buffer->length)
+    return;
+  int len = buffer->length - end;
+  _hs_buffer_init(&request->pipelined, len, &request->server->memused);
+  memcpy(request->pipelined.buf, buffer->buf + end, len);
+  request->pipelined.length = len;
 }
 
 void _http_perform_response(http_request_t *request, http_response_t *response,
-                            grwprintf_t *printctx, hs_req_fn_t http_write) {
+                            grwbuf_t *ctx, hs_req_fn_t http_write) {
+  hs_response_free(response);
+  _hs_request_keep_pipelined(request);
+  _hs_buffer_free(&request->buffer, &request->server->memused);
+  request->buffer = (struct hsh_buffer_s){0};
+  request->bytes_sent += ctx->size;
+  hs_request_queue_output(request, ctx->buf, ctx->size, ctx->capacity);
+  request->out.more = 0;
+  if (request->times[HTTP_PHASE_WRITE] == 0)
+    _hs_request_mark(request, HTTP_PHASE_WRITE);
+  request->state = HTTP_SESSION_WRITE;
+  // Written once the handler or chunk callback returned, see
+  // _hs_request_batch_response and _hs_request_next_chunks.
+  if (!request->batching)
+    http_write(request);
+}
+
+// Frees the response and its header list, not the strings they point to.
+void hs_response_free(http_response_t *response) {
   http_header_t *header = response->headers;
   while (header) {
     http_header_t *tmp = header;
     header = tmp->next;
     free(tmp);
   }
-  _hs_buffer_free(&request->buffer, &request->server->memused);
   free(response);
-  request->buffer.buf = printctx->buf;
-  request->buffer.length = printctx->size;
-  request->buffer.capacity = printctx->capacity;
-  request->bytes_written = 0;
-  request->state = HTTP_SESSION_WRITE;
-  http_write(request);
 }
 
 // See api.h http_response_header
@@ -2155,23 +3956,57 @@ void hs_response_set_header(http_response_t *response, char const *key,
   http_header_t *header = (http_header_t *)malloc(sizeof(http_header_t));
   assert(header != NULL);
   header->key = key;
+  header->key_len = strlen(key);
   header->value = value;
+  header->value_len = strlen(value);
   http_header_t *prev = response->headers;
   header->next = prev;
   response->headers = header;
 }
 
-// Serializes the response into the request buffer and calls http_write.
-// See api.h http_respond for more details
-void hs_request_respond(http_request_t *request, http_response_t *response,
-                        hs_req_fn_t http_write) {
-  grwprintf_t printctx;
-  _grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
-  _http_serialize_headers(request, response, &printctx);
+// Marks the response of the request as complete for the in-flight limit.
+void hs_request_end_inflight(http_request_t *request) {
+  if (HTTP_FLAG_CHECK(request->flags, HTTP_INFLIGHT)) {
+    HTTP_FLAG_CLEAR(request->flags, HTTP_INFLIGHT);
+    request->server->stats.inflight--;
+  }
+}
+
+#define HS_SERVER_TIMING_MAX 128
+
+// Renders the Server-Timing value of a traced request: reading the head,
+// waiting for the handler (e.g. for the body) and the handler itself.
+void _hs_server_timing(http_request_t *request, char *out) {
+  int64_t *t = request->times;
+  snprintf(out, HS_SERVER_TIMING_MAX,
+           "head;dur=%.3f, wait;dur=%.3f, handler;dur=%.3f",
+           (t[HTTP_PHASE_HEADERS] - t[HTTP_PHASE_START]) / 1e6,
+           (t[HTTP_PHASE_HANDLER] - t[HTTP_PHASE_HEADERS]) / 1e6,
+           (t[HTTP_PHASE_RESPOND] - t[HTTP_PHASE_HANDLER]) / 1e6);
+}
+
+// Serializes the response into the request buffer and calls http_write.
+// See api.h http_respond for more details
+void hs_request_respond(http_request_t *request, http_response_t *response,
+                        hs_req_fn_t http_write) {
+  grwbuf_t ctx;
+  char timing[HS_SERVER_TIMING_MAX];
+  hs_request_end_inflight(request);
+  request->status = response->status;
+  _hs_request_mark(request, HTTP_PHASE_RESPOND);
+  if (HTTP_FLAG_CHECK(request->flags, HTTP_TRACED)) {
+    _hs_server_timing(request, timing);
+    hs_response_set_header(response, "Server-Timing", timing);
+  }
+  _grwbuf_init(&ctx,
+               _http_headers_size(request, response) +
+                   response->content_length,
+               &request->server->memused);
+  _http_serialize_headers(request, response, &ctx);
   if (response->body) {
-    _grwmemcpy(&printctx, response->body, response->content_length);
+    _grwmemcpy(&ctx, response->body, response->content_length);
   }
-  _http_perform_response(request, response, &printctx, http_write);
+  _http_perform_response(request, response, &ctx, http_write);
 }
 
 // Serializes a chunk into the request buffer and calls http_write.
@@ -2179,18 +4014,33 @@ void hs_request_respond(http_request_t *request, http_response_t *response,
 void hs_request_respond_chunk(http_request_t *request,
                               http_response_t *response, hs_req_fn_t cb,
                               hs_req_fn_t http_write) {
-  grwprintf_t printctx;
-  _grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
+  grwbuf_t ctx;
+  char timing[HS_SERVER_TIMING_MAX];
+  int size = HS_CHUNK_SIZE_MAX + response->content_length + 2;
   if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
-    HTTP_FLAG_SET(request->flags, HTTP_CHUNKED_RESPONSE);
     hs_response_set_header(response, "Transfer-Encoding", "chunked");
-    _http_serialize_headers(request, response, &printctx);
+    request->status = response->status;
+    _hs_request_mark(request, HTTP_PHASE_RESPOND);
+    if (HTTP_FLAG_CHECK(request->flags, HTTP_TRACED)) {
+      _hs_server_timing(request, timing);
+      hs_response_set_header(response, "Server-Timing", timing);
+    }
+    size += _http_headers_size(request, response);
+  }
+  _grwbuf_init(&ctx, size, &request->server->memused);
+  if (!HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE)) {
+    HTTP_FLAG_SET(request->flags, HTTP_CHUNKED_RESPONSE);
+    _http_serialize_headers(request, response, &ctx);
   }
   request->chunk_cb = cb;
-  _grwprintf(&printctx, "%X\r\n", response->content_length);
-  _grwmemcpy(&printctx, response->body, response->content_length);
-  _grwprintf(&printctx, "\r\n");
-  _http_perform_response(request, response, &printctx, http_write);
+  char chunk_size[HS_CHUNK_SIZE_MAX];
+  int len = _hs_utox(chunk_size, response->content_length);
+  chunk_size[len++] = '\r';
+  chunk_size[len++] = '\n';
+  _grwmemcpy(&ctx, chunk_size, len);
+  _grwmemcpy(&ctx, response->body, response->content_length);
+  _grwmemcpy(&ctx, "\r\n", 2);
+  _http_perform_response(request, response, &ctx, http_write);
 }
 
 // Serializes the zero sized final chunk into the request buffer and calls
@@ -2198,13 +4048,15 @@ void hs_request_respond_chunk(http_request_t *request,
 void hs_request_respond_chunk_end(http_request_t *request,
                                   http_response_t *response,
                                   hs_req_fn_t http_write) {
-  grwprintf_t printctx;
-  _grwprintf_init(&printctx, HTTP_RESPONSE_BUF_SIZE, &request->server->memused);
-  _grwprintf(&printctx, "0\r\n");
-  _http_serialize_headers_list(response, &printctx);
-  _grwprintf(&printctx, "\r\n");
+  grwbuf_t ctx;
+  hs_request_end_inflight(request);
+  _grwbuf_init(&ctx, 3 + _http_headers_list_size(response) + 2,
+               &request->server->memused);
+  _grwmemcpy(&ctx, "0\r\n", 3);
+  _http_serialize_headers_list(response, &ctx);
+  _grwmemcpy(&ctx, "\r\n", 2);
   HTTP_FLAG_CLEAR(request->flags, HTTP_CHUNKED_RESPONSE);
-  _http_perform_response(request, response, &printctx, http_write);
+  _http_perform_response(request, response, &ctx, http_write);
 }
 
 // See api.h http_response_status
@@ -2236,24 +4088,31 @@ void hs_request_respond_error(http_request_t *request, int code,
   hs_response_set_header(response, "Content-Type", "text/plain");
   hs_response_set_body(response, message, strlen(message));
   hs_request_respond(request, response, http_write);
-  http_write(request);
 }
 
 #line 1 "server.c"
 #include <arpa/inet.h>
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <signal.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <time.h>
+#include <unistd.h>
 
 #ifdef EPOLL
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
-#else
+#elif defined(KQUEUE)
 #include <sys/event.h>
+#elif defined(IOURING)
+#include <poll.h>
 #endif
 
 void _hs_bind_localhost(int s, struct sockaddr_in *addr, const char *ipaddr,
@@ -2271,11 +4130,49 @@ void _hs_bind_localhost(int s, struct sockaddr_in *addr, const char *ipaddr,
   }
 }
 
+// A socket file no server accepts on anymore. Anything else at the path is
+// left alone and makes bind fail.
+int _hs_unix_path_stale(struct sockaddr_un *addr) {
+  struct stat st;
+  if (stat(addr->sun_path, &st) < 0 || !S_ISSOCK(st.st_mode))
+    return 0;
+  int s = socket(AF_UNIX, SOCK_STREAM, 0);
+  int rc = connect(s, (struct sockaddr *)addr, sizeof(struct sockaddr_un));
+  int stale = rc < 0 && errno == ECONNREFUSED;
+  close(s);
+  return stale;
+}
+
+void _hs_bind_unix(int s, const char *path, int mode) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    exit(1);
+  }
+  strcpy(addr.sun_path, path);
+  if (_hs_unix_path_stale(&addr)) {
+    unlink(path);
+  }
+  int rc = bind(s, (struct sockaddr *)&addr, sizeof(addr));
+  if (rc < 0 || chmod(path, mode) < 0) {
+    exit(1);
+  }
+}
+
 #ifdef KQUEUE
 
+// Level triggered so connections left over by the accept budget are reported
+// again on the next iteration.
 void _hs_add_server_sock_events(http_server_t *serv) {
   struct kevent ev_set;
-  EV_SET(&ev_set, serv->socket, EVFILT_READ, EV_ADD | EV_CLEAR, 0, 0, serv);
+  EV_SET(&ev_set, serv->socket, EVFILT_READ, EV_ADD, 0, 0, serv);
+  kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
+}
+
+void _hs_delete_server_sock_events(http_server_t *serv) {
+  struct kevent ev_set;
+  EV_SET(&ev_set, serv->socket, EVFILT_READ, EV_DELETE, 0, 0, serv);
   kevent(serv->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
@@ -2314,6 +4211,89 @@ int hs_server_poll_events(http_server_t *serv) {
   return nev;
 }
 
+void _hs_on_watch_event(struct kevent *ev) {
+  struct hs_watch_s *watch = (struct hs_watch_s *)ev->udata;
+  watch->handler(watch->data);
+}
+
+void _hs_add_watch_events(struct hs_watch_s *watch) {
+  struct kevent ev_set;
+  EV_SET(&ev_set, watch->fd, EVFILT_READ, EV_ADD, 0, 0, watch);
+  kevent(watch->server->loop, &ev_set, 1, NULL, 0, NULL);
+}
+
+#elif defined(IOURING)
+
+void _hs_server_init_events(http_server_t *serv, hs_evt_cb_t timer_cb) {
+  if (_hs_uring_init(&serv->ring, HTTP_URING_ENTRIES) < 0 ||
+      _hs_uring_init_buffers(&serv->ring, &serv->memused) < 0) {
+    exit(1);
+  }
+  serv->loop = serv->ring.fd;
+  serv->timer_handler = timer_cb;
+  serv->timer_ts.tv_sec = 1;
+  _hs_uring_prep_timeout(&serv->ring, &serv->timer_ts, &serv->timer_handler);
+}
+
+void _hs_add_server_sock_events(http_server_t *serv) {
+  _hs_uring_prep_multishot_accept(&serv->ring, serv->socket, serv);
+}
+
+// The accept completes with -ECANCELED and is not queued again.
+void _hs_delete_server_sock_events(http_server_t *serv) {
+  _hs_uring_prep_cancel(&serv->ring, serv);
+}
+
+// Everything queued while handling a batch of completions goes to the kernel
+// with the same io_uring_enter call that waits for the next batch.
+int hs_server_run_event_loop(http_server_t *serv, const char *ipaddr) {
+  hs_server_listen_on_addr(serv, ipaddr);
+  while (1) {
+    _hs_uring_submit(&serv->ring, 1);
+    _hs_uring_process_completions(&serv->ring, 0);
+    hs_server_free_closed_connections(serv);
+  }
+  return 0;
+}
+
+int hs_server_poll_events(http_server_t *serv) {
+  _hs_uring_submit(&serv->ring, 0);
+  int nev = _hs_uring_process_completions(&serv->ring, 1);
+  hs_server_free_closed_connections(serv);
+  return nev;
+}
+
+// A multishot poll, queued again when the kernel ends it.
+void _hs_uring_prep_poll(struct hs_uring_s *ring, int fd, void *data) {
+  struct io_uring_sqe *sqe = _hs_uring_get_sqe(ring, 1);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->len = IORING_POLL_ADD_MULTI;
+  sqe->poll32_events = POLLIN;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+}
+
+// A single poll for the socket to become writable.
+void _hs_uring_prep_poll_out(struct hs_uring_s *ring, int fd, void *data) {
+  struct io_uring_sqe *sqe = _hs_uring_get_sqe(ring, 1);
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLOUT;
+  sqe->user_data = (uint64_t)(uintptr_t)data;
+}
+
+void _hs_on_watch_event(struct io_uring_cqe *cqe) {
+  struct hs_watch_s *watch = (struct hs_watch_s *)(uintptr_t)cqe->user_data;
+  if (!(cqe->flags & IORING_CQE_F_MORE))
+    _hs_uring_prep_poll(&watch->server->ring, watch->fd, watch);
+  if (cqe->res > 0)
+    watch->handler(watch->data);
+}
+
+void _hs_add_watch_events(struct hs_watch_s *watch) {
+  _hs_uring_prep_poll(&watch->server->ring, watch->fd, watch);
+}
+
 #else
 
 void _hs_server_init_events(http_server_t *serv, hs_evt_cb_t timer_cb) {
@@ -2333,13 +4313,19 @@ void _hs_server_init_events(http_server_t *serv, hs_evt_cb_t timer_cb) {
   serv->timerfd = tfd;
 }
 
+// Level triggered so connections left over by the accept budget are reported
+// again on the next iteration.
 void _hs_add_server_sock_events(http_server_t *serv) {
   struct epoll_event ev;
-  ev.events = EPOLLIN | EPOLLET;
+  ev.events = EPOLLIN;
   ev.data.ptr = serv;
   epoll_ctl(serv->loop, EPOLL_CTL_ADD, serv->socket, &ev);
 }
 
+void _hs_delete_server_sock_events(http_server_t *serv) {
+  epoll_ctl(serv->loop, EPOLL_CTL_DEL, serv->socket, NULL);
+}
+
 int hs_server_run_event_loop(http_server_t *serv, const char *ipaddr) {
   hs_server_listen_on_addr(serv, ipaddr);
   struct epoll_event ev_list[1];
@@ -2363,72 +4349,292 @@ int hs_server_poll_events(http_server_t *serv) {
   return nev;
 }
 
+void _hs_on_watch_event(struct epoll_event *ev) {
+  struct hs_watch_s *watch = (struct hs_watch_s *)ev->data.ptr;
+  watch->handler(watch->data);
+}
+
+void _hs_add_watch_events(struct hs_watch_s *watch) {
+  struct epoll_event ev;
+  ev.events = EPOLLIN;
+  ev.data.ptr = watch;
+  epoll_ctl(watch->server->loop, EPOLL_CTL_ADD, watch->fd, &ev);
+}
+
 #endif
 
+void http_server_watch(http_server_t *serv, int fd, void (*handler)(void *),
+                       void *data) {
+  struct hs_watch_s *watch =
+      (struct hs_watch_s *)calloc(1, sizeof(struct hs_watch_s));
+  watch->ev.handler = _hs_on_watch_event;
+  watch->fd = fd;
+  watch->handler = handler;
+  watch->data = data;
+  watch->server = serv;
+  _hs_add_watch_events(watch);
+}
+
 void hs_server_listen_on_addr(http_server_t *serv, const char *ipaddr) {
   // Ignore SIGPIPE. We handle these errors at the call site.
   signal(SIGPIPE, SIG_IGN);
-  serv->socket = socket(AF_INET, SOCK_STREAM, 0);
-  int flag = 1;
-  setsockopt(serv->socket, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
-  _hs_bind_localhost(serv->socket, &serv->addr, ipaddr, serv->port);
+  if (serv->listen_fd >= 0) {
+    // Already bound, listen below only applies the backlog.
+    serv->socket = serv->listen_fd;
+  } else if (serv->unix_path) {
+    serv->socket = socket(AF_UNIX, SOCK_STREAM, 0);
+    _hs_bind_unix(serv->socket, serv->unix_path, serv->unix_mode);
+  } else {
+    serv->socket = socket(AF_INET, SOCK_STREAM, 0);
+    int flag = 1;
+    setsockopt(serv->socket, SOL_SOCKET, SO_REUSEPORT, &flag, sizeof(flag));
+    _hs_bind_localhost(serv->socket, &serv->addr, ipaddr, serv->port);
+  }
   serv->len = sizeof(serv->addr);
   int flags = fcntl(serv->socket, F_GETFL, 0);
   fcntl(serv->socket, F_SETFL, flags | O_NONBLOCK);
-  listen(serv->socket, 128);
+#ifdef TCP_DEFER_ACCEPT
+  if (serv->defer_accept > 0) {
+    setsockopt(serv->socket, IPPROTO_TCP, TCP_DEFER_ACCEPT, &serv->defer_accept,
+               sizeof(serv->defer_accept));
+  }
+#endif
+  listen(serv->socket, serv->backlog);
+  serv->reserve_fd = open("/dev/null", O_RDONLY);
   _hs_add_server_sock_events(serv);
 }
 
-void hs_generate_date_time(char *datetime) {
+// Between two requests of a keep-alive connection, nothing of the next one
+// received yet. One that arrived but was not read is served instead.
+int _hs_request_idle(http_request_t *request) {
+  char byte;
+  return HTTP_FLAG_CHECK(request->flags, HTTP_REUSED) &&
+         request->state == HTTP_SESSION_READ && request->buffer.length == 0 &&
+         recv(request->socket, &byte, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+         errno == EAGAIN;
+}
+
+void http_server_drain(http_server_t *serv) {
+  if (serv->draining)
+    return;
+  serv->draining = 1;
+  if (serv->socket >= 0) {
+    _hs_delete_server_sock_events(serv);
+    close(serv->socket);
+    serv->socket = -1;
+  }
+}
+
+// Closes the keep-alive connections of a draining server that were idle since
+// the previous sweep. Closing them right away would race with requests the
+// clients are sending.
+void _hs_server_sweep_idle(http_server_t *serv) {
+  http_request_t *request = serv->open;
+  while (request) {
+    http_request_t *next = request->open_next;
+    if (!_hs_request_idle(request)) {
+      HTTP_FLAG_CLEAR(request->flags, HTTP_DRAIN_IDLE);
+    } else if (HTTP_FLAG_CHECK(request->flags, HTTP_DRAIN_IDLE)) {
+      hs_request_terminate_connection(request);
+    } else {
+      HTTP_FLAG_SET(request->flags, HTTP_DRAIN_IDLE);
+    }
+    request = next;
+  }
+}
+
+// Renders the "Date: ...\r\n" header line into datetime (at least 48 bytes)
+// and returns its length.
+int hs_generate_date_time(char *datetime) {
   time_t rawtime;
-  struct tm *timeinfo;
+  struct tm timeinfo;
   time(&rawtime);
-  timeinfo = gmtime(&rawtime);
-  strftime(datetime, 32, "%a, %d %b %Y %T GMT", timeinfo);
+  gmtime_r(&rawtime, &timeinfo);
+  return strftime(datetime, 48, "Date: %a, %d %b %Y %T GMT\r\n", &timeinfo);
 }
 
 http_server_t *hs_server_init(int port, void (*handler)(http_request_t *),
                               hs_evt_cb_t accept_cb,
                               hs_evt_cb_t epoll_timer_cb) {
-  http_server_t *serv = (http_server_t *)malloc(sizeof(http_server_t));
+  http_server_t *serv = (http_server_t *)calloc(1, sizeof(http_server_t));
   assert(serv != NULL);
   serv->port = port;
   serv->memused = 0;
+  serv->max_memory = HTTP_MAX_TOTAL_EST_MEM_USAGE;
+  http_server_set_retry_after(serv, HTTP_SHED_RETRY_AFTER);
+  serv->backlog = HTTP_LISTEN_BACKLOG;
+  serv->accept_budget = HTTP_ACCEPT_BUDGET;
+  serv->reserve_fd = -1;
+  serv->listen_fd = -1;
+  serv->socket = -1;
   serv->handler = accept_cb;
   _hs_server_init_events(serv, epoll_timer_cb);
-  hs_generate_date_time(serv->date);
+  serv->date_len = hs_generate_date_time(serv->date);
   serv->request_handler = handler;
   return serv;
 }
 
+int hs_server_over_memory_limit(http_server_t *server) {
+  return server->max_memory > 0 &&
+         server->memused + server->extmemused > server->max_memory;
+}
+
 #line 1 "write_socket.c"
+#include <assert.h>
 #include <errno.h>
-#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#ifndef MSG_MORE
+#define MSG_MORE 0
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
 
 #ifdef DEBUG
-#define write hs_test_write
-ssize_t hs_test_write(int fd, char const *data, size_t size);
+#define sendmsg hs_test_sendmsg
+ssize_t hs_test_sendmsg(int fd, struct msghdr const *msg, int flags);
 #endif
 
-// Writes response bytes from the buffer out to the socket.
+void hs_request_queue_output(http_request_t *request, char *buf, int length,
+                             int capacity) {
+  struct hs_out_queue_s *out = &request->out;
+  // Full only when the socket did not take a flush, the last fragment grows.
+  if (out->count == HTTP_OUT_QUEUE_FRAGS) {
+    struct hs_out_frag_s *last = &out->frags[out->count - 1];
+    last->buf = (char *)realloc(last->buf, last->length + length);
+    assert(last->buf != NULL);
+    memcpy(last->buf + last->length, buf, length);
+    request->server->memused += last->length + length - last->capacity;
+    last->length += length;
+    last->capacity = last->length;
+    request->server->memused -= capacity;
+    free(buf);
+  } else {
+    out->frags[out->count++] = (struct hs_out_frag_s){buf, length, capacity};
+  }
+  out->length += length;
+}
+
+int hs_out_queue_full(struct hs_out_queue_s *out) {
+  return out->length >= HTTP_OUT_QUEUE_MAX ||
+         out->count == HTTP_OUT_QUEUE_FRAGS;
+}
+
+// Points iov at the unwritten bytes of the fragments and returns their count.
+int hs_out_queue_iov(struct hs_out_queue_s *out, struct iovec *iov) {
+  for (int i = 0; i < out->count; i++) {
+    iov[i].iov_base = out->frags[i].buf;
+    iov[i].iov_len = out->frags[i].length;
+  }
+  if (out->count > 0) {
+    iov[0].iov_base = out->frags[0].buf + out->offset;
+    iov[0].iov_len -= out->offset;
+  }
+  return out->count;
+}
+
+// Drops bytes written from the front of the queue, freeing the fragments
+// sent completely.
+void hs_out_queue_consume(struct hs_out_queue_s *out, int64_t bytes,
+                          int64_t *memused) {
+  out->length -= bytes;
+  bytes += out->offset;
+  int sent = 0;
+  while (sent < out->count && bytes >= out->frags[sent].length) {
+    bytes -= out->frags[sent].length;
+    free(out->frags[sent].buf);
+    *memused -= out->frags[sent].capacity;
+    sent++;
+  }
+  out->count -= sent;
+  memmove(out->frags, out->frags + sent, out->count * sizeof(out->frags[0]));
+  out->offset = bytes;
+}
+
+void hs_out_queue_free(struct hs_out_queue_s *out, int64_t *memused) {
+  hs_out_queue_consume(out, out->length, memused);
+}
+
+// Sends the queued fragments with one call. MSG_MORE keeps the kernel from
+// sending a partial frame when more output follows right away.
+ssize_t _hs_out_queue_send(int socket, struct hs_out_queue_s *out) {
+  struct iovec iov[HTTP_OUT_QUEUE_FRAGS];
+  struct msghdr msg = {0};
+  msg.msg_iov = iov;
+  msg.msg_iovlen = hs_out_queue_iov(out, iov);
+  return sendmsg(socket, &msg, MSG_NOSIGNAL | (out->more ? MSG_MORE : 0));
+}
+
+// Writes what the output queue holds without waiting for the socket, used
+// when the connection stops producing output for now. What the socket does
+// not take is written once it is writable again, or with the response being
+// written by then. A frame held back by an earlier MSG_MORE is pushed out.
+void hs_request_flush_output(http_request_t *request) {
+  struct hs_out_queue_s *out = &request->out;
+  if (out->length == 0 && out->more) {
+    // Setting TCP_NODELAY again pushes pending frames, it is a no-op for
+    // unix sockets which do not hold any back.
+    int flag = 1;
+    setsockopt(request->socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  }
+  out->more = 0;
+  if (out->length == 0)
+    return;
+  ssize_t bytes = _hs_out_queue_send(request->socket, out);
+  if (bytes > 0)
+    hs_out_queue_consume(out, bytes, &request->server->memused);
+  // A failed socket is left to the reads, which see it closed.
+  if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+    return;
+  if (out->length > 0 && request->state != HTTP_SESSION_WRITE &&
+      !out->flushing) {
+    out->flushing = 1;
+    hs_request_begin_flush(request);
+  }
+}
+
+// The socket became writable while output left by a flush waits.
+void hs_request_flush_ready(http_request_t *request) {
+  request->out.flushing = 0;
+  if (request->state != HTTP_SESSION_WRITE)
+    hs_request_flush_output(request);
+}
+
+// Writes the output queue out to the socket.
 //
 // Runs when we get a socket ready to write event or when initiating an HTTP
 // response and writing to the socket for the first time. If the response is
 // chunked the chunk_cb callback will be invoked signalling to the user code
 // that another chunk is ready to be written.
 enum hs_write_rc_e hs_write_socket(http_request_t *request) {
-  int bytes =
-      write(request->socket, request->buffer.buf + request->bytes_written,
-            request->buffer.length - request->bytes_written);
-  if (bytes > 0)
-    request->bytes_written += bytes;
+  struct hs_out_queue_s *out = &request->out;
+#ifdef IOURING
+  // The send was submitted to the ring and its result is already consumed
+  // from the queue, see _hs_on_uring_send_event.
+  int failed = request->uring.send_failed;
+#else
+  int failed = 0;
+  if (out->length > 0) {
+    ssize_t bytes = _hs_out_queue_send(request->socket, out);
+    if (bytes > 0)
+      hs_out_queue_consume(out, bytes, &request->server->memused);
+    failed = bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK &&
+             errno != EINTR;
+  }
+#endif
 
   enum hs_write_rc_e rc = HS_WRITE_RC_SUCCESS;
 
-  if (errno == EPIPE) {
+  if (failed) {
     rc = HS_WRITE_RC_SOCKET_ERR;
   } else {
-    if (request->bytes_written != request->buffer.length) {
+    if (out->length > 0) {
       // All bytes of the body were not written and we need to wait until the
       // socket is writable again to complete the write
       rc = HS_WRITE_RC_CONTINUE;
@@ -2450,14 +4656,17 @@ enum hs_write_rc_e hs_write_socket(http_request_t *request) {
 
 #line 1 "connection.c"
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <stdlib.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #ifdef KQUEUE
 #include <sys/event.h>
-#else
+#elif defined(EPOLL)
 #include <sys/epoll.h>
 #include <sys/timerfd.h>
 #include <time.h>
@@ -2480,6 +4689,35 @@ void _hs_add_timer_event(http_request_t *request, hs_io_cb_t unused) {
   kevent(request->server->loop, &ev_set, 1, NULL, 0, NULL);
 }
 
+#elif defined(IOURING)
+
+// Cancels the pending operations and queues the request to be freed once
+// their completions arrived.
+void _hs_delete_events(http_request_t *request) {
+  http_server_t *server = request->server;
+  struct hs_uring_conn_s *conn = &request->uring;
+  if (conn->recv_armed)
+    _hs_uring_prep_cancel(&server->ring, request);
+  if (conn->send_armed)
+    _hs_uring_prep_cancel(&server->ring, &request->send_handler);
+  if (request->out.flushing)
+    _hs_uring_prep_cancel(&server->ring, &request->flush_handler);
+  if (conn->recv_bid >= 0) {
+    _hs_uring_recycle_buffer(&server->ring, conn->recv_bid);
+    conn->recv_bid = -1;
+  }
+  conn->closing = 1;
+  conn->next_closed = server->closed;
+  server->closed = request;
+}
+
+// There is no timer per connection, each receive and send carries a linked
+// timeout completing on timer_cb.
+void _hs_add_timer_event(http_request_t *request, hs_io_cb_t timer_cb) {
+  request->timer_handler = timer_cb;
+  request->uring.recv_bid = -1;
+}
+
 #else
 
 void _hs_delete_events(http_request_t *request) {
@@ -2512,15 +4750,65 @@ void _hs_add_timer_event(http_request_t *request, hs_io_cb_t timer_cb) {
 
 #endif
 
+void _hs_request_free(http_request_t *request) {
+  http_server_t *server = request->server;
+  _hs_buffer_free(&request->buffer, &server->memused);
+  _hs_buffer_free(&request->pipelined, &server->memused);
+  hs_out_queue_free(&request->out, &server->memused);
+  server->memused -= sizeof(http_request_t) +
+                     request->tokens.capacity * sizeof(struct hsh_token_s);
+  if (request->line) {
+    server->memused -= HTTP_REQUEST_LINE_MAX;
+    free(request->line);
+  }
+  free(request->tokens.buf);
+  free(request);
+}
+
 void hs_request_terminate_connection(http_request_t *request) {
+#ifdef IOURING
+  if (request->uring.closing)
+    return;
+#endif
   _hs_delete_events(request);
   close(request->socket);
-  _hs_buffer_free(&request->buffer, &request->server->memused);
-  free(request->tokens.buf);
-  request->tokens.buf = NULL;
-  free(request);
+  if (request->data && request->server->abort_handler) {
+    request->server->abort_handler(request);
+    request->data = NULL;
+  }
+  hs_request_end_inflight(request);
+  request->server->stats.connections--;
+  if (request->open_prev)
+    request->open_prev->open_next = request->open_next;
+  else
+    request->server->open = request->open_next;
+  if (request->open_next)
+    request->open_next->open_prev = request->open_prev;
+#ifdef IOURING
+  // The cancelled operations still refer to the request and its buffer, it is
+  // freed by the event loop once they completed.
+#else
+  _hs_request_free(request);
+#endif
+}
+
+#ifdef IOURING
+
+void hs_server_free_closed_connections(http_server_t *server) {
+  http_request_t **link = &server->closed;
+  while (*link) {
+    http_request_t *request = *link;
+    if (request->uring.ops == 0) {
+      *link = request->uring.next_closed;
+      _hs_request_free(request);
+    } else {
+      link = &request->uring.next_closed;
+    }
+  }
 }
 
+#endif
+
 void _hs_token_array_init(struct hs_token_array_s *array, int capacity) {
   array->buf =
       (struct hsh_token_s *)malloc(sizeof(struct hsh_token_s) * capacity);
@@ -2541,24 +4829,74 @@ http_request_t *_hs_request_init(int sock, http_server_t *server,
   request->parser = (struct hsh_parser_s){};
   request->buffer = (struct hsh_buffer_s){};
   request->tokens.buf = NULL;
+  if (server->done_handler || server->trace_sample)
+    request->accepted_at = _hs_monotonic_ns();
   _hs_token_array_init(&request->tokens, 32);
+  server->memused += sizeof(http_request_t) + 32 * sizeof(struct hsh_token_s);
+  server->stats.connections++;
+  request->open_next = server->open;
+  if (server->open)
+    server->open->open_prev = request;
+  server->open = request;
   return request;
 }
 
+// Accepts a connection with the socket already non-blocking and close-on-exec.
+// accept4 needs _GNU_SOURCE on glibc, otherwise falls back to fcntl calls.
+int _hs_accept(int server_socket) {
+#if defined(SOCK_NONBLOCK) && defined(_GNU_SOURCE)
+  return accept4(server_socket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+#else
+  int sock = accept(server_socket, NULL, NULL);
+  if (sock >= 0) {
+    int flags = fcntl(sock, F_GETFL, 0);
+    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    fcntl(sock, F_SETFD, FD_CLOEXEC);
+  }
+  return sock;
+#endif
+}
+
+// Sets up the request struct and events of an accepted socket.
+http_request_t *_hs_server_adopt_connection(http_server_t *server, int sock,
+                                            hs_io_cb_t io_cb,
+                                            hs_io_cb_t timer_cb) {
+  server->stats.accepted++;
+  server->stats.accepted_this_second++;
+  // Responses leave in as few writes as the output queue allows, there is
+  // nothing for Nagle's algorithm to coalesce. Fails for unix sockets.
+  int flag = 1;
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+  http_request_t *request = _hs_request_init(sock, server, io_cb);
+  _hs_add_timer_event(request, timer_cb);
+  return request;
+}
+
+// Called when accepting failed because we are out of descriptors. The pending
+// connection would keep the server socket ready forever, so use the spare
+// descriptor to accept and drop it.
+void _hs_server_drop_pending_connection(http_server_t *server) {
+  if (server->reserve_fd < 0)
+    return;
+  close(server->reserve_fd);
+  int sock = _hs_accept(server->socket);
+  if (sock >= 0)
+    close(sock);
+  server->reserve_fd = open("/dev/null", O_RDONLY);
+}
+
 http_request_t *hs_server_accept_connection(http_server_t *server,
                                             hs_io_cb_t io_cb,
                                             hs_io_cb_t epoll_timer_cb) {
   http_request_t *request = NULL;
-  int sock = 0;
-
-  sock = accept(server->socket, (struct sockaddr *)&server->addr, &server->len);
-
-  if (sock > 0) {
-    int flags = fcntl(sock, F_GETFL, 0);
-    fcntl(sock, F_SETFL, flags | O_NONBLOCK);
-
-    request = _hs_request_init(sock, server, io_cb);
-    _hs_add_timer_event(request, epoll_timer_cb);
+  int sock = _hs_accept(server->socket);
+
+  if (sock >= 0) {
+    request = _hs_server_adopt_connection(server, sock, io_cb, epoll_timer_cb);
+  } else if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+    server->stats.accept_errors++;
+    if (errno == EMFILE || errno == ENFILE)
+      _hs_server_drop_pending_connection(server);
   }
   return request;
 }
@@ -2568,6 +4906,10 @@ http_request_t *hs_server_accept_connection(http_server_t *server,
 
 #ifdef KQUEUE
 #include <sys/event.h>
+#elif defined(IOURING)
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
 #else
 #include <stdint.h>
 #include <sys/epoll.h>
@@ -2596,14 +4938,38 @@ void _hs_read_socket_and_handle_return_code(http_request_t *request) {
 
 void hs_request_begin_read(http_request_t *request);
 
+// Asks the application for the next chunks once the previous ones were
+// written. Chunks given right away are queued and the callback called again,
+// they are written together when it stops or the output queue is full.
+void _hs_request_next_chunks(http_request_t *request) {
+  request->batching = 1;
+  do {
+    request->state = HTTP_SESSION_NOP;
+    request->chunk_cb(request);
+  } while (request->state == HTTP_SESSION_WRITE &&
+           HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE) &&
+           !hs_out_queue_full(&request->out));
+  request->batching = 0;
+  if (request->state != HTTP_SESSION_WRITE) {
+    // The callback responds later, what it queued so far goes out now.
+    hs_request_flush_output(request);
+    return;
+  }
+  request->out.more = HTTP_FLAG_CHECK(request->flags, HTTP_CHUNKED_RESPONSE);
+  hs_request_begin_write(request);
+}
+
 void _hs_write_socket_and_handle_return_code(http_request_t *request) {
   enum hs_write_rc_e rc = hs_write_socket(request);
 
   request->timeout = rc == HS_WRITE_RC_SUCCESS ? HTTP_KEEP_ALIVE_TIMEOUT
                                                : HTTP_REQUEST_TIMEOUT;
 
-  if (rc != HS_WRITE_RC_CONTINUE)
-    _hs_buffer_free(&request->buffer, &request->server->memused);
+  if (rc != HS_WRITE_RC_CONTINUE && rc != HS_WRITE_RC_SUCCESS_CHUNK &&
+      request->server->done_handler && request->status) {
+    _hs_request_mark(request, HTTP_PHASE_DONE);
+    request->server->done_handler(request);
+  }
 
   switch (rc) {
   case HS_WRITE_RC_SUCCESS_CLOSE:
@@ -2613,30 +4979,54 @@ void _hs_write_socket_and_handle_return_code(http_request_t *request) {
     break;
   case HS_WRITE_RC_SUCCESS:
     // Response complete, keep-alive connection
+    HTTP_FLAG_SET(request->flags, HTTP_REUSED);
+    HTTP_FLAG_CLEAR(request->flags, HTTP_DRAIN_IDLE);
     hs_request_begin_read(request);
     break;
   case HS_WRITE_RC_SUCCESS_CHUNK:
     // Finished writing chunk, request next
-    request->state = HTTP_SESSION_NOP;
-    request->chunk_cb(request);
+    _hs_request_next_chunks(request);
     break;
   case HS_WRITE_RC_CONTINUE:
     break;
   }
 }
 
+// Called once per second by the server timer.
+void _hs_server_tick(http_server_t *server) {
+  server->date_len = hs_generate_date_time(server->date);
+  server->stats.accepted_last_second = server->stats.accepted_this_second;
+  server->stats.accepted_this_second = 0;
+  if (server->draining)
+    _hs_server_sweep_idle(server);
+  if (server->tick_handler)
+    server->tick_handler(server);
+}
+
+// Sheds a new connection when the server is overloaded, otherwise starts
+// reading its first request.
+void _hs_begin_request_cycle(http_server_t *server, http_request_t *request) {
+  if ((server->max_connections > 0 &&
+       server->stats.connections > server->max_connections) ||
+      hs_server_over_memory_limit(server)) {
+    hs_request_shed(request);
+  } else {
+    hs_request_begin_read(request);
+  }
+}
+
 void _hs_accept_and_begin_request_cycle(http_server_t *server,
                                         hs_io_cb_t on_client_connection_cb,
                                         hs_io_cb_t on_timer_event_cb) {
   http_request_t *request = NULL;
-  while ((request = hs_server_accept_connection(server, on_client_connection_cb,
-                                                on_timer_event_cb))) {
-    if (server->memused > HTTP_MAX_TOTAL_EST_MEM_USAGE) {
-      hs_request_respond_error(request, 503, "Service Unavailable",
-                               hs_request_begin_write);
-    } else {
-      hs_request_begin_read(request);
-    }
+  for (int accepted = 0;
+       server->accept_budget <= 0 || accepted < server->accept_budget;
+       accepted++) {
+    request = hs_server_accept_connection(server, on_client_connection_cb,
+                                          on_timer_event_cb);
+    if (!request)
+      break;
+    _hs_begin_request_cycle(server, request);
   }
 }
 
@@ -2648,6 +5038,8 @@ void _hs_on_kqueue_client_connection_event(struct kevent *ev) {
     request->timeout -= 1;
     if (request->timeout == 0)
       hs_request_terminate_connection(request);
+  } else if (ev->filter == EVFILT_WRITE && request->out.flushing) {
+    hs_request_flush_ready(request);
   } else {
     if (request->state == HTTP_SESSION_READ) {
       _hs_read_socket_and_handle_return_code(request);
@@ -2660,17 +5052,144 @@ void _hs_on_kqueue_client_connection_event(struct kevent *ev) {
 void hs_on_kqueue_server_event(struct kevent *ev) {
   http_server_t *server = (http_server_t *)ev->udata;
   if (ev->filter == EVFILT_TIMER) {
-    hs_generate_date_time(server->date);
+    _hs_server_tick(server);
   } else {
     _hs_accept_and_begin_request_cycle(
         server, _hs_on_kqueue_client_connection_event, NULL);
   }
 }
 
+#elif defined(IOURING)
+
+void _hs_on_uring_send_event(struct io_uring_cqe *cqe);
+
+// Submits the operation the request waits for in its current state, unless it
+// is already pending. Does nothing for terminated requests.
+void _hs_uring_settle(http_request_t *request) {
+  struct hs_uring_conn_s *conn = &request->uring;
+  struct hs_uring_s *ring = &request->server->ring;
+  if (conn->closing)
+    return;
+  if (request->state == HTTP_SESSION_READ && !conn->recv_armed &&
+      conn->recv_bid < 0 && !conn->recv_eof) {
+    _hs_uring_prep_recv(ring, request->socket, request, &conn->recv_ts,
+                        request->timeout, &request->timer_handler);
+    conn->recv_armed = 1;
+    conn->ops += 2;
+  } else if (request->state == HTTP_SESSION_WRITE && !conn->send_armed &&
+             request->out.length > 0) {
+    request->send_handler = _hs_on_uring_send_event;
+    conn->send_msg.msg_iov = conn->send_iov;
+    conn->send_msg.msg_iovlen = hs_out_queue_iov(&request->out, conn->send_iov);
+    _hs_uring_prep_sendmsg(ring, request->socket, &conn->send_msg,
+                           request->out.more ? MSG_MORE : 0,
+                           &request->send_handler, &conn->send_ts,
+                           request->timeout, &request->timer_handler);
+    conn->send_armed = 1;
+    conn->ops += 2;
+  }
+}
+
+void _hs_on_uring_recv_event(struct io_uring_cqe *cqe) {
+  http_request_t *request = (http_request_t *)(uintptr_t)cqe->user_data;
+  struct hs_uring_conn_s *conn = &request->uring;
+  conn->ops--;
+  conn->recv_armed = 0;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+    if (conn->closing || cqe->res <= 0) {
+      _hs_uring_recycle_buffer(&request->server->ring, bid);
+    } else {
+      conn->recv_bid = bid;
+      conn->recv_off = 0;
+      conn->recv_len = cqe->res;
+    }
+  }
+  if (conn->closing)
+    return;
+  // Out of provided buffers, retry once the others are handed back.
+  if (cqe->res != -ENOBUFS) {
+    // Closed, failed or cancelled by the linked timeout.
+    if (cqe->res <= 0)
+      conn->recv_eof = 1;
+    if (request->state == HTTP_SESSION_READ)
+      _hs_read_socket_and_handle_return_code(request);
+  }
+  _hs_uring_settle(request);
+}
+
+void _hs_on_uring_send_event(struct io_uring_cqe *cqe) {
+  http_request_t *request =
+      (http_request_t *)((char *)(uintptr_t)cqe->user_data -
+                         offsetof(http_request_t, send_handler));
+  struct hs_uring_conn_s *conn = &request->uring;
+  conn->ops--;
+  conn->send_armed = 0;
+  if (conn->closing)
+    return;
+  if (cqe->res < 0) {
+    conn->send_failed = 1;
+  } else {
+    hs_out_queue_consume(&request->out, cqe->res, &request->server->memused);
+  }
+  _hs_write_socket_and_handle_return_code(request);
+  _hs_uring_settle(request);
+}
+
+void _hs_on_uring_flush_event(struct io_uring_cqe *cqe) {
+  http_request_t *request =
+      (http_request_t *)((char *)(uintptr_t)cqe->user_data -
+                         offsetof(http_request_t, flush_handler));
+  request->uring.ops--;
+  if (request->uring.closing)
+    return;
+  hs_request_flush_ready(request);
+  _hs_uring_settle(request);
+}
+
+// Completion of the timeout linked to a receive or send. When it fires the
+// operation itself completes with -ECANCELED.
+void _hs_on_uring_timeout_event(struct io_uring_cqe *cqe) {
+  http_request_t *request =
+      (http_request_t *)((char *)(uintptr_t)cqe->user_data -
+                         offsetof(http_request_t, timer_handler));
+  request->uring.ops--;
+}
+
+void hs_on_uring_server_accept_event(struct io_uring_cqe *cqe) {
+  http_server_t *server = (http_server_t *)(uintptr_t)cqe->user_data;
+  if (!(cqe->flags & IORING_CQE_F_MORE) && !server->draining) {
+    // The multishot accept stopped, usually because of an error.
+    _hs_uring_prep_multishot_accept(&server->ring, server->socket, server);
+  }
+  if (cqe->res == -ECANCELED)
+    return;
+  if (cqe->res < 0) {
+    server->stats.accept_errors++;
+    if (cqe->res == -EMFILE || cqe->res == -ENFILE)
+      _hs_server_drop_pending_connection(server);
+    return;
+  }
+  http_request_t *request = _hs_server_adopt_connection(
+      server, cqe->res, _hs_on_uring_recv_event, _hs_on_uring_timeout_event);
+  _hs_begin_request_cycle(server, request);
+}
+
+void hs_on_uring_server_timer_event(struct io_uring_cqe *cqe) {
+  http_server_t *server =
+      (http_server_t *)((char *)(uintptr_t)cqe->user_data -
+                        offsetof(http_server_t, timer_handler));
+  _hs_server_tick(server);
+  _hs_uring_prep_timeout(&server->ring, &server->timer_ts,
+                         &server->timer_handler);
+}
+
 #else
 
 void _hs_on_epoll_client_connection_event(struct epoll_event *ev) {
   http_request_t *request = (http_request_t *)ev->data.ptr;
+  if ((ev->events & EPOLLOUT) && request->out.flushing)
+    hs_request_flush_ready(request);
   if (request->state == HTTP_SESSION_READ) {
     _hs_read_socket_and_handle_return_code(request);
   } else if (request->state == HTTP_SESSION_WRITE) {
@@ -2701,18 +5220,25 @@ void hs_on_epoll_server_timer_event(struct epoll_event *ev) {
   uint64_t res;
   int bytes = read(server->timerfd, &res, sizeof(res));
   (void)bytes; // suppress warning
-  hs_generate_date_time(server->date);
+  _hs_server_tick(server);
 }
 
 #endif
 
 void _hs_add_write_event(http_request_t *request) {
+#ifndef IOURING
+  // Replaces the write interest added by hs_request_begin_flush.
+  request->out.flushing = 0;
+#endif
 #ifdef KQUEUE
   struct kevent ev_set[2];
   EV_SET(&ev_set[0], request->socket, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0,
          request);
   EV_SET(&ev_set[1], request->socket, EVFILT_READ, EV_DISABLE, 0, 0, request);
   kevent(request->server->loop, ev_set, 2, NULL, 0, NULL);
+#elif defined(IOURING)
+  // The send is submitted by _hs_uring_settle once the socket was handled.
+  (void)request;
 #else
   struct epoll_event ev;
   ev.events = EPOLLOUT | EPOLLET;
@@ -2725,9 +5251,16 @@ void hs_request_begin_write(http_request_t *request) {
   request->state = HTTP_SESSION_WRITE;
   _hs_add_write_event(request);
   _hs_write_socket_and_handle_return_code(request);
+#ifdef IOURING
+  _hs_uring_settle(request);
+#endif
 }
 
 void _hs_add_read_event(http_request_t *request) {
+#ifndef IOURING
+  // Nothing is left to flush when a connection goes back to reading.
+  request->out.flushing = 0;
+#endif
 #ifdef KQUEUE
   // No action needed for kqueue since it's read event stays active. Should
   // it be disabled during write?
@@ -2735,6 +5268,9 @@ void _hs_add_read_event(http_request_t *request) {
   EV_SET(&ev_set, request->socket, EVFILT_READ, EV_ADD | EV_ENABLE, 0, 0,
          request);
   kevent(request->server->loop, &ev_set, 1, NULL, 0, NULL);
+#elif defined(IOURING)
+  // The receive is submitted by _hs_uring_settle once the socket was handled.
+  (void)request;
 #else
   struct epoll_event ev;
   ev.events = EPOLLIN | EPOLLET;
@@ -2747,6 +5283,49 @@ void hs_request_begin_read(http_request_t *request) {
   request->state = HTTP_SESSION_READ;
   _hs_add_read_event(request);
   _hs_read_socket_and_handle_return_code(request);
+#ifdef IOURING
+  _hs_uring_settle(request);
+#endif
+}
+
+// Adds write interest for output left by a flush, keeping the read interest
+// of a connection that still reads its request.
+void hs_request_begin_flush(http_request_t *request) {
+#ifdef KQUEUE
+  struct kevent ev_set;
+  EV_SET(&ev_set, request->socket, EVFILT_WRITE, EV_ADD | EV_ENABLE | EV_CLEAR,
+         0, 0, request);
+  kevent(request->server->loop, &ev_set, 1, NULL, 0, NULL);
+#elif defined(IOURING)
+  request->flush_handler = _hs_on_uring_flush_event;
+  _hs_uring_prep_poll_out(&request->server->ring, request->socket,
+                          &request->flush_handler);
+  request->uring.ops++;
+#else
+  struct epoll_event ev;
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+  ev.data.ptr = request;
+  epoll_ctl(request->server->loop, EPOLL_CTL_MOD, request->socket, &ev);
+#endif
+}
+
+// Rejects a request of an overloaded server and closes its connection. A 503
+// response with Retry-After is written first unless the server is configured
+// to close right away.
+void hs_request_shed(http_request_t *request) {
+  http_server_t *server = request->server;
+  server->stats.shed++;
+  if (server->retry_after < 0) {
+    hs_request_terminate_connection(request);
+    return;
+  }
+  hs_request_set_keep_alive_flag(request, HTTP_CLOSE);
+  http_response_t *response = hs_response_init();
+  hs_response_set_status(response, 503);
+  hs_response_set_header(response, "Content-Type", "text/plain");
+  hs_response_set_header(response, "Retry-After", server->retry_after_str);
+  hs_response_set_body(response, "Service Unavailable", 19);
+  hs_request_respond(request, response, hs_request_begin_write);
 }
 
 #endif
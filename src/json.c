@@ -0,0 +1,649 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file json.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "json.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+struct json_decoder {
+	lua_State* L;
+	const char* start;
+	const char* p;
+	const char* end;
+	int32_t depth;
+	char* error;
+};
+
+struct json_encoder {
+	lua_State* L;
+	struct json_buffer* out;
+	char* error;
+};
+
+int32_t json_decode_value(struct json_decoder* d);
+int32_t json_encode_value(struct json_encoder* e, int32_t idx, int32_t depth);
+
+// ************************************************************************************
+// Length of the run of characters that need no escaping in a JSON string,
+// up to a quote, a backslash or a control character.
+int32_t json_scan_string(const char* p, const char* end) {
+	const char* s = p;
+
+#ifdef __SSE2__
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i backslash = _mm_set1_epi8('\\');
+	const __m128i control = _mm_set1_epi8(0x1f);
+
+	while (end - s >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i*)s);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+		// unsigned v <= 0x1f
+		m = _mm_or_si128(m, _mm_cmpeq_epi8(_mm_min_epu8(v, control), v));
+
+		int32_t mask = _mm_movemask_epi8(m);
+		if (mask) return (s - p) + __builtin_ctz(mask);
+		s += 16;
+	}
+#endif
+
+	while (s < end && *s != '"' && *s != '\\' && (unsigned char)*s >= 0x20) s++;
+	return s - p;
+}
+
+// ************************************************************************************
+void json_buffer_init(struct json_buffer* buf) {
+	buf->data = (char*)malloc(JSON_BUFFER_INITIAL);
+	buf->len = 0;
+	buf->cap = JSON_BUFFER_INITIAL;
+}
+
+// ************************************************************************************
+void json_buffer_free(struct json_buffer* buf) {
+	free(buf->data);
+	buf->data = NULL;
+	buf->len = 0;
+	buf->cap = 0;
+}
+
+// ************************************************************************************
+void json_buffer_reserve(struct json_buffer* buf, int32_t n) {
+	if (buf->len + n <= buf->cap) return;
+
+	int32_t cap = buf->cap ? buf->cap : JSON_BUFFER_INITIAL;
+	while (cap < buf->len + n) cap *= 2;
+	buf->data = (char*)realloc(buf->data, cap);
+	buf->cap = cap;
+}
+
+// ************************************************************************************
+void json_buffer_append(struct json_buffer* buf, const char* s, int32_t n) {
+	json_buffer_reserve(buf, n);
+	memcpy(buf->data + buf->len, s, n);
+	buf->len += n;
+}
+
+// ************************************************************************************
+int32_t json_fail(struct json_decoder* d, const char* what) {
+	if (d->error) snprintf(d->error, JSON_ERROR_MAX, "%s at position %d", what, (int32_t)(d->p - d->start));
+	return -1;
+}
+
+// ************************************************************************************
+void json_skip_whitespace(struct json_decoder* d) {
+	while (d->p < d->end && (*d->p == ' ' || *d->p == '\n' || *d->p == '\r' || *d->p == '\t')) d->p++;
+}
+
+// ************************************************************************************
+int32_t json_hex4(const char* p) {
+	int32_t v = 0;
+	for(int32_t i=0;i<4;++i) {
+		char c = p[i];
+		v <<= 4;
+		if (c >= '0' && c <= '9') v |= c - '0';
+		else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+		else return -1;
+	}
+	return v;
+}
+
+// ************************************************************************************
+int32_t json_utf8(uint32_t cp, char* out) {
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+	if (cp < 0x800) {
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+	if (cp < 0x10000) {
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+	out[0] = 0xf0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3f);
+	out[2] = 0x80 | ((cp >> 6) & 0x3f);
+	out[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+// ************************************************************************************
+// \uXXXX after the backslash and the u, surrogate pairs joined, lone
+// surrogates replaced by U+FFFD.
+int32_t json_decode_unicode(struct json_decoder* d, luaL_Buffer* b) {
+	char utf8[4];
+
+	if (d->end - d->p < 4) return json_fail(d, "truncated \\u escape");
+	int32_t cp = json_hex4(d->p);
+	if (cp < 0) return json_fail(d, "invalid \\u escape");
+	d->p += 4;
+
+	if (cp >= 0xd800 && cp <= 0xdbff) {
+		int32_t low = -1;
+		if (d->end - d->p >= 6 && d->p[0] == '\\' && d->p[1] == 'u') {
+			low = json_hex4(d->p + 2);
+		}
+		if (low >= 0xdc00 && low <= 0xdfff) {
+			cp = 0x10000 + ((cp - 0xd800) << 10) + (low - 0xdc00);
+			d->p += 6;
+		} else {
+			cp = 0xfffd;
+		}
+	} else if (cp >= 0xdc00 && cp <= 0xdfff) {
+		cp = 0xfffd;
+	}
+
+	luaL_addlstring(b, utf8, json_utf8(cp, utf8));
+	return 0;
+}
+
+// ************************************************************************************
+int32_t json_decode_string(struct json_decoder* d) {
+	d->p++;
+
+	// no escapes, the common case, pushed straight from the input
+	int32_t n = json_scan_string(d->p, d->end);
+	if (d->p + n < d->end && d->p[n] == '"') {
+		lua_pushlstring(d->L, d->p, n);
+		d->p += n + 1;
+		return 0;
+	}
+
+	luaL_Buffer b;
+	luaL_buffinit(d->L, &b);
+
+	for(;;) {
+		n = json_scan_string(d->p, d->end);
+		luaL_addlstring(&b, d->p, n);
+		d->p += n;
+
+		if (d->p >= d->end) return json_fail(d, "unterminated string");
+		if (*d->p == '"') {
+			d->p++;
+			luaL_pushresult(&b);
+			return 0;
+		}
+		if (*d->p != '\\') return json_fail(d, "control character in string");
+
+		d->p++;
+		if (d->p >= d->end) return json_fail(d, "unterminated string");
+
+		char c = *d->p++;
+		switch (c) {
+			case '"': luaL_addchar(&b, '"'); break;
+			case '\\': luaL_addchar(&b, '\\'); break;
+			case '/': luaL_addchar(&b, '/'); break;
+			case 'b': luaL_addchar(&b, '\b'); break;
+			case 'f': luaL_addchar(&b, '\f'); break;
+			case 'n': luaL_addchar(&b, '\n'); break;
+			case 'r': luaL_addchar(&b, '\r'); break;
+			case 't': luaL_addchar(&b, '\t'); break;
+			case 'u':
+				if (json_decode_unicode(d, &b) < 0) return -1;
+				break;
+			default:
+				d->p--;
+				return json_fail(d, "invalid escape");
+		}
+	}
+}
+
+// ************************************************************************************
+// Integers that fit are pushed as Lua integers, the rest as floats.
+int32_t json_decode_number(struct json_decoder* d) {
+	const char* s = d->p;
+	const char* p = s;
+	int32_t is_float = 0;
+
+	if (p < d->end && *p == '-') p++;
+	if (p >= d->end || *p < '0' || *p > '9') return json_fail(d, "invalid number");
+	while (p < d->end && *p >= '0' && *p <= '9') p++;
+
+	if (p < d->end && *p == '.') {
+		is_float = 1;
+		p++;
+		if (p >= d->end || *p < '0' || *p > '9') return json_fail(d, "invalid number");
+		while (p < d->end && *p >= '0' && *p <= '9') p++;
+	}
+	if (p < d->end && (*p == 'e' || *p == 'E')) {
+		is_float = 1;
+		p++;
+		if (p < d->end && (*p == '+' || *p == '-')) p++;
+		if (p >= d->end || *p < '0' || *p > '9') return json_fail(d, "invalid number");
+		while (p < d->end && *p >= '0' && *p <= '9') p++;
+	}
+
+	int32_t digits = p - s - (*s == '-');
+	if (!is_float && digits <= 18) {
+		int64_t v = 0;
+		for(const char* q = s + (*s == '-');q < p;++q) v = v * 10 + (*q - '0');
+		lua_pushinteger(d->L, *s == '-' ? -v : v);
+	} else {
+		// strtod needs a terminated copy, the input is not
+		char tmp[64];
+		if (p - s >= sizeof(tmp)) return json_fail(d, "number too long");
+		memcpy(tmp, s, p - s);
+		tmp[p - s] = 0;
+		lua_pushnumber(d->L, strtod(tmp, NULL));
+	}
+
+	d->p = p;
+	return 0;
+}
+
+// ************************************************************************************
+int32_t json_decode_literal(struct json_decoder* d, const char* literal, int32_t len) {
+	if (d->end - d->p < len || memcmp(d->p, literal, len) != 0) return json_fail(d, "unexpected character");
+	d->p += len;
+	return 0;
+}
+
+// ************************************************************************************
+int32_t json_decode_object(struct json_decoder* d) {
+	d->p++;
+	lua_createtable(d->L, 0, 4);
+
+	json_skip_whitespace(d);
+	if (d->p < d->end && *d->p == '}') {
+		d->p++;
+		return 0;
+	}
+
+	for(;;) {
+		json_skip_whitespace(d);
+		if (d->p >= d->end || *d->p != '"') return json_fail(d, "expected a key");
+		if (json_decode_string(d) < 0) return -1;
+
+		json_skip_whitespace(d);
+		if (d->p >= d->end || *d->p != ':') return json_fail(d, "expected ':'");
+		d->p++;
+
+		if (json_decode_value(d) < 0) return -1;
+		lua_rawset(d->L, -3);
+
+		json_skip_whitespace(d);
+		if (d->p >= d->end) return json_fail(d, "unterminated object");
+		if (*d->p == '}') {
+			d->p++;
+			return 0;
+		}
+		if (*d->p != ',') return json_fail(d, "expected ',' or '}'");
+		d->p++;
+	}
+}
+
+// ************************************************************************************
+int32_t json_decode_array(struct json_decoder* d) {
+	lua_Integer i = 1;
+
+	d->p++;
+	lua_createtable(d->L, 4, 0);
+
+	json_skip_whitespace(d);
+	if (d->p < d->end && *d->p == ']') {
+		d->p++;
+		return 0;
+	}
+
+	for(;;) {
+		if (json_decode_value(d) < 0) return -1;
+		lua_rawseti(d->L, -2, i++);
+
+		json_skip_whitespace(d);
+		if (d->p >= d->end) return json_fail(d, "unterminated array");
+		if (*d->p == ']') {
+			d->p++;
+			return 0;
+		}
+		if (*d->p != ',') return json_fail(d, "expected ',' or ']'");
+		d->p++;
+	}
+}
+
+// ************************************************************************************
+int32_t json_decode_value(struct json_decoder* d) {
+	int32_t res = 0;
+
+	json_skip_whitespace(d);
+	if (d->p >= d->end) return json_fail(d, "unexpected end");
+	if (!lua_checkstack(d->L, 3)) return json_fail(d, "nested too deep");
+
+	switch (*d->p) {
+		case '{':
+		case '[':
+			if (++d->depth > JSON_MAX_DEPTH) return json_fail(d, "nested too deep");
+			res = *d->p == '{' ? json_decode_object(d) : json_decode_array(d);
+			d->depth--;
+			return res;
+
+		case '"':
+			return json_decode_string(d);
+
+		case 't':
+			if (json_decode_literal(d, "true", 4) < 0) return -1;
+			lua_pushboolean(d->L, 1);
+			return 0;
+
+		case 'f':
+			if (json_decode_literal(d, "false", 5) < 0) return -1;
+			lua_pushboolean(d->L, 0);
+			return 0;
+
+		case 'n':
+			if (json_decode_literal(d, "null", 4) < 0) return -1;
+			lua_pushlightuserdata(d->L, NULL);
+			return 0;
+
+		default:
+			return json_decode_number(d);
+	}
+}
+
+// ************************************************************************************
+// Pushes the decoded value, null decodes to json.null. On error nothing is
+// pushed and the message goes to error (if given).
+int32_t json_decode(lua_State* L, const char* data, int32_t len, char* error) {
+	struct json_decoder d = { L, data, data, data + len, 0, error };
+	int32_t top = lua_gettop(L);
+
+	if (json_decode_value(&d) < 0) {
+		lua_settop(L, top);
+		return -1;
+	}
+
+	json_skip_whitespace(&d);
+	if (d.p < d.end) {
+		json_fail(&d, "trailing characters");
+		lua_settop(L, top);
+		return -1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+void json_encode_string(struct json_buffer* out, const char* s, int32_t len) {
+	static const char hex[] = "0123456789abcdef";
+	const char* end = s + len;
+
+	json_buffer_reserve(out, len + 2);
+	out->data[out->len++] = '"';
+
+	while (s < end) {
+		int32_t n = json_scan_string(s, end);
+		json_buffer_append(out, s, n);
+		s += n;
+		if (s >= end) break;
+
+		char esc[6] = { '\\', 0, '0', '0', 0, 0 };
+		int32_t esc_len = 2;
+		switch (*s) {
+			case '"': esc[1] = '"'; break;
+			case '\\': esc[1] = '\\'; break;
+			case '\n': esc[1] = 'n'; break;
+			case '\r': esc[1] = 'r'; break;
+			case '\t': esc[1] = 't'; break;
+			case '\b': esc[1] = 'b'; break;
+			case '\f': esc[1] = 'f'; break;
+			default:
+				esc[1] = 'u';
+				esc[4] = hex[(*s >> 4) & 0xf];
+				esc[5] = hex[*s & 0xf];
+				esc_len = 6;
+				break;
+		}
+		json_buffer_append(out, esc, esc_len);
+		s++;
+	}
+
+	json_buffer_append(out, "\"", 1);
+}
+
+// ************************************************************************************
+int32_t json_encode_fail(struct json_encoder* e, const char* what) {
+	if (e->error) snprintf(e->error, JSON_ERROR_MAX, "%s", what);
+	return -1;
+}
+
+// ************************************************************************************
+// A table is an array when its keys are exactly 1..n, returns n or -1.
+int32_t json_array_length(lua_State* L, int32_t idx) {
+	int32_t n = lua_rawlen(L, idx);
+	int32_t count = 0;
+
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		lua_pop(L, 1);
+		if (!lua_isinteger(L, -1)) {
+			lua_pop(L, 1);
+			return -1;
+		}
+		lua_Integer k = lua_tointeger(L, -1);
+		if (k < 1 || k > n) {
+			lua_pop(L, 1);
+			return -1;
+		}
+		count++;
+	}
+	return count == n ? n : -1;
+}
+
+// ************************************************************************************
+int32_t json_encode_table(struct json_encoder* e, int32_t idx, int32_t depth) {
+	lua_State* L = e->L;
+
+	if (depth > JSON_MAX_DEPTH) return json_encode_fail(e, "nested too deep or a cycle");
+	if (!lua_checkstack(L, 4)) return json_encode_fail(e, "nested too deep");
+
+	// empty tables encode as objects
+	int32_t n = json_array_length(L, idx);
+	if (n > 0) {
+		json_buffer_append(e->out, "[", 1);
+		for(int32_t i=1;i<=n;++i) {
+			if (i > 1) json_buffer_append(e->out, ",", 1);
+			lua_rawgeti(L, idx, i);
+			if (json_encode_value(e, lua_gettop(L), depth + 1) < 0) return -1;
+			lua_pop(L, 1);
+		}
+		json_buffer_append(e->out, "]", 1);
+		return 0;
+	}
+
+	int32_t first = 1;
+	json_buffer_append(e->out, "{", 1);
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		if (!first) json_buffer_append(e->out, ",", 1);
+		first = 0;
+
+		// lua_tolstring would turn a number key into a string in place and break lua_next
+		if (lua_type(L, -2) == LUA_TSTRING) {
+			size_t len = 0;
+			const char* key = lua_tolstring(L, -2, &len);
+			json_encode_string(e->out, key, len);
+		} else if (lua_isinteger(L, -2)) {
+			char key[32];
+			int32_t len = snprintf(key, sizeof(key), "\"%lld\"", (long long)lua_tointeger(L, -2));
+			json_buffer_append(e->out, key, len);
+		} else {
+			return json_encode_fail(e, "cannot encode a table key that is not a string or an integer");
+		}
+
+		json_buffer_append(e->out, ":", 1);
+		if (json_encode_value(e, lua_gettop(L), depth + 1) < 0) return -1;
+		lua_pop(L, 1);
+	}
+	json_buffer_append(e->out, "}", 1);
+	return 0;
+}
+
+// ************************************************************************************
+int32_t json_encode_value(struct json_encoder* e, int32_t idx, int32_t depth) {
+	lua_State* L = e->L;
+	char num[64];
+	int32_t len = 0;
+
+	switch (lua_type(L, idx)) {
+		case LUA_TNIL:
+			json_buffer_append(e->out, "null", 4);
+			return 0;
+
+		case LUA_TBOOLEAN:
+			if (lua_toboolean(L, idx)) {
+				json_buffer_append(e->out, "true", 4);
+			} else {
+				json_buffer_append(e->out, "false", 5);
+			}
+			return 0;
+
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, idx)) {
+				len = snprintf(num, sizeof(num), "%lld", (long long)lua_tointeger(L, idx));
+			} else {
+				double v = lua_tonumber(L, idx);
+				if (isnan(v) || isinf(v)) return json_encode_fail(e, "cannot encode nan or inf");
+				// the shortest of the two that reads back the same number
+				len = snprintf(num, sizeof(num), "%.15g", v);
+				if (strtod(num, NULL) != v) len = snprintf(num, sizeof(num), "%.17g", v);
+			}
+			json_buffer_append(e->out, num, len);
+			return 0;
+
+		case LUA_TSTRING: {
+			size_t slen = 0;
+			const char* s = lua_tolstring(L, idx, &slen);
+			json_encode_string(e->out, s, slen);
+			return 0;
+		}
+
+		case LUA_TTABLE:
+			return json_encode_table(e, idx, depth);
+
+		case LUA_TLIGHTUSERDATA:
+			if (lua_touserdata(L, idx) == NULL) {
+				json_buffer_append(e->out, "null", 4);
+				return 0;
+			}
+			break;
+	}
+
+	if (e->error) snprintf(e->error, JSON_ERROR_MAX, "cannot encode a %s", luaL_typename(L, idx));
+	return -1;
+}
+
+// ************************************************************************************
+// Appends the value at idx to out, on error out is left partly written.
+int32_t json_encode(lua_State* L, int32_t idx, struct json_buffer* out, char* error) {
+	struct json_encoder e = { L, out, error };
+	int32_t top = lua_gettop(L);
+	int32_t res = json_encode_value(&e, lua_absindex(L, idx), 0);
+	lua_settop(L, top);
+	return res;
+}
+
+// ************************************************************************************
+// json.encode(value), raises an error for values JSON cannot hold
+int json_lua_encode(lua_State* L) {
+	struct json_buffer* buf = (struct json_buffer*)lua_touserdata(L, lua_upvalueindex(1));
+	char error[JSON_ERROR_MAX];
+
+	luaL_checkany(L, 1);
+	buf->len = 0;
+	if (json_encode(L, 1, buf, error) < 0) {
+		return luaL_error(L, "json.encode: %s", error);
+	}
+	lua_pushlstring(L, buf->data, buf->len);
+	return 1;
+}
+
+// ************************************************************************************
+// json.decode(string), returns nil and the error for invalid input
+int json_lua_decode(lua_State* L) {
+	size_t len = 0;
+	const char* s = luaL_checklstring(L, 1, &len);
+	char error[JSON_ERROR_MAX];
+
+	if (json_decode(L, s, len, error) < 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, error);
+		return 2;
+	}
+	return 1;
+}
+
+// ************************************************************************************
+// Registers the global json table, the encoder output goes to buf.
+void json_open(lua_State* L, struct json_buffer* buf) {
+	lua_createtable(L, 0, 3);
+
+	lua_pushlightuserdata(L, buf);
+	lua_pushcclosure(L, json_lua_encode, 1);
+	lua_setfield(L, -2, "encode");
+
+	lua_pushcfunction(L, json_lua_decode);
+	lua_setfield(L, -2, "decode");
+
+	lua_pushlightuserdata(L, NULL);
+	lua_setfield(L, -2, "null");
+
+	lua_setglobal(L, "json");
+}
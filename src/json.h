@@ -0,0 +1,57 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file json.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef JSON_H_
+#define JSON_H_
+
+#include <stdint.h>
+
+#define JSON_MAX_DEPTH 128
+#define JSON_BUFFER_INITIAL 16384
+#define JSON_ERROR_MAX 128
+
+struct lua_State;
+
+// Output of the encoder, reused between calls so encoding a response does not
+// allocate once the buffer has grown to the usual response size.
+struct json_buffer {
+	char* data;
+	int32_t len;
+	int32_t cap;
+};
+
+void json_buffer_init(struct json_buffer* buf);
+void json_buffer_free(struct json_buffer* buf);
+
+int32_t json_decode(struct lua_State* L, const char* data, int32_t len, char* error);
+int32_t json_encode(struct lua_State* L, int32_t idx, struct json_buffer* out, char* error);
+
+void json_open(struct lua_State* L, struct json_buffer* buf);
+
+#endif /* JSON_H_ */
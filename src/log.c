@@ -30,44 +30,315 @@
 
 #include "log.h"
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <stdarg.h>
+#include <string.h>
 #include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/uio.h>
+
+// Lines are formatted by the event loop thread into a ring per output and
+// written out by a background thread in large batches, so a slow terminal or
+// pipe never stalls request handling. Each ring has a single producer and a
+// single consumer, so head and tail are plain atomics without locks. While
+// lines keep coming the writer collects them for up to LOG_FLUSH_INTERVAL_NS
+// between writes; once the rings stay empty it sleeps on a condition variable
+// and the producer only takes the lock to wake it for the next line.
+
+#define LOG_RING_SIZE (1 << 20)
+#define LOG_LINE_MAX 2048
+#define LOG_FLUSH_INTERVAL_NS 10000000
+
+enum log_sink_id {
+	LOG_SINK_ERROR,
+	LOG_SINK_ACCESS,
+	LOG_SINK_COUNT
+};
+
+struct log_sink {
+	int32_t fd;
+	char* ring;
+	// bytes pushed by the producer
+	_Atomic uint64_t head;
+	// bytes written out by the writer
+	_Atomic uint64_t tail;
+	// lines lost because the ring was full
+	_Atomic uint64_t dropped;
+	uint64_t dropped_reported;
+};
+
+static struct log_sink g_sinks[LOG_SINK_COUNT] = { { .fd = 2 }, { .fd = -1 } };
+static pthread_t g_writer;
+static pthread_t g_producer;
+static atomic_int g_running;
+
+// set by the writer before it checks the rings one last time and sleeps
+static atomic_int g_waiting;
+static pthread_mutex_t g_wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t g_wake = PTHREAD_COND_INITIALIZER;
+
+static time_t g_date_time = 0;
+static char g_date_str[32];
 
 // ************************************************************************************
 void build_date(char* out, int size) {
 	time_t now = time(NULL);
-	struct tm *t = localtime(&now);
+	struct tm t;
+	localtime_r(&now, &t);
 
-	strftime(out, size, "%Y-%m-%d %H:%M:%S", t);
+	strftime(out, size, "%Y-%m-%d %H:%M:%S", &t);
 }
 
 // ************************************************************************************
-void log_info(const char* fmt, ...) {
-    va_list argptr;
-    va_start(argptr, fmt);
+// Date of the current second, formatted only once per second. Producer thread only.
+const char* log_cached_date() {
+	time_t now = time(NULL);
+	if (now != g_date_time) {
+		struct tm t;
+		localtime_r(&now, &t);
+		strftime(g_date_str, sizeof(g_date_str), "%Y-%m-%d %H:%M:%S", &t);
+		g_date_time = now;
+	}
+	return g_date_str;
+}
+
+// ************************************************************************************
+void log_write_full(int32_t fd, const char* data, int32_t len) {
+	while (len > 0) {
+		ssize_t n = write(fd, data, len);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) return;
+		data += n;
+		len -= n;
+	}
+}
 
-    char date_str[128] = { 0 };
-    build_date(date_str, sizeof(date_str) - 1);
+// ************************************************************************************
+void log_wake() {
+	pthread_mutex_lock(&g_wake_lock);
+	pthread_cond_signal(&g_wake);
+	pthread_mutex_unlock(&g_wake_lock);
+}
+
+// ************************************************************************************
+int32_t log_push(struct log_sink* sink, const char* line, int32_t len) {
+	uint64_t head = atomic_load_explicit(&sink->head, memory_order_relaxed);
+	uint64_t tail = atomic_load_explicit(&sink->tail, memory_order_acquire);
 
-    fprintf(stderr, "[%s] [INFO] ", date_str);
-    vfprintf(stderr, fmt, argptr);
-    fprintf(stderr, "\n");
+	if (LOG_RING_SIZE - (head - tail) < (uint64_t)len) {
+		atomic_fetch_add_explicit(&sink->dropped, 1, memory_order_relaxed);
+		return 0;
+	}
 
-    va_end(argptr);
+	uint32_t pos = head & (LOG_RING_SIZE - 1);
+	uint32_t first = LOG_RING_SIZE - pos;
+	if (first > (uint32_t)len) first = len;
+
+	memcpy(sink->ring + pos, line, first);
+	memcpy(sink->ring, line + first, len - first);
+
+	atomic_store_explicit(&sink->head, head + len, memory_order_release);
+
+	// pairs with the fence in log_writer_wait: either the writer sees this
+	// line before sleeping or we see it waiting (the tail read above may be
+	// older than its last drain, so it cannot tell whether the ring was empty)
+	atomic_thread_fence(memory_order_seq_cst);
+	if (atomic_load_explicit(&g_waiting, memory_order_relaxed)) log_wake();
+	return 1;
+}
+
+// ************************************************************************************
+void log_emit(int32_t sink_id, const char* level, const char* fmt, va_list argptr) {
+	struct log_sink* sink = &g_sinks[sink_id];
+	if (sink->fd < 0) return;
+
+	int32_t async = atomic_load_explicit(&g_running, memory_order_relaxed) && pthread_equal(pthread_self(), g_producer);
+
+	char line[LOG_LINE_MAX];
+	char date_str[32];
+	int32_t len = 0;
+
+	if (async) {
+		len = snprintf(line, LOG_LINE_MAX, "[%s] %s", log_cached_date(), level);
+	} else {
+		build_date(date_str, sizeof(date_str));
+		len = snprintf(line, LOG_LINE_MAX, "[%s] %s", date_str, level);
+	}
+
+	int32_t n = vsnprintf(line + len, LOG_LINE_MAX - len, fmt, argptr);
+	len += n;
+	if (len > LOG_LINE_MAX - 1) len = LOG_LINE_MAX - 1;
+	line[len++] = '\n';
+
+	if (async) {
+		log_push(sink, line, len);
+	} else {
+		log_write_full(sink->fd, line, len);
+	}
+}
+
+// ************************************************************************************
+void log_info(const char* fmt, ...) {
+	va_list argptr;
+	va_start(argptr, fmt);
+	log_emit(LOG_SINK_ERROR, "[INFO] ", fmt, argptr);
+	va_end(argptr);
 }
 
 // ************************************************************************************
 void log_error(const char* fmt, ...) {
-    va_list argptr;
-    va_start(argptr, fmt);
+	va_list argptr;
+	va_start(argptr, fmt);
+	log_emit(LOG_SINK_ERROR, "[ERROR] ", fmt, argptr);
+	va_end(argptr);
+}
 
-    char date_str[128] = { 0 };
-    build_date(date_str, sizeof(date_str) - 1);
+// ************************************************************************************
+void log_access(const char* fmt, ...) {
+	va_list argptr;
+	va_start(argptr, fmt);
+	log_emit(LOG_SINK_ACCESS, "", fmt, argptr);
+	va_end(argptr);
+}
+
+// ************************************************************************************
+int32_t log_access_enabled() {
+	return g_sinks[LOG_SINK_ACCESS].fd >= 0;
+}
+
+// ************************************************************************************
+// Writes out everything pushed so far. Returns the number of bytes written.
+uint64_t log_drain(struct log_sink* sink) {
+	uint64_t tail = atomic_load_explicit(&sink->tail, memory_order_relaxed);
+	uint64_t head = atomic_load_explicit(&sink->head, memory_order_acquire);
+	uint64_t total = head - tail;
+
+	while (tail < head) {
+		uint32_t pos = tail & (LOG_RING_SIZE - 1);
+		uint32_t first = LOG_RING_SIZE - pos;
+		if (first > head - tail) first = head - tail;
+
+		struct iovec iov[2];
+		iov[0].iov_base = sink->ring + pos;
+		iov[0].iov_len = first;
+		iov[1].iov_base = sink->ring;
+		iov[1].iov_len = (head - tail) - first;
 
-    fprintf(stderr, "[%s] [ERROR] ", date_str);
-    vfprintf(stderr, fmt, argptr);
-    fprintf(stderr, "\n");
+		ssize_t n = writev(sink->fd, iov, iov[1].iov_len ? 2 : 1);
+		if (n < 0 && errno == EINTR) continue;
+		if (n <= 0) {
+			// output is gone, throw the data away rather than spin on it
+			tail = head;
+		} else {
+			tail += n;
+		}
+		atomic_store_explicit(&sink->tail, tail, memory_order_release);
+	}
 
-    va_end(argptr);
+	uint64_t dropped = atomic_load_explicit(&sink->dropped, memory_order_relaxed);
+	if (dropped != sink->dropped_reported) {
+		char line[128];
+		char date_str[32];
+		build_date(date_str, sizeof(date_str));
+		int32_t len = snprintf(line, sizeof(line), "[%s] [ERROR] [LOG] %llu lines dropped, log output too slow\n",
+			date_str, (unsigned long long)(dropped - sink->dropped_reported));
+		log_write_full(g_sinks[LOG_SINK_ERROR].fd, line, len);
+		sink->dropped_reported = dropped;
+	}
+
+	return total;
+}
+
+// ************************************************************************************
+// Sleeps until a line is pushed into an empty ring or the log stops.
+void log_writer_wait() {
+	pthread_mutex_lock(&g_wake_lock);
+	atomic_store_explicit(&g_waiting, 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+
+	int32_t empty = atomic_load_explicit(&g_running, memory_order_acquire);
+	for(int32_t i=0;i<LOG_SINK_COUNT && empty;++i) {
+		struct log_sink* sink = &g_sinks[i];
+		empty = sink->fd < 0 || atomic_load_explicit(&sink->head, memory_order_acquire) == atomic_load_explicit(&sink->tail, memory_order_relaxed);
+	}
+	if (empty) pthread_cond_wait(&g_wake, &g_wake_lock);
+
+	atomic_store_explicit(&g_waiting, 0, memory_order_relaxed);
+	pthread_mutex_unlock(&g_wake_lock);
 }
 
+// ************************************************************************************
+void* log_writer_main(void* arg) {
+	struct timespec interval = { 0, LOG_FLUSH_INTERVAL_NS };
+
+	while (atomic_load_explicit(&g_running, memory_order_acquire)) {
+		uint64_t written = 0;
+		for(int32_t i=0;i<LOG_SINK_COUNT;++i) {
+			if (g_sinks[i].fd >= 0) written += log_drain(&g_sinks[i]);
+		}
+		if (written == 0) log_writer_wait();
+		else nanosleep(&interval, NULL);
+	}
+
+	for(int32_t i=0;i<LOG_SINK_COUNT;++i) {
+		if (g_sinks[i].fd >= 0) log_drain(&g_sinks[i]);
+	}
+	return NULL;
+}
+
+// ************************************************************************************
+int32_t log_start(const char* access_path) {
+	if (atomic_load(&g_running)) return 0;
+
+	if (access_path) {
+		if (strcmp(access_path, "-") == 0) {
+			g_sinks[LOG_SINK_ACCESS].fd = 2;
+		} else {
+			g_sinks[LOG_SINK_ACCESS].fd = open(access_path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+			if (g_sinks[LOG_SINK_ACCESS].fd < 0) {
+				log_error("[LOG] Cannot open access log %s: %s", access_path, strerror(errno));
+				return -1;
+			}
+		}
+	}
+
+	for(int32_t i=0;i<LOG_SINK_COUNT;++i) {
+		if (g_sinks[i].fd < 0) continue;
+		g_sinks[i].ring = (char*)malloc(LOG_RING_SIZE);
+		if (!g_sinks[i].ring) return -1;
+	}
+
+	g_producer = pthread_self();
+	atomic_store(&g_running, 1);
+	if (pthread_create(&g_writer, NULL, log_writer_main, NULL) != 0) {
+		atomic_store(&g_running, 0);
+		log_error("[LOG] Cannot start log writer thread");
+		return -1;
+	}
+
+	atexit(log_stop);
+	return 0;
+}
+
+// ************************************************************************************
+void log_stop() {
+	if (!atomic_load(&g_running)) return;
+
+	atomic_store(&g_running, 0);
+	log_wake();
+	pthread_join(g_writer, NULL);
+}
+
+// ************************************************************************************
+uint64_t log_dropped() {
+	uint64_t res = 0;
+	for(int32_t i=0;i<LOG_SINK_COUNT;++i) {
+		res += atomic_load_explicit(&g_sinks[i].dropped, memory_order_relaxed);
+	}
+	return res;
+}
@@ -31,7 +31,18 @@
 #ifndef LOG_H_
 #define LOG_H_
 
+#include <stdint.h>
+
 void log_info(const char* fmt, ...);
 void log_error(const char* fmt, ...);
+void log_access(const char* fmt, ...);
+int32_t log_access_enabled();
+
+// Moves writing to a background thread. Lines logged from the calling thread
+// are queued from then on, lines from other threads are still written directly.
+// access_path is the access log file, "-" for stderr, NULL to disable it.
+int32_t log_start(const char* access_path);
+void log_stop();
+uint64_t log_dropped();
 
 #endif /* LOG_H_ */
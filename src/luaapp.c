@@ -31,17 +31,38 @@
 #include "vfs.h"
 #include "httpserver.h"
 #include "log.h"
+#include "router.h"
+#include "cache.h"
+#include "json.h"
+#include "form.h"
+#include "pool.h"
+#include "utils.h"
 
 #include <stdio.h>
+#include <strings.h>
 
 #include <lualib.h>
 #include <lauxlib.h>
 
+#define LUAAPP_GC_SENTINEL "emb.gcsentinel"
+#define LUAAPP_REQUEST_META "emb.request"
+
+// yielded by worker.* calls, any other yield of a handler is an error
+static char luaapp_task_sentinel;
+
+void luaapp_push_gc_sentinel(struct lua_app* app);
+void luaapp_open_router(struct lua_app* app);
+void luaapp_open_request(struct lua_app* app);
+void luaapp_open_worker(struct lua_app* app);
+void luaapp_parse_query_state(lua_State* L, const char* query, int32_t len);
+
 // ************************************************************************************
 struct lua_app* luaapp_init(struct hashmap* vfs) {
 	struct lua_app* res = (struct lua_app*)malloc(sizeof(struct lua_app));
 
 	res->vfs = vfs;
+	res->gc_cycles = 0;
+	res->router = router_init();
 	res->state = luaL_newstate();
 
 	if (!res->state) {
@@ -49,11 +70,343 @@ struct lua_app* luaapp_init(struct hashmap* vfs) {
 		return NULL;
 	}
 
+	// new threads copy it, only handler coroutines get a call
+	*(struct luaapp_call**)lua_getextraspace(res->state) = NULL;
+	res->pool = NULL;
+	res->calls = NULL;
+	res->current = NULL;
+	res->suspended = 0;
+	res->resumed = NULL;
+
 	luaL_openlibs(res->state);
+	luaapp_push_gc_sentinel(res);
+	lua_pop(res->state, 1);
+	luaapp_open_router(res);
+	luaapp_open_request(res);
+	luaapp_open_worker(res);
+	json_buffer_init(&res->json);
+	json_open(res->state, &res->json);
+
+	return res;
+}
+
+// ************************************************************************************
+// Closes the state, no handler may be suspended in it.
+void luaapp_free(struct lua_app* app) {
+	if (!app) return;
+
+	lua_close(app->state);
+	while (app->calls) {
+		struct luaapp_call* call = app->calls;
+		app->calls = call->next;
+		free(call);
+	}
+	router_free(app->router);
+	json_buffer_free(&app->json);
+	free(app);
+}
+
+// ************************************************************************************
+// The sentinel is unreachable right after creation, so its finalizer runs once
+// per completed collection cycle. Each run counts the cycle and leaves a fresh
+// sentinel behind for the next one.
+int luaapp_gc_sentinel_finalize(lua_State* L) {
+	struct lua_app* app = *(struct lua_app**)lua_touserdata(L, 1);
+	app->gc_cycles += 1;
+	luaapp_push_gc_sentinel(app);
+	return 0;
+}
+
+// ************************************************************************************
+void luaapp_push_gc_sentinel(struct lua_app* app) {
+	struct lua_app** ud = (struct lua_app**)lua_newuserdatauv(app->state, sizeof(struct lua_app*), 0);
+	*ud = app;
+
+	if (luaL_newmetatable(app->state, LUAAPP_GC_SENTINEL)) {
+		lua_pushcfunction(app->state, luaapp_gc_sentinel_finalize);
+		lua_setfield(app->state, -2, "__gc");
+	}
+	lua_setmetatable(app->state, -2);
+}
+
+// ************************************************************************************
+// router.add(method, pattern, handler), method "*" matches any method
+int luaapp_router_add(lua_State* L) {
+	struct lua_app* app = (struct lua_app*)lua_touserdata(L, lua_upvalueindex(1));
+	const char* method = luaL_checkstring(L, 1);
+	const char* pattern = luaL_checkstring(L, 2);
+	luaL_checktype(L, 3, LUA_TFUNCTION);
+
+	lua_pushvalue(L, 3);
+	int32_t ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	if (router_add(app->router, method, pattern, ref) < 0) {
+		luaL_unref(L, LUA_REGISTRYINDEX, ref);
+		return luaL_error(L, "cannot add route %s %s", method, pattern);
+	}
+	return 0;
+}
 
+// ************************************************************************************
+void luaapp_open_router(struct lua_app* app) {
+	lua_newtable(app->state);
+	lua_pushlightuserdata(app->state, app);
+	lua_pushcclosure(app->state, luaapp_router_add, 1);
+	lua_setfield(app->state, -2, "add");
+	lua_setglobal(app->state, "router");
+}
+
+// ************************************************************************************
+// request:query(name), the values of one query parameter
+int luaapp_request_query(lua_State* L) {
+	size_t name_len = 0;
+	size_t len = 0;
+	const char* name = luaL_checklstring(L, 2, &name_len);
+
+	luaL_checktype(L, 1, LUA_TTABLE);
+	lua_pushstring(L, "queryString");
+	lua_rawget(L, 1);
+	const char* query = lua_tolstring(L, -1, &len);
+	if (!query) return 0;
+
+	return luaapp_query_values(L, query, len, name, name_len);
+}
+
+// ************************************************************************************
+// Value of a request header, names compared case-insensitively. Nothing is
+// left on the stack, the string stays referenced by the headers table.
+const char* luaapp_request_header(lua_State* L, int32_t idx, const char* name, size_t* len) {
+	const char* res = NULL;
+
+	lua_pushstring(L, "headers");
+	lua_rawget(L, idx);
+	if (!lua_istable(L, -1)) {
+		lua_pop(L, 1);
+		return NULL;
+	}
+
+	lua_pushnil(L);
+	while (lua_next(L, -2)) {
+		if (lua_type(L, -2) == LUA_TSTRING && strcasecmp(lua_tostring(L, -2), name) == 0 && lua_type(L, -1) == LUA_TSTRING) {
+			res = lua_tolstring(L, -1, len);
+			lua_pop(L, 2);
+			break;
+		}
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
 	return res;
 }
 
+// ************************************************************************************
+// Pushes the fields of an urlencoded or multipart body, nothing for other
+// bodies or a malformed one.
+int32_t luaapp_push_form(lua_State* L, int32_t idx) {
+	char boundary[FORM_BOUNDARY_MAX + 1];
+	size_t ct_len = 0;
+	size_t len = 0;
+
+	const char* ct = luaapp_request_header(L, idx, "Content-Type", &ct_len);
+	if (!ct) return 0;
+
+	lua_pushstring(L, "body");
+	lua_rawget(L, idx);
+	const char* body = lua_tolstring(L, -1, &len);
+	if (!body) {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	if (form_is_urlencoded(ct, ct_len)) {
+		lua_newtable(L);
+		luaapp_parse_query_state(L, body, len);
+	} else if (form_boundary(ct, ct_len, boundary) > 0) {
+		// the body string outlives the parser, fields are sliced from it
+		struct form* form = form_init(boundary, 1);
+		if (form_feed(form, body, len) < 0 || form_finish(form) < 0) {
+			form_free(form);
+			lua_pop(L, 1);
+			return 0;
+		}
+		form_push(L, form);
+		form_free(form);
+	} else {
+		lua_pop(L, 1);
+		return 0;
+	}
+
+	lua_remove(L, -2);
+	return 1;
+}
+
+// ************************************************************************************
+// Fields of the request computed on first access, anything else is looked up
+// in the HTTPRequest table so methods defined there work as request:method().
+int luaapp_request_index(lua_State* L) {
+	const char* key = lua_tostring(L, 2);
+
+	if (key && strcmp(key, "query") == 0) {
+		lua_pushcfunction(L, luaapp_request_query);
+		return 1;
+	}
+
+	if (key && strcmp(key, "queryParams") == 0) {
+		size_t len = 0;
+		lua_pushstring(L, "queryString");
+		lua_rawget(L, 1);
+		const char* query = lua_tolstring(L, -1, &len);
+
+		lua_newtable(L);
+		if (query) luaapp_parse_query_state(L, query, len);
+
+		// keep it for the next access
+		lua_pushstring(L, "queryParams");
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 1);
+		return 1;
+	}
+
+	if (key && strcmp(key, "form") == 0) {
+		if (!luaapp_push_form(L, 1)) return 0;
+
+		// keep it for the next access
+		lua_pushstring(L, "form");
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 1);
+		return 1;
+	}
+
+	if (key && strcmp(key, "json") == 0) {
+		size_t len = 0;
+		lua_pushstring(L, "body");
+		lua_rawget(L, 1);
+		const char* body = lua_tolstring(L, -1, &len);
+		if (!body || json_decode(L, body, len, NULL) < 0) return 0;
+
+		// keep it for the next access
+		lua_pushstring(L, "json");
+		lua_pushvalue(L, -2);
+		lua_rawset(L, 1);
+		return 1;
+	}
+
+	lua_getglobal(L, "HTTPRequest");
+	if (!lua_istable(L, -1)) return 0;
+	lua_pushvalue(L, 2);
+	lua_gettable(L, -2);
+	return 1;
+}
+
+// ************************************************************************************
+void luaapp_open_request(struct lua_app* app) {
+	luaL_newmetatable(app->state, LUAAPP_REQUEST_META);
+	lua_pushcfunction(app->state, luaapp_request_index);
+	lua_setfield(app->state, -2, "__index");
+	lua_pop(app->state, 1);
+}
+
+// ************************************************************************************
+int32_t luaapp_push_task_result(lua_State* L, struct pool_task* task) {
+	if (task->error[0]) {
+		lua_pushnil(L);
+		lua_pushstring(L, task->error);
+		return 2;
+	}
+
+	if (task->kind == POOL_SLEEP) {
+		lua_pushboolean(L, 1);
+	} else {
+		lua_pushlstring(L, task->output, task->output_len);
+	}
+	return 1;
+}
+
+// ************************************************************************************
+// Called from a handler the task goes to the pool and the handler resumes
+// with its results; anywhere else, or without a pool, it runs right here.
+int luaapp_worker_run(lua_State* L, struct pool_task* task) {
+	struct lua_app* app = (struct lua_app*)lua_touserdata(L, lua_upvalueindex(1));
+	struct luaapp_call* call = *(struct luaapp_call**)lua_getextraspace(L);
+
+	if (app->pool && call && lua_isyieldable(L)) {
+		task->data = call;
+		pool_submit(app->pool, task);
+		lua_pushlightuserdata(L, &luaapp_task_sentinel);
+		return lua_yield(L, 1);
+	}
+
+	pool_task_run(task);
+	int32_t res = luaapp_push_task_result(L, task);
+	pool_task_free(task);
+	return res;
+}
+
+// ************************************************************************************
+// worker.readFile(path), the contents or nil and an error
+int luaapp_worker_read_file(lua_State* L) {
+	size_t len = 0;
+	const char* path = luaL_checklstring(L, 1, &len);
+	return luaapp_worker_run(L, pool_task_init(POOL_READ_FILE, path, len));
+}
+
+// ************************************************************************************
+// worker.sha256(data), the hex digest
+int luaapp_worker_sha256(lua_State* L) {
+	size_t len = 0;
+	const char* data = luaL_checklstring(L, 1, &len);
+	return luaapp_worker_run(L, pool_task_init(POOL_SHA256, data, len));
+}
+
+// ************************************************************************************
+// worker.gzip(data [, level])
+int luaapp_worker_gzip(lua_State* L) {
+	size_t len = 0;
+	const char* data = luaL_checklstring(L, 1, &len);
+	int32_t level = luaL_optinteger(L, 2, 0);
+
+	struct pool_task* task = pool_task_init(POOL_GZIP, data, len);
+	task->number = level;
+	return luaapp_worker_run(L, task);
+}
+
+// ************************************************************************************
+// worker.sleep(seconds)
+int luaapp_worker_sleep(lua_State* L) {
+	struct pool_task* task = pool_task_init(POOL_SLEEP, NULL, 0);
+	task->number = luaL_checknumber(L, 1);
+	return luaapp_worker_run(L, task);
+}
+
+// ************************************************************************************
+// worker.exchange(address, data [, timeout]), address is a unix socket path
+// or ip:port; the reply read until the peer closes
+int luaapp_worker_exchange(lua_State* L) {
+	size_t len = 0;
+	const char* target = luaL_checkstring(L, 1);
+	const char* data = luaL_checklstring(L, 2, &len);
+
+	struct pool_task* task = pool_task_init(POOL_EXCHANGE, data, len);
+	task->target = strdup(target);
+	task->number = luaL_optnumber(L, 3, 0);
+	return luaapp_worker_run(L, task);
+}
+
+// ************************************************************************************
+void luaapp_open_worker(struct lua_app* app) {
+	const luaL_Reg funcs[] = {
+		{ "readFile", luaapp_worker_read_file },
+		{ "sha256", luaapp_worker_sha256 },
+		{ "gzip", luaapp_worker_gzip },
+		{ "sleep", luaapp_worker_sleep },
+		{ "exchange", luaapp_worker_exchange },
+		{ NULL, NULL }
+	};
+
+	lua_newtable(app->state);
+	lua_pushlightuserdata(app->state, app);
+	luaL_setfuncs(app->state, funcs, 1);
+	lua_setglobal(app->state, "worker");
+}
+
 // ************************************************************************************
 void luaapp_dump_stack(struct lua_app* app) {
     int32_t top = lua_gettop(app->state);
@@ -176,25 +529,89 @@ int32_t luaapp_refcallback(struct lua_app* app, const char* name) {
 }
 
 // ************************************************************************************
-void luaapp_parse_query(struct lua_app* app, const char* query, int32_t len) {
-	char* query_copy = strndup(query, len);
-	char* p = NULL;
+// Pushes a query component with %xx and '+' decoded, straight from the
+// request buffer when there is nothing to decode.
+void luaapp_push_decoded(lua_State* L, const char* s, int32_t len) {
+	if (!url_needs_decode(s, len)) {
+		lua_pushlstring(L, s, len);
+		return;
+	}
 
-	while((p = strsep(&query_copy, "&\n"))) {
-		char *name = strtok(p, "=");
-		char* value = NULL;
+	luaL_Buffer b;
+	char* dest = luaL_buffinitsize(L, &b, len);
+	luaL_pushresultsize(&b, url_decode(s, len, dest));
+}
 
-		if (name && (value = strtok(NULL, "="))) {
-			// TODO: if value is numeric, pushnumber
-			// TODO: query params with same name will be replaced
+// ************************************************************************************
+// Fills the table on the top of the stack with the decoded parameters in one
+// pass. Parameters without a value get "", repeated ones become an array.
+void luaapp_parse_query_state(lua_State* L, const char* query, int32_t len) {
+	int32_t t = lua_gettop(L);
+	const char* end = query + len;
+
+	for(const char* p = query; p < end; ) {
+		const char* amp = memchr(p, '&', end - p);
+		if (!amp) amp = end;
+		const char* eq = memchr(p, '=', amp - p);
+		const char* key_end = eq ? eq : amp;
+
+		if (key_end > p) {
+			luaapp_push_decoded(L, p, key_end - p);
+			lua_pushvalue(L, -1);
+			lua_rawget(L, t);
+
+			int32_t type = lua_type(L, -1);
+			if (type == LUA_TNIL) {
+				lua_pop(L, 1);
+				luaapp_push_decoded(L, eq ? eq + 1 : amp, eq ? amp - eq - 1 : 0);
+				lua_rawset(L, t);
+			} else if (type == LUA_TSTRING) {
+				// the second value turns the parameter into an array
+				lua_createtable(L, 2, 0);
+				lua_insert(L, -2);
+				lua_rawseti(L, -2, 1);
+				luaapp_push_decoded(L, eq ? eq + 1 : amp, eq ? amp - eq - 1 : 0);
+				lua_rawseti(L, -2, 2);
+				lua_rawset(L, t);
+			} else {
+				luaapp_push_decoded(L, eq ? eq + 1 : amp, eq ? amp - eq - 1 : 0);
+				lua_rawseti(L, -2, lua_rawlen(L, -2) + 1);
+				lua_pop(L, 2);
+			}
+		}
 
-			lua_pushstring(app->state, name);
-			lua_pushstring(app->state, value);
-			lua_settable(app->state, -3);
+		p = amp + 1;
+	}
+}
+
+// ************************************************************************************
+void luaapp_parse_query(struct lua_app* app, const char* query, int32_t len) {
+	if (!app) return;
+	luaapp_parse_query_state(app->state, query, len);
+}
+
+// ************************************************************************************
+// Pushes the decoded values of one parameter without building the table,
+// returns how many there were.
+int32_t luaapp_query_values(lua_State* L, const char* query, int32_t len, const char* name, int32_t name_len) {
+	const char* end = query + len;
+	int32_t count = 0;
+
+	for(const char* p = query; p < end; ) {
+		const char* amp = memchr(p, '&', end - p);
+		if (!amp) amp = end;
+		const char* eq = memchr(p, '=', amp - p);
+		const char* key_end = eq ? eq : amp;
+
+		if (url_decode_equals(p, key_end - p, name, name_len) && lua_checkstack(L, 1)) {
+			luaapp_push_decoded(L, eq ? eq + 1 : amp, eq ? amp - eq - 1 : 0);
+			count++;
 		}
+
+		p = amp + 1;
 	}
 
-	free(query_copy);
+	return count;
 }
 
 // ************************************************************************************
@@ -202,8 +619,7 @@ void luaapp_push_request(struct lua_app* app, struct http_request_s* request) {
 	http_string_t str;
 
 	lua_newtable(app->state);
-	lua_getglobal(app->state, "HTTPRequest"); // TODO: optimize string lookup using ref?
-	lua_setmetatable(app->state, -2);
+	luaL_setmetatable(app->state, LUAAPP_REQUEST_META);
 
 	// request.method = xx
 	if (1) {
@@ -215,7 +631,7 @@ void luaapp_push_request(struct lua_app* app, struct http_request_s* request) {
 		}
 	}
 
-	// request.path + request.query + request.queryParams
+	// request.path + request.queryString
 	if (1) {
 		str = hs_get_token_string(request, HSH_TOK_TARGET);
 		if (str.buf) {
@@ -234,10 +650,9 @@ void luaapp_push_request(struct lua_app* app, struct http_request_s* request) {
 				lua_pushlstring(app->state, str.buf, query_pos);
 				lua_settable(app->state, -3);
 
-				// queryParams
-				lua_pushstring(app->state, "queryParams");
-				lua_newtable(app->state);
-				luaapp_parse_query(app, str.buf + query_pos + 1, str.len - query_pos - 1);
+				// queryString, queryParams is parsed from it on first access
+				lua_pushstring(app->state, "queryString");
+				lua_pushlstring(app->state, str.buf + query_pos + 1, str.len - query_pos - 1);
 				lua_settable(app->state, -3);
 
 			} else {
@@ -245,11 +660,6 @@ void luaapp_push_request(struct lua_app* app, struct http_request_s* request) {
 				lua_pushstring(app->state, "path");
 				lua_pushlstring(app->state, str.buf, str.len);
 				lua_settable(app->state, -3);
-
-				// queryParams
-				lua_pushstring(app->state, "queryParams");
-				lua_newtable(app->state);
-				lua_settable(app->state, -3);
 			}
 		}
 	}
@@ -271,8 +681,34 @@ void luaapp_push_request(struct lua_app* app, struct http_request_s* request) {
 		lua_settable(app->state, -3);
 	}
 
-	// TODO: request content
-	// TODO: contentJson?
+	// request.timing, milliseconds since the first byte of the request
+	if (http_request_traced(request)) {
+		static const char* phases[] = { "accept", "start", "headers", "handler" };
+		static const int32_t phase_ids[] = { HTTP_PHASE_ACCEPT, HTTP_PHASE_START, HTTP_PHASE_HEADERS, HTTP_PHASE_HANDLER };
+		int64_t start = http_request_phase_time(request, HTTP_PHASE_START);
+
+		lua_pushstring(app->state, "timing");
+		lua_newtable(app->state);
+		for(int32_t i=0;i<4;++i) {
+			int64_t t = http_request_phase_time(request, phase_ids[i]);
+			if (t == 0) continue;
+
+			lua_pushstring(app->state, phases[i]);
+			lua_pushnumber(app->state, (t - start) / 1e6);
+			lua_settable(app->state, -3);
+		}
+		lua_settable(app->state, -3);
+	}
+
+	// request.body, request.json is decoded from it on first access
+	if (1) {
+		str = http_request_body(request);
+		if (str.buf && str.len > 0) {
+			lua_pushstring(app->state, "body");
+			lua_pushlstring(app->state, str.buf, str.len);
+			lua_settable(app->state, -3);
+		}
+	}
 }
 
 // ************************************************************************************
@@ -304,7 +740,7 @@ void luaapp_push_response(struct lua_app* app) {
 }
 
 // ************************************************************************************
-void luaapp_pop_response(struct lua_app* app, struct http_request_s* request) {
+struct http_response_s* luaapp_pop_response(struct lua_app* app) {
 	struct http_response_s* response = http_response_init();
 	int32_t has_content_type = 0;
 
@@ -339,31 +775,118 @@ void luaapp_pop_response(struct lua_app* app, struct http_request_s* request) {
 		lua_pop(app->state, 1);
 	}
 
+	// json, encoded into the app buffer instead of the content
+	int32_t has_json = 0;
+	if (1) {
+		lua_pushstring(app->state, "json");
+		lua_gettable(app->state, -2);
+
+		if (!lua_isnil(app->state, -1)) {
+			char error[JSON_ERROR_MAX];
+			app->json.len = 0;
+			if (json_encode(app->state, -1, &app->json, error) == 0) {
+				has_json = 1;
+			} else {
+				log_error("[LUA] Cannot encode response.json: %s", error);
+				http_response_status(response, 500);
+			}
+		}
+
+		lua_pop(app->state, 1);
+	}
+
 	if (!has_content_type) {
-		http_response_header(response, "Content-Type", "text/plain");
+		http_response_header(response, "Content-Type", has_json ? "application/json" : "text/plain");
 	}
 
 	// content
-	if (1) {
+	if (has_json) {
+		http_response_body(response, app->json.data, app->json.len);
+	} else {
+		// binary safe, worker.gzip output goes out as it is
+		size_t len = 0;
 		lua_pushstring(app->state, "content");
 		lua_gettable(app->state, -2);
-		const char* content = luaapp_pop_string(app);
-		http_response_body(response, content, strlen(content));
+		const char* content = lua_tolstring(app->state, -1, &len);
+		http_response_body(response, content ? content : "", len);
+		lua_pop(app->state, 1);
 	}
 
 	lua_pop(app->state, 1);
 
-	// TODO: contentJson processing?
-
-	http_respond(request, response);
+	return response;
 }
 
 
 // ************************************************************************************
-int32_t luaapp_process_http(struct lua_app* app, int32_t callbackRef, struct http_request_s* request) {
+// response.cacheTTL, response.cacheStale and response.cacheKey of the response
+// table on the top of the stack
+void luaapp_read_cache_rule(struct lua_app* app, struct cache_rule* rule) {
+	rule->ttl = 0;
+	rule->stale = 0;
+	rule->spec[0] = 0;
+
+	lua_getfield(app->state, -1, "cacheTTL");
+	rule->ttl = lua_tonumber(app->state, -1);
+	lua_pop(app->state, 1);
+	if (rule->ttl <= 0) return;
+
+	lua_getfield(app->state, -1, "cacheStale");
+	rule->stale = lua_tonumber(app->state, -1);
+	lua_pop(app->state, 1);
+
+	// { query = { names }, headers = { names } } becomes "name,name;name,name"
+	lua_getfield(app->state, -1, "cacheKey");
+	if (lua_istable(app->state, -1)) {
+		static const char* lists[] = { "query", "headers" };
+		int32_t len = 0;
+
+		for(int32_t l=0;l<2;++l) {
+			if (l == 1) len += snprintf(rule->spec + len, CACHE_SPEC_MAX - len, ";");
+
+			lua_getfield(app->state, -1, lists[l]);
+			if (lua_istable(app->state, -1)) {
+				int32_t count = lua_rawlen(app->state, -1);
+				for(int32_t i=1;i<=count && len < CACHE_SPEC_MAX;++i) {
+					lua_rawgeti(app->state, -1, i);
+					const char* name = lua_tostring(app->state, -1);
+					if (name) len += snprintf(rule->spec + len, CACHE_SPEC_MAX - len, "%s%s", i > 1 ? "," : "", name);
+					lua_pop(app->state, 1);
+				}
+			}
+			lua_pop(app->state, 1);
+		}
+
+		// names cut short would key different responses alike
+		if (len >= CACHE_SPEC_MAX) rule->ttl = 0;
+	}
+	lua_pop(app->state, 1);
+}
+
+// ************************************************************************************
+// Pushes the response table, the handler and its arguments. Everything the
+// handler gets from the request is copied, so the request may be answered
+// before luaapp_end_http runs the handler. A form parsed while the body was
+// streamed becomes request.form.
+int32_t luaapp_begin_http(struct lua_app* app, int32_t callbackRef, struct http_request_s* request, struct router_match* match, struct form* form) {
 	if (!app) return -1;
 	if (!request) return -1;
 
+	// the handler runs in a coroutine so worker.* calls can suspend it
+	struct luaapp_call* call = app->calls;
+	if (call) {
+		app->calls = call->next;
+	} else {
+		call = (struct luaapp_call*)calloc(1, sizeof(struct luaapp_call));
+		call->app = app;
+		call->thread = lua_newthread(app->state);
+		call->ref = luaL_ref(app->state, LUA_REGISTRYINDEX);
+		*(struct luaapp_call**)lua_getextraspace(call->thread) = call;
+	}
+	call->data = NULL;
+	call->next = NULL;
+	app->current = call;
+
 	// first response
 	luaapp_push_response(app);
 
@@ -373,14 +896,129 @@ int32_t luaapp_process_http(struct lua_app* app, int32_t callbackRef, struct htt
 	// request
 	luaapp_push_request(app, request);
 
+	// request.params of the matched route
+	if (match) {
+		lua_pushstring(app->state, "params");
+		lua_createtable(app->state, 0, match->params_count);
+		for(int32_t i=0;i<match->params_count;++i) {
+			lua_pushstring(app->state, match->params[i].name);
+			lua_pushlstring(app->state, match->params[i].value, match->params[i].value_len);
+			lua_settable(app->state, -3);
+		}
+		lua_settable(app->state, -3);
+	}
+
+	if (form) {
+		lua_pushstring(app->state, "form");
+		form_push(app->state, form);
+		lua_rawset(app->state, -3);
+	}
+
 	// response dup
 	lua_pushvalue(app->state, -3);
 
-	// call
-	lua_pcall(app->state, 2, 0, 0);
+	lua_xmove(app->state, call->thread, 4);
+	return 0;
+}
+
+// ************************************************************************************
+// Runs the handler coroutine until it returns, fails or waits for a worker
+// task (NULL then). The response of a failed handler is a 500.
+struct http_response_s* luaapp_resume(struct lua_app* app, struct luaapp_call* call, int32_t nargs, struct cache_rule* rule) {
+	lua_State* co = call->thread;
+	int32_t nres = 0;
+
+	if (rule) rule->ttl = 0;
+
+	// follows the profiler, which hooks the main thread only; set again only
+	// when it changed, setting it restarts the instruction countdown and short
+	// handlers would never be sampled
+	if (lua_gethook(co) != lua_gethook(app->state) || lua_gethookmask(co) != lua_gethookmask(app->state) ||
+		lua_gethookcount(co) != lua_gethookcount(app->state)) {
+		lua_sethook(co, lua_gethook(app->state), lua_gethookmask(app->state), lua_gethookcount(app->state));
+	}
+
+	int32_t status = lua_resume(co, app->state, nargs, &nres);
+	if (status == LUA_YIELD && nres == 1 && lua_touserdata(co, -1) == &luaapp_task_sentinel) {
+		lua_pop(co, 1);
+		return NULL;
+	}
 
-	// read response
-	luaapp_pop_response(app, request);
+	if (status != LUA_OK) {
+		const char* err = status == LUA_YIELD ? "handler yielded outside of a worker call" : lua_tostring(co, -1);
+		log_error("[LUA] %s", err ? err : "error without a message");
 
+		// the coroutine is dead or stuck, left to the GC
+		*(struct luaapp_call**)lua_getextraspace(co) = NULL;
+		luaL_unref(app->state, LUA_REGISTRYINDEX, call->ref);
+		free(call);
+
+		struct http_response_s* response = http_response_init();
+		http_response_status(response, 500);
+		http_response_header(response, "Content-Type", "text/plain");
+		http_response_body(response, "Internal Server Error\n", 22);
+		return response;
+	}
+
+	// the response table is left at the bottom
+	lua_settop(co, 1);
+	lua_xmove(co, app->state, 1);
+	call->next = app->calls;
+	app->calls = call;
+
+	if (rule) luaapp_read_cache_rule(app, rule);
+	return luaapp_pop_response(app);
+}
+
+// ************************************************************************************
+// Runs the handler pushed by luaapp_begin_http and returns its response, a
+// 500 if it failed. The cache rule (if any) is filled from the response.
+// NULL means the handler waits for a worker task: the caller sets
+// app->current->data and gets the response through app->resumed.
+struct http_response_s* luaapp_end_http(struct lua_app* app, struct cache_rule* rule) {
+	struct http_response_s* response = luaapp_resume(app, app->current, 2, rule);
+	if (!response) app->suspended++;
+	return response;
+}
+
+// ************************************************************************************
+// Complete callback of the pool, resumes the handler that waits for the task.
+// After a reload that may be a handler of the replaced state.
+void luaapp_task_done(struct pool_task* task, void* data) {
+	struct luaapp_call* call = (struct luaapp_call*)task->data;
+	struct lua_app* app = call->app;
+	struct cache_rule rule;
+
+	int32_t nargs = luaapp_push_task_result(call->thread, task);
+	pool_task_free(task);
+
+	// the call is reused once the handler returned
+	void* call_data = call->data;
+	struct http_response_s* response = luaapp_resume(app, call, nargs, &rule);
+	if (response) {
+		app->suspended--;
+		app->resumed(call_data, response, &rule);
+	}
+}
+
+// ************************************************************************************
+int32_t luaapp_process_http(struct lua_app* app, int32_t callbackRef, struct http_request_s* request, struct router_match* match) {
+	if (luaapp_begin_http(app, callbackRef, request, match, NULL) < 0) return -1;
+
+	// a handler waiting for a worker is answered through app->resumed
+	struct http_response_s* response = luaapp_end_http(app, NULL);
+	if (response) http_respond(request, response);
 	return 0;
 }
+
+// ************************************************************************************
+int64_t luaapp_memory(struct lua_app* app) {
+	if (!app) return 0;
+	return (int64_t)lua_gc(app->state, LUA_GCCOUNT, 0) * 1024 + lua_gc(app->state, LUA_GCCOUNTB, 0);
+}
+
+// ************************************************************************************
+uint64_t luaapp_gc_cycles(struct lua_app* app) {
+	if (!app) return 0;
+	return app->gc_cycles;
+}
@@ -32,17 +32,61 @@
 
 #include <lua.h>
 
+#include "json.h"
+
+struct http_request_s;
+struct http_response_s;
+struct router_match;
+struct cache_rule;
+struct form;
+struct pool;
+struct pool_task;
+
+// A handler coroutine. It is suspended while a worker task it started runs;
+// data is the state of the caller to finish the request with.
+struct luaapp_call {
+	struct lua_app* app;
+	struct lua_State* thread;
+	int32_t ref;
+	void* data;
+	struct luaapp_call* next;
+};
+
 struct lua_app {
 	struct lua_State* state;
 	struct hashmap* vfs;
-};
+	uint64_t gc_cycles;
+	struct router* router;
+	struct json_buffer json;
 
-struct http_request_s;
+	// worker.* tasks run here, without it they block the loop
+	struct pool* pool;
+	// coroutines of finished handlers, reused
+	struct luaapp_call* calls;
+	// the handler of the last luaapp_begin_http
+	struct luaapp_call* current;
+	// handlers waiting for a worker task, the state stays until they finish
+	int32_t suspended;
+	// gets the response of a handler that was suspended
+	void (*resumed)(void* data, struct http_response_s* response, struct cache_rule* rule);
+};
 
 struct lua_app* luaapp_init(struct hashmap* vfs);
+void luaapp_free(struct lua_app* app);
 int32_t luaapp_runfile(struct lua_app* app, const char* path);
 int32_t luaapp_refcallback(struct lua_app* app, const char* name);
 
-int32_t luaapp_process_http(struct lua_app* app, int32_t callbackRef, struct http_request_s* req);
+void luaapp_parse_query(struct lua_app* app, const char* query, int32_t len);
+int32_t luaapp_query_values(lua_State* L, const char* query, int32_t len, const char* name, int32_t name_len);
+void luaapp_push_request(struct lua_app* app, struct http_request_s* request);
+void luaapp_push_response(struct lua_app* app);
+struct http_response_s* luaapp_pop_response(struct lua_app* app);
+
+int32_t luaapp_begin_http(struct lua_app* app, int32_t callbackRef, struct http_request_s* req, struct router_match* match, struct form* form);
+struct http_response_s* luaapp_end_http(struct lua_app* app, struct cache_rule* rule);
+void luaapp_task_done(struct pool_task* task, void* data);
+int32_t luaapp_process_http(struct lua_app* app, int32_t callbackRef, struct http_request_s* req, struct router_match* match);
+int64_t luaapp_memory(struct lua_app* app);
+uint64_t luaapp_gc_cycles(struct lua_app* app);
 
 #endif /* LUAAPP_H_ */
@@ -27,11 +27,14 @@
  *
  * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
 
+#define _GNU_SOURCE
 
 #include <stdio.h>
 #include <stdlib.h>
 
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/stat.h>
 #include <elf.h>
 #include <libelf.h>
@@ -46,13 +49,74 @@
 #include "luaapp.h"
 #include "utils.h"
 #include "log.h"
+#include "metrics.h"
+#include "profiler.h"
+#include "router.h"
+#include "cache.h"
+#include "form.h"
+#include "shdict.h"
+#include "pool.h"
+#include "timer.h"
+#include "upgrade.h"
 
 #define VFS_EMBED_BASE_ADDR 0x80000000
 
+// permissions of the -u socket file, the proxy connects as a member of the group
+#define UNIX_SOCKET_DEFAULT_MODE 0660
+
+// seconds a process replaced by an upgrade waits for its connections
+#define UPGRADE_DRAIN_TIMEOUT 60
+
+// getopt string of the options accepted in both standalone and embedded mode
+#define SERVER_OPTS "p:u:k:b:a:w:c:i:m:r:M:L:t:P:C:S:T:U:"
+
+struct app_options {
+	int32_t port;
+	const char* unix_path;
+	int32_t unix_mode;
+	int32_t backlog;
+	int32_t accept_budget;
+	int32_t defer_accept;
+	int32_t max_connections;
+	int32_t max_inflight;
+	int64_t max_memory;
+	int32_t retry_after;
+	const char* metrics_path;
+	const char* access_log;
+	int32_t trace_sample;
+	const char* profiler_path;
+	int64_t cache_size;
+	int64_t shared_size;
+	int32_t threads;
+	const char* upgrade_path;
+};
+
 static struct hashmap* g_vfs;
 static struct hashmap* g_mime;
 static struct lua_app* g_lua;
 static int32_t g_http_callback;
+static struct metrics* g_metrics;
+static const char* g_metrics_path;
+static struct profiler* g_profiler;
+static const char* g_profiler_path;
+static volatile sig_atomic_t g_profiler_toggle;
+static struct cache* g_cache;
+static struct shdict* g_shared;
+static struct pool* g_pool;
+static struct timers* g_timers;
+static const char* g_data_path;
+static volatile sig_atomic_t g_reload;
+static int32_t g_upgrade_fd = -1;
+static time_t g_drain_deadline;
+
+// A Lua state replaced by a reload, with the VFS it was loaded from (NULL when
+// the VFS is kept), until no handler is suspended in it.
+struct lua_retired {
+	struct lua_app* app;
+	struct hashmap* vfs;
+	struct lua_retired* next;
+};
+static struct lua_retired* g_retired;
 
 static volatile char* g_emb_mark = "--$$NO_EMB$$--";
 
@@ -65,15 +129,575 @@ int32_t is_embedded() {
 	}
 }
 
+// ************************************************************************************
+// Returns 1 if the query string has the parameter, its value goes to value (if any).
+int32_t query_has_param(const char* query, const char* name, int32_t* value) {
+	int32_t name_len = strlen(name);
+
+	for(const char* p = query; p && *p; p = strchr(p, '&'), p = p ? p + 1 : NULL) {
+		if (strncmp(p, name, name_len) != 0) continue;
+		if (p[name_len] == '=') {
+			if (value) *value = atoi(p + name_len + 1);
+			return 1;
+		}
+		if (p[name_len] == '&' || p[name_len] == 0) return 1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+// ?start[=period] and ?stop control the profiler, ?reset drops the samples,
+// without parameters the samples are returned as collapsed stacks.
+void handle_profiler_request(struct http_request_s* request, const char* query) {
+	char status[128] = { 0 };
+	char* body = NULL;
+	int32_t len = 0;
+	int32_t period = 0;
+
+	if (query_has_param(query, "start", &period)) {
+		profiler_start(g_profiler, period);
+		snprintf(status, sizeof(status), "profiler started, sampling every %d instructions\n", g_profiler->period);
+	} else if (query_has_param(query, "stop", NULL)) {
+		profiler_stop(g_profiler);
+		snprintf(status, sizeof(status), "profiler stopped, %llu samples\n", (unsigned long long)g_profiler->samples);
+	}
+	if (query_has_param(query, "reset", NULL)) {
+		profiler_reset(g_profiler);
+		if (!status[0]) snprintf(status, sizeof(status), "profiler reset\n");
+	}
+
+	struct http_response_s* response = http_response_init();
+	http_response_status(response, 200);
+	http_response_header(response, "Content-Type", "text/plain");
+	if (status[0]) {
+		http_response_body(response, status, strlen(status));
+	} else {
+		body = profiler_dump(g_profiler, &len);
+		http_response_body(response, body, len);
+	}
+	http_respond(request, response);
+	free(body);
+}
+
+// ************************************************************************************
+void handle_profiler_signal(int32_t sig) {
+	g_profiler_toggle = 1;
+}
+
+// ************************************************************************************
+// SIGUSR2 starts the profiler, the next one stops it and writes the samples out.
+void handle_profiler_toggle() {
+	if (profiler_running(g_profiler)) {
+		char path[64];
+		sprintf(path, "emb-http-lua.%d.folded", getpid());
+
+		profiler_stop(g_profiler);
+		if (profiler_dump_file(g_profiler, path) == 0) {
+			log_info("[LUA] Profiler stopped, %llu samples written to %s", (unsigned long long)g_profiler->samples, path);
+		}
+		profiler_reset(g_profiler);
+	} else {
+		profiler_start(g_profiler, 0);
+		log_info("[LUA] Profiler started, sampling every %d instructions", g_profiler->period);
+	}
+}
+
+// ************************************************************************************
+void handle_reload_signal(int32_t sig) {
+	g_reload = 1;
+}
+
+void handle_lua_resumed(void* data, struct http_response_s* response, struct cache_rule* rule);
+
+// ************************************************************************************
+// Creates a Lua state and runs /lib.lua and /main.lua in it, at the start and
+// on reload. The reference of __httpHandle goes to callback.
+struct lua_app* load_lua_app(struct hashmap* vfs, int32_t* callback) {
+	struct lua_app* app = luaapp_init(vfs);
+	if (!app) {
+		log_error("[LUA] Cannot init lua");
+		return NULL;
+	}
+
+	if (g_shared) shdict_open(app->state, g_shared);
+	timers_open(app->state, g_timers);
+	app->pool = g_pool;
+	app->resumed = handle_lua_resumed;
+
+	if (luaapp_runfile(app, "/lib.lua") < 0) {
+		log_error("[VFS] Cannot run /lib.lua");
+		timers_drop(g_timers, app->state);
+		luaapp_free(app);
+		return NULL;
+	}
+
+	if (luaapp_runfile(app, "/main.lua") < 0) {
+		log_error("Cannot run /main.lua");
+		timers_drop(g_timers, app->state);
+		luaapp_free(app);
+		return NULL;
+	}
+
+	// callback, optional when main.lua registers routes
+	*callback = luaapp_refcallback(app, "__httpHandle");
+	if (*callback < 0 && app->router->routes == 0) {
+		log_error("[LUA] Cannot ref __httpHandle function");
+		timers_drop(g_timers, app->state);
+		luaapp_free(app);
+		return NULL;
+	}
+	if (app->router->routes > 0) {
+		log_info("[LUA] Routing %d routes%s", app->router->routes, *callback < 0 ? "" : ", the rest to __httpHandle");
+	}
+
+	return app;
+}
+
+// ************************************************************************************
+// Closes the replaced states no handler is suspended in anymore.
+void free_retired() {
+	struct lua_retired** p = &g_retired;
+	while (*p) {
+		struct lua_retired* r = *p;
+		if (r->app->suspended > 0) {
+			p = &r->next;
+			continue;
+		}
+
+		*p = r->next;
+		// nothing scheduled in the state may outlive it
+		timers_drop(g_timers, r->app->state);
+		luaapp_free(r->app);
+		vfs_free(r->vfs);
+		free(r);
+		log_info("[LUA] Closed the replaced Lua state");
+	}
+}
+
+// ************************************************************************************
+// Memory the server counts against its limit besides its own: the Lua state,
+// the cache and the uploads being parsed.
+void report_memory(struct http_server_s* server) {
+	http_server_set_external_memory(server, luaapp_memory(g_lua) + cache_memory(g_cache) + form_memory());
+}
+
+// ************************************************************************************
+// Swaps in a fresh Lua state between two requests. Suspended handlers of the
+// old state finish in it, it is closed after them; a state that fails to load
+// leaves the running one in place.
+void handle_reload(struct http_server_s* server) {
+	struct hashmap* vfs = g_vfs;
+	int32_t callback = LUA_NOREF;
+
+	// the data dir is scanned again for new files and changed sizes
+	if (g_data_path && vfs_init_fs(&vfs, g_data_path) < 0) {
+		log_error("[VFS] Cannot scan %s, reload cancelled", g_data_path);
+		return;
+	}
+
+	struct lua_app* app = load_lua_app(vfs, &callback);
+	if (!app) {
+		if (vfs != g_vfs) vfs_free(vfs);
+		log_error("[LUA] Reload failed, the running code stays");
+		return;
+	}
+
+	struct lua_retired* retired = (struct lua_retired*)malloc(sizeof(struct lua_retired));
+	retired->app = g_lua;
+	retired->vfs = vfs != g_vfs ? g_vfs : NULL;
+	retired->next = g_retired;
+	g_retired = retired;
+	timers_retire(g_timers, g_lua->state);
+
+	// the profiler follows, hooked into the new state
+	int32_t profiling = profiler_running(g_profiler);
+	if (profiling) profiler_stop(g_profiler);
+	g_profiler->app = app;
+	if (profiling) profiler_start(g_profiler, g_profiler->period);
+
+	g_lua = app;
+	g_vfs = vfs;
+	g_http_callback = callback;
+	cache_clear(g_cache);
+	report_memory(server);
+	log_info("[LUA] Reloaded");
+
+	free_retired();
+}
+
+// ************************************************************************************
+// Signals are acted upon here, on the event loop.
+void handle_tick(struct http_server_s* server) {
+	if (g_profiler_toggle) {
+		g_profiler_toggle = 0;
+		handle_profiler_toggle();
+	}
+
+	if (g_reload) {
+		g_reload = 0;
+		handle_reload(server);
+	}
+
+	if (g_retired) free_retired();
+
+	if (g_drain_deadline) {
+		int32_t open = http_server_stats(server)->connections;
+		if (open == 0 || time(NULL) >= g_drain_deadline) {
+			log_info("[NET] Drained, exiting with %d connections open", open);
+			exit(0);
+		}
+	}
+}
+
+// ************************************************************************************
+// A new process connected to the upgrade socket: it gets the listening socket
+// and accepts from now on, this one finishes the requests it has and exits.
+void handle_upgrade(void* data) {
+	struct http_server_s* server = (struct http_server_s*)data;
+	if (g_drain_deadline) return;
+	if (!upgrade_send(g_upgrade_fd, http_server_listen_fd(server))) return;
+
+	// the new process has bound the path again, nobody connects here anymore
+	close(g_upgrade_fd);
+	http_server_drain(server);
+	g_drain_deadline = time(NULL) + UPGRADE_DRAIN_TIMEOUT;
+	log_info("[NET] Handed the listening socket over, draining %d connections", http_server_stats(server)->connections);
+}
+
+// ************************************************************************************
+// 404 or 405 for requests no route takes, answered without entering Lua.
+void handle_router_miss(struct http_request_s* request, int32_t route, struct router_match* match) {
+	struct http_response_s* response = http_response_init();
+	http_response_header(response, "Content-Type", "text/plain");
+	if (route == ROUTER_METHOD_NOT_ALLOWED) {
+		http_response_status(response, 405);
+		http_response_header(response, "Allow", match->allow);
+		http_response_body(response, "Method Not Allowed\n", 19);
+	} else {
+		http_response_status(response, 404);
+		http_response_body(response, "Not Found\n", 10);
+	}
+	http_respond(request, response);
+	metrics_count_handled(g_metrics, METRICS_KIND_ROUTER);
+}
+
+// ************************************************************************************
+// Reads a chunked (411) or too large (413) body Lua cannot be given as
+// request.body to its end, so its bytes are not taken for the next request,
+// and refuses it.
+void handle_body_refused(struct http_request_s* request) {
+	if (http_request_chunk(request).len > 0) {
+		http_request_read_chunk(request, handle_body_refused);
+		return;
+	}
+
+	struct http_response_s* response = http_response_init();
+	http_response_header(response, "Content-Type", "text/plain");
+	if (http_request_header(request, "Transfer-Encoding").buf) {
+		http_response_status(response, 411);
+		http_response_body(response, "Length Required\n", 16);
+	} else {
+		http_response_status(response, 413);
+		http_response_body(response, "Payload Too Large\n", 18);
+	}
+	http_respond(request, response);
+	metrics_count_handled(g_metrics, METRICS_KIND_ROUTER);
+}
+
+// A request handled by Lua. It moves to the heap while the body of an upload
+// is read, when the handler waits for a worker task or while the request
+// waits for a pending miss of its cache key; request is NULL once answered (a
+// cache refresh) or when the client went away meanwhile.
+struct lua_call {
+	struct http_request_s* request;
+	struct http_server_s* server;
+	struct form* form;
+	int32_t suspended;
+	// an upload whose body is only read to its end, form_feed failed
+	int32_t rejected;
+	// waits for the pending miss of flight, chained in its waiters by next
+	int32_t waiting;
+	// key of the pending miss this request runs or waits for
+	char* flight;
+	struct lua_call* next;
+	int32_t cached;
+	int32_t cacheable;
+	char* query_path;
+	const char* query;
+	int32_t query_len;
+	char key[CACHE_KEY_MAX];
+	char spec[CACHE_SPEC_MAX];
+	int64_t lua_start;
+};
+
+void handle_upload_chunk(struct http_request_s* request);
+void handle_lua_request(struct http_request_s* request, http_string_t str, int32_t ql, const char* query_path, struct form* form, int32_t join);
+
+// ************************************************************************************
+// The handler of a pending miss finished: the requests waiting for it are
+// answered from the cache entry it left, or run their own handler.
+void handle_flight_done(const char* key, const char* uncacheable) {
+	struct lua_call* waiter = (struct lua_call*)cache_flight_end(g_cache, key, uncacheable);
+	while (waiter) {
+		struct lua_call* next = waiter->next;
+		struct http_request_s* request = waiter->request;
+
+		http_request_set_userdata(request, NULL);
+		http_string_t str = hs_get_token_string(request, HSH_TOK_TARGET);
+		handle_lua_request(request, str, strlen(waiter->query_path), waiter->query_path, NULL, 0);
+
+		free(waiter->query_path);
+		free(waiter->flight);
+		free(waiter);
+		waiter = next;
+	}
+}
+
+// ************************************************************************************
+// Sends (or caches) the response of a handler, right away or once resumed.
+void handle_lua_done(struct lua_call* call, struct http_response_s* response, struct cache_rule* rule) {
+	// path of a response that was not cached, when the client is still there
+	const char* uncacheable = NULL;
+
+	if (call->cached == CACHE_REFRESH) {
+		if (rule->ttl > 0 && strcmp(rule->spec, call->spec) == 0) {
+			cache_store(g_cache, call->query_path, call->key, rule, response);
+		} else {
+			cache_refresh_done(g_cache, call->key);
+		}
+		http_response_free(response);
+	} else if (call->request) {
+		if (call->cacheable && rule->ttl > 0 && cache_key(call->query_path, call->query, call->query_len, rule->spec, call->request, call->key) >= 0) {
+			cache_store(g_cache, call->query_path, call->key, rule, response);
+		} else {
+			uncacheable = call->query_path;
+		}
+		if (call->suspended) http_request_set_userdata(call->request, NULL);
+		http_respond(call->request, response);
+		metrics_count_handled(g_metrics, METRICS_KIND_LUA);
+	} else {
+		http_response_free(response);
+	}
+
+	if (g_metrics) {
+		metrics_record(g_metrics, METRICS_PHASE_LUA, metrics_now() - call->lua_start);
+	}
+	form_free(call->form);
+	report_memory(call->server);
+	if (call->suspended) {
+		if (call->flight) handle_flight_done(call->flight, uncacheable);
+		free(call->flight);
+		free(call->query_path);
+		free(call);
+	}
+}
+
+// ************************************************************************************
+// Resumed handler of a request that waited for a worker task.
+void handle_lua_resumed(void* data, struct http_response_s* response, struct cache_rule* rule) {
+	handle_lua_done((struct lua_call*)data, response, rule);
+}
+
+// ************************************************************************************
+// Routes to Lua: a matched route or __httpHandle, through the response cache.
+// The form (if any) is freed when the handler is done. With join a request
+// whose cache key misses while a handler for it waits for a worker task waits
+// for that instead of running the handler again.
+void handle_lua_request(struct http_request_s* request, http_string_t str, int32_t ql, const char* query_path, struct form* form, int32_t join) {
+	// routes registered from Lua, the rest (a path routed only for other
+	// methods too) goes to __httpHandle if there is one
+	struct router_match match;
+	http_string_t method = http_request_method(request);
+	int32_t route = router_match(g_lua->router, method.buf, method.len, str.buf, ql, &match);
+	if (route != ROUTER_FOUND && g_http_callback == LUA_NOREF) {
+		handle_router_miss(request, route, &match);
+		form_free(form);
+		return;
+	}
+
+	// multipart uploads too large to buffer are parsed while they are read,
+	// big parts going to temporary files, and Lua runs when the body is done
+	if (!form && http_request_has_flag(request, HTTP_FLG_STREAMED)) {
+		char boundary[FORM_BOUNDARY_MAX + 1];
+		http_string_t ct = http_request_header(request, "Content-Type");
+		http_string_t cl = http_request_header(request, "Content-Length");
+		http_string_t te = http_request_header(request, "Transfer-Encoding");
+
+		if (te.buf || (cl.buf && cl.len > 0 && cl.buf[0] != '0')) {
+			if (ct.buf && form_boundary(ct.buf, ct.len, boundary) > 0) {
+				struct lua_call* upload = (struct lua_call*)calloc(1, sizeof(struct lua_call));
+				upload->form = form_init(boundary, 0);
+				http_request_set_userdata(request, upload);
+				http_request_read_chunk(request, handle_upload_chunk);
+				return;
+			}
+
+			http_request_read_chunk(request, handle_body_refused);
+			return;
+		}
+	}
+
+	int32_t handler = route == ROUTER_FOUND ? match.handler : g_http_callback;
+	struct router_match* params = route == ROUTER_FOUND ? &match : NULL;
+	struct lua_call call;
+	call.request = request;
+	call.form = form;
+	call.suspended = 0;
+	call.waiting = 0;
+	call.flight = NULL;
+	call.next = NULL;
+	call.spec[0] = 0;
+	call.query_path = (char*)query_path;
+	call.query = ql < str.len ? str.buf + ql + 1 : NULL;
+	call.query_len = ql < str.len ? str.len - ql - 1 : 0;
+	call.cacheable = g_cache && query_path && method.len == 3 && memcmp(method.buf, "GET", 3) == 0;
+
+	// responses cached by earlier requests are served like static files
+	struct cache_entry* entry = NULL;
+	call.cached = call.cacheable ? cache_lookup(g_cache, query_path, call.query, call.query_len, request, call.key, call.spec, &entry) : CACHE_MISS;
+	if (call.cached == CACHE_FRESH || call.cached == CACHE_STALE) {
+		http_respond(request, cache_response(entry));
+		metrics_count_handled(g_metrics, METRICS_KIND_CACHE);
+		form_free(form);
+		return;
+	}
+
+	// a miss is known by its cache key, or by the whole query while the spec
+	// of the path is not learned yet
+	char flight[CACHE_KEY_MAX];
+	int32_t single = join && !form && call.cached == CACHE_MISS && call.cacheable &&
+		cache_key(query_path, call.query, call.query_len, call.spec, request, flight) >= 0;
+	struct cache_flight* pending = single ? cache_flight_get(g_cache, flight) : NULL;
+	if (pending) {
+		struct lua_call* waiter = (struct lua_call*)calloc(1, sizeof(struct lua_call));
+		waiter->request = request;
+		waiter->waiting = 1;
+		waiter->flight = strdup(flight);
+		waiter->query_path = strdup(query_path);
+		waiter->next = (struct lua_call*)pending->waiters;
+		pending->waiters = waiter;
+		http_request_set_userdata(request, waiter);
+		return;
+	}
+
+	// request may be already freed after the response, so grab the server first
+	call.server = http_request_server(request);
+	call.lua_start = g_metrics ? metrics_now() : 0;
+	struct cache_rule rule;
+
+	luaapp_begin_http(g_lua, handler, request, params, form);
+	if (call.cached == CACHE_REFRESH) {
+		// the stale response goes out first, this request only refreshes the entry
+		http_respond(request, cache_response(entry));
+		http_respond_flush(request);
+		metrics_count_handled(g_metrics, METRICS_KIND_CACHE);
+		call.request = NULL;
+	}
+
+	struct http_response_s* response = luaapp_end_http(g_lua, call.cacheable ? &rule : NULL);
+	if (response) {
+		handle_lua_done(&call, response, &rule);
+		return;
+	}
+
+	// waits for a worker task, handle_lua_resumed finishes it
+	struct lua_call* suspended = (struct lua_call*)malloc(sizeof(struct lua_call));
+	*suspended = call;
+	suspended->suspended = 1;
+	suspended->query_path = query_path ? strdup(query_path) : NULL;
+	if (single && cache_flight_begin(g_cache, query_path, flight)) {
+		// later requests of the key wait for this handler, see handle_flight_done
+		suspended->flight = strdup(flight);
+	}
+	g_lua->current->data = suspended;
+	if (suspended->request) http_request_set_userdata(suspended->request, suspended);
+}
+
+// ************************************************************************************
+// Feeds the streamed body of an upload to its form parser.
+void handle_upload_chunk(struct http_request_s* request) {
+	struct lua_call* upload = (struct lua_call*)http_request_userdata(request);
+	struct form* form = upload->form;
+	struct http_server_s* server = http_request_server(request);
+	http_string_t chunk = http_request_chunk(request);
+
+	if (chunk.len > 0) {
+		// after the first error the rest of the body is only read to its end
+		// before the 400 or 413, it is not parsed anymore
+		if (!upload->rejected && form_feed(form, chunk.buf, chunk.len) < 0) upload->rejected = 1;
+		report_memory(server);
+		http_request_read_chunk(request, handle_upload_chunk);
+		return;
+	}
+
+	http_request_set_userdata(request, NULL);
+	free(upload);
+	int32_t res = form_finish(form);
+	if (res < 0) {
+		struct http_response_s* response = http_response_init();
+		if (res == -2) {
+			http_response_status(response, 413);
+			http_response_header(response, "Content-Type", "text/plain");
+			http_response_body(response, "Payload Too Large\n", 18);
+		} else {
+			http_response_status(response, 400);
+			http_response_header(response, "Content-Type", "text/plain");
+			http_response_body(response, "Bad Request\n", 12);
+		}
+		http_respond(request, response);
+		form_free(form);
+		report_memory(server);
+		return;
+	}
+
+	http_string_t str = hs_get_token_string(request, HSH_TOK_TARGET);
+	int32_t ql = str.len;
+	for(int32_t i=0;i<str.len;++i) {
+		if (str.buf[i] == '?') {
+			ql = i;
+			break;
+		}
+	}
+
+	char* query_path = strndup(str.buf, ql);
+	handle_lua_request(request, str, ql, query_path, form, 1);
+	free(query_path);
+}
+
+// ************************************************************************************
+// The client went away during an upload, while its handler was suspended or
+// while it waited for a pending miss; a suspended handler still runs to its
+// end, its response is dropped.
+void handle_upload_abort(struct http_request_s* request) {
+	struct lua_call* call = (struct lua_call*)http_request_userdata(request);
+	if (call->suspended) {
+		call->request = NULL;
+	} else if (call->waiting) {
+		struct cache_flight* pending = cache_flight_get(g_cache, call->flight);
+		struct lua_call** p = (struct lua_call**)&pending->waiters;
+		while (*p != call) p = &(*p)->next;
+		*p = call->next;
+		free(call->query_path);
+		free(call->flight);
+		free(call);
+	} else {
+		form_free(call->form);
+		free(call);
+		report_memory(http_request_server(request));
+	}
+}
+
 // ************************************************************************************
 void handle_request(struct http_request_s* request) {
 	char* query_path = NULL;
+	http_string_t str = { 0 };
+	int32_t ql = 0;
 
 	// extract path from query
 	if (1) {
-		http_string_t str = hs_get_token_string(request, HSH_TOK_TARGET);
+		str = hs_get_token_string(request, HSH_TOK_TARGET);
 		if (str.buf) {
-			int32_t ql = str.len;
+			ql = str.len;
 			for(int32_t i=0;i<str.len;++i) {
 				if (str.buf[i] == '?') {
 					ql = i;
@@ -84,6 +708,31 @@ void handle_request(struct http_request_s* request) {
 		}
 	}
 
+	// metrics endpoint
+	if (query_path && g_metrics_path && strcmp(query_path, g_metrics_path) == 0) {
+		int32_t len = 0;
+		char* body = metrics_render(g_metrics, http_request_server(request), luaapp_memory(g_lua), luaapp_gc_cycles(g_lua), &len);
+		metrics_count_handled(g_metrics, METRICS_KIND_METRICS);
+
+		struct http_response_s* response = http_response_init();
+		http_response_status(response, 200);
+		http_response_header(response, "Content-Type", "text/plain; version=0.0.4");
+		http_response_body(response, body, len);
+		http_respond(request, response);
+		free(body);
+		free(query_path);
+		return;
+	}
+
+	// profiler endpoint
+	if (query_path && g_profiler_path && strcmp(query_path, g_profiler_path) == 0) {
+		char* query = ql < str.len ? strndup(str.buf + ql + 1, str.len - ql - 1) : NULL;
+		handle_profiler_request(request, query);
+		free(query);
+		free(query_path);
+		return;
+	}
+
 	// check file from vfs
 	if (query_path) {
 		struct vfs_buffer buf;
@@ -102,16 +751,43 @@ void handle_request(struct http_request_s* request) {
 			}
 			http_response_body(response, buf.data, buf.len);
 			http_respond(request, response);
+			metrics_count_handled(g_metrics, METRICS_KIND_STATIC);
 			vfs_buffer_free(&buf);
 			free(query_path);
 			return;
 		}
 	}
 
-	luaapp_process_http(g_lua, g_http_callback, request);
+	handle_lua_request(request, str, ql, query_path, NULL, 1);
 	free(query_path);
 }
 
+// ************************************************************************************
+void handle_request_done(struct http_request_s* request) {
+	metrics_record_response(g_metrics, request);
+
+	if (log_access_enabled()) {
+		http_string_t line = http_request_line(request);
+		int64_t start = http_request_phase_time(request, HTTP_PHASE_START);
+		int64_t done = http_request_phase_time(request, HTTP_PHASE_DONE);
+
+		if (http_request_traced(request)) {
+			int64_t headers = http_request_phase_time(request, HTTP_PHASE_HEADERS);
+			int64_t handler = http_request_phase_time(request, HTTP_PHASE_HANDLER);
+			int64_t respond = http_request_phase_time(request, HTTP_PHASE_RESPOND);
+			int64_t write = http_request_phase_time(request, HTTP_PHASE_WRITE);
+
+			log_access("%.*s %d %lld %.3fms head=%.3f wait=%.3f handler=%.3f serialize=%.3f write=%.3f", line.len, line.buf,
+				http_request_status(request), (long long)http_request_bytes_sent(request), (done - start) / 1e6,
+				(headers - start) / 1e6, (handler - headers) / 1e6, (respond - handler) / 1e6,
+				(write - respond) / 1e6, (done - write) / 1e6);
+		} else {
+			log_access("%.*s %d %lld %.3fms", line.len, line.buf, http_request_status(request),
+				(long long)http_request_bytes_sent(request), (done - start) / 1e6);
+		}
+	}
+}
+
 // ************************************************************************************
 uint64_t align(uint64_t val) {
 	uint64_t r = val % 4096;
@@ -233,27 +909,149 @@ int self_pack(char* dest) {
 void print_usage(char* app_name) {
 	if (is_embedded()) {
 		printf("Usage:\n");
-		printf("  ./%s -p port\n", app_name);
+		printf("  ./%s -p port [server options]\n", app_name);
 	} else {
 		printf("Usage:\n");
 		printf("  Run webserver from data_dir\n");
-		printf("    %s -d data_dir -p port \n", app_name);
+		printf("    %s -d data_dir -p port [server options]\n", app_name);
 		printf("\n");
 		printf("  Self-pack datadir and executable to output_path\n");
 		printf("    %s -d data_dir -o output_path\n", app_name);
 	}
+	printf("\n");
+	printf("Server options:\n");
+	printf("  -u path      listen on a unix socket at path instead of the port, -p is then not needed\n");
+	printf("  -k mode      permissions of the -u socket file, octal (default %04o)\n", UNIX_SOCKET_DEFAULT_MODE);
+	printf("  -b backlog   listen queue length (default %d)\n", HTTP_LISTEN_BACKLOG);
+	printf("  -a count     connections accepted per event loop wakeup, 0 = unlimited (default %d)\n", HTTP_ACCEPT_BUDGET);
+	printf("  -w seconds   wake up only when the connection has data (TCP_DEFER_ACCEPT), 0 = off\n");
+	printf("  -c count     maximum open connections, 0 = unlimited (default 0)\n");
+	printf("  -i count     maximum requests in flight, 0 = unlimited (default 0)\n");
+	printf("  -m megabytes maximum memory of buffers and lua heap, 0 = unlimited (default %lld)\n", (long long)(HTTP_MAX_TOTAL_EST_MEM_USAGE >> 20));
+	printf("  -r seconds   Retry-After of 503 responses when overloaded, -1 = close without response (default %d)\n", HTTP_SHED_RETRY_AFTER);
+	printf("  -M path      serve Prometheus metrics under path, e.g. /__metrics (default off)\n");
+	printf("  -L file      write an access log to file, - = stderr (default off)\n");
+	printf("  -P path      serve the Lua profiler under path, e.g. /__profile (default off)\n");
+	printf("  -C megabytes size of the cache of Lua responses, 0 = off (default %lld)\n", (long long)(CACHE_DEFAULT_SIZE >> 20));
+	printf("  -S megabytes size of the shared dictionary of Lua, 0 = off (default %lld)\n", (long long)(SHDICT_DEFAULT_SIZE >> 20));
+	printf("  -T count     worker threads for blocking Lua calls, 0 = run them inline (default %d)\n", POOL_DEFAULT_THREADS);
+	printf("  -U path      unix socket to take the listening socket over from a running process and hand it to the next one (default off)\n");
+	printf("  -t count     trace every count-th request: Server-Timing header, request.timing, phases in the access log (default 0 = off)\n");
+}
+
+// ************************************************************************************
+void init_options(struct app_options* opts) {
+	opts->port = 0;
+	opts->unix_path = NULL;
+	opts->unix_mode = UNIX_SOCKET_DEFAULT_MODE;
+	opts->backlog = HTTP_LISTEN_BACKLOG;
+	opts->accept_budget = HTTP_ACCEPT_BUDGET;
+	opts->defer_accept = 0;
+	opts->max_connections = 0;
+	opts->max_inflight = 0;
+	opts->max_memory = HTTP_MAX_TOTAL_EST_MEM_USAGE;
+	opts->retry_after = HTTP_SHED_RETRY_AFTER;
+	opts->metrics_path = NULL;
+	opts->access_log = NULL;
+	opts->trace_sample = 0;
+	opts->profiler_path = NULL;
+	opts->cache_size = CACHE_DEFAULT_SIZE;
+	opts->shared_size = SHDICT_DEFAULT_SIZE;
+	opts->threads = POOL_DEFAULT_THREADS;
+	opts->upgrade_path = NULL;
 }
 
 // ************************************************************************************
-int app_run(int port) {
+int32_t parse_server_option(struct app_options* opts, int32_t opt, const char* arg) {
+	switch(opt) {
+		case 'p':
+			opts->port = atoi(arg);
+			return 1;
+
+		case 'u':
+			opts->unix_path = arg;
+			return 1;
+
+		case 'k':
+			opts->unix_mode = (int32_t)strtol(arg, NULL, 8);
+			return 1;
+
+		case 'b':
+			opts->backlog = atoi(arg);
+			return 1;
+
+		case 'a':
+			opts->accept_budget = atoi(arg);
+			return 1;
+
+		case 'w':
+			opts->defer_accept = atoi(arg);
+			return 1;
+
+		case 'c':
+			opts->max_connections = atoi(arg);
+			return 1;
+
+		case 'i':
+			opts->max_inflight = atoi(arg);
+			return 1;
+
+		case 'm':
+			opts->max_memory = (int64_t)atoll(arg) << 20;
+			return 1;
+
+		case 'r':
+			opts->retry_after = atoi(arg);
+			return 1;
+
+		case 'M':
+			opts->metrics_path = arg;
+			return 1;
+
+		case 'L':
+			opts->access_log = arg;
+			return 1;
+
+		case 't':
+			opts->trace_sample = atoi(arg);
+			return 1;
+
+		case 'P':
+			opts->profiler_path = arg;
+			return 1;
+
+		case 'C':
+			opts->cache_size = (int64_t)atoll(arg) << 20;
+			return 1;
+
+		case 'S':
+			opts->shared_size = (int64_t)atoll(arg) << 20;
+			return 1;
+
+		case 'T':
+			opts->threads = atoi(arg);
+			return 1;
+
+		case 'U':
+			opts->upgrade_path = arg;
+			return 1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+int app_run(struct app_options* opts) {
 	struct vfs_buffer buf;
-	int32_t res = 0;
 
-    if (port <= 0) {
+    if (opts->port <= 0 && !opts->unix_path) {
     	log_error("Missing -p argument");
     	return 1;
     }
 
+	if (log_start(opts->access_log) < 0) {
+		return 1;
+	}
+
 	// mime load
 	if (1) {
 		vfs_get(g_vfs, "/mime.types", &buf);
@@ -266,42 +1064,111 @@ int app_run(int port) {
 		vfs_buffer_free(&buf);
 	}
 
-	// lua init
-	g_lua = luaapp_init(g_vfs);
-	if (!g_lua) {
-		log_error("[LUA] Cannot init lua");
+	// shared, mapped before anything could fork so every process sees it
+	if (opts->shared_size > 0) {
+		g_shared = shdict_init(opts->shared_size);
+		if (!g_shared) {
+			log_error("[LUA] Cannot map the shared dictionary of %lld bytes", (long long)opts->shared_size);
+			return 1;
+		}
+	}
+
+	// timer.after/every, /main.lua may schedule them already
+	g_timers = timers_init();
+	if (!g_timers) {
+		log_error("[LUA] Cannot create the timer descriptor");
 		return 1;
 	}
 
-	// lua load /lib.lua
-	if (1) {
-		res = luaapp_runfile(g_lua, "/lib.lua");;
-		if (res < 0) {
-			log_error("[VFS] Cannot run /lib.lua");
+	// worker.* calls of handlers, finished tasks resume them on the loop
+	if (opts->threads > 0) {
+		g_pool = pool_init(opts->threads, luaapp_task_done, NULL);
+		if (!g_pool) {
+			log_error("[LUA] Cannot start %d worker threads", opts->threads);
 			return 1;
 		}
+		log_info("[LUA] Running blocking calls on %d worker threads", opts->threads);
+	}
+
+	g_lua = load_lua_app(g_vfs, &g_http_callback);
+	if (!g_lua) {
+		return 1;
+	}
+
+	struct http_server_s* server = http_server_init(opts->port, handle_request);
+	http_server_set_listen_backlog(server, opts->backlog);
+	if (opts->unix_path) {
+		http_server_set_unix_socket(server, opts->unix_path, opts->unix_mode);
+	}
+	http_server_set_accept_budget(server, opts->accept_budget);
+	http_server_set_defer_accept(server, opts->defer_accept);
+	http_server_set_max_connections(server, opts->max_connections);
+	http_server_set_max_inflight(server, opts->max_inflight);
+	http_server_set_max_memory(server, opts->max_memory);
+	http_server_set_retry_after(server, opts->retry_after);
+	http_server_set_trace_sampling(server, opts->trace_sample);
+	http_server_set_external_memory(server, luaapp_memory(g_lua));
+
+	// filled only by handlers setting response.cacheTTL
+	g_cache = cache_init(opts->cache_size);
+
+	if (opts->metrics_path) {
+		g_metrics = metrics_init();
+		g_metrics_path = opts->metrics_path;
+		log_info("[NET] Serving metrics under %s", g_metrics_path);
 	}
 
-	// lua load /main.lua
+	if (g_metrics || opts->access_log) {
+		http_server_set_done_handler(server, handle_request_done);
+	}
+
+	// uploads and suspended handlers cut off by the client
+	http_server_set_abort_handler(server, handle_upload_abort);
+
+	// timers run between the I/O events, woken up by their timerfd
+	http_server_watch(server, timers_fd(g_timers), timers_run, g_timers);
+
+	if (g_pool) {
+		http_server_watch(server, pool_fd(g_pool), pool_drain, g_pool);
+	}
+
+	// profiler, idle until started with SIGUSR2 or through its endpoint
 	if (1) {
-		res = luaapp_runfile(g_lua, "/main.lua");;
-		if (res < 0) {
-			log_error("Cannot run /main.lua");
-			return 1;
+		g_profiler = profiler_init(g_lua);
+		g_profiler_path = opts->profiler_path;
+		signal(SIGUSR2, handle_profiler_signal);
+		http_server_set_tick_handler(server, handle_tick);
+		if (g_profiler_path) {
+			log_info("[LUA] Serving profiler under %s", g_profiler_path);
 		}
 	}
 
-	// callback
-	if (1) {
-		g_http_callback = luaapp_refcallback(g_lua, "__httpHandle");
-		if (g_http_callback < 0) {
-			log_error("[LUA] Cannot ref __httpHandle function");
+	// SIGHUP reloads the Lua code
+	signal(SIGHUP, handle_reload_signal);
+
+	// listening socket inherited through exec, or taken over from the process
+	// being upgraded, which then drains and exits
+	const char* listen_fd = getenv("EMB_LISTEN_FD");
+	if (listen_fd) {
+		http_server_set_listen_fd(server, atoi(listen_fd));
+	}
+	if (opts->upgrade_path) {
+		int32_t fd = upgrade_receive(opts->upgrade_path);
+		if (fd >= 0) {
+			http_server_set_listen_fd(server, fd);
+		}
+		g_upgrade_fd = upgrade_listen(opts->upgrade_path);
+		if (g_upgrade_fd < 0) {
 			return 1;
 		}
+		http_server_watch(server, g_upgrade_fd, handle_upgrade, server);
 	}
 
-	struct http_server_s* server = http_server_init(port, handle_request);
-	log_info("[NET] Started HTTP server on port %d", port);
+	if (opts->unix_path) {
+		log_info("[NET] Started HTTP server on unix socket %s", opts->unix_path);
+	} else {
+		log_info("[NET] Started HTTP server on port %d", opts->port);
+	}
 	http_server_listen(server);
 
 	return 0;
@@ -310,17 +1177,17 @@ int app_run(int port) {
 // ************************************************************************************
 int main_standalone(int argc, char** argv) {
 	int32_t res = 0;
-	int32_t port = 0;
+	struct app_options opts;
 	char* data_path = NULL;
 	char* pack_dest = NULL;
 
+	init_options(&opts);
+
     int opt;
-    while((opt = getopt(argc, argv, "p:d:o:h")) != -1) {
-        switch(opt) {
-            case 'p':
-            	port = atoi(optarg);
-                break;
+    while((opt = getopt(argc, argv, SERVER_OPTS "d:o:h")) != -1) {
+    	if (parse_server_option(&opts, opt, optarg)) continue;
 
+        switch(opt) {
             case 'd':
             	data_path = strdup(optarg);
                 break;
@@ -351,26 +1218,27 @@ int main_standalone(int argc, char** argv) {
 		log_error("[VFS] Cannot init VFS from data dir %s", data_path);
 		return 1;
 	}
+	g_data_path = data_path;
 
     if (pack_dest) {
     	return self_pack(pack_dest);
     } else {
-    	return app_run(port);
+    	return app_run(&opts);
     }
 }
 
 // ************************************************************************************
 int main_embedded(int argc, char** argv) {
 	int32_t res = 0;
-	int32_t port = 0;
+	struct app_options opts;
+
+	init_options(&opts);
 
     int opt;
-    while((opt = getopt(argc, argv, "p:h")) != -1) {
-        switch(opt) {
-            case 'p':
-            	port = atoi(optarg);
-                break;
+    while((opt = getopt(argc, argv, SERVER_OPTS "h")) != -1) {
+    	if (parse_server_option(&opts, opt, optarg)) continue;
 
+        switch(opt) {
             case 'h':
             	print_usage(argv[0]);
             	return 0;
@@ -389,7 +1257,7 @@ int main_embedded(int argc, char** argv) {
 		return 1;
 	}
 
-   	return app_run(port);
+   	return app_run(&opts);
 }
 
 // ************************************************************************************
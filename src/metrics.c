@@ -0,0 +1,221 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file metrics.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "metrics.h"
+#include "httpserver.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+
+struct metrics_buffer {
+	char* data;
+	int32_t len;
+	int32_t cap;
+};
+
+static const char* g_kind_names[METRICS_KIND_COUNT] = { "static", "lua", "metrics", "router", "cache" };
+static const char* g_phase_names[METRICS_PHASE_COUNT] = { "parse", "lua", "write", "total" };
+
+// ************************************************************************************
+// Upper bound of the bucket in nanoseconds.
+int64_t metrics_bucket_bound(int32_t idx) {
+	int64_t bound = 1000ll << (idx / 2);
+	if (idx % 2) bound += bound / 2;
+	return bound;
+}
+
+// ************************************************************************************
+struct metrics* metrics_init() {
+	struct metrics* res = (struct metrics*)calloc(1, sizeof(struct metrics));
+
+	// the bounds are whole nanoseconds, printed exactly without trailing zeros
+	for(int32_t i=0;i<METRICS_HIST_BUCKETS - 1;++i) {
+		int64_t ns = metrics_bucket_bound(i);
+		int32_t n = snprintf(res->bucket_le[i], sizeof(res->bucket_le[i]), "%lld.%09lld", (long long)(ns / 1000000000), (long long)(ns % 1000000000));
+		while (res->bucket_le[i][n - 1] == '0') n--;
+		if (res->bucket_le[i][n - 1] == '.') n--;
+		res->bucket_le[i][n] = 0;
+	}
+	return res;
+}
+
+// ************************************************************************************
+int64_t metrics_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// ************************************************************************************
+void metrics_count_handled(struct metrics* m, int32_t kind) {
+	if (!m) return;
+	m->handled[kind]++;
+}
+
+// ************************************************************************************
+// Bucket bounds are 1, 1.5, 2, 3, 4, 6, 8, ... microseconds. Counted in half
+// microseconds they are 2^(k+1) and 3*2^k, so the two top bits of the value pick
+// the bucket, HDR histogram style.
+int32_t metrics_bucket(int64_t ns) {
+	if (ns <= 1000) return 0;
+
+	uint64_t u = (ns + 499) / 500;
+	int32_t p = 63 - __builtin_clzll(u - 1);
+	if (p == 0) return 0;
+
+	int32_t idx = (u <= (3ull << (p - 1))) ? 2 * p - 1 : 2 * p;
+	return idx < METRICS_HIST_BUCKETS - 1 ? idx : METRICS_HIST_BUCKETS - 1;
+}
+
+// ************************************************************************************
+void metrics_record(struct metrics* m, int32_t phase, int64_t ns) {
+	if (!m) return;
+	if (ns < 0) return;
+
+	struct metrics_histogram* h = &m->phases[phase];
+	h->buckets[metrics_bucket(ns)]++;
+	h->count++;
+	h->sum_ns += ns;
+}
+
+// ************************************************************************************
+void metrics_record_response(struct metrics* m, struct http_request_s* request) {
+	if (!m) return;
+
+	int32_t status = http_request_status(request);
+	m->responses[(status >= 100 && status < 600) ? status / 100 : 0]++;
+
+	int64_t start = http_request_phase_time(request, HTTP_PHASE_START);
+	int64_t handler = http_request_phase_time(request, HTTP_PHASE_HANDLER);
+	int64_t respond = http_request_phase_time(request, HTTP_PHASE_RESPOND);
+	int64_t done = http_request_phase_time(request, HTTP_PHASE_DONE);
+
+	if (start && handler) metrics_record(m, METRICS_PHASE_PARSE, handler - start);
+	if (respond && done) metrics_record(m, METRICS_PHASE_WRITE, done - respond);
+	if (start && done) metrics_record(m, METRICS_PHASE_TOTAL, done - start);
+}
+
+// ************************************************************************************
+void metrics_printf(struct metrics_buffer* buf, const char* fmt, ...) {
+	va_list argptr;
+
+	while(1) {
+		va_start(argptr, fmt);
+		int32_t n = vsnprintf(buf->data + buf->len, buf->cap - buf->len, fmt, argptr);
+		va_end(argptr);
+
+		if (n < buf->cap - buf->len) {
+			buf->len += n;
+			return;
+		}
+
+		buf->cap = buf->cap * 2 + n;
+		buf->data = (char*)realloc(buf->data, buf->cap);
+	}
+}
+
+// ************************************************************************************
+void metrics_render_histogram(struct metrics_buffer* buf, struct metrics* m, const char* phase, struct metrics_histogram* h) {
+	uint64_t cumulative = 0;
+
+	for(int32_t i=0;i<METRICS_HIST_BUCKETS - 1;++i) {
+		cumulative += h->buckets[i];
+		metrics_printf(buf, "emb_http_phase_seconds_bucket{phase=\"%s\",le=\"%s\"} %llu\n",
+			phase, m->bucket_le[i], (unsigned long long)cumulative);
+	}
+	metrics_printf(buf, "emb_http_phase_seconds_bucket{phase=\"%s\",le=\"+Inf\"} %llu\n", phase, (unsigned long long)h->count);
+	metrics_printf(buf, "emb_http_phase_seconds_sum{phase=\"%s\"} %.9f\n", phase, h->sum_ns / 1e9);
+	metrics_printf(buf, "emb_http_phase_seconds_count{phase=\"%s\"} %llu\n", phase, (unsigned long long)h->count);
+}
+
+// ************************************************************************************
+// Renders all metrics in the Prometheus text format. Returned buffer has to be freed.
+char* metrics_render(struct metrics* m, struct http_server_s* server, int64_t lua_heap, uint64_t lua_gc_cycles, int32_t* len) {
+	if (!m) return NULL;
+
+	struct metrics_buffer buf = { 0 };
+	buf.cap = 16384;
+	buf.data = (char*)malloc(buf.cap);
+
+	const struct http_server_stats_s* stats = http_server_stats(server);
+
+	metrics_printf(&buf, "# HELP emb_http_responses_total Responses sent, by status class.\n");
+	metrics_printf(&buf, "# TYPE emb_http_responses_total counter\n");
+	for(int32_t i=1;i<6;++i) {
+		metrics_printf(&buf, "emb_http_responses_total{class=\"%dxx\"} %llu\n", i, (unsigned long long)m->responses[i]);
+	}
+	metrics_printf(&buf, "emb_http_responses_total{class=\"other\"} %llu\n", (unsigned long long)m->responses[0]);
+
+	metrics_printf(&buf, "# HELP emb_http_handled_total Requests passed to the handler, by what served them.\n");
+	metrics_printf(&buf, "# TYPE emb_http_handled_total counter\n");
+	for(int32_t i=0;i<METRICS_KIND_COUNT;++i) {
+		metrics_printf(&buf, "emb_http_handled_total{kind=\"%s\"} %llu\n", g_kind_names[i], (unsigned long long)m->handled[i]);
+	}
+
+	metrics_printf(&buf, "# HELP emb_http_phase_seconds Time spent in request phases.\n");
+	metrics_printf(&buf, "# TYPE emb_http_phase_seconds histogram\n");
+	for(int32_t i=0;i<METRICS_PHASE_COUNT;++i) {
+		metrics_render_histogram(&buf, m, g_phase_names[i], &m->phases[i]);
+	}
+
+	metrics_printf(&buf, "# HELP emb_http_connections Open connections.\n");
+	metrics_printf(&buf, "# TYPE emb_http_connections gauge\n");
+	metrics_printf(&buf, "emb_http_connections %d\n", stats->connections);
+	metrics_printf(&buf, "# HELP emb_http_inflight Requests being handled.\n");
+	metrics_printf(&buf, "# TYPE emb_http_inflight gauge\n");
+	metrics_printf(&buf, "emb_http_inflight %d\n", stats->inflight);
+	metrics_printf(&buf, "# HELP emb_http_accepted_total Accepted connections.\n");
+	metrics_printf(&buf, "# TYPE emb_http_accepted_total counter\n");
+	metrics_printf(&buf, "emb_http_accepted_total %lld\n", (long long)stats->accepted);
+	metrics_printf(&buf, "# HELP emb_http_accept_errors_total Failed accept calls.\n");
+	metrics_printf(&buf, "# TYPE emb_http_accept_errors_total counter\n");
+	metrics_printf(&buf, "emb_http_accept_errors_total %lld\n", (long long)stats->accept_errors);
+	metrics_printf(&buf, "# HELP emb_http_shed_total Connections and requests rejected because of overload.\n");
+	metrics_printf(&buf, "# TYPE emb_http_shed_total counter\n");
+	metrics_printf(&buf, "emb_http_shed_total %lld\n", (long long)stats->shed);
+	metrics_printf(&buf, "# HELP emb_http_memory_bytes Memory counted against the server limit, Lua heap included.\n");
+	metrics_printf(&buf, "# TYPE emb_http_memory_bytes gauge\n");
+	metrics_printf(&buf, "emb_http_memory_bytes %lld\n", (long long)http_server_memory(server));
+	metrics_printf(&buf, "# HELP emb_lua_heap_bytes Memory used by the Lua state.\n");
+	metrics_printf(&buf, "# TYPE emb_lua_heap_bytes gauge\n");
+	metrics_printf(&buf, "emb_lua_heap_bytes %lld\n", (long long)lua_heap);
+	metrics_printf(&buf, "# HELP emb_lua_gc_cycles_total Completed Lua garbage collection cycles.\n");
+	metrics_printf(&buf, "# TYPE emb_lua_gc_cycles_total counter\n");
+	metrics_printf(&buf, "emb_lua_gc_cycles_total %llu\n", (unsigned long long)lua_gc_cycles);
+	metrics_printf(&buf, "# HELP emb_log_dropped_total Log lines dropped because the log output was too slow.\n");
+	metrics_printf(&buf, "# TYPE emb_log_dropped_total counter\n");
+	metrics_printf(&buf, "emb_log_dropped_total %llu\n", (unsigned long long)log_dropped());
+
+	*len = buf.len;
+	return buf.data;
+}
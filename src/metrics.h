@@ -0,0 +1,85 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file metrics.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdint.h>
+
+// two buckets per power of two from 1us up to ~33s, the last one catches the rest
+#define METRICS_HIST_BUCKETS 52
+#define METRICS_LE_MAX 24
+
+enum metrics_kind {
+	METRICS_KIND_STATIC,
+	METRICS_KIND_LUA,
+	METRICS_KIND_METRICS,
+	METRICS_KIND_ROUTER,
+	METRICS_KIND_CACHE,
+	METRICS_KIND_COUNT
+};
+
+enum metrics_phase {
+	METRICS_PHASE_PARSE,
+	METRICS_PHASE_LUA,
+	METRICS_PHASE_WRITE,
+	METRICS_PHASE_TOTAL,
+	METRICS_PHASE_COUNT
+};
+
+struct metrics_histogram {
+	uint64_t buckets[METRICS_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum_ns;
+};
+
+// All requests are handled on the single event loop thread, so the counters
+// are plain integers - recording is a few increments without locks or atomics.
+struct metrics {
+	// responses by status class, index 0 holds anything outside 1xx-5xx
+	uint64_t responses[6];
+	uint64_t handled[METRICS_KIND_COUNT];
+	struct metrics_histogram phases[METRICS_PHASE_COUNT];
+	// le labels of the buckets but the last, built once
+	char bucket_le[METRICS_HIST_BUCKETS - 1][METRICS_LE_MAX];
+};
+
+struct http_request_s;
+struct http_server_s;
+
+struct metrics* metrics_init();
+int64_t metrics_now();
+
+void metrics_count_handled(struct metrics* m, int32_t kind);
+void metrics_record(struct metrics* m, int32_t phase, int64_t ns);
+void metrics_record_response(struct metrics* m, struct http_request_s* request);
+
+char* metrics_render(struct metrics* m, struct http_server_s* server, int64_t lua_heap, uint64_t lua_gc_cycles, int32_t* len);
+
+#endif /* METRICS_H_ */
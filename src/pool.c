@@ -0,0 +1,359 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file pool.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "pool.h"
+#include "log.h"
+#include "utils.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include <zlib.h>
+
+// ************************************************************************************
+struct pool_task* pool_task_init(int32_t kind, const char* input, int64_t input_len) {
+	struct pool_task* res = (struct pool_task*)calloc(1, sizeof(struct pool_task));
+	res->kind = kind;
+	if (input) {
+		res->input = (char*)malloc(input_len + 1);
+		memcpy(res->input, input, input_len);
+		res->input[input_len] = 0;
+		res->input_len = input_len;
+	}
+	return res;
+}
+
+// ************************************************************************************
+void pool_task_free(struct pool_task* task) {
+	if (!task) return;
+	free(task->input);
+	free(task->target);
+	free(task->output);
+	free(task);
+}
+
+// ************************************************************************************
+void pool_task_error(struct pool_task* task, const char* what) {
+	snprintf(task->error, POOL_ERROR_MAX, "%s: %s", what, strerror(errno));
+}
+
+// ************************************************************************************
+void pool_read_file(struct pool_task* task) {
+	struct stat st;
+	int32_t fd = open(task->input, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		pool_task_error(task, task->input);
+		return;
+	}
+
+	int32_t res = fstat(fd, &st);
+	if (res < 0 || !S_ISREG(st.st_mode)) {
+		if (res == 0) errno = EISDIR;
+		pool_task_error(task, task->input);
+		close(fd);
+		return;
+	}
+
+	task->output = (char*)malloc(st.st_size + 1);
+	while (task->output_len < st.st_size) {
+		ssize_t res = read(fd, task->output + task->output_len, st.st_size - task->output_len);
+		if (res < 0 && errno == EINTR) continue;
+		if (res < 0) {
+			pool_task_error(task, task->input);
+			break;
+		}
+		if (res == 0) break;
+		task->output_len += res;
+	}
+	close(fd);
+}
+
+// ************************************************************************************
+void pool_sha256(struct pool_task* task) {
+	uint8_t digest[32];
+	sha256(task->input, task->input_len, digest);
+
+	task->output = (char*)malloc(65);
+	for(int32_t i=0;i<32;++i) {
+		sprintf(task->output + i * 2, "%02x", digest[i]);
+	}
+	task->output_len = 64;
+}
+
+// ************************************************************************************
+// gzip, the level in number (0 = the zlib default)
+void pool_gzip(struct pool_task* task) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+
+	int32_t level = task->number > 0 ? (int32_t)task->number : Z_DEFAULT_COMPRESSION;
+	if (deflateInit2(&zs, level, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		snprintf(task->error, POOL_ERROR_MAX, "gzip: bad level %d", level);
+		return;
+	}
+
+	int64_t cap = deflateBound(&zs, task->input_len);
+	task->output = (char*)malloc(cap);
+	zs.next_in = (Bytef*)task->input;
+	zs.avail_in = task->input_len;
+	zs.next_out = (Bytef*)task->output;
+	zs.avail_out = cap;
+
+	if (deflate(&zs, Z_FINISH) != Z_STREAM_END) {
+		snprintf(task->error, POOL_ERROR_MAX, "gzip: %s", zs.msg ? zs.msg : "cannot compress");
+	} else {
+		task->output_len = zs.total_out;
+	}
+	deflateEnd(&zs);
+}
+
+// ************************************************************************************
+void pool_sleep(struct pool_task* task) {
+	struct timespec ts;
+	ts.tv_sec = (time_t)task->number;
+	ts.tv_nsec = (long)((task->number - ts.tv_sec) * 1e9);
+	while (nanosleep(&ts, &ts) < 0 && errno == EINTR);
+}
+
+// ************************************************************************************
+// Connects to a unix socket path or an ip:port, sends the input, shuts the
+// writing side down and reads the reply to its end.
+void pool_exchange(struct pool_task* task) {
+	struct sockaddr_storage addr;
+	socklen_t addr_len = 0;
+	const char* colon = strrchr(task->target, ':');
+
+	memset(&addr, 0, sizeof(addr));
+	if (task->target[0] == '/') {
+		struct sockaddr_un* un = (struct sockaddr_un*)&addr;
+		if (strlen(task->target) >= sizeof(un->sun_path)) {
+			snprintf(task->error, POOL_ERROR_MAX, "%s: path too long", task->target);
+			return;
+		}
+		un->sun_family = AF_UNIX;
+		strcpy(un->sun_path, task->target);
+		addr_len = sizeof(struct sockaddr_un);
+	} else if (colon) {
+		char host[64];
+		struct sockaddr_in* in = (struct sockaddr_in*)&addr;
+		snprintf(host, sizeof(host), "%.*s", (int)(colon - task->target), task->target);
+		in->sin_family = AF_INET;
+		in->sin_port = htons(atoi(colon + 1));
+		if (inet_pton(AF_INET, host, &in->sin_addr) != 1) {
+			snprintf(task->error, POOL_ERROR_MAX, "%s: bad address", task->target);
+			return;
+		}
+		addr_len = sizeof(struct sockaddr_in);
+	} else {
+		snprintf(task->error, POOL_ERROR_MAX, "%s: bad address", task->target);
+		return;
+	}
+
+	int32_t fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		pool_task_error(task, "socket");
+		return;
+	}
+
+	struct timeval tv;
+	double timeout = task->number > 0 ? task->number : 30;
+	tv.tv_sec = (time_t)timeout;
+	tv.tv_usec = (suseconds_t)((timeout - tv.tv_sec) * 1e6);
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+	if (connect(fd, (struct sockaddr*)&addr, addr_len) < 0) {
+		pool_task_error(task, task->target);
+		close(fd);
+		return;
+	}
+
+	for(int64_t pos = 0; pos < task->input_len; ) {
+		ssize_t res = send(fd, task->input + pos, task->input_len - pos, MSG_NOSIGNAL);
+		if (res < 0 && errno == EINTR) continue;
+		if (res < 0) {
+			pool_task_error(task, task->target);
+			close(fd);
+			return;
+		}
+		pos += res;
+	}
+	shutdown(fd, SHUT_WR);
+
+	int64_t cap = 0;
+	for(;;) {
+		if (task->output_len == cap) {
+			if (cap == POOL_EXCHANGE_MAX) break;
+			cap = cap ? cap * 2 : 16384;
+			if (cap > POOL_EXCHANGE_MAX) cap = POOL_EXCHANGE_MAX;
+			task->output = (char*)realloc(task->output, cap);
+		}
+		ssize_t res = recv(fd, task->output + task->output_len, cap - task->output_len, 0);
+		if (res < 0 && errno == EINTR) continue;
+		if (res < 0) {
+			pool_task_error(task, task->target);
+			break;
+		}
+		if (res == 0) break;
+		task->output_len += res;
+	}
+	close(fd);
+}
+
+// ************************************************************************************
+// Runs the task in the calling thread.
+void pool_task_run(struct pool_task* task) {
+	switch(task->kind) {
+		case POOL_READ_FILE: pool_read_file(task); break;
+		case POOL_SHA256: pool_sha256(task); break;
+		case POOL_GZIP: pool_gzip(task); break;
+		case POOL_SLEEP: pool_sleep(task); break;
+		case POOL_EXCHANGE: pool_exchange(task); break;
+	}
+}
+
+// ************************************************************************************
+void* pool_worker(void* arg) {
+	struct pool* pool = (struct pool*)arg;
+	uint64_t one = 1;
+
+	for(;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (!pool->queue) pthread_cond_wait(&pool->wake, &pool->lock);
+		struct pool_task* task = pool->queue;
+		pool->queue = task->next;
+		if (!pool->queue) pool->queue_tail = NULL;
+		pthread_mutex_unlock(&pool->lock);
+
+		pool_task_run(task);
+
+		pthread_mutex_lock(&pool->lock);
+		task->next = pool->done;
+		pool->done = task;
+		pthread_mutex_unlock(&pool->lock);
+
+		if (write(pool->event_fd, &one, sizeof(one)) < 0) log_error("[LUA] Could not signal a finished task: %s", strerror(errno));
+	}
+	return NULL;
+}
+
+// ************************************************************************************
+struct pool* pool_init(int32_t threads, void (*complete)(struct pool_task* task, void* data), void* data) {
+	sigset_t all, old;
+
+	if (threads <= 0) return NULL;
+
+	struct pool* res = (struct pool*)calloc(1, sizeof(struct pool));
+	res->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (res->event_fd < 0) {
+		free(res);
+		return NULL;
+	}
+	pthread_mutex_init(&res->lock, NULL);
+	pthread_cond_init(&res->wake, NULL);
+	res->complete = complete;
+	res->complete_data = data;
+
+	// signals stay with the event loop thread
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	res->threads = (pthread_t*)calloc(threads, sizeof(pthread_t));
+	for(int32_t i=0;i<threads;++i) {
+		if (pthread_create(&res->threads[i], NULL, pool_worker, res) != 0) break;
+		res->threads_count++;
+	}
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (res->threads_count == 0) {
+		close(res->event_fd);
+		free(res->threads);
+		free(res);
+		return NULL;
+	}
+	return res;
+}
+
+// ************************************************************************************
+int32_t pool_fd(struct pool* pool) {
+	return pool ? pool->event_fd : -1;
+}
+
+// ************************************************************************************
+void pool_submit(struct pool* pool, struct pool_task* task) {
+	task->next = NULL;
+	pool->submitted++;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->queue_tail) pool->queue_tail->next = task;
+	else pool->queue = task;
+	pool->queue_tail = task;
+	pthread_cond_signal(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// ************************************************************************************
+// Hands the finished tasks to the complete callback, on the event loop thread.
+void pool_drain(void* data) {
+	struct pool* pool = (struct pool*)data;
+	uint64_t count = 0;
+
+	if (read(pool->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) log_error("[LUA] Could not read finished tasks: %s", strerror(errno));
+
+	pthread_mutex_lock(&pool->lock);
+	struct pool_task* done = pool->done;
+	pool->done = NULL;
+	pthread_mutex_unlock(&pool->lock);
+
+	// oldest first
+	struct pool_task* ordered = NULL;
+	while (done) {
+		struct pool_task* next = done->next;
+		done->next = ordered;
+		ordered = done;
+		done = next;
+	}
+
+	while (ordered) {
+		struct pool_task* next = ordered->next;
+		pool->completed++;
+		pool->complete(ordered, pool->complete_data);
+		ordered = next;
+	}
+}
@@ -0,0 +1,94 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file pool.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef POOL_H_
+#define POOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+
+#define POOL_DEFAULT_THREADS 4
+#define POOL_ERROR_MAX 128
+// replies of a socket exchange are cut here
+#define POOL_EXCHANGE_MAX (8 * 1024 * 1024)
+
+#define POOL_READ_FILE 1
+#define POOL_SHA256 2
+#define POOL_GZIP 3
+#define POOL_SLEEP 4
+#define POOL_EXCHANGE 5
+
+// A blocking job. Input is owned by the task, output is set by the worker
+// and owned by the task too; error is empty when the task succeeded.
+struct pool_task {
+	int32_t kind;
+	char* input;
+	int64_t input_len;
+	char* target;
+	double number;
+
+	char* output;
+	int64_t output_len;
+	char error[POOL_ERROR_MAX];
+
+	void* data;
+	struct pool_task* next;
+};
+
+// Fixed set of threads running tasks. Finished tasks are queued back and
+// an eventfd is signalled, the event loop then hands them to the complete
+// callback in pool_drain.
+struct pool {
+	pthread_t* threads;
+	int32_t threads_count;
+
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	struct pool_task* queue;
+	struct pool_task* queue_tail;
+	struct pool_task* done;
+
+	int32_t event_fd;
+	void (*complete)(struct pool_task* task, void* data);
+	void* complete_data;
+
+	uint64_t submitted;
+	uint64_t completed;
+};
+
+struct pool* pool_init(int32_t threads, void (*complete)(struct pool_task* task, void* data), void* data);
+int32_t pool_fd(struct pool* pool);
+void pool_submit(struct pool* pool, struct pool_task* task);
+void pool_drain(void* pool);
+
+struct pool_task* pool_task_init(int32_t kind, const char* input, int64_t input_len);
+void pool_task_run(struct pool_task* task);
+void pool_task_free(struct pool_task* task);
+
+#endif /* POOL_H_ */
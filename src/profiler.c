@@ -0,0 +1,216 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file profiler.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "profiler.h"
+#include "luaapp.h"
+#include "hashmap.h"
+#include "utils.h"
+#include "log.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <lua.h>
+
+#define PROFILER_MAX_DEPTH 64
+#define PROFILER_FRAME_MAX 128
+#define PROFILER_STACK_MAX (PROFILER_MAX_DEPTH * PROFILER_FRAME_MAX)
+
+struct profiler_stack {
+	char* stack;
+	uint64_t count;
+};
+
+// the hook gets only the lua state, there is one state per process
+static struct profiler* g_profiler;
+
+// ************************************************************************************
+uint64_t profiler_stack_hash(const void *item, uint64_t seed0, uint64_t seed1) {
+    const struct profiler_stack* entry = item;
+    return hashmap_sip(entry->stack, strlen(entry->stack), seed0, seed1);
+}
+
+// ************************************************************************************
+int32_t profiler_stack_compare(const void *a, const void *b, void *udata) {
+    const struct profiler_stack* a_entry = a;
+    const struct profiler_stack* b_entry = b;
+    return strcmp(a_entry->stack, b_entry->stack);
+}
+
+// ************************************************************************************
+void profiler_stack_free(void *item) {
+	struct profiler_stack* entry = item;
+	free(entry->stack);
+}
+
+// ************************************************************************************
+struct profiler* profiler_init(struct lua_app* app) {
+	if (!app) return NULL;
+
+	struct profiler* res = (struct profiler*)calloc(1, sizeof(struct profiler));
+	res->app = app;
+	res->stacks = hashmap_new(sizeof(struct profiler_stack), 0, 0, 0, profiler_stack_hash, profiler_stack_compare, profiler_stack_free, NULL);
+	return res;
+}
+
+// ************************************************************************************
+// Names a frame like "handler@/main.lua:12", C functions as "[C] name".
+int32_t profiler_frame_name(lua_Debug* ar, char* out) {
+	if (strcmp(ar->what, "C") == 0) {
+		return snprintf(out, PROFILER_FRAME_MAX, "[C] %s", ar->name ? ar->name : "?");
+	}
+	if (strcmp(ar->what, "main") == 0) {
+		return snprintf(out, PROFILER_FRAME_MAX, "main@%s", ar->short_src);
+	}
+	return snprintf(out, PROFILER_FRAME_MAX, "%s@%s:%d", ar->name ? ar->name : "anonymous", ar->short_src, ar->linedefined);
+}
+
+// ************************************************************************************
+void profiler_hook(lua_State* L, lua_Debug* hook_ar) {
+	struct profiler* prof = g_profiler;
+	char frames[PROFILER_MAX_DEPTH][PROFILER_FRAME_MAX];
+	int32_t lens[PROFILER_MAX_DEPTH];
+	int32_t depth = 0;
+	lua_Debug ar;
+
+	if (!prof) return;
+
+	while (depth < PROFILER_MAX_DEPTH && lua_getstack(L, depth, &ar)) {
+		lua_getinfo(L, "Sn", &ar);
+		lens[depth] = profiler_frame_name(&ar, frames[depth]);
+		if (lens[depth] >= PROFILER_FRAME_MAX) lens[depth] = PROFILER_FRAME_MAX - 1;
+		depth++;
+	}
+	if (depth == 0) return;
+
+	// collapsed stacks go from the root to the leaf, separated by ';'
+	char stack[PROFILER_STACK_MAX + PROFILER_MAX_DEPTH];
+	int32_t len = 0;
+	for(int32_t i=depth - 1;i>=0;--i) {
+		memcpy(stack + len, frames[i], lens[i]);
+		len += lens[i];
+		stack[len++] = i > 0 ? ';' : 0;
+	}
+
+	struct profiler_stack q;
+	q.stack = stack;
+
+	struct profiler_stack* entry = (struct profiler_stack*)hashmap_get(prof->stacks, &q);
+	if (entry) {
+		entry->count++;
+	} else {
+		q.stack = strdup(stack);
+		q.count = 1;
+		hashmap_set(prof->stacks, &q);
+	}
+	prof->samples++;
+}
+
+// ************************************************************************************
+int32_t profiler_start(struct profiler* prof, int32_t period) {
+	if (!prof) return -1;
+	if (period <= 0) period = PROFILER_DEFAULT_PERIOD;
+
+	g_profiler = prof;
+	prof->period = period;
+	lua_sethook(prof->app->state, profiler_hook, LUA_MASKCOUNT, period);
+	return 0;
+}
+
+// ************************************************************************************
+void profiler_stop(struct profiler* prof) {
+	if (!prof) return;
+	if (!prof->period) return;
+
+	lua_sethook(prof->app->state, NULL, 0, 0);
+	prof->period = 0;
+}
+
+// ************************************************************************************
+int32_t profiler_running(struct profiler* prof) {
+	if (!prof) return 0;
+	return prof->period > 0;
+}
+
+// ************************************************************************************
+void profiler_reset(struct profiler* prof) {
+	if (!prof) return;
+	hashmap_clear(prof->stacks, false);
+	prof->samples = 0;
+}
+
+// ************************************************************************************
+// Renders the samples in the collapsed stack format of flamegraph.pl, one
+// "root;...;leaf count" line per stack. Returned buffer has to be freed.
+char* profiler_dump(struct profiler* prof, int32_t* len) {
+	if (!prof) return NULL;
+
+	size_t iter = 0;
+	void* item = NULL;
+	int32_t cap = 1;
+	while (hashmap_iter(prof->stacks, &iter, &item)) {
+		const struct profiler_stack* e = item;
+		cap += strlen(e->stack) + 24;
+	}
+
+	char* res = (char*)malloc(cap);
+	int32_t pos = 0;
+	iter = 0;
+	while (hashmap_iter(prof->stacks, &iter, &item)) {
+		const struct profiler_stack* e = item;
+		pos += snprintf(res + pos, cap - pos, "%s %llu\n", e->stack, (unsigned long long)e->count);
+	}
+	res[pos] = 0;
+
+	*len = pos;
+	return res;
+}
+
+// ************************************************************************************
+int32_t profiler_dump_file(struct profiler* prof, const char* path) {
+	if (!prof) return -1;
+
+	int32_t len = 0;
+	char* data = profiler_dump(prof, &len);
+
+	int32_t fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		log_error("[LUA] Cannot write profile to %s", path);
+		free(data);
+		return -1;
+	}
+
+	write_full(fd, data, len);
+	close(fd);
+	free(data);
+	return 0;
+}
@@ -0,0 +1,60 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file profiler.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include <stdint.h>
+
+// VM instructions between two samples when no period is given
+#define PROFILER_DEFAULT_PERIOD 10000
+
+struct lua_app;
+struct hashmap;
+
+// Sampling profiler of the Lua code. While running, a count hook records the
+// Lua stack every period VM instructions; stopped, no hook is installed and
+// Lua runs at full speed.
+struct profiler {
+	struct lua_app* app;
+	struct hashmap* stacks;
+	int32_t period;
+	uint64_t samples;
+};
+
+struct profiler* profiler_init(struct lua_app* app);
+int32_t profiler_start(struct profiler* prof, int32_t period);
+void profiler_stop(struct profiler* prof);
+int32_t profiler_running(struct profiler* prof);
+void profiler_reset(struct profiler* prof);
+
+char* profiler_dump(struct profiler* prof, int32_t* len);
+int32_t profiler_dump_file(struct profiler* prof, const char* path);
+
+#endif /* PROFILER_H_ */
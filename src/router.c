@@ -0,0 +1,299 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file router.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "router.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+struct router_route {
+	char method[ROUTER_METHOD_MAX];
+	int32_t handler;
+};
+
+// Static nodes hold a compressed prefix and are keyed by its first character
+// in the parent. Parameter and catch-all nodes hold the parameter name.
+struct router_node {
+	char* prefix;
+	int32_t prefix_len;
+	char* name;
+
+	struct router_node** children;
+	int32_t children_count;
+	struct router_node* param;
+	struct router_node* wildcard;
+
+	struct router_route* routes;
+	int32_t routes_count;
+};
+
+// ************************************************************************************
+struct router_node* router_node_new(const char* prefix, int32_t len) {
+	struct router_node* node = (struct router_node*)calloc(1, sizeof(struct router_node));
+	node->prefix = strndup(prefix ? prefix : "", len);
+	node->prefix_len = len;
+	return node;
+}
+
+// ************************************************************************************
+void router_node_free(struct router_node* node) {
+	if (!node) return;
+
+	for(int32_t i=0;i<node->children_count;++i) {
+		router_node_free(node->children[i]);
+	}
+	router_node_free(node->param);
+	router_node_free(node->wildcard);
+
+	free(node->children);
+	free(node->routes);
+	free(node->prefix);
+	free(node->name);
+	free(node);
+}
+
+// ************************************************************************************
+// Splits the prefix of node at the given position, the tail with everything
+// hanging off the node moves to a new single child.
+void router_node_split(struct router_node* node, int32_t at) {
+	struct router_node* tail = (struct router_node*)malloc(sizeof(struct router_node));
+	*tail = *node;
+	tail->prefix = strndup(node->prefix + at, node->prefix_len - at);
+	tail->prefix_len = node->prefix_len - at;
+
+	node->prefix[at] = 0;
+	node->prefix_len = at;
+	node->children = (struct router_node**)malloc(sizeof(struct router_node*));
+	node->children[0] = tail;
+	node->children_count = 1;
+	node->param = NULL;
+	node->wildcard = NULL;
+	node->routes = NULL;
+	node->routes_count = 0;
+}
+
+// ************************************************************************************
+struct router_node* router_node_child(struct router_node* node, char c) {
+	for(int32_t i=0;i<node->children_count;++i) {
+		if (node->children[i]->prefix[0] == c) return node->children[i];
+	}
+	return NULL;
+}
+
+// ************************************************************************************
+// Walks the pattern down from node, creating and splitting nodes on the way.
+// Returns the node where the pattern ends, NULL if the pattern is invalid.
+struct router_node* router_insert(struct router_node* node, const char* s) {
+	while (*s) {
+		// parameters take a whole segment, the catch-all also the rest of the path
+		if (*s == ':' || *s == '*') {
+			int32_t n = 1;
+			while (s[n] && s[n] != '/') n++;
+
+			if (n == 1 || s[-1] != '/') return NULL;
+			if (*s == '*' && s[n]) return NULL;
+
+			struct router_node** slot = *s == ':' ? &node->param : &node->wildcard;
+			if (!*slot) {
+				*slot = router_node_new(NULL, 0);
+				(*slot)->name = strndup(s + 1, n - 1);
+			} else if ((int32_t)strlen((*slot)->name) != n - 1 || strncmp((*slot)->name, s + 1, n - 1) != 0) {
+				// one node cannot hold two differently named parameters
+				return NULL;
+			}
+
+			node = *slot;
+			s += n;
+			continue;
+		}
+
+		int32_t n = 0;
+		while (s[n] && s[n] != ':' && s[n] != '*') n++;
+
+		struct router_node* child = router_node_child(node, s[0]);
+		if (!child) {
+			child = router_node_new(s, n);
+			node->children = (struct router_node**)realloc(node->children, sizeof(struct router_node*) * (node->children_count + 1));
+			node->children[node->children_count++] = child;
+			node = child;
+			s += n;
+			continue;
+		}
+
+		int32_t common = 0;
+		while (common < n && common < child->prefix_len && s[common] == child->prefix[common]) common++;
+		if (common < child->prefix_len) {
+			router_node_split(child, common);
+		}
+
+		node = child;
+		s += common;
+	}
+
+	return node;
+}
+
+// ************************************************************************************
+// Index of the route of node taking the method, -1 if none does.
+int32_t router_node_route(struct router_node* node, const char* method, int32_t method_len) {
+	for(int32_t i=0;i<node->routes_count;++i) {
+		const char* m = node->routes[i].method;
+		if ((m[0] == '*' && m[1] == 0) || ((int32_t)strlen(m) == method_len && memcmp(m, method, method_len) == 0)) return i;
+	}
+	return -1;
+}
+
+// ************************************************************************************
+// Adds the methods of node missing in the Allow list of match, as many as fit.
+void router_allow(struct router_match* match, struct router_node* node) {
+	int32_t len = strlen(match->allow);
+
+	for(int32_t i=0;i<node->routes_count;++i) {
+		const char* m = node->routes[i].method;
+		int32_t n = strlen(m);
+
+		const char* p = match->allow;
+		while ((p = strstr(p, m)) && !((p == match->allow || p[-1] == ' ') && (p[n] == 0 || p[n] == ','))) p += n;
+		if (p) continue;
+
+		if (len + n + 2 >= (int32_t)sizeof(match->allow)) return;
+		len += snprintf(match->allow + len, sizeof(match->allow) - len, "%s%s", len ? ", " : "", m);
+	}
+}
+
+// ************************************************************************************
+// Depth first, static children before the parameter before the catch-all.
+// A pattern matching the path without routing the method does not stop the
+// search, its methods are gathered in the Allow list for the 405. Params of
+// abandoned branches are dropped on the way back.
+struct router_node* router_lookup(struct router_node* node, const char* path, int32_t len, const char* method, int32_t method_len, struct router_match* match) {
+	struct router_node* res = NULL;
+
+	if (len == 0 && node->routes_count > 0) {
+		if (router_node_route(node, method, method_len) >= 0) return node;
+		router_allow(match, node);
+	}
+
+	if (len > 0) {
+		struct router_node* child = router_node_child(node, path[0]);
+		if (child && child->prefix_len <= len && memcmp(child->prefix, path, child->prefix_len) == 0) {
+			res = router_lookup(child, path + child->prefix_len, len - child->prefix_len, method, method_len, match);
+			if (res) return res;
+		}
+	}
+
+	if (node->param && match->params_count < ROUTER_MAX_PARAMS) {
+		int32_t n = 0;
+		while (n < len && path[n] != '/') n++;
+
+		if (n > 0) {
+			int32_t idx = match->params_count++;
+			match->params[idx].name = node->param->name;
+			match->params[idx].value = path;
+			match->params[idx].value_len = n;
+
+			res = router_lookup(node->param, path + n, len - n, method, method_len, match);
+			if (res) return res;
+			match->params_count = idx;
+		}
+	}
+
+	if (node->wildcard && match->params_count < ROUTER_MAX_PARAMS) {
+		if (router_node_route(node->wildcard, method, method_len) < 0) {
+			router_allow(match, node->wildcard);
+			return NULL;
+		}
+
+		int32_t idx = match->params_count++;
+		match->params[idx].name = node->wildcard->name;
+		match->params[idx].value = path;
+		match->params[idx].value_len = len;
+		return node->wildcard;
+	}
+
+	return NULL;
+}
+
+// ************************************************************************************
+struct router* router_init() {
+	struct router* res = (struct router*)calloc(1, sizeof(struct router));
+	res->root = router_node_new(NULL, 0);
+	return res;
+}
+
+// ************************************************************************************
+void router_free(struct router* router) {
+	if (!router) return;
+	router_node_free(router->root);
+	free(router);
+}
+
+// ************************************************************************************
+// Method "*" matches any method. Returns -1 for an invalid pattern or
+// a method already routed for it.
+int32_t router_add(struct router* router, const char* method, const char* pattern, int32_t handler) {
+	if (!router) return -1;
+	if (!method || !method[0] || strlen(method) >= ROUTER_METHOD_MAX) return -1;
+	if (!pattern || pattern[0] != '/') return -1;
+
+	struct router_node* node = router_insert(router->root, pattern);
+	if (!node) return -1;
+
+	for(int32_t i=0;i<node->routes_count;++i) {
+		if (strcmp(node->routes[i].method, method) == 0) return -1;
+	}
+
+	node->routes = (struct router_route*)realloc(node->routes, sizeof(struct router_route) * (node->routes_count + 1));
+	strcpy(node->routes[node->routes_count].method, method);
+	node->routes[node->routes_count].handler = handler;
+	node->routes_count += 1;
+	router->routes += 1;
+	return 0;
+}
+
+// ************************************************************************************
+int32_t router_match(struct router* router, const char* method, int32_t method_len, const char* path, int32_t path_len, struct router_match* match) {
+	match->handler = -1;
+	match->params_count = 0;
+	match->allow[0] = 0;
+
+	if (!router || !router->routes) return ROUTER_NOT_FOUND;
+	if (!path) return ROUTER_NOT_FOUND;
+
+	struct router_node* node = router_lookup(router->root, path, path_len, method, method_len, match);
+	if (node) {
+		match->handler = node->routes[router_node_route(node, method, method_len)].handler;
+		match->allow[0] = 0;
+		return ROUTER_FOUND;
+	}
+
+	match->params_count = 0;
+	return match->allow[0] ? ROUTER_METHOD_NOT_ALLOWED : ROUTER_NOT_FOUND;
+}
@@ -0,0 +1,75 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file router.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef ROUTER_H_
+#define ROUTER_H_
+
+#include <stdint.h>
+
+#define ROUTER_MAX_PARAMS 8
+#define ROUTER_METHOD_MAX 16
+
+// results of router_match
+#define ROUTER_NOT_FOUND 0
+#define ROUTER_FOUND 1
+#define ROUTER_METHOD_NOT_ALLOWED 2
+
+struct router_node;
+
+// Routing table compiled into a radix tree. Patterns are static segments,
+// ":name" segments matching one path segment and a trailing "*name" matching
+// the rest of the path; static segments win over parameters, parameters over
+// the catch-all. Every pattern maps methods to an opaque handler (a Lua ref).
+struct router {
+	struct router_node* root;
+	int32_t routes;
+};
+
+struct router_param {
+	const char* name;
+	const char* value;
+	int32_t value_len;
+};
+
+// Params point into the router and into the matched path.
+struct router_match {
+	int32_t handler;
+	int32_t params_count;
+	struct router_param params[ROUTER_MAX_PARAMS];
+	// methods of the patterns matching the path, for the Allow header of a 405
+	char allow[128];
+};
+
+struct router* router_init();
+void router_free(struct router* router);
+
+int32_t router_add(struct router* router, const char* method, const char* pattern, int32_t handler);
+int32_t router_match(struct router* router, const char* method, int32_t method_len, const char* path, int32_t path_len, struct router_match* match);
+
+#endif /* ROUTER_H_ */
@@ -0,0 +1,644 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file shdict.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "shdict.h"
+#include "hashmap.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// the key is hashed the same way in every process
+#define SHDICT_SEED0 0x736864696374
+#define SHDICT_SEED1 0x656d622d6874
+// type of an item in a free list, class of a page not handed out yet
+#define SHDICT_FREE 0xff
+#define SHDICT_PAGE_UNUSED 0xff
+
+#define SHDICT_AT(stripe, off) ((struct shdict_item*)((char*)(stripe) + (off)))
+
+struct shdict_item {
+	uint32_t hnext;
+	// neighbours in the LRU or the free list of the class
+	uint32_t prev;
+	uint32_t next;
+	uint32_t hash;
+	// CLOCK_MONOTONIC milliseconds, 0 = never
+	uint64_t expires;
+	uint16_t key_len;
+	uint8_t type;
+	uint8_t cls;
+	uint32_t value_len;
+	char data[];
+};
+
+struct shdict_list {
+	uint32_t head;
+	uint32_t tail;
+};
+
+struct shdict_class {
+	struct shdict_list lru;
+	struct shdict_list free;
+	uint32_t pages;
+};
+
+struct shdict_stripe {
+	pthread_mutex_t lock;
+	uint32_t buckets_mask;
+	uint32_t buckets;
+	uint32_t page_classes;
+	uint32_t pages;
+	uint32_t pages_count;
+	uint32_t pages_used;
+	struct shdict_class classes[SHDICT_CLASSES];
+	uint64_t items;
+	uint64_t evictions;
+};
+
+// ************************************************************************************
+uint64_t shdict_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// ************************************************************************************
+uint64_t shdict_expires(double ttl) {
+	if (ttl <= 0) return 0;
+	return shdict_now() + (uint64_t)(ttl * 1000);
+}
+
+// ************************************************************************************
+// Lays out an empty stripe, everything but its lock.
+void shdict_stripe_clear(struct shdict_stripe* stripe, int64_t size) {
+	// a bucket for every 256 bytes of pages and a class byte per page
+	int64_t header = (sizeof(struct shdict_stripe) + 63) & ~63;
+	int64_t pages = (size - header - 64) / (SHDICT_PAGE_SIZE + SHDICT_PAGE_SIZE / 256 * 4 + 1);
+	uint32_t buckets = 1;
+	while (buckets * 2 <= pages * (SHDICT_PAGE_SIZE / 256)) buckets *= 2;
+
+	stripe->buckets_mask = buckets - 1;
+	stripe->buckets = header;
+	stripe->page_classes = header + buckets * 4;
+	stripe->pages = (stripe->page_classes + pages + 63) & ~63;
+	stripe->pages_count = pages;
+	stripe->pages_used = 0;
+	memset(stripe->classes, 0, sizeof(stripe->classes));
+	stripe->evictions += stripe->items;
+	stripe->items = 0;
+	memset((char*)stripe + stripe->buckets, 0, buckets * 4);
+	memset((char*)stripe + stripe->page_classes, SHDICT_PAGE_UNUSED, pages);
+}
+
+// ************************************************************************************
+// The lock is robust: a process dying while it holds it (killed in the middle
+// of a change) does not leave the others waiting forever.
+void shdict_stripe_init(struct shdict_stripe* stripe, int64_t size) {
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+	pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+	pthread_mutex_init(&stripe->lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+
+	shdict_stripe_clear(stripe, size);
+}
+
+// ************************************************************************************
+struct shdict* shdict_init(int64_t size) {
+	if (size < SHDICT_PAGE_SIZE * 4) return NULL;
+
+	// stripes of at least 8 pages, offsets in a stripe are 32 bits
+	int32_t stripes = SHDICT_STRIPES_MAX;
+	while (stripes > 1 && size / stripes < SHDICT_PAGE_SIZE * 8) stripes /= 2;
+	int64_t stripe_size = (size / stripes) & ~(int64_t)(SHDICT_PAGE_SIZE - 1);
+	if (stripe_size > 0x7fff0000) stripe_size = 0x7fff0000;
+
+	char* base = (char*)mmap(NULL, stripe_size * stripes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (base == MAP_FAILED) return NULL;
+
+	struct shdict* res = (struct shdict*)calloc(1, sizeof(struct shdict));
+	res->base = base;
+	res->size = stripe_size * stripes;
+	res->stripes_count = stripes;
+	res->stripe_size = stripe_size;
+	res->scratch = (char*)malloc(SHDICT_PAGE_SIZE);
+
+	for(int32_t i=0;i<stripes;++i) {
+		shdict_stripe_init((struct shdict_stripe*)(base + i * stripe_size), stripe_size);
+	}
+	return res;
+}
+
+// ************************************************************************************
+void shdict_list_unlink(struct shdict_stripe* stripe, struct shdict_list* list, struct shdict_item* item) {
+	if (item->prev) SHDICT_AT(stripe, item->prev)->next = item->next;
+	else list->head = item->next;
+	if (item->next) SHDICT_AT(stripe, item->next)->prev = item->prev;
+	else list->tail = item->prev;
+}
+
+// ************************************************************************************
+void shdict_list_push(struct shdict_stripe* stripe, struct shdict_list* list, struct shdict_item* item, uint32_t off) {
+	item->prev = 0;
+	item->next = list->head;
+	if (list->head) SHDICT_AT(stripe, list->head)->prev = off;
+	else list->tail = off;
+	list->head = off;
+}
+
+// ************************************************************************************
+uint32_t shdict_find(struct shdict_stripe* stripe, uint32_t hash, const char* key, int32_t key_len) {
+	uint32_t* buckets = (uint32_t*)((char*)stripe + stripe->buckets);
+
+	for(uint32_t off = buckets[hash & stripe->buckets_mask]; off; ) {
+		struct shdict_item* item = SHDICT_AT(stripe, off);
+		if (item->hash == hash && item->key_len == key_len && memcmp(item->data, key, key_len) == 0) return off;
+		off = item->hnext;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+// Takes the item out of the hash table and the LRU into the free list.
+void shdict_item_free(struct shdict_stripe* stripe, uint32_t off) {
+	struct shdict_item* item = SHDICT_AT(stripe, off);
+	uint32_t* link = (uint32_t*)((char*)stripe + stripe->buckets) + (item->hash & stripe->buckets_mask);
+
+	while (*link != off) link = &SHDICT_AT(stripe, *link)->hnext;
+	*link = item->hnext;
+
+	shdict_list_unlink(stripe, &stripe->classes[item->cls].lru, item);
+	item->type = SHDICT_FREE;
+	shdict_list_push(stripe, &stripe->classes[item->cls].free, item, off);
+	stripe->items--;
+}
+
+// ************************************************************************************
+void shdict_page_carve(struct shdict_stripe* stripe, uint32_t page, int32_t cls) {
+	uint32_t slot = SHDICT_ITEM_MIN << cls;
+	uint32_t start = stripe->pages + page * SHDICT_PAGE_SIZE;
+
+	((uint8_t*)stripe + stripe->page_classes)[page] = cls;
+	stripe->classes[cls].pages++;
+
+	for(uint32_t off = start; off + slot <= start + SHDICT_PAGE_SIZE; off += slot) {
+		struct shdict_item* item = SHDICT_AT(stripe, off);
+		item->type = SHDICT_FREE;
+		item->cls = cls;
+		shdict_list_push(stripe, &stripe->classes[cls].free, item, off);
+	}
+}
+
+// ************************************************************************************
+// Moves a page of the class holding the most pages to another class, its
+// items are evicted.
+int32_t shdict_page_reclaim(struct shdict_stripe* stripe, int32_t cls) {
+	int32_t victim = -1;
+	for(int32_t i=0;i<SHDICT_CLASSES;++i) {
+		if (i == cls || stripe->classes[i].pages == 0) continue;
+		if (victim < 0 || stripe->classes[i].pages > stripe->classes[victim].pages) victim = i;
+	}
+	if (victim < 0) return -1;
+
+	// a page with free slots costs the fewest items
+	struct shdict_class* c = &stripe->classes[victim];
+	uint32_t off = c->free.head ? c->free.head : c->lru.tail;
+	uint32_t page = (off - stripe->pages) / SHDICT_PAGE_SIZE;
+	uint32_t slot = SHDICT_ITEM_MIN << victim;
+	uint32_t start = stripe->pages + page * SHDICT_PAGE_SIZE;
+
+	for(off = start; off + slot <= start + SHDICT_PAGE_SIZE; off += slot) {
+		struct shdict_item* item = SHDICT_AT(stripe, off);
+		if (item->type != SHDICT_FREE) {
+			shdict_item_free(stripe, off);
+			stripe->evictions++;
+		}
+		shdict_list_unlink(stripe, &c->free, item);
+	}
+	c->pages--;
+
+	shdict_page_carve(stripe, page, cls);
+	return 0;
+}
+
+// ************************************************************************************
+// A free slot of the class: from its free list, a new page, its least
+// recently used item or a page taken from another class.
+uint32_t shdict_alloc(struct shdict_stripe* stripe, int32_t cls) {
+	struct shdict_class* c = &stripe->classes[cls];
+
+	if (!c->free.head) {
+		if (stripe->pages_used < stripe->pages_count) {
+			shdict_page_carve(stripe, stripe->pages_used++, cls);
+		} else if (c->lru.tail) {
+			shdict_item_free(stripe, c->lru.tail);
+			stripe->evictions++;
+		} else if (shdict_page_reclaim(stripe, cls) < 0) {
+			return 0;
+		}
+	}
+
+	uint32_t off = c->free.head;
+	shdict_list_unlink(stripe, &c->free, SHDICT_AT(stripe, off));
+	return off;
+}
+
+// ************************************************************************************
+int32_t shdict_class(int32_t size) {
+	for(int32_t i=0;i<SHDICT_CLASSES;++i) {
+		if ((SHDICT_ITEM_MIN << i) >= size) return i;
+	}
+	return -1;
+}
+
+// ************************************************************************************
+uint32_t shdict_value_len(struct shdict_value* value) {
+	switch(value->type) {
+		case SHDICT_STRING: return value->len;
+		case SHDICT_INTEGER: return sizeof(int64_t);
+		case SHDICT_NUMBER: return sizeof(double);
+		case SHDICT_BOOLEAN: return 1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+void shdict_value_write(struct shdict_item* item, struct shdict_value* value) {
+	char* dest = item->data + item->key_len;
+
+	item->type = value->type;
+	item->value_len = shdict_value_len(value);
+	switch(value->type) {
+		case SHDICT_STRING: memcpy(dest, value->data, value->len); break;
+		case SHDICT_INTEGER: memcpy(dest, &value->integer, sizeof(int64_t)); break;
+		case SHDICT_NUMBER: memcpy(dest, &value->number, sizeof(double)); break;
+		case SHDICT_BOOLEAN: *dest = value->integer != 0; break;
+	}
+}
+
+// ************************************************************************************
+// Strings are copied to scratch, valid until the next call.
+void shdict_value_read(struct shdict_item* item, struct shdict_value* value, char* scratch) {
+	const char* src = item->data + item->key_len;
+
+	value->type = item->type;
+	switch(item->type) {
+		case SHDICT_STRING:
+			memcpy(scratch, src, item->value_len);
+			value->data = scratch;
+			value->len = item->value_len;
+			break;
+		case SHDICT_INTEGER: memcpy(&value->integer, src, sizeof(int64_t)); break;
+		case SHDICT_NUMBER: memcpy(&value->number, src, sizeof(double)); break;
+		case SHDICT_BOOLEAN: value->integer = *src; break;
+	}
+}
+
+// ************************************************************************************
+struct shdict_stripe* shdict_lock(struct shdict* dict, const char* key, int32_t key_len, uint32_t* hash) {
+	uint64_t h = hashmap_sip(key, key_len, SHDICT_SEED0, SHDICT_SEED1);
+	struct shdict_stripe* stripe = (struct shdict_stripe*)(dict->base + ((h >> 32) & (dict->stripes_count - 1)) * dict->stripe_size);
+
+	*hash = (uint32_t)h;
+	if (pthread_mutex_lock(&stripe->lock) == EOWNERDEAD) {
+		// its lists may be half relinked, the stripe starts over empty
+		shdict_stripe_clear(stripe, dict->stripe_size);
+		pthread_mutex_consistent(&stripe->lock);
+	}
+	return stripe;
+}
+
+// ************************************************************************************
+// Finds a live item, an expired one is freed on the way.
+uint32_t shdict_lookup(struct shdict_stripe* stripe, uint32_t hash, const char* key, int32_t key_len) {
+	uint32_t off = shdict_find(stripe, hash, key, key_len);
+	if (off && SHDICT_AT(stripe, off)->expires && SHDICT_AT(stripe, off)->expires <= shdict_now()) {
+		shdict_item_free(stripe, off);
+		return 0;
+	}
+	return off;
+}
+
+// ************************************************************************************
+int32_t shdict_store(struct shdict_stripe* stripe, uint32_t hash, const char* key, int32_t key_len, struct shdict_value* value, uint64_t expires) {
+	int32_t cls = shdict_class(sizeof(struct shdict_item) + key_len + shdict_value_len(value));
+	if (cls < 0) return SHDICT_ERR_TOO_LARGE;
+
+	// replaced in place when it stays in its class
+	uint32_t off = shdict_find(stripe, hash, key, key_len);
+	if (off && SHDICT_AT(stripe, off)->cls == cls) {
+		shdict_list_unlink(stripe, &stripe->classes[cls].lru, SHDICT_AT(stripe, off));
+	} else {
+		if (off) shdict_item_free(stripe, off);
+
+		off = shdict_alloc(stripe, cls);
+		if (!off) return SHDICT_ERR_NO_MEMORY;
+
+		uint32_t* bucket = (uint32_t*)((char*)stripe + stripe->buckets) + (hash & stripe->buckets_mask);
+		struct shdict_item* item = SHDICT_AT(stripe, off);
+		item->hash = hash;
+		item->key_len = key_len;
+		memcpy(item->data, key, key_len);
+		item->hnext = *bucket;
+		*bucket = off;
+		stripe->items++;
+	}
+
+	struct shdict_item* item = SHDICT_AT(stripe, off);
+	shdict_value_write(item, value);
+	item->expires = expires;
+	shdict_list_push(stripe, &stripe->classes[cls].lru, item, off);
+	return SHDICT_OK;
+}
+
+// ************************************************************************************
+int32_t shdict_get(struct shdict* dict, const char* key, int32_t key_len, struct shdict_value* value) {
+	uint32_t hash = 0;
+	if (!dict || key_len > SHDICT_KEY_MAX) return SHDICT_ERR_NOT_FOUND;
+
+	struct shdict_stripe* stripe = shdict_lock(dict, key, key_len, &hash);
+	uint32_t off = shdict_lookup(stripe, hash, key, key_len);
+	if (off) {
+		struct shdict_item* item = SHDICT_AT(stripe, off);
+		shdict_value_read(item, value, dict->scratch);
+		shdict_list_unlink(stripe, &stripe->classes[item->cls].lru, item);
+		shdict_list_push(stripe, &stripe->classes[item->cls].lru, item, off);
+	}
+	pthread_mutex_unlock(&stripe->lock);
+
+	return off ? SHDICT_OK : SHDICT_ERR_NOT_FOUND;
+}
+
+// ************************************************************************************
+int32_t shdict_set(struct shdict* dict, const char* key, int32_t key_len, struct shdict_value* value, double ttl) {
+	uint32_t hash = 0;
+	if (!dict) return SHDICT_ERR_NO_MEMORY;
+	if (key_len > SHDICT_KEY_MAX) return SHDICT_ERR_TOO_LARGE;
+
+	struct shdict_stripe* stripe = shdict_lock(dict, key, key_len, &hash);
+	int32_t res = shdict_store(stripe, hash, key, key_len, value, shdict_expires(ttl));
+	pthread_mutex_unlock(&stripe->lock);
+	return res;
+}
+
+// ************************************************************************************
+// Adds delta to a number, integers stay integers. A missing key starts at
+// init if given, with the ttl; the ttl of an existing key is kept.
+int32_t shdict_incr(struct shdict* dict, const char* key, int32_t key_len, struct shdict_value* delta, struct shdict_value* init, double ttl, struct shdict_value* result) {
+	uint32_t hash = 0;
+	int32_t res = SHDICT_OK;
+	struct shdict_value current;
+	if (!dict || key_len > SHDICT_KEY_MAX) return SHDICT_ERR_NOT_FOUND;
+
+	struct shdict_stripe* stripe = shdict_lock(dict, key, key_len, &hash);
+	uint32_t off = shdict_lookup(stripe, hash, key, key_len);
+	if (off) {
+		shdict_value_read(SHDICT_AT(stripe, off), &current, dict->scratch);
+	} else if (init) {
+		current = *init;
+	} else {
+		pthread_mutex_unlock(&stripe->lock);
+		return SHDICT_ERR_NOT_FOUND;
+	}
+
+	if (current.type != SHDICT_INTEGER && current.type != SHDICT_NUMBER) {
+		pthread_mutex_unlock(&stripe->lock);
+		return SHDICT_ERR_NOT_NUMBER;
+	}
+
+	if (current.type == SHDICT_INTEGER && delta->type == SHDICT_INTEGER) {
+		result->type = SHDICT_INTEGER;
+		result->integer = (int64_t)((uint64_t)current.integer + (uint64_t)delta->integer);
+	} else {
+		result->type = SHDICT_NUMBER;
+		result->number = (current.type == SHDICT_INTEGER ? (double)current.integer : current.number) +
+			(delta->type == SHDICT_INTEGER ? (double)delta->integer : delta->number);
+	}
+
+	if (off && shdict_value_len(result) == SHDICT_AT(stripe, off)->value_len) {
+		struct shdict_item* item = SHDICT_AT(stripe, off);
+		shdict_value_write(item, result);
+		shdict_list_unlink(stripe, &stripe->classes[item->cls].lru, item);
+		shdict_list_push(stripe, &stripe->classes[item->cls].lru, item, off);
+	} else {
+		res = shdict_store(stripe, hash, key, key_len, result, off ? SHDICT_AT(stripe, off)->expires : shdict_expires(ttl));
+	}
+
+	pthread_mutex_unlock(&stripe->lock);
+	return res;
+}
+
+// ************************************************************************************
+int32_t shdict_delete(struct shdict* dict, const char* key, int32_t key_len) {
+	uint32_t hash = 0;
+	if (!dict || key_len > SHDICT_KEY_MAX) return SHDICT_ERR_NOT_FOUND;
+
+	struct shdict_stripe* stripe = shdict_lock(dict, key, key_len, &hash);
+	uint32_t off = shdict_find(stripe, hash, key, key_len);
+	if (off) shdict_item_free(stripe, off);
+	pthread_mutex_unlock(&stripe->lock);
+
+	return off ? SHDICT_OK : SHDICT_ERR_NOT_FOUND;
+}
+
+// ************************************************************************************
+int64_t shdict_items(struct shdict* dict) {
+	int64_t res = 0;
+	if (!dict) return 0;
+
+	for(int32_t i=0;i<dict->stripes_count;++i) {
+		res += ((struct shdict_stripe*)(dict->base + i * dict->stripe_size))->items;
+	}
+	return res;
+}
+
+// ************************************************************************************
+int64_t shdict_evictions(struct shdict* dict) {
+	int64_t res = 0;
+	if (!dict) return 0;
+
+	for(int32_t i=0;i<dict->stripes_count;++i) {
+		res += ((struct shdict_stripe*)(dict->base + i * dict->stripe_size))->evictions;
+	}
+	return res;
+}
+
+// ************************************************************************************
+const char* shdict_error(int32_t err) {
+	switch(err) {
+		case SHDICT_ERR_NOT_FOUND: return "not found";
+		case SHDICT_ERR_NOT_NUMBER: return "not a number";
+		case SHDICT_ERR_TOO_LARGE: return "too large";
+		case SHDICT_ERR_NO_MEMORY: return "no memory";
+	}
+	return "ok";
+}
+
+// ************************************************************************************
+// Reads a Lua value, returns 0 for types the dictionary cannot hold.
+int32_t shdict_lua_value(lua_State* L, int32_t idx, struct shdict_value* value) {
+	size_t len = 0;
+
+	switch(lua_type(L, idx)) {
+		case LUA_TSTRING:
+			value->type = SHDICT_STRING;
+			value->data = lua_tolstring(L, idx, &len);
+			value->len = len;
+			return 1;
+		case LUA_TNUMBER:
+			if (lua_isinteger(L, idx)) {
+				value->type = SHDICT_INTEGER;
+				value->integer = lua_tointeger(L, idx);
+			} else {
+				value->type = SHDICT_NUMBER;
+				value->number = lua_tonumber(L, idx);
+			}
+			return 1;
+		case LUA_TBOOLEAN:
+			value->type = SHDICT_BOOLEAN;
+			value->integer = lua_toboolean(L, idx);
+			return 1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+void shdict_lua_push(lua_State* L, struct shdict_value* value) {
+	switch(value->type) {
+		case SHDICT_STRING: lua_pushlstring(L, value->data, value->len); break;
+		case SHDICT_INTEGER: lua_pushinteger(L, value->integer); break;
+		case SHDICT_NUMBER: lua_pushnumber(L, value->number); break;
+		case SHDICT_BOOLEAN: lua_pushboolean(L, value->integer != 0); break;
+		default: lua_pushnil(L); break;
+	}
+}
+
+// ************************************************************************************
+// shared.get(key), nil when missing or expired
+int shdict_lua_get(lua_State* L) {
+	struct shdict* dict = (struct shdict*)lua_touserdata(L, lua_upvalueindex(1));
+	struct shdict_value value;
+	size_t key_len = 0;
+	const char* key = luaL_checklstring(L, 1, &key_len);
+
+	if (shdict_get(dict, key, key_len, &value) != SHDICT_OK) value.type = SHDICT_NIL;
+	shdict_lua_push(L, &value);
+	return 1;
+}
+
+// ************************************************************************************
+// shared.set(key, value [, ttl]), a nil value deletes the key
+int shdict_lua_set(lua_State* L) {
+	struct shdict* dict = (struct shdict*)lua_touserdata(L, lua_upvalueindex(1));
+	struct shdict_value value;
+	size_t key_len = 0;
+	const char* key = luaL_checklstring(L, 1, &key_len);
+	double ttl = luaL_optnumber(L, 3, 0);
+
+	int32_t res = SHDICT_OK;
+	if (lua_isnoneornil(L, 2)) {
+		shdict_delete(dict, key, key_len);
+	} else if (shdict_lua_value(L, 2, &value)) {
+		res = shdict_set(dict, key, key_len, &value, ttl);
+	} else {
+		return luaL_argerror(L, 2, "string, number or boolean expected");
+	}
+
+	if (res != SHDICT_OK) {
+		lua_pushboolean(L, 0);
+		lua_pushstring(L, shdict_error(res));
+		return 2;
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// ************************************************************************************
+// shared.incr(key, delta [, init [, ttl]]), the new value or nil and an error
+int shdict_lua_incr(lua_State* L) {
+	struct shdict* dict = (struct shdict*)lua_touserdata(L, lua_upvalueindex(1));
+	struct shdict_value delta, init, result;
+	size_t key_len = 0;
+	const char* key = luaL_checklstring(L, 1, &key_len);
+
+	luaL_checktype(L, 2, LUA_TNUMBER);
+	shdict_lua_value(L, 2, &delta);
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TNUMBER);
+		shdict_lua_value(L, 3, &init);
+	}
+	double ttl = luaL_optnumber(L, 4, 0);
+
+	int32_t res = shdict_incr(dict, key, key_len, &delta, lua_isnoneornil(L, 3) ? NULL : &init, ttl, &result);
+	if (res != SHDICT_OK) {
+		lua_pushnil(L);
+		lua_pushstring(L, shdict_error(res));
+		return 2;
+	}
+	shdict_lua_push(L, &result);
+	return 1;
+}
+
+// ************************************************************************************
+// shared.delete(key), true when the key was there
+int shdict_lua_delete(lua_State* L) {
+	struct shdict* dict = (struct shdict*)lua_touserdata(L, lua_upvalueindex(1));
+	size_t key_len = 0;
+	const char* key = luaL_checklstring(L, 1, &key_len);
+
+	lua_pushboolean(L, shdict_delete(dict, key, key_len) == SHDICT_OK);
+	return 1;
+}
+
+// ************************************************************************************
+// Registers the global shared table, not at all without a dictionary.
+void shdict_open(lua_State* L, struct shdict* dict) {
+	const luaL_Reg funcs[] = {
+		{ "get", shdict_lua_get },
+		{ "set", shdict_lua_set },
+		{ "incr", shdict_lua_incr },
+		{ "delete", shdict_lua_delete },
+		{ NULL, NULL }
+	};
+
+	if (!dict) return;
+
+	lua_newtable(L);
+	lua_pushlightuserdata(L, dict);
+	luaL_setfuncs(L, funcs, 1);
+	lua_setglobal(L, "shared");
+}
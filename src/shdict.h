@@ -0,0 +1,91 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file shdict.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef SHDICT_H_
+#define SHDICT_H_
+
+#include <stdint.h>
+
+#define SHDICT_DEFAULT_SIZE (16 * 1024 * 1024)
+#define SHDICT_STRIPES_MAX 16
+// items come from pages split into size classes of 64 bytes to a whole page
+#define SHDICT_PAGE_SIZE (64 * 1024)
+#define SHDICT_ITEM_MIN 64
+#define SHDICT_CLASSES 11
+#define SHDICT_KEY_MAX 250
+
+#define SHDICT_NIL 0
+#define SHDICT_STRING 1
+#define SHDICT_INTEGER 2
+#define SHDICT_NUMBER 3
+#define SHDICT_BOOLEAN 4
+
+#define SHDICT_OK 0
+#define SHDICT_ERR_NOT_FOUND -1
+#define SHDICT_ERR_NOT_NUMBER -2
+#define SHDICT_ERR_TOO_LARGE -3
+#define SHDICT_ERR_NO_MEMORY -4
+
+struct lua_State;
+
+struct shdict_value {
+	int32_t type;
+	int64_t integer;
+	double number;
+	const char* data;
+	int32_t len;
+};
+
+// Key/value store in one shared anonymous mapping, so processes forked after
+// shdict_init see the same contents. The mapping is split into stripes,
+// each with its own process-shared lock, hash table and slab pages. Nothing
+// in it is a pointer, items refer to each other by offsets in their stripe.
+// The locks are robust; a stripe whose holder died is emptied.
+struct shdict {
+	char* base;
+	int64_t size;
+	int32_t stripes_count;
+	int64_t stripe_size;
+
+	// values are copied out here under the lock, this process only
+	char* scratch;
+};
+
+struct shdict* shdict_init(int64_t size);
+int32_t shdict_get(struct shdict* dict, const char* key, int32_t key_len, struct shdict_value* value);
+int32_t shdict_set(struct shdict* dict, const char* key, int32_t key_len, struct shdict_value* value, double ttl);
+int32_t shdict_incr(struct shdict* dict, const char* key, int32_t key_len, struct shdict_value* delta, struct shdict_value* init, double ttl, struct shdict_value* result);
+int32_t shdict_delete(struct shdict* dict, const char* key, int32_t key_len);
+int64_t shdict_items(struct shdict* dict);
+int64_t shdict_evictions(struct shdict* dict);
+const char* shdict_error(int32_t err);
+
+void shdict_open(struct lua_State* L, struct shdict* dict);
+
+#endif /* SHDICT_H_ */
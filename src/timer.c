@@ -0,0 +1,301 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file timer.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "timer.h"
+#include "log.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/timerfd.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+// registry key marking a state replaced by a reload, see timers_retire
+static char timers_retired_key;
+
+// ************************************************************************************
+int64_t timers_now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// ************************************************************************************
+void timers_sift_up(struct timers* timers, int32_t i) {
+	struct timer t = timers->heap[i];
+	while (i > 0) {
+		int32_t parent = (i - 1) / 2;
+		if (timers->heap[parent].due <= t.due) break;
+		timers->heap[i] = timers->heap[parent];
+		i = parent;
+	}
+	timers->heap[i] = t;
+}
+
+// ************************************************************************************
+void timers_sift_down(struct timers* timers, int32_t i) {
+	struct timer t = timers->heap[i];
+	while (1) {
+		int32_t child = i * 2 + 1;
+		if (child >= timers->count) break;
+		if (child + 1 < timers->count && timers->heap[child + 1].due < timers->heap[child].due) child++;
+		if (t.due <= timers->heap[child].due) break;
+		timers->heap[i] = timers->heap[child];
+		i = child;
+	}
+	timers->heap[i] = t;
+}
+
+// ************************************************************************************
+void timers_push(struct timers* timers, struct timer* t) {
+	if (timers->count == timers->cap) {
+		timers->cap *= 2;
+		timers->heap = (struct timer*)realloc(timers->heap, timers->cap * sizeof(struct timer));
+	}
+	timers->heap[timers->count++] = *t;
+	timers_sift_up(timers, timers->count - 1);
+}
+
+// ************************************************************************************
+void timers_remove(struct timers* timers, int32_t i) {
+	timers->count--;
+	if (i == timers->count) return;
+
+	timers->heap[i] = timers->heap[timers->count];
+	timers_sift_up(timers, i);
+	timers_sift_down(timers, i);
+}
+
+// ************************************************************************************
+// Arms the timerfd for the earliest timer, disarms it when there is none.
+// Overdue timers get the smallest delay so they run after the pending I/O.
+void timers_arm(struct timers* timers) {
+	struct itimerspec ts;
+	memset(&ts, 0, sizeof(ts));
+
+	if (timers->count > 0) {
+		int64_t delay = timers->heap[0].due - timers_now();
+		if (delay < 1) delay = 1;
+		ts.it_value.tv_sec = delay / 1000000000LL;
+		ts.it_value.tv_nsec = delay % 1000000000LL;
+	}
+	timerfd_settime(timers->fd, 0, &ts, NULL);
+}
+
+// ************************************************************************************
+struct timers* timers_init() {
+	int32_t fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (fd < 0) return NULL;
+
+	struct timers* res = (struct timers*)calloc(1, sizeof(struct timers));
+	res->fd = fd;
+	res->cap = TIMER_INITIAL_CAP;
+	res->heap = (struct timer*)malloc(res->cap * sizeof(struct timer));
+	res->running = -1;
+	return res;
+}
+
+// ************************************************************************************
+int32_t timers_fd(struct timers* timers) {
+	if (!timers) return -1;
+	return timers->fd;
+}
+
+// ************************************************************************************
+// Schedules the function of the registry reference, owned by the timer from
+// now on. An interval makes it repeat, at least every millisecond.
+int32_t timers_add(struct timers* timers, lua_State* L, int64_t delay_ms, int64_t interval_ms, int32_t ref) {
+	if (delay_ms < 0) delay_ms = 0;
+	if (interval_ms < 0) interval_ms = 0;
+
+	struct timer t;
+	t.L = L;
+	t.due = timers_now() + delay_ms * 1000000LL;
+	t.interval = interval_ms * 1000000LL;
+	t.ref = ref;
+	t.id = ++timers->next_id;
+	if (t.id <= 0) t.id = timers->next_id = 1;
+
+	timers_push(timers, &t);
+	if (timers->heap[0].id == t.id) timers_arm(timers);
+	return t.id;
+}
+
+// ************************************************************************************
+// Returns 1 if the timer was pending or is the one running now.
+int32_t timers_cancel(struct timers* timers, int32_t id) {
+	if (id == timers->running) {
+		timers->cancelled = 1;
+		return 1;
+	}
+
+	for(int32_t i=0;i<timers->count;++i) {
+		if (timers->heap[i].id != id) continue;
+
+		luaL_unref(timers->heap[i].L, LUA_REGISTRYINDEX, timers->heap[i].ref);
+		timers_remove(timers, i);
+		if (i == 0) timers_arm(timers);
+		return 1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+// Removes every timer of the state, before it is replaced or closed.
+void timers_drop(struct timers* timers, lua_State* L) {
+	int32_t kept = 0;
+	for(int32_t i=0;i<timers->count;++i) {
+		if (timers->heap[i].L == L) {
+			luaL_unref(L, LUA_REGISTRYINDEX, timers->heap[i].ref);
+		} else {
+			timers->heap[kept++] = timers->heap[i];
+		}
+	}
+
+	// rebuilt bottom-up, what is left may no longer be a heap
+	timers->count = kept;
+	for(int32_t i=kept / 2 - 1;i>=0;--i) timers_sift_down(timers, i);
+	timers_arm(timers);
+}
+
+// ************************************************************************************
+// Drops the timers of a state replaced by a reload. Handlers still suspended in
+// it cannot schedule new ones, the state is closed once they finish.
+void timers_retire(struct timers* timers, lua_State* L) {
+	timers_drop(timers, L);
+	lua_pushboolean(L, 1);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, &timers_retired_key);
+}
+
+// ************************************************************************************
+// Watch handler of the timerfd: runs the due timers within the tick budget.
+void timers_run(void* data) {
+	struct timers* timers = (struct timers*)data;
+	uint64_t expirations = 0;
+	int64_t start = timers_now();
+	int64_t now = start;
+
+	if (read(timers->fd, &expirations, sizeof(expirations)) < 0) {
+		// nothing expired, woken up by a rearm
+	}
+
+	while (timers->count > 0 && timers->heap[0].due <= now) {
+		struct timer t = timers->heap[0];
+		timers_remove(timers, 0);
+
+		timers->running = t.id;
+		timers->cancelled = 0;
+
+		lua_rawgeti(t.L, LUA_REGISTRYINDEX, t.ref);
+		if (lua_pcall(t.L, 0, 0, 0) != LUA_OK) {
+			const char* err = lua_tostring(t.L, -1);
+			log_error("[LUA] Timer: %s", err ? err : "error without a message");
+			lua_pop(t.L, 1);
+		}
+		timers->running = -1;
+		now = timers_now();
+
+		// a late repeating timer skips the missed runs instead of catching up
+		if (t.interval > 0 && !timers->cancelled) {
+			t.due += t.interval;
+			if (t.due <= now) t.due = now + t.interval;
+			timers_push(timers, &t);
+		} else {
+			luaL_unref(t.L, LUA_REGISTRYINDEX, t.ref);
+		}
+
+		if (now - start >= TIMER_TICK_BUDGET_NS) break;
+	}
+
+	timers_arm(timers);
+}
+
+// ************************************************************************************
+int32_t timers_lua_schedule(lua_State* L, int32_t repeat) {
+	struct timers* timers = (struct timers*)lua_touserdata(L, lua_upvalueindex(1));
+	int64_t ms = luaL_checkinteger(L, 1);
+	luaL_checktype(L, 2, LUA_TFUNCTION);
+
+	if (repeat && ms < 1) ms = 1;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, &timers_retired_key);
+	int32_t retired = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+	if (retired) return luaL_error(L, "timer: the code was reloaded, this state takes no new timers");
+
+	// called from a handler L is its coroutine, timers run on the main thread
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	lua_State* main = lua_tothread(L, -1);
+	lua_pop(L, 1);
+
+	lua_pushvalue(L, 2);
+	int32_t ref = luaL_ref(L, LUA_REGISTRYINDEX);
+	lua_pushinteger(L, timers_add(timers, main, ms, repeat ? ms : 0, ref));
+	return 1;
+}
+
+// ************************************************************************************
+// timer.after(ms, fn), the id of the timer
+int timers_lua_after(lua_State* L) {
+	return timers_lua_schedule(L, 0);
+}
+
+// ************************************************************************************
+// timer.every(ms, fn), the id of the timer
+int timers_lua_every(lua_State* L) {
+	return timers_lua_schedule(L, 1);
+}
+
+// ************************************************************************************
+// timer.cancel(id), true if the timer was still pending
+int timers_lua_cancel(lua_State* L) {
+	struct timers* timers = (struct timers*)lua_touserdata(L, lua_upvalueindex(1));
+	lua_pushboolean(L, timers_cancel(timers, luaL_checkinteger(L, 1)));
+	return 1;
+}
+
+// ************************************************************************************
+void timers_open(lua_State* L, struct timers* timers) {
+	const luaL_Reg funcs[] = {
+		{ "after", timers_lua_after },
+		{ "every", timers_lua_every },
+		{ "cancel", timers_lua_cancel },
+		{ NULL, NULL }
+	};
+
+	if (!timers) return;
+
+	lua_newtable(L);
+	lua_pushlightuserdata(L, timers);
+	luaL_setfuncs(L, funcs, 1);
+	lua_setglobal(L, "timer");
+}
@@ -0,0 +1,78 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file timer.h
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#ifndef TIMER_H_
+#define TIMER_H_
+
+#include <stdint.h>
+
+// due timers run until this much time is spent, the rest after the pending I/O
+#define TIMER_TICK_BUDGET_NS (2 * 1000000LL)
+#define TIMER_INITIAL_CAP 16
+
+struct lua_State;
+
+struct timer {
+	// main thread of the state the function lives in
+	struct lua_State* L;
+	// CLOCK_MONOTONIC nanoseconds
+	int64_t due;
+	// 0 for timer.after
+	int64_t interval;
+	int32_t ref;
+	int32_t id;
+};
+
+// Lua timers in a min-heap on the due time. A timerfd armed for the earliest
+// one wakes up the event loop, which runs them in timers_run. The states
+// share it across a reload, the old one drops its timers.
+struct timers {
+	int32_t fd;
+
+	struct timer* heap;
+	int32_t count;
+	int32_t cap;
+	int32_t next_id;
+
+	// the timer whose callback runs now, timer.cancel of it sets cancelled
+	int32_t running;
+	int32_t cancelled;
+};
+
+struct timers* timers_init();
+int32_t timers_fd(struct timers* timers);
+int32_t timers_add(struct timers* timers, struct lua_State* L, int64_t delay_ms, int64_t interval_ms, int32_t ref);
+int32_t timers_cancel(struct timers* timers, int32_t id);
+void timers_drop(struct timers* timers, struct lua_State* L);
+void timers_retire(struct timers* timers, struct lua_State* L);
+void timers_run(void* timers);
+
+void timers_open(struct lua_State* L, struct timers* timers);
+
+#endif /* TIMER_H_ */
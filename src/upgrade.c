@@ -0,0 +1,139 @@
+/** * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * *
+ * @file upgrade.c
+ * @project emb-http-lua
+ * @url https://github.com/pregusia/emb-http-lua
+ *
+ * MIT License
+ *
+ * Copyright (c) 2024 pregusia
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ *
+ * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
+
+#include "upgrade.h"
+#include "log.h"
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// ************************************************************************************
+int32_t upgrade_address(const char* path, struct sockaddr_un* addr) {
+	memset(addr, 0, sizeof(struct sockaddr_un));
+	addr->sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(addr->sun_path)) {
+		log_error("[NET] Upgrade socket path too long: %s", path);
+		return 0;
+	}
+	strcpy(addr->sun_path, path);
+	return 1;
+}
+
+// ************************************************************************************
+// Asks the process listening on the path for its listening socket. Returns -1
+// when there is none, the server then binds the port itself.
+int32_t upgrade_receive(const char* path) {
+	struct sockaddr_un addr;
+	if (!upgrade_address(path, &addr)) return -1;
+
+	int32_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0) return -1;
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+		close(fd);
+		return -1;
+	}
+
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t n;
+	do {
+		n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC);
+	} while (n < 0 && errno == EINTR);
+	close(fd);
+
+	struct cmsghdr* cmsg = n > 0 ? CMSG_FIRSTHDR(&msg) : NULL;
+	if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) {
+		log_error("[NET] No listening socket received over %s", path);
+		return -1;
+	}
+
+	int listen_fd;
+	memcpy(&listen_fd, CMSG_DATA(cmsg), sizeof(int));
+	log_info("[NET] Took over the listening socket over %s", path);
+	return listen_fd;
+}
+
+// ************************************************************************************
+// Listens on the path for the process replacing this one. A stale socket file
+// of a process gone is removed first.
+int32_t upgrade_listen(const char* path) {
+	struct sockaddr_un addr;
+	if (!upgrade_address(path, &addr)) return -1;
+
+	int32_t fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+	if (fd < 0) return -1;
+	unlink(path);
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 || listen(fd, 1) != 0) {
+		log_error("[NET] Could not listen on upgrade socket %s: %s", path, strerror(errno));
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+// ************************************************************************************
+// Accepts the process connected to the upgrade socket and sends it the
+// listening socket. Returns 1 when it was handed over.
+int32_t upgrade_send(int32_t ctl_fd, int32_t listen_fd) {
+	int32_t fd = accept(ctl_fd, NULL, NULL);
+	if (fd < 0) return 0;
+
+	char byte = 0;
+	struct iovec iov = { &byte, 1 };
+	char control[CMSG_SPACE(sizeof(int))];
+	memset(control, 0, sizeof(control));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &listen_fd, sizeof(int));
+
+	// the accepted socket is blocking, the message fits its buffer
+	ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	close(fd);
+	return n == 1;
+}
@@ -99,6 +99,68 @@ void extract_extension(const char* path, char* dest, int32_t dest_len) {
 	}
 }
 
+// ************************************************************************************
+int32_t url_hex(char c) {
+	if (c >= '0' && c <= '9') return c - '0';
+	if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+	return -1;
+}
+
+// ************************************************************************************
+// Decodes one character of a query component into out, returns the number
+// of source characters used. Malformed %xx sequences are kept as they are.
+int32_t url_decode_char(const char* src, int32_t len, char* out) {
+	if (src[0] == '+') {
+		*out = ' ';
+		return 1;
+	}
+	if (src[0] == '%' && len >= 3) {
+		int32_t hi = url_hex(src[1]);
+		int32_t lo = url_hex(src[2]);
+		if (hi >= 0 && lo >= 0) {
+			*out = (hi << 4) | lo;
+			return 3;
+		}
+	}
+	*out = src[0];
+	return 1;
+}
+
+// ************************************************************************************
+int32_t url_needs_decode(const char* src, int32_t len) {
+	for(int32_t i=0;i<len;++i) {
+		if (src[i] == '%' || src[i] == '+') return 1;
+	}
+	return 0;
+}
+
+// ************************************************************************************
+// Decodes %xx and '+' of a query component, dest needs len bytes.
+// Returns the decoded length.
+int32_t url_decode(const char* src, int32_t len, char* dest) {
+	int32_t n = 0;
+	for(int32_t i=0;i<len;) {
+		i += url_decode_char(src + i, len - i, dest + n);
+		n++;
+	}
+	return n;
+}
+
+// ************************************************************************************
+// Compares the decoded form of src with str without decoding into a buffer.
+int32_t url_decode_equals(const char* src, int32_t len, const char* str, int32_t str_len) {
+	int32_t n = 0;
+	char c;
+
+	for(int32_t i=0;i<len;) {
+		if (n >= str_len) return 0;
+		i += url_decode_char(src + i, len - i, &c);
+		if (c != str[n++]) return 0;
+	}
+	return n == str_len;
+}
+
 // ************************************************************************************
 int32_t read_full(int32_t fd, char* dest, uint32_t size) {
 	uint32_t pos = 0;
@@ -138,3 +200,74 @@ int32_t write_full(int32_t fd, const char* src, uint32_t size) {
 
 	return pos;
 }
+
+// ************************************************************************************
+static const uint32_t sha256_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define SHA256_ROR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+// ************************************************************************************
+void sha256_block(uint32_t* state, const uint8_t* block) {
+	uint32_t w[64];
+	uint32_t v[8];
+
+	for(int32_t i=0;i<16;++i) {
+		w[i] = (uint32_t)block[i * 4] << 24 | (uint32_t)block[i * 4 + 1] << 16 | (uint32_t)block[i * 4 + 2] << 8 | block[i * 4 + 3];
+	}
+	for(int32_t i=16;i<64;++i) {
+		uint32_t s0 = SHA256_ROR(w[i - 15], 7) ^ SHA256_ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		uint32_t s1 = SHA256_ROR(w[i - 2], 17) ^ SHA256_ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(v, state, sizeof(v));
+	for(int32_t i=0;i<64;++i) {
+		uint32_t s1 = SHA256_ROR(v[4], 6) ^ SHA256_ROR(v[4], 11) ^ SHA256_ROR(v[4], 25);
+		uint32_t t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + sha256_k[i] + w[i];
+		uint32_t s0 = SHA256_ROR(v[0], 2) ^ SHA256_ROR(v[0], 13) ^ SHA256_ROR(v[0], 22);
+		uint32_t t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * sizeof(uint32_t));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for(int32_t i=0;i<8;++i) state[i] += v[i];
+}
+
+// ************************************************************************************
+// SHA-256 of src, digest gets 32 bytes.
+void sha256(const char* src, int64_t len, uint8_t* digest) {
+	uint32_t state[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+	uint8_t tail[128] = { 0 };
+	int64_t pos = 0;
+
+	for(;pos + 64 <= len;pos += 64) {
+		sha256_block(state, (const uint8_t*)src + pos);
+	}
+
+	// the rest, the 0x80 marker and the length in bits
+	int32_t rest = len - pos;
+	int32_t tail_len = rest < 56 ? 64 : 128;
+	memcpy(tail, src + pos, rest);
+	tail[rest] = 0x80;
+	for(int32_t i=0;i<8;++i) {
+		tail[tail_len - 1 - i] = (uint8_t)((uint64_t)len * 8 >> (i * 8));
+	}
+	sha256_block(state, tail);
+	if (tail_len == 128) sha256_block(state, tail + 64);
+
+	for(int32_t i=0;i<8;++i) {
+		digest[i * 4] = state[i] >> 24;
+		digest[i * 4 + 1] = state[i] >> 16;
+		digest[i * 4 + 2] = state[i] >> 8;
+		digest[i * 4 + 3] = state[i];
+	}
+}
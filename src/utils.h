@@ -46,4 +46,10 @@ int32_t write_full(int32_t fd, const char* src, uint32_t size);
 
 void extract_extension(const char* path, char* dest, int32_t dest_len);
 
+int32_t url_needs_decode(const char* src, int32_t len);
+int32_t url_decode(const char* src, int32_t len, char* dest);
+int32_t url_decode_equals(const char* src, int32_t len, const char* str, int32_t str_len);
+
+void sha256(const char* src, int64_t len, uint8_t* digest);
+
 #endif /* UTILS_H_ */
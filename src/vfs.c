@@ -221,6 +221,18 @@ int32_t vfs_init_fs(struct hashmap** vfs, const char* fs_path) {
 
 // ************************************************************************************
 void vfs_free(struct hashmap* vfs) {
+	if (!vfs) return;
+
+	// paths of entries from the data dir are copies, in-memory ones point into the segment
+	size_t iter = 0;
+	void* item = NULL;
+	while (hashmap_iter(vfs, &iter, &item)) {
+		struct vfs_entry* e = (struct vfs_entry*)item;
+		if (e->fs_path) {
+			free(e->fs_path);
+			free(e->vfs_path);
+		}
+	}
 	hashmap_free(vfs);
 }
 